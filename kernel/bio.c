@@ -1,10 +1,44 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets, each
+// with its own lock, so lookups of different blocks don't contend.
+// The number of buffers is set at boot (nbuf=, default NBUF), and
+// the buffers and their data come from kalloc().
+//
+// Replacement is CAR (CLOCK with Adaptive Replacement; Bansal and
+// Modha, FAST '04), the clock version of ARC. Resident buffers are
+// on one of two clocks: T1 holds blocks seen once recently, T2
+// blocks seen at least twice. B1 and B2 remember the identities of
+// blocks recently evicted from T1 and T2, and a miss on one of them
+// moves the target size p of T1 towards whichever list would have
+// kept the block. A hit only sets the buffer's reference bit under
+// its bucket lock, so hits never touch the clocks; a big sequential
+// scan just cycles through T1 and leaves T2 (inode, bitmap and
+// directory blocks) alone.
+//
+// A miss takes bcache.lock, which serializes eviction and protects
+// the clocks and ghost lists. Lock order is bcache.lock, then one
+// bucket lock.
+//
+// A block the log has committed but not yet installed is read
+// from the log's snapshot of it instead of the disk (logread()).
+//
+// bprefetch() starts a read without waiting for it: the buffer
+// keeps a reference for the transfer, its sleep-lock is released
+// right away, and the disk interrupt marks it valid and drops the
+// reference. bread() of a block whose read is still in flight
+// waits for that read instead of starting another.
+//
+// Transfers go to the driver of the buffer's device through
+// bdevsw[], filled in by each driver's init: the virtio disks,
+// which queue requests and interrupt when done, and the RAM
+// disk, which copies at once.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -22,72 +56,494 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "trace.h"
 
-struct {
+#define NBUCKET 251
+
+struct bdevsw bdevsw[NBDEV];
+
+// CAR lists.
+#define BFREE 0  // never used since boot
+#define T1    1
+#define T2    2
+#define B1    3
+#define B2    4
+#define NLIST 5
+
+// Identity of a block recently evicted from T1 or T2.
+struct ghost {
+  uint dev;
+  uint blockno;
+  char list;            // B1, B2, or BFREE if unused
+  struct ghost *hnext;  // ghost hash chain
+  struct ghost *prev;   // B1/B2 list, most recent first
+  struct ghost *next;
+};
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;     // hash chain, through hnext
+  uint64 hits;
+  uint64 misses;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;   // serializes eviction; protects everything below
+  int nbuf;
+  int p;                  // target size of T1
+  int n[NLIST];           // list lengths
+  struct buf clock[3];    // BFREE, T1 and T2 heads, through prev/next
+  struct ghost ghost[3];  // unused ghosts, B1 and B2 heads: ghost[l - B1 + 1]
+  struct ghost *ghosthash[NBUCKET];
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+// Read-ahead counters.
+static struct {
+  uint64 issued;   // prefetch reads started
+  uint64 hits;     // prefetched blocks later asked for by bread()
+  uint64 wasted;   // prefetched blocks evicted without being read
+} ra;
+
+static uint
+bhash(uint dev, uint blockno)
+{
+  return (dev * 31 + blockno) % NBUCKET;
+}
+
+// Clock and ghost lists are circular lists with a dummy head.
+// The clock hand is at head.next; new entries go in at the tail
+// (head.prev), which is the spot just behind the hand.
+
+static struct buf*
+clockhead(int l)
+{
+  return &bcache.clock[l];
+}
+
+static void
+clockremove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  bcache.n[(int)b->list]--;
+}
+
+static void
+clockappend(int l, struct buf *b)
+{
+  struct buf *h = clockhead(l);
+
+  b->next = h;
+  b->prev = h->prev;
+  h->prev->next = b;
+  h->prev = b;
+  b->list = l;
+  bcache.n[l]++;
+}
+
+static struct ghost*
+ghosthead(int l)
+{
+  return &bcache.ghost[l == BFREE ? 0 : l - B1 + 1];
+}
+
+static void
+ghostremove(struct ghost *g)
+{
+  struct ghost **pp;
+
+  g->next->prev = g->prev;
+  g->prev->next = g->next;
+  if(g->list != BFREE){
+    bcache.n[(int)g->list]--;
+    for(pp = &bcache.ghosthash[bhash(g->dev, g->blockno)]; *pp != g; pp = &(*pp)->hnext)
+      ;
+    *pp = g->hnext;
+  }
+}
+
+// Insert g at the most recently used end of list l.
+static void
+ghostpush(int l, struct ghost *g)
+{
+  struct ghost *h = ghosthead(l);
+  uint hv;
+
+  g->next = h->next;
+  g->prev = h;
+  h->next->prev = g;
+  h->next = g;
+  g->list = l;
+  if(l != BFREE){
+    bcache.n[l]++;
+    hv = bhash(g->dev, g->blockno);
+    g->hnext = bcache.ghosthash[hv];
+    bcache.ghosthash[hv] = g;
+  }
+}
+
+// Forget the least recently used ghost on list l.
+static void
+ghostdiscard(int l)
+{
+  struct ghost *g = ghosthead(l)->prev;
+
+  if(g == ghosthead(l))
+    return;
+  ghostremove(g);
+  ghostpush(BFREE, g);
+}
+
+static struct ghost*
+ghostfind(uint dev, uint blockno)
+{
+  struct ghost *g;
+
+  for(g = bcache.ghosthash[bhash(dev, blockno)]; g; g = g->hnext)
+    if(g->dev == dev && g->blockno == blockno)
+      return g;
+  return 0;
+}
+
+// Look for a cached copy of the block in bucket bk.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
+static void
+bunhash(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bk->head; *pp != b; pp = &(*pp)->hnext)
+    ;
+  *pp = b->hnext;
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct ghost *g;
+  char *mem, *data;
+  int i, nb, ng, l;
 
   initlock(&bcache.lock, "bcache");
+  for(i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+  for(l = 0; l < 3; l++){
+    bcache.clock[l].prev = bcache.clock[l].next = &bcache.clock[l];
+    bcache.ghost[l].prev = bcache.ghost[l].next = &bcache.ghost[l];
+  }
+
+  // The log pins up to LOGSIZE buffers for each of its two
+  // transactions, and every FS operation in progress can
+  // hold a few more.
+  bcache.nbuf = bootarg("nbuf", NBUF);
+  if(bcache.nbuf < 2*LOGSIZE + 2*MAXOPBLOCKS)
+    bcache.nbuf = 2*LOGSIZE + 2*MAXOPBLOCKS;
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  // Carve buf structs, ghosts, and block data out of pages.
+  mem = 0;
+  data = 0;
+  nb = ng = 0;
+  for(i = 0; i < bcache.nbuf; i++){
+    if(nb == 0){
+      if((mem = kalloc()) == 0)
+        panic("binit: kalloc");
+      memset(mem, 0, PGSIZE);
+      nb = PGSIZE / sizeof(struct buf);
+    }
+    if(((uint64)data % PGSIZE) == 0 && (data = kalloc()) == 0)
+      panic("binit: kalloc");
+    b = (struct buf*)mem;
+    mem += sizeof(struct buf);
+    nb--;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->data = (uchar*)data;
+    data += BSIZE;
+    clockappend(BFREE, b);
+  }
+
+  // CAR remembers at most nbuf evicted blocks, plus one
+  // that replace() adds just before a ghost is discarded.
+  for(i = 0; i < bcache.nbuf + 1; i++){
+    if(ng == 0){
+      if((mem = kalloc()) == 0)
+        panic("binit: kalloc");
+      memset(mem, 0, PGSIZE);
+      ng = PGSIZE / sizeof(struct ghost);
+    }
+    g = (struct ghost*)mem;
+    mem += sizeof(struct ghost);
+    ng--;
+    ghostpush(BFREE, g);
   }
 }
 
+// Pick an idle resident buffer to reuse, remove it from its hash
+// bucket and clock, and remember it on B1 or B2.
+// Caller must hold bcache.lock.
+static struct buf*
+replace(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+  struct ghost *g;
+  int l, other, busy[3], spins;
+
+  busy[T1] = busy[T2] = 0;
+  for(spins = 0; spins < 4*bcache.nbuf; spins++){
+    l = bcache.n[T1] >= (bcache.p > 1 ? bcache.p : 1) ? T1 : T2;
+    // Don't keep sweeping a clock whose buffers are all in use.
+    other = l == T1 ? T2 : T1;
+    if(busy[l] >= bcache.n[l] && bcache.n[other] > busy[other])
+      l = other;
+
+    b = clockhead(l)->next;
+    bk = &bcache.bucket[bhash(b->dev, b->blockno)];
+    acquire(&bk->lock);
+    if(b->refcnt != 0){
+      // in use or pinned by the log; look at it again next time around.
+      release(&bk->lock);
+      clockremove(b);
+      clockappend(l, b);
+      busy[l]++;
+      continue;
+    }
+    if(b->ref){
+      // used since the hand last passed: give it another lap,
+      // on T2 since it has now been seen at least twice.
+      b->ref = 0;
+      release(&bk->lock);
+      clockremove(b);
+      clockappend(T2, b);
+      busy[T1] = busy[T2] = 0;
+      continue;
+    }
+    bunhash(bk, b);
+    release(&bk->lock);
+    clockremove(b);
+    if(b->prefetched){
+      b->prefetched = 0;
+      __sync_fetch_and_add(&ra.wasted, 1);
+    }
+
+    g = ghosthead(BFREE)->next;
+    if(g == ghosthead(BFREE))
+      panic("bget: no ghosts");
+    ghostremove(g);
+    g->dev = b->dev;
+    g->blockno = b->blockno;
+    ghostpush(l == T1 ? B1 : B2, g);
+    return b;
+  }
+  panic("bget: no buffers");
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
-// In either case, return locked buffer.
+// In either case, return the buffer with its reference count
+// raised but not locked, and set *cached if it was found.
 static struct buf*
-bget(uint dev, uint blockno)
+bclaim(uint dev, uint blockno, int *cached)
 {
+  struct bucket *bk;
   struct buf *b;
+  struct ghost *g;
+  int c, d;
 
-  acquire(&bcache.lock);
+  bk = &bcache.bucket[bhash(dev, blockno)];
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    b->ref = 1;
+    bk->hits++;
+    release(&bk->lock);
+    *cached = 1;
+    return b;
+  }
+  release(&bk->lock);
+
+  // Not cached. Only one process evicts at a time, so check again:
+  // someone else may have brought the block in while we were
+  // waiting for bcache.lock.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    b->refcnt++;
+    b->ref = 1;
+    bk->hits++;
+    release(&bk->lock);
+    release(&bcache.lock);
+    *cached = 1;
+    return b;
+  }
+  bk->misses++;
+  release(&bk->lock);
+
+  c = bcache.nbuf;
+  g = ghostfind(dev, blockno);
+  if((b = clockhead(BFREE)->next) != clockhead(BFREE)){
+    clockremove(b);
+  } else {
+    b = replace();
+    // Keep T1+B1 <= c and T1+T2+B1+B2 <= 2c.
+    if(g == 0){
+      if(bcache.n[T1] + bcache.n[B1] >= c)
+        ghostdiscard(B1);
+      else if(bcache.n[T1] + bcache.n[T2] + bcache.n[B1] + bcache.n[B2] >= 2*c)
+        ghostdiscard(B2);
     }
   }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  if(g == 0){
+    clockappend(T1, b);
+  } else {
+    // A recently evicted block is back: adapt, and since it
+    // has been seen twice, put it on T2.
+    if(g->list == B1){
+      d = bcache.n[B1] ? bcache.n[B2] / bcache.n[B1] : 1;
+      bcache.p += d > 1 ? d : 1;
+      if(bcache.p > c)
+        bcache.p = c;
+    } else {
+      d = bcache.n[B2] ? bcache.n[B1] / bcache.n[B2] : 1;
+      bcache.p -= d > 1 ? d : 1;
+      if(bcache.p < 0)
+        bcache.p = 0;
     }
+    ghostremove(g);
+    ghostpush(BFREE, g);
+    clockappend(T2, b);
   }
-  panic("bget: no buffers");
+
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  b->ref = 0;
+  b->prefetched = 0;
+  b->done = 0;
+  acquire(&bk->lock);
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  *cached = 0;
+  return b;
+}
+
+// Return a locked buffer for the block.
+static struct buf*
+bget(uint dev, uint blockno)
+{
+  struct buf *b;
+  int cached;
+
+  b = bclaim(dev, blockno, &cached);
+  trace(TR_BGET, blockno, cached);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Drop a reference taken by bclaim().
+static void
+bunref(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[bhash(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
+// The driver for block device dev.
+static struct bdevsw*
+bdev(uint dev)
+{
+  if(dev >= NBDEV || bdevsw[dev].submit == 0)
+    panic("bio: no such device");
+  return &bdevsw[dev];
+}
+
+// Hand a transfer of b to or from block blockno of dev to the
+// driver, recording it in the disk trace. Every transfer,
+// waited for or not, goes through here.
+static int
+bsubmit(uint dev, struct buf *b, uint blockno, int write, int wait)
+{
+  trace(TR_DISK, blockno, write);
+  return bdev(dev)->submit(dev, b, blockno, write, wait);
+}
+
+// Read or write b's block and wait for the transfer.
+static void
+brw(struct buf *b, int write)
+{
+  bsubmit(b->dev, b, b->blockno, write, 1);
+  bwait(b);
+}
+
+// Disk interrupt: a prefetch read has finished.
+static void
+bprefetchdone(struct buf *b)
+{
+  b->valid = 1;
+  b->done = 0;
+  bunref(b);
+}
+
+// Start reading the block into the cache if it isn't there,
+// without waiting. Gives up rather than sleep if the buffer
+// is busy or the disk queue is full. The read is only queued;
+// call bkick() after a batch of prefetches.
+void
+bprefetch(uint dev, uint blockno)
+{
+  struct buf *b;
+  int cached;
+
+  if(bdev(dev)->wait == 0)
+    return;   // reads at once, nothing to gain
+  b = bclaim(dev, blockno, &cached);
+  if(cached || !tryacquiresleep(&b->lock)){
+    bunref(b);
+    return;
+  }
+  if(b->valid || b->disk || logread(b)){
+    b->valid = 1;
+    releasesleep(&b->lock);
+    bunref(b);
+    return;
+  }
+  // The reference from bclaim() now belongs to the transfer.
+  b->prefetched = 1;
+  b->done = bprefetchdone;
+  if(bsubmit(dev, b, b->blockno, 0, 0) < 0){
+    b->prefetched = 0;
+    b->done = 0;
+    releasesleep(&b->lock);
+    bunref(b);
+    return;
+  }
+  __sync_fetch_and_add(&ra.issued, 1);
+  releasesleep(&b->lock);
 }
 
+
 // Return a locked buf with the contents of the indicated block.
 struct buf*
 bread(uint dev, uint blockno)
@@ -95,24 +551,81 @@ bread(uint dev, uint blockno)
   struct buf *b;
 
   b = bget(dev, blockno);
+  if(b->prefetched){
+    b->prefetched = 0;
+    __sync_fetch_and_add(&ra.hits, 1);
+  }
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    if(b->disk)
+      bwait(b);  // prefetch still in flight
+    else if(!logread(b))
+      brw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Return a locked, zeroed buf for a block whose old contents
+// don't matter, such as one just allocated, without reading it.
+struct buf*
+bzeroed(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if(b->disk)
+    bwait(b);  // don't let a prefetch land on top
+  b->prefetched = 0;
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  brw(b, 1);
+}
+
+// Queue a write of b's data to block blockno of device dev,
+// which need not be b's own, without waiting for it. The caller
+// must hold a reference to b (lock or pin) and keep b->data
+// unchanged until bwait(b) returns. Writes are not sent until
+// bkick() or bwait(), so a batch of them goes to the disk with
+// one notification.
+void
+bwriteat(struct buf *b, uint dev, uint blockno)
+{
+  b->done = 0;
+  bsubmit(dev, b, blockno, 1, 1);
+}
+
+// Send queued prefetches and writes to the disks.
+void
+bkick(void)
+{
+  int dev;
+
+  for(dev = 0; dev < NBDEV; dev++)
+    if(bdevsw[dev].kick)
+      bdevsw[dev].kick(dev);
+}
+
+// Wait for a transfer queued on b, if any. b->disk is the
+// device it is queued on.
+void
+bwait(struct buf *b)
+{
+  int dev = b->disk;
+
+  if(dev)
+    bdevsw[dev].wait(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
 void
 brelse(struct buf *b)
 {
@@ -120,34 +633,50 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bunref(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[bhash(b->dev, b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
+  bunref(b);
 }
 
+// Print buffer cache statistics for the statistics device.
+int
+bcachestats(char *buf, int sz)
+{
+  struct bucket *bk;
+  uint64 n, nts, hits, misses;
+  int m;
 
+  n = nts = hits = misses = 0;
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++){
+    acquire(&bk->lock);
+    n += bk->lock.n;
+    nts += bk->lock.nts;
+    hits += bk->hits;
+    misses += bk->misses;
+    release(&bk->lock);
+  }
+  m = snprintf(buf, sz, "--- bcache\nbuffers %d hits %l misses %l\n"
+               "buckets: #acquire() %l #test-and-set %l\n",
+               bcache.nbuf, hits, misses, n, nts);
+  acquire(&bcache.lock);
+  m += snprintf(buf+m, sz-m, "car: T1 %d T2 %d B1 %d B2 %d p %d\n"
+                "evict: #acquire() %l #test-and-set %l\n",
+                bcache.n[T1], bcache.n[T2], bcache.n[B1], bcache.n[B2], bcache.p,
+                bcache.lock.n, bcache.lock.nts);
+  release(&bcache.lock);
+  m += snprintf(buf+m, sz-m, "readahead: issued %l hits %l wasted %l\n",
+                ra.issued, ra.hits, ra.wasted);
+  return m;
+}
@@ -0,0 +1,136 @@
+//
+// kernel command line.
+//
+// qemu passes the address of a flattened device tree in a1 when
+// it starts each hart. start() calls bootargsinit() on hart 0,
+// in machine mode and before kinit() can reuse the memory the
+// tree lives in, to save a copy of /chosen/bootargs (set with
+// qemu -append, see BOOTARGS in the Makefile). The rest of the
+// kernel looks up "key=value" settings with bootarg().
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define FDT_MAGIC      0xd00dfeed
+#define FDT_BEGIN_NODE 1
+#define FDT_END_NODE   2
+#define FDT_PROP       3
+#define FDT_NOP        4
+#define FDT_END        9
+
+#define MAXBOOTARGS 256
+
+static char bootargs[MAXBOOTARGS];
+
+// device tree fields are big-endian.
+static uint
+be32(void *p)
+{
+  uchar *b = p;
+  return ((uint)b[0] << 24) | ((uint)b[1] << 16) | ((uint)b[2] << 8) | b[3];
+}
+
+static int
+streq(const char *a, const char *b)
+{
+  while(*a && *a == *b)
+    a++, b++;
+  return *a == *b;
+}
+
+// Copy /chosen/bootargs out of the device tree at dtb.
+// Runs in machine mode with paging off, before there is
+// a console, so it just gives up on anything unexpected.
+void
+bootargsinit(uint64 dtb)
+{
+  char *fdt, *p, *end, *strs, *name;
+  uint tok, len, depth;
+  int inchosen, i;
+
+  fdt = (char*)dtb;
+  if(fdt == 0 || be32(fdt) != FDT_MAGIC)
+    return;
+  p = fdt + be32(fdt + 8);        // off_dt_struct
+  strs = fdt + be32(fdt + 12);    // off_dt_strings
+  end = p + be32(fdt + 36);       // size_dt_struct
+
+  depth = 0;
+  inchosen = 0;
+  while(p < end){
+    tok = be32(p);
+    p += 4;
+    switch(tok){
+    case FDT_BEGIN_NODE:
+      name = p;
+      depth++;
+      if(depth == 2 && streq(name, "chosen"))
+        inchosen = 1;
+      while(*p)
+        p++;
+      p = (char*)(((uint64)p + 1 + 3) & ~3);
+      break;
+    case FDT_END_NODE:
+      if(depth == 2)
+        inchosen = 0;
+      depth--;
+      break;
+    case FDT_PROP:
+      len = be32(p);
+      name = strs + be32(p + 4);
+      p += 8;
+      if(inchosen && streq(name, "bootargs")){
+        for(i = 0; i < len && i < MAXBOOTARGS-1 && p[i]; i++)
+          bootargs[i] = p[i];
+        bootargs[i] = 0;
+        return;
+      }
+      p = (char*)(((uint64)p + len + 3) & ~3);
+      break;
+    case FDT_NOP:
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+// Return the value of "key=value" on the kernel command line
+// as a decimal integer, or def if key isn't there.
+int
+bootarg(char *key, int def)
+{
+  char *s, *k;
+  int n;
+
+  s = bootargs;
+  while(*s){
+    while(*s == ' ')
+      s++;
+    for(k = key; *k && *s == *k; k++, s++)
+      ;
+    if(*k == 0 && *s == '='){
+      s++;
+      if(*s < '0' || *s > '9')
+        return def;
+      n = 0;
+      while(*s >= '0' && *s <= '9')
+        n = n*10 + *s++ - '0';
+      return n;
+    }
+    while(*s && *s != ' ')
+      s++;
+  }
+  return def;
+}
+
+// The whole command line, for printing at boot.
+char*
+bootargline(void)
+{
+  return bootargs;
+}
@@ -1,12 +1,34 @@
 struct buf {
   int valid;   // has data been read from disk?
-  int disk;    // does disk "own" buf?
+  int disk;    // device whose driver owns buf, or 0
+  int vq;      // the driver's queue it is on, while disk is set
+  int prefetched; // read ahead, and not yet asked for?
+  void (*done)(struct buf*); // called by the disk interrupt, if set
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  char ref;         // used since the clock hand last passed?
+  char list;        // which replacement list (see bio.c)
+  struct buf *hnext; // hash bucket chain
+  struct buf *prev; // clock list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data;      // BSIZE bytes
 };
 
+
+// Block device drivers, indexed by device number. submit() starts
+// a transfer between b->data and block blockno of dev; b->disk is
+// dev until it is done, when the driver clears it and calls
+// b->done, if set. When the queue is full, submit() sleeps if
+// wait is set and returns -1 otherwise. kick() sends what has been
+// queued and wait() waits for b's transfer. A driver without
+// wait() finishes the transfer inside submit(), and neither sets
+// b->disk nor calls b->done.
+struct bdevsw {
+  int (*submit)(int dev, struct buf *b, uint blockno, int write, int wait);
+  void (*kick)(int dev);
+  void (*wait)(struct buf *b);
+};
+
+extern struct bdevsw bdevsw[];
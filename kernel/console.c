@@ -17,6 +17,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "fcntl.h"
 #include "memlayout.h"
 #include "riscv.h"
 #include "defs.h"
@@ -35,9 +36,9 @@ consputc(int c)
 {
   if(c == BACKSPACE){
     // if the user typed backspace, overwrite with a space.
-    uartputc_sync('\b'); uartputc_sync(' '); uartputc_sync('\b');
+    uartputc_async('\b'); uartputc_async(' '); uartputc_async('\b');
   } else {
-    uartputc_sync(c);
+    uartputc_async(c);
   }
 }
 
@@ -50,6 +51,7 @@ struct {
   uint r;  // Read index
   uint w;  // Write index
   uint e;  // Edit index
+  struct pollhead poll;  // poll() callers waiting for input
 } cons;
 
 //
@@ -58,13 +60,15 @@ struct {
 int
 consolewrite(int user_src, uint64 src, int n)
 {
-  int i;
+  char buf[128];
+  int i, m;
 
-  for(i = 0; i < n; i++){
-    char c;
-    if(either_copyin(&c, user_src, src+i, 1) == -1)
+  // copy a chunk at a time, and hand it to the uart in bulk.
+  for(i = 0; i < n; i += m){
+    m = n - i < sizeof(buf) ? n - i : sizeof(buf);
+    if(either_copyin(buf, user_src, src+i, m) == -1)
       break;
-    uartputc(c);
+    uartwrite(buf, m);
   }
 
   return i;
@@ -126,6 +130,21 @@ consoleread(int user_dst, uint64 dst, int n)
   return target - n;
 }
 
+// Input is ready for consoleread() once a whole line is in;
+// output never waits long.
+static int
+consolepoll(struct pollent *e)
+{
+  int r;
+
+  acquire(&cons.lock);
+  if(e)
+    pollqueue(&cons.poll, e);
+  r = POLLOUT | (cons.r != cons.w ? POLLIN : 0);
+  release(&cons.lock);
+  return r;
+}
+
 //
 // the console input interrupt handler.
 // uartintr() calls this for input character.
@@ -170,6 +189,7 @@ consoleintr(int c)
         // has arrived.
         cons.w = cons.e;
         wakeup(&cons.r);
+        pollwake(&cons.poll);
       }
     }
     break;
@@ -189,4 +209,5 @@ consoleinit(void)
   // to consoleread and consolewrite.
   devsw[CONSOLE].read = consoleread;
   devsw[CONSOLE].write = consolewrite;
+  devsw[CONSOLE].poll = consolepoll;
 }
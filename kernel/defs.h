@@ -3,11 +3,19 @@ struct context;
 struct file;
 struct inode;
 struct pipe;
+struct pollent;
+struct pollhead;
 struct proc;
+struct seqlock;
+struct shmseg;
+struct kmem_cache;
+struct iovec;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct timer;
+struct vma;
 
 // bio.c
 void            binit(void);
@@ -16,6 +24,17 @@ void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bcachestats(char*, int);
+void            bprefetch(uint, uint);
+void            bkick(void);
+void            bwriteat(struct buf*, uint, uint);
+void            bwait(struct buf*);
+struct buf*     bzeroed(uint, uint);
+
+// bootargs.c
+void            bootargsinit(uint64);
+int             bootarg(char*, int);
+char*           bootargline(void);
 
 // console.c
 void            consoleinit(void);
@@ -23,7 +42,8 @@ void            consoleintr(int);
 void            consputc(int);
 
 // exec.c
-int             exec(char*, char**);
+int             exec(char*, char*, int);
+int             execproc(struct proc*, char*, char*, int);
 
 // file.c
 struct file*    filealloc(void);
@@ -32,11 +52,29 @@ struct file*    filedup(struct file*);
 void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
+int             filegetdents(struct file*, uint64, int);
+int             filepread(struct file*, uint64, int, uint);
+int             filepwrite(struct file*, uint64, int, uint);
+int             filereadv(struct file*, struct iovec*, int);
+int             filewritev(struct file*, struct iovec*, int);
 int             filewrite(struct file*, uint64, int n);
+int             filesplice(struct file*, struct file*, int, int);
+int             filepoll(struct file*, struct pollent*);
+void            fdinit(struct proc*);
+int             fdalloc(struct proc*, struct file*);
+void            fdset(struct proc*, int, struct file*);
+void            fdfree(struct proc*, int);
+int             fdcopy(struct proc*, struct proc*);
+void            fdcloseall(struct proc*);
+void            fdtabfree(struct proc*);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
+void            dirunlink(struct inode*, uint);
+int             ismount(struct inode*);
+void            dcinval(struct inode*, char*);
+int             fsstats(char*, int);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
@@ -45,47 +83,73 @@ void            ilock(struct inode*);
 void            iput(struct inode*);
 void            iunlock(struct inode*);
 void            iunlockput(struct inode*);
+void            ilockshared(struct inode*);
+void            iunlockshared(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
+struct inode*   nameiat(struct inode*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
 void            stati(struct inode*, struct stat*);
+short           itype(uint, uint);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
 
 // ramdisk.c
 void            ramdiskinit(void);
-void            ramdiskintr(void);
-void            ramdiskrw(struct buf*);
 
 // kalloc.c
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+uint64          kfreepages(void);
+void            kdup(void*);
+int             krefs(void*);
+void*           kalloc_order(int);
+void*           kzalloc(void);
+void            kzinit(void);
+void            kfree_order(void*, int);
+int             kallocstats(char*, int);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+int             logstats(char*, int);
 void            begin_op(void);
 void            end_op(void);
+void            end_op_async(void);
+void            log_sync(void);
+int             logread(struct buf*);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
-int             piperead(struct pipe*, uint64, int);
-int             pipewrite(struct pipe*, uint64, int);
+int             piperead(struct pipe*, uint64, int, int);
+int             pipewrite(struct pipe*, int, uint64, int, int);
+int             pipepoll(struct pipe*, int, struct pollent*);
+int             pipesize(struct pipe*, int);
+int             pipeget(struct pipe*, int, int, int, char**);
+void            pipeput(struct pipe*, int, int);
+void            pipeinit(void);
 
 // printf.c
 void            printf(char*, ...);
 void            panic(char*) __attribute__((noreturn));
 void            printfinit(void);
 
+// poll.c
+void            pollqueue(struct pollhead*, struct pollent*);
+void            pollwake(struct pollhead*);
+int             poll(uint64, int, int);
+
 // proc.c
 int             cpuid(void);
 void            exit(int);
 int             fork(void);
+int             spawn(char*, char*, int, int*, int);
 int             growproc(int);
+void            kthread(void (*)(void), char*);
 void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
@@ -96,16 +160,48 @@ struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+void            runnable(struct proc*);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(uint64);
 void            wakeup(void*);
+int             wakeupn(void*, int);
 void            yield(void);
+void            preempt(void);
+int             setpriority(int, int);
+int             setaffinity(int, uint64);
+int             procsyscount(int, int, uint64*, uint64*);
+int             procrusage(int, uint64, int);
+int             clone(uint64, uint64, uint64);
+int             join(uint64);
+int             futex_wait(uint64, int);
+int             futex_wake(uint64, int);
+void            tgvmlock(struct proc*);
+void            tgvmunlock(struct proc*);
+int             tgshared(struct proc*);
+void            tlbshootdown(struct proc*);
+void            tlbintr(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
+int             procstats(char*, int);
+
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
+
+// prof.c
+extern volatile int profrate;
+void            profinit(void);
+void            profsample(uint64, int);
+
+// trace.c
+void            traceinit(void);
+void            trace(int, uint64, uint64);
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -117,12 +213,24 @@ void            initlock(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+void            freelock(struct spinlock*);
+int             lockstats(char*, int);
+
+// seqlock.c
+void            initseqlock(struct seqlock*, char*);
+void            writeseqlock(struct seqlock*);
+void            writesequnlock(struct seqlock*);
+uint            readseqbegin(struct seqlock*);
+int             readseqretry(struct seqlock*, uint);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquiresleepshared(struct sleeplock*);
+void            releasesleepshared(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
+int             tryacquiresleep(struct sleeplock*);
 
 // string.c
 int             memcmp(const void*, const void*, uint);
@@ -141,23 +249,44 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// tmpfs.c
+void            tmpinit(int);
+uint            tmpialloc(void);
+void            tmpifree(uint);
+int             tmpread(struct inode*, int, uint64, uint, uint);
+int             tmpwrite(struct inode*, int, uint64, uint, uint);
+void            tmptrunc(struct inode*);
+int             tmpstats(char*, int);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+void            ipi(int);
+void            timeradd(struct timer*, uint, void*);
+void            timerdel(struct timer*);
+void            tickstop(int);
+void            tickstart(int);
+uint64          mtime(void);
 
 // uart.c
 void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 void            uartputc_sync(int);
+void            uartputc_async(int);
+void            uartwrite(const char*, int);
+void            uartasync(void);
+void            uartflush(void);
 int             uartgetc(void);
 
 // vm.c
 void            kvminit(void);
 void            kvminithart(void);
+extern int      asids;
+void            tlbflush(pagetable_t, uint64);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
 pagetable_t     uvmcreate(void);
@@ -171,9 +300,44 @@ void            uvmclear(pagetable_t, uint64);
 pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
+int             uvmcow(pagetable_t, uint64);
+int             uvmfault(pagetable_t, uint64, uint64, int);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
 
+// slab.c
+void            slabinit(void);
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             slabstats(char*, int);
+
+// shm.c
+void            shminit(void);
+int             shmget(int, uint64);
+uint64          shmat(int);
+int             shmdt(uint64);
+void*           shmpage(struct shmseg*, int);
+void            shmdup(struct shmseg*);
+void            shmput(struct shmseg*);
+
+// vma.c
+void            vmainit(void);
+struct vma*     vmafind(struct proc*, uint64);
+int             vmaadd(struct vma*, uint64, uint64, int, int, struct inode*, uint, uint);
+void            vmacopy(struct vma*, struct vma*);
+void            vmafree(struct vma*);
+void            vmaclear(struct proc*);
+uint64          vmatop(struct proc*);
+uint64          vmagap(struct proc*, uint64);
+int             vmfault(struct proc*, uint64, int);
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+void            vmtouch(uint64, uint64, int);
+void            textinval(struct inode*);
+int             textreclaim(void);
+int             textstats(char*, int);
+
 // plic.c
 void            plicinit(void);
 void            plicinithart(void);
@@ -181,9 +345,8 @@ int             plic_claim(void);
 void            plic_complete(int);
 
 // virtio_disk.c
-void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
-void            virtio_disk_intr(void);
+int             virtio_disk_init(int);
+void            virtio_disk_intr(int);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
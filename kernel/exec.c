@@ -7,8 +7,6 @@
 #include "defs.h"
 #include "elf.h"
 
-static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
-
 int flags2perm(int flags)
 {
     int perm = 0;
@@ -19,17 +17,25 @@ int flags2perm(int flags)
     return perm;
 }
 
+// Replace p's memory with the program in path, with the argc
+// strings packed in the page args as its arguments, and set it
+// up to start the program when it next returns to user space.
+// p is the current process, or a new one that spawn() is making
+// and that isn't running yet. The page is used to build the
+// stack in. Returns argc, or -1 leaving p as it was.
 int
-exec(char *path, char **argv)
+execproc(struct proc *p, char *path, char *args, int argc)
 {
   char *s, *last;
-  int i, off;
-  uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  int i, off, len;
+  uint64 sz = 0, sp, *uargv, stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+  struct vma vma[NVMA];
+
+  memset(vma, 0, sizeof(vma));
 
   begin_op();
 
@@ -37,7 +43,7 @@ exec(char *path, char **argv)
     end_op();
     return -1;
   }
-  ilock(ip);
+  ilockshared(ip);
 
   // Check ELF header
   if(readi(ip, 0, (uint64)&elf, 0, sizeof(elf)) != sizeof(elf))
@@ -61,18 +67,21 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
+    if(ph.vaddr + ph.memsz > UTOP)
       goto bad;
-    sz = sz1;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    // Don't read the segment in now: record where it comes
+    // from, and let vmfault() read each page when it's touched.
+    if(vmaadd(vma, ph.vaddr, ph.memsz, flags2perm(ph.flags) | PTE_R, 0,
+              ip, ph.off, ph.filesz) < 0)
       goto bad;
+    if(PGROUNDUP(ph.vaddr + ph.memsz) > sz)
+      sz = PGROUNDUP(ph.vaddr + ph.memsz);
   }
-  iunlockput(ip);
+  iunlockshared(ip);
+  iput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
   // Allocate two pages at the next page boundary.
@@ -87,26 +96,25 @@ exec(char *path, char **argv)
   sp = sz;
   stackbase = sp - PGSIZE;
 
-  // Push argument strings, prepare rest of stack in ustack.
-  for(argc = 0; argv[argc]; argc++) {
-    if(argc >= MAXARG)
-      goto bad;
-    sp -= strlen(argv[argc]) + 1;
-    sp -= sp % 16; // riscv sp must be 16-byte aligned
-    if(sp < stackbase)
-      goto bad;
-    if(copyout(pagetable, sp, argv[argc], strlen(argv[argc]) + 1) < 0)
-      goto bad;
-    ustack[argc] = sp;
-  }
-  ustack[argc] = 0;
-
-  // push the array of argv[] pointers.
-  sp -= (argc+1) * sizeof(uint64);
-  sp -= sp % 16;
-  if(sp < stackbase)
+  // Lay the top of the stack out in args as it is to be at
+  // stackbase: the strings at the top, the array of argv[]
+  // pointers below them, and copy it all out at once.
+  for(len = 0, i = 0; i < argc; i++)
+    len += strlen(args + len) + 1;
+  memmove(args + PGSIZE - len, args, len);
+  off = PGSIZE - len - (argc+1) * sizeof(uint64);
+  if(off < 0)
     goto bad;
-  if(copyout(pagetable, sp, (char *)ustack, (argc+1)*sizeof(uint64)) < 0)
+  off -= off % 16; // riscv sp must be 16-byte aligned
+  uargv = (uint64*)(args + off);
+  s = args + PGSIZE - len;
+  for(i = 0; i < argc; i++){
+    uargv[i] = stackbase + (s - args);
+    s += strlen(s) + 1;
+  }
+  uargv[argc] = 0;
+  sp = stackbase + off;
+  if(copyout(pagetable, sp, args + off, PGSIZE - off) < 0)
     goto bad;
 
   // arguments to user main(argc, argv)
@@ -121,6 +129,8 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vmaclear(p);
+  memmove(p->vma, vma, sizeof(vma));
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
@@ -134,33 +144,25 @@ exec(char *path, char **argv)
   if(pagetable)
     proc_freepagetable(pagetable, sz);
   if(ip){
-    iunlockput(ip);
+    iunlockshared(ip);
+    vmafree(vma);
+    iput(ip);
+    end_op();
+  } else {
+    begin_op();
+    vmafree(vma);
     end_op();
   }
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+int
+exec(char *path, char *args, int argc)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
+  struct proc *p = myproc();
+
+  // the other threads would be left without memory.
+  if(tgshared(p))
+    return -1;
+  return execproc(p, path, args, argc);
 }
@@ -3,3 +3,38 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+#define O_ASYNC   0x800  // writes needn't be durable until fsync()
+#define O_NONBLOCK 0x1000 // reads and writes return -1 rather than wait
+
+#define PROT_READ  0x1
+#define PROT_WRITE 0x2
+#define PROT_EXEC  0x4
+
+#define MAP_SHARED  0x01
+#define MAP_PRIVATE 0x02
+
+#define F_GETPIPE_SZ 1  // fcntl(): a pipe's capacity
+#define F_SETPIPE_SZ 2  // fcntl(): resize a pipe, at least arg bytes
+#define F_GETFL      3  // fcntl(): the file's O_NONBLOCK
+#define F_SETFL      4  // fcntl(): set or clear O_NONBLOCK
+
+// A buffer for readv() and writev().
+struct iovec {
+  void *base;
+  int len;
+};
+
+#define IOV_MAX 16   // buffers per readv() or writev()
+
+// A descriptor for poll() to watch.
+struct pollfd {
+  int fd;          // ignored if negative
+  short events;    // POLLIN and POLLOUT wanted
+  short revents;   // what poll() found, events or ones below
+};
+
+#define POLLIN   0x1  // read won't wait
+#define POLLOUT  0x4  // write won't wait
+#define POLLERR  0x8  // read end of a pipe closed
+#define POLLHUP  0x10 // write end of a pipe closed
+#define POLLNVAL 0x20 // fd isn't open
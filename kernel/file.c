@@ -12,17 +12,28 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "fcntl.h"
 
 struct devsw devsw[NDEV];
+
+// Open files come from an object cache (slab.c), up to max at a
+// time: nfile= at boot, or by default one per four free pages
+// and at least NFILE. The lock guards their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
+  int n;             // files allocated
+  int max;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
+  ftable.max = bootarg("nfile", kfreepages() / 4);
+  if(ftable.max < NFILE)
+    ftable.max = NFILE;
 }
 
 // Allocate a file structure.
@@ -32,15 +43,21 @@ filealloc(void)
   struct file *f;
 
   acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
+  if(ftable.n >= ftable.max){
+    release(&ftable.lock);
+    return 0;
   }
+  ftable.n++;
   release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0){
+    acquire(&ftable.lock);
+    ftable.n--;
+    release(&ftable.lock);
+    return 0;
+  }
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -68,20 +85,226 @@ fileclose(struct file *f)
     release(&ftable.lock);
     return;
   }
-  ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
+  ftable.n--;
   release(&ftable.lock);
+  ff = *f;
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
   } else if(ff.type == FD_INODE || ff.type == FD_DEVICE){
+    if(ff.ip->dev == TMPDEV){
+      iput(ff.ip);   // tmpfs: nothing to log
+      return;
+    }
     begin_op();
     iput(ff.ip);
     end_op();
   }
 }
 
+// File descriptor tables. A process starts with the NOFILE
+// slots in its struct proc; when they fill, fdalloc() moves the
+// table to pages of its own, and doubles it after that, up to
+// MAXFD. p->fdmap has a bit for each descriptor in use, so the
+// lowest free one is found a word of 64 at a time, starting
+// from p->fdlow, below which all are in use. Only p itself
+// uses its table.
+
+// Give p an empty table of its own NOFILE slots.
+void
+fdinit(struct proc *p)
+{
+  p->ofile = p->ofile0;
+  p->nofile = NOFILE;
+  p->fdlow = 0;
+  memset(p->ofile0, 0, sizeof(p->ofile0));
+  memset(p->fdmap, 0, sizeof(p->fdmap));
+}
+
+// kalloc_order() order for a table of n slots, n a power of
+// two of at least a page.
+static int
+fdorder(int n)
+{
+  int order;
+
+  for(order = 0; ((uint64)PGSIZE << order) < n * sizeof(struct file*); order++)
+    ;
+  return order;
+}
+
+// Double p's table, to at least a page. Returns -1 if it is at
+// MAXFD or there is no memory.
+static int
+fdgrow(struct proc *p)
+{
+  struct file **t;
+  int n;
+
+  if(p->nofile >= MAXFD)
+    return -1;
+  n = p->nofile * 2;
+  if(n < PGSIZE / sizeof(struct file*))
+    n = PGSIZE / sizeof(struct file*);
+  if(n > MAXFD)
+    n = MAXFD;
+  if((t = kalloc_order(fdorder(n))) == 0)
+    return -1;
+  memset(t, 0, n * sizeof(struct file*));
+  memmove(t, p->ofile, p->nofile * sizeof(struct file*));
+  if(p->ofile != p->ofile0)
+    kfree_order(p->ofile, fdorder(p->nofile));
+  p->ofile = t;
+  p->nofile = n;
+  return 0;
+}
+
+// Give f the lowest free descriptor of p, growing the table if
+// need be. Takes over the caller's reference to f on success.
+// Returns -1 if p has MAXFD open already or memory runs out.
+int
+fdalloc(struct proc *p, struct file *f)
+{
+  int w, fd;
+
+  for(w = p->fdlow / 64; w < MAXFD / 64 && p->fdmap[w] == ~0L; w++)
+    ;
+  if(w == MAXFD / 64)
+    return -1;
+  fd = w * 64 + __builtin_ctzl(~p->fdmap[w]);
+  while(fd >= p->nofile)
+    if(fdgrow(p) < 0)
+      return -1;
+  p->fdmap[w] |= 1L << (fd % 64);
+  p->ofile[fd] = f;
+  p->fdlow = fd + 1;
+  return fd;
+}
+
+// Make f descriptor fd of p, which must be free and below NOFILE.
+void
+fdset(struct proc *p, int fd, struct file *f)
+{
+  if(fd < 0 || fd >= NOFILE || p->ofile[fd])
+    panic("fdset");
+  p->fdmap[fd / 64] |= 1L << (fd % 64);
+  p->ofile[fd] = f;
+}
+
+// Take descriptor fd away from p, without closing its file.
+void
+fdfree(struct proc *p, int fd)
+{
+  p->ofile[fd] = 0;
+  p->fdmap[fd / 64] &= ~(1L << (fd % 64));
+  if(fd < p->fdlow)
+    p->fdlow = fd;
+}
+
+// Give np, whose table is empty, a copy of p's descriptors.
+// Returns -1, with nothing copied, if memory runs out.
+int
+fdcopy(struct proc *np, struct proc *p)
+{
+  int fd;
+
+  while(np->nofile < p->nofile)
+    if(fdgrow(np) < 0)
+      return -1;
+  for(fd = 0; fd < p->nofile; fd++)
+    if(p->ofile[fd])
+      np->ofile[fd] = filedup(p->ofile[fd]);
+  memmove(np->fdmap, p->fdmap, sizeof(p->fdmap));
+  np->fdlow = p->fdlow;
+  return 0;
+}
+
+// Close all of p's descriptors.
+void
+fdcloseall(struct proc *p)
+{
+  struct file *f;
+  int fd;
+
+  for(fd = 0; fd < p->nofile; fd++){
+    if((f = p->ofile[fd]) != 0){
+      fdfree(p, fd);
+      fileclose(f);
+    }
+  }
+}
+
+// Free the table p grew, and go back to the NOFILE slots.
+// The descriptors must be closed already.
+void
+fdtabfree(struct proc *p)
+{
+  if(p->ofile && p->ofile != p->ofile0)
+    kfree_order(p->ofile, fdorder(p->nofile));
+  fdinit(p);
+}
+
+// Bracket an operation on f's inode that may write. Files on
+// the tmpfs have nothing to log, so they skip the transaction.
+static void
+fbegin(struct file *f)
+{
+  if(f->ip->dev != TMPDEV)
+    begin_op();
+}
+
+static void
+fend(struct file *f)
+{
+  if(f->ip->dev == TMPDEV)
+    return;
+  if(f->async)
+    end_op_async();
+  else
+    end_op();
+}
+
+// Lock f's inode to read it, shared with other readers unless
+// f itself is shared: then f->off must move for one read at a
+// time. Returns what to hand iunlockread().
+static int
+ilockread(struct file *f)
+{
+  // other references to f come only from this process's
+  // fork() and dup(), so f->ref can't grow under us.
+  if(f->ref > 1){
+    ilock(f->ip);
+    return 0;
+  }
+  ilockshared(f->ip);
+  return 1;
+}
+
+static void
+iunlockread(struct file *f, int shared)
+{
+  if(shared)
+    iunlockshared(f->ip);
+  else
+    iunlock(f->ip);
+}
+
+// What a read or write of f could do now without waiting, as
+// POLLIN and POLLOUT, or POLLERR or POLLHUP for a pipe with an
+// end closed. Puts e, if not 0, on the poll list of f's pipe
+// or device. Files on disk are always ready.
+int
+filepoll(struct file *f, struct pollent *e)
+{
+  if(f->type == FD_PIPE)
+    return pipepoll(f->pipe, f->writable, e);
+  if(f->type == FD_DEVICE && f->major >= 0 && f->major < NDEV &&
+     devsw[f->major].poll)
+    return devsw[f->major].poll(e);
+  return (f->readable ? POLLIN : 0) | (f->writable ? POLLOUT : 0);
+}
+
 // Get metadata about file f.
 // addr is a user virtual address, pointing to a struct stat.
 int
@@ -91,9 +314,9 @@ filestat(struct file *f, uint64 addr)
   struct stat st;
   
   if(f->type == FD_INODE || f->type == FD_DEVICE){
-    ilock(f->ip);
+    ilockshared(f->ip);
     stati(f->ip, &st);
-    iunlock(f->ip);
+    iunlockshared(f->ip);
     if(copyout(p->pagetable, addr, (char *)&st, sizeof(st)) < 0)
       return -1;
     return 0;
@@ -101,27 +324,86 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+#define NDENT 16   // entries read from a directory at a time
+
+// Copy as many of directory f's entries in use as fit in n
+// bytes to user address addr, as struct dents, starting at
+// f->off. Returns the number of bytes copied, 0 at the end of
+// the directory, or -1.
+int
+filegetdents(struct file *f, uint64 addr, int n)
+{
+  struct proc *p = myproc();
+  struct dirent de[NDENT];
+  struct dent d;
+  int i, m, r, shared, tot;
+
+  if(f->type != FD_INODE || f->readable == 0)
+    return -1;
+  vmtouch(addr, n, 1);
+  for(tot = 0; tot + sizeof(d) <= n; ){
+    m = (n - tot) / sizeof(d);
+    if(m > NDENT)
+      m = NDENT;
+    shared = ilockread(f);
+    if(f->ip->type != T_DIR){
+      iunlockread(f, shared);
+      return -1;
+    }
+    if((r = readi(f->ip, 0, (uint64)de, f->off, m * sizeof(de[0]))) > 0)
+      f->off += r;
+    iunlockread(f, shared);
+    if(r <= 0)
+      break;
+
+    // the inodes' types, with the directory unlocked: one of
+    // them is the directory itself, and one its parent.
+    fbegin(f);
+    for(i = 0; i < r / sizeof(de[0]); i++){
+      if(de[i].inum == 0)
+        continue;
+      d.inum = de[i].inum;
+      d.type = itype(f->ip->dev, de[i].inum);
+      memmove(d.name, de[i].name, DIRSIZ);
+      if(copyout(p->pagetable, addr + tot, (char*)&d, sizeof(d)) < 0){
+        fend(f);
+        return -1;
+      }
+      tot += sizeof(d);
+    }
+    fend(f);
+  }
+  return tot;
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  int r = 0, shared;
 
   if(f->readable == 0)
     return -1;
 
+  // The copy to addr is made holding a lock that reading in
+  // a page of a program would need or mustn't be held for.
+  vmtouch(addr, n, 1);
+
   if(f->type == FD_PIPE){
-    r = piperead(f->pipe, addr, n);
+    r = piperead(f->pipe, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].read)
       return -1;
+    if(f->nonblock && devsw[f->major].poll &&
+       (devsw[f->major].poll(0) & POLLIN) == 0)
+      return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
+    shared = ilockread(f);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
-    iunlock(f->ip);
+    iunlockread(f, shared);
   } else {
     panic("fileread");
   }
@@ -129,50 +411,59 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Write n bytes from user address addr to f's inode at *off,
+// advancing *off, a few blocks at a time to avoid exceeding
+// the maximum log transaction size, including i-node, indirect
+// block, allocation blocks, and 2 blocks of slop for
+// non-aligned writes.
+#define MAXWRITE (((MAXOPBLOCKS-1-1-2) / 2) * BSIZE)
+
+static int
+inodewrite(struct file *f, uint64 addr, int n, uint *off)
+{
+  int r, i = 0;
+
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > MAXWRITE)
+      n1 = MAXWRITE;
+
+    fbegin(f);
+    ilock(f->ip);
+    if ((r = writei(f->ip, 1, addr + i, *off, n1)) > 0)
+      *off += r;
+    iunlock(f->ip);
+    fend(f);
+
+    if(r != n1){
+      // error from writei
+      break;
+    }
+    i += r;
+  }
+  return i == n ? n : -1;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
 
+  vmtouch(addr, n, 0);
+
   if(f->type == FD_PIPE){
-    ret = pipewrite(f->pipe, addr, n);
+    ret = pipewrite(f->pipe, 1, addr, n, f->nonblock);
   } else if(f->type == FD_DEVICE){
     if(f->major < 0 || f->major >= NDEV || !devsw[f->major].write)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r != n1){
-        // error from writei
-        break;
-      }
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = inodewrite(f, addr, n, &f->off);
   } else {
     panic("filewrite");
   }
@@ -180,3 +471,176 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Read n bytes of f's inode at offset off to user address
+// addr, leaving f->off alone, so readers needn't take turns.
+int
+filepread(struct file *f, uint64 addr, int n, uint off)
+{
+  int r;
+
+  if(f->readable == 0 || f->type != FD_INODE)
+    return -1;
+  vmtouch(addr, n, 1);
+  ilockshared(f->ip);
+  r = readi(f->ip, 1, addr, off, n);
+  iunlockshared(f->ip);
+  return r;
+}
+
+// Write n bytes from user address addr at offset off in f's
+// inode, leaving f->off alone.
+int
+filepwrite(struct file *f, uint64 addr, int n, uint off)
+{
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  vmtouch(addr, n, 0);
+  return inodewrite(f, addr, n, &off);
+}
+
+// Read into each of the n buffers in iov in turn, stopping
+// after a short read. Returns the bytes read, or -1.
+int
+filereadv(struct file *f, struct iovec *iov, int n)
+{
+  int i, r, tot;
+
+  tot = 0;
+  for(i = 0; i < n; i++){
+    if(iov[i].len < 0)
+      return -1;
+    if((r = fileread(f, (uint64)iov[i].base, iov[i].len)) < 0)
+      return tot > 0 ? tot : -1;
+    tot += r;
+    if(r < iov[i].len)
+      break;
+  }
+  return tot;
+}
+
+// Write the n buffers in iov in turn. To an inode, they go
+// in as few transactions as one write of the same total size
+// would take.
+int
+filewritev(struct file *f, struct iovec *iov, int n)
+{
+  int i, r, n1, room, done, tot;
+
+  if(f->writable == 0)
+    return -1;
+  for(i = 0; i < n; i++){
+    if(iov[i].len < 0)
+      return -1;
+    vmtouch((uint64)iov[i].base, iov[i].len, 0);
+  }
+  if(f->type != FD_INODE){
+    tot = 0;
+    for(i = 0; i < n; i++){
+      if((r = filewrite(f, (uint64)iov[i].base, iov[i].len)) != iov[i].len)
+        return -1;
+      tot += r;
+    }
+    return tot;
+  }
+
+  tot = 0;
+  i = 0;
+  done = 0;   // bytes of iov[i] written
+  while(i < n){
+    fbegin(f);
+    ilock(f->ip);
+    for(room = MAXWRITE; room > 0 && i < n; ){
+      n1 = iov[i].len - done;
+      if(n1 > room)
+        n1 = room;
+      if((r = writei(f->ip, 1, (uint64)iov[i].base + done, f->off, n1)) > 0)
+        f->off += r;
+      if(r != n1)
+        break;
+      done += r;
+      room -= r;
+      tot += r;
+      if(done == iov[i].len){
+        i++;
+        done = 0;
+      }
+    }
+    iunlock(f->ip);
+    fend(f);
+    if(r != n1)
+      return -1;
+  }
+  return tot;
+}
+
+// Move up to n bytes from fin to fout inside the kernel, for
+// splice(). One of them must be a pipe and the other a pipe or
+// an inode; data goes between the pipe's ring and the buffer
+// cache with no copy through user space. If keep is set (tee()),
+// both must be pipes and fin's data stays in it.
+// Returns the number of bytes moved, or -1.
+int
+filesplice(struct file *fin, struct file *fout, int n, int keep)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  int i, m, r, shared;
+  char *p;
+
+  if(fin->readable == 0 || fout->writable == 0 || n < 0)
+    return -1;
+  if(fin->type != FD_PIPE && fout->type != FD_PIPE)
+    return -1;
+  if(keep && (fin->type != FD_PIPE || fout->type != FD_PIPE))
+    return -1;
+
+  if(fin->type == FD_PIPE && fout->type == FD_PIPE){
+    if(fin->pipe == fout->pipe)
+      return -1;
+    // one run of fin's ring, written straight into fout's.
+    if((m = pipeget(fin->pipe, 0, 1, n, &p)) <= 0)
+      return m;
+    r = pipewrite(fout->pipe, 0, (uint64)p, m, 0);
+    pipeput(fin->pipe, 0, keep || r < 0 ? 0 : r);
+    return r;
+  }
+
+  if(fout->type == FD_PIPE){
+    if(fin->type != FD_INODE)
+      return -1;
+    // read from the file straight into fout's ring, until n
+    // bytes or end of file.
+    for(i = 0; i < n; i += r){
+      if((m = pipeget(fout->pipe, 1, 1, n - i, &p)) < 0)
+        return i > 0 ? i : -1;
+      shared = ilockread(fin);
+      if((r = readi(fin->ip, 0, (uint64)p, fin->off, m)) > 0)
+        fin->off += r;
+      iunlockread(fin, shared);
+      pipeput(fout->pipe, 1, r > 0 ? r : 0);
+      if(r <= 0)
+        break;
+    }
+    return i;
+  }
+
+  if(fout->type != FD_INODE)
+    return -1;
+  // write runs of fin's ring straight to the file. Like read(),
+  // wait only for the first.
+  for(i = 0; i < n; i += r){
+    if((m = pipeget(fin->pipe, 0, i == 0, n - i, &p)) <= 0)
+      return i > 0 ? i : m;
+    if(m > max)
+      m = max;
+    fbegin(fout);
+    ilock(fout->ip);
+    if((r = writei(fout->ip, 0, (uint64)p, fout->off, m)) > 0)
+      fout->off += r;
+    iunlock(fout->ip);
+    fend(fout);
+    pipeput(fin->pipe, 0, r > 0 ? r : 0);
+    if(r != m)
+      return i > 0 ? i : -1;
+  }
+  return i;
+}
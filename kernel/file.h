@@ -3,6 +3,8 @@ struct file {
   int ref; // reference count
   char readable;
   char writable;
+  char async;        // O_ASYNC: don't wait for writes to commit
+  char nonblock;     // O_NONBLOCK: fail rather than wait
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
@@ -18,6 +20,10 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int hashed;         // in an itable bucket?
+  struct inode *hnext; // itable bucket chain
+  struct inode *prev; // itable free list
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,15 +32,51 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint extblk;
+  uint dindirect;
+  uint index;
+
+  int nextent;        // extents in use, or -1 if not counted yet
+  uint extblocks;     // blocks mapped by the extents
+  uint64 extcursor;   // extent of the last lookup, and in the
+                      // high 32 bits the file block it starts at
+  uint dfree;         // directories: no empty dirent before this offset
+
+  uint ranext;        // read-ahead: block after the last one read
+  uint rawin;         // read-ahead window, in blocks
+  uint raend;         // read-ahead issued up to here
+  int text;           // may have pages in the text cache (vma.c)
+
+  char **tmap;        // tmpfs: page of pointers to its data pages
+  int pinned;         // tmpfs: holds a reference to itself
 };
 
 // map major device number to device functions.
+// A poll() caller's entry on the list of something it watches
+// (poll.c).
+struct pollent {
+  struct pollhead *h;  // list it is on, if any
+  int *ready;          // set, and woken, on pollwake()
+  struct pollent *next;
+  struct pollent *prev;
+};
+
+// What a pipe or device keeps for poll(): the callers waiting
+// for it to change.
+struct pollhead {
+  struct pollent *list;
+};
+
 struct devsw {
   int (*read)(int, uint64, int);
   int (*write)(int, uint64, int);
+  int (*poll)(struct pollent*);  // POLLIN etc. now; may be 0
 };
 
 extern struct devsw devsw[];
 
 #define CONSOLE 1
+#define STATS   2
+#define TRACE   3
+#define PROF    4
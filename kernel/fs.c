@@ -15,6 +15,7 @@
 #include "param.h"
 #include "stat.h"
 #include "spinlock.h"
+#include "seqlock.h"
 #include "proc.h"
 #include "sleeplock.h"
 #include "fs.h"
@@ -37,6 +38,12 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+// The tmpfs (tmpfs.c) on /tmp: the disk directory it covers,
+// and its root. namex() goes from one to the other.
+static struct inode *tmpmnt, *tmproot;
+
+static void tmpmount(void);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +51,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  tmpmount();
 }
 
 // Zero a block.
@@ -52,56 +60,209 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  bp = bzeroed(dev, bno);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Where a search without a goal starts: just past the
+// last block allocated.
+static uint bnext;
+
+// Index of the lowest set bit of x, which must not be 0.
+static int
+lowbit(uint64 x)
+{
+  int i;
+
+  for(i = 0; (x & 0xff) == 0; i += 8)
+    x >>= 8;
+  for(; (x & 1) == 0; i++)
+    x >>= 1;
+  return i;
+}
+
+// Return the first clear bit at or after bit bi in a bitmap
+// block holding nbits bits, or -1. Looks at 64 bits at a time.
+static int
+bitscan(uchar *data, int bi, int nbits)
+{
+  uint64 *w = (uint64*)data;
+  uint64 x;
+  int i;
+
+  for(i = bi / 64; i * 64 < nbits; i++){
+    x = ~w[i];
+    if(i == bi / 64)
+      x &= ~0UL << (bi % 64);
+    if(x){
+      bi = i * 64 + lowbit(x);
+      return bi < nbits ? bi : -1;
+    }
+  }
+  return -1;
+}
+
+// Allocation windows. A file being appended to has the RSVLEN
+// blocks after its last one set aside for it, in memory only,
+// so that files written at the same time don't take turns with
+// blocks and end up in one-block extents. A search whose goal
+// isn't in a window passes over the window's free blocks, and
+// only takes them if nothing else is left.
+#define NRSV 16
+#define RSVLEN 32
+
+static struct {
+  struct spinlock lock;
+  struct rsv {
+    struct inode *ip;   // 0 if unused
+    uint start;
+    uint end;
+  } w[NRSV];
+  int next;             // window to replace next
+} rsv;
+
+// If block b is in a window that doesn't hold goal, return
+// the end of that window; otherwise 0.
+static uint
+rsvskip(uint goal, uint b)
+{
+  struct rsv *w;
+  uint end;
+
+  end = 0;
+  acquire(&rsv.lock);
+  for(w = rsv.w; w < rsv.w + NRSV; w++){
+    if(w->ip && b >= w->start && b < w->end &&
+       !(goal >= w->start && goal < w->end)){
+      end = w->end;
+      break;
+    }
+  }
+  release(&rsv.lock);
+  return end;
+}
+
+// ip has just been given block b: move its window to just
+// after b.
+static void
+rsvset(struct inode *ip, uint b)
+{
+  struct rsv *w, *free;
+
+  free = 0;
+  acquire(&rsv.lock);
+  for(w = rsv.w; w < rsv.w + NRSV; w++){
+    if(w->ip == ip)
+      break;
+    if(w->ip == 0 && free == 0)
+      free = w;
+  }
+  if(w == rsv.w + NRSV){
+    if((w = free) == 0){
+      w = &rsv.w[rsv.next];
+      rsv.next = (rsv.next + 1) % NRSV;
+    }
+    w->ip = ip;
+  }
+  w->start = b + 1;
+  w->end = b + 1 + RSVLEN;
+  release(&rsv.lock);
+}
+
+// Give up ip's window, if it has one.
+static void
+rsvdrop(struct inode *ip)
+{
+  struct rsv *w;
+
+  acquire(&rsv.lock);
+  for(w = rsv.w; w < rsv.w + NRSV; w++)
+    if(w->ip == ip)
+      w->ip = 0;
+  release(&rsv.lock);
+}
+
+// Allocate a zeroed disk block, the first free one at or
+// after goal, wrapping around to the start of the disk.
+// A goal of 0 means anywhere; the search then starts
+// where the last one left off. The first pass leaves
+// alone other files' windows; a second one doesn't.
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal)
 {
-  int b, bi, m;
+  int i, bi, nbits, pass;
+  uint b, start, want, skip;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
+  want = goal;
+  if(goal == 0 || goal >= sb.size)
+    goal = bnext;
+  if(goal >= sb.size)
+    goal = 0;
+
+  for(pass = 0; pass < 2; pass++){
+    // Visit every bitmap block, starting in the middle of
+    // goal's, and finally the start of goal's block again.
+    b = goal;
+    for(i = 0; i <= (sb.size + BPB - 1) / BPB; i++){
+      start = b - b % BPB;
+      nbits = min(BPB, sb.size - start);
+      bp = bread(dev, BBLOCK(b, sb));
+      bi = bitscan(bp->data, b % BPB, nbits);
+      while(pass == 0 && bi >= 0 && (skip = rsvskip(want, start + bi)) != 0)
+        bi = skip - start < nbits ? bitscan(bp->data, skip - start, nbits) : -1;
+      if(bi >= 0){
+        bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        b = start + bi;
+        bnext = b + 1;
+        bzero(dev, b);
+        return b;
       }
+      brelse(bp);
+      b = start + BPB;
+      if(b >= sb.size)
+        b = 0;
     }
-    brelse(bp);
   }
   printf("balloc: out of blocks\n");
   return 0;
 }
 
-// Free a disk block.
+// Free len disk blocks starting at block b, with one read
+// of each bitmap block they are in.
 static void
-bfree(int dev, uint b)
+bfreerun(int dev, uint b, uint len)
 {
   struct buf *bp;
   int bi, m;
 
-  bp = bread(dev, BBLOCK(b, sb));
-  bi = b % BPB;
-  m = 1 << (bi % 8);
-  if((bp->data[bi/8] & m) == 0)
-    panic("freeing free block");
-  bp->data[bi/8] &= ~m;
-  log_write(bp);
-  brelse(bp);
+  while(len > 0){
+    bp = bread(dev, BBLOCK(b, sb));
+    do {
+      bi = b % BPB;
+      m = 1 << (bi % 8);
+      if((bp->data[bi/8] & m) == 0)
+        panic("freeing free block");
+      bp->data[bi/8] &= ~m;
+      b++;
+      len--;
+    } while(len > 0 && b % BPB != 0);
+    log_write(bp);
+    brelse(bp);
+  }
+}
+
+// Free a disk block.
+static void
+bfree(int dev, uint b)
+{
+  bfreerun(dev, b, 1);
 }
 
 // Inodes.
@@ -164,33 +325,148 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable is a hash table of inodes keyed by (dev, inum),
+// sized at boot from the amount of free memory. Each bucket's
+// spin-lock protects the ip->ref, ip->dev, and ip->inum of the
+// inodes hashed there, so one must hold the bucket lock while
+// using any of those fields. Unreferenced inodes stay hashed,
+// with their content, on a free list in least recently used
+// order (itable.lrulock, taken after a bucket lock). Only one
+// process at a time recycles an inode (itable.lock).
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
+// Code that only reads an inode may hold ip->lock shared with
+// other readers (ilockshared()); it then writes nothing but
+// the extent and read-ahead hints.
+
+#define NIBUCKET 127
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct spinlock lrulock;
+  struct ibucket {
+    struct spinlock lock;
+    struct inode *head;
+  } bucket[NIBUCKET];
+  struct inode lru;   // head of the free list; lru.next is the oldest
+  int ninode;
+  uint64 hits, misses;
 } itable;
 
+static struct ibucket*
+ihash(uint dev, uint inum)
+{
+  return &itable.bucket[(dev * 31 + inum) % NIBUCKET];
+}
+
+// Append ip to the free list. Caller must hold itable.lrulock.
+static void
+lruappend(struct inode *ip)
+{
+  ip->next = &itable.lru;
+  ip->prev = itable.lru.prev;
+  itable.lru.prev->next = ip;
+  itable.lru.prev = ip;
+}
+
+// Take ip off the free list. Caller must hold itable.lrulock.
+static void
+lruremove(struct inode *ip)
+{
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  ip->next = ip->prev = 0;
+}
+
+static void dcinit(void);
+static int isinline(struct inode*);
+static void extcount(struct inode*);
+static uint bmap(struct inode*, uint);
+
 void
 iinit()
 {
-  int i = 0;
+  int i, per;
+  struct inode *ip;
+  char *mem;
   
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+  initlock(&itable.lrulock, "itable.lru");
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&itable.bucket[i].lock, "itable.bucket");
+  itable.lru.prev = itable.lru.next = &itable.lru;
+  dcinit();
+  initlock(&rsv.lock, "rsv");
+
+  // One inode for every 16 free pages, unless the boot
+  // arguments say otherwise, but at least NINODE.
+  itable.ninode = bootarg("ninode", kfreepages() / 16);
+  if(itable.ninode < NINODE)
+    itable.ninode = NINODE;
+
+  per = PGSIZE / sizeof(struct inode);
+  mem = 0;
+  for(i = 0; i < itable.ninode; i++) {
+    if(i % per == 0 && (mem = kalloc()) == 0)
+      panic("iinit: kalloc");
+    ip = (struct inode*)mem + i % per;
+    memset(ip, 0, sizeof(*ip));
+    initsleeplock(&ip->lock, "inode");
+    lruappend(ip);
   }
 }
 
 static struct inode* iget(uint dev, uint inum);
 
+// Allocate a tmpfs inode: it is in memory from the start.
+static struct inode*
+tmpiget(short type)
+{
+  struct inode *ip;
+  uint inum;
+
+  if((inum = tmpialloc()) == 0){
+    printf("ialloc: no tmpfs inodes\n");
+    return 0;
+  }
+  ip = iget(TMPDEV, inum);
+  ip->type = type;
+  ip->major = ip->minor = ip->nlink = 0;
+  ip->size = 0;
+  memset(ip->ext, 0, sizeof(ip->ext));
+  ip->extblk = ip->dindirect = ip->index = 0;
+  ip->nextent = 0;
+  ip->extblocks = 0;
+  ip->extcursor = 0;
+  ip->dfree = 0;
+  ip->ranext = ip->rawin = ip->raend = 0;
+  ip->tmap = 0;
+  ip->pinned = 0;
+  ip->valid = 1;
+  return ip;
+}
+
+// A tmpfs inode has nowhere to be read back from, so while it
+// has links it holds a reference to itself, and stays in the
+// table.
+static void
+tmppin(struct inode *ip)
+{
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
+  if(ip->nlink > 0 && !ip->pinned){
+    ip->pinned = 1;
+    ip->ref++;
+  } else if(ip->nlink == 0 && ip->pinned){
+    ip->pinned = 0;
+    ip->ref--;   // the caller has one too
+  }
+  release(&bk->lock);
+}
+
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
 // Returns an unlocked but allocated and referenced inode,
@@ -202,6 +478,9 @@ ialloc(uint dev, short type)
   struct buf *bp;
   struct dinode *dip;
 
+  if(dev == TMPDEV)
+    return tmpiget(type);
+
   for(inum = 1; inum < sb.ninodes; inum++){
     bp = bread(dev, IBLOCK(inum, sb));
     dip = (struct dinode*)bp->data + inum%IPB;
@@ -228,6 +507,10 @@ iupdate(struct inode *ip)
   struct buf *bp;
   struct dinode *dip;
 
+  if(ip->dev == TMPDEV){
+    tmppin(ip);
+    return;
+  }
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
@@ -235,42 +518,113 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->extblk = ip->extblk;
+  dip->dindirect = ip->dindirect;
+  dip->index = ip->index;
   log_write(bp);
   brelse(bp);
 }
 
+static struct inode*
+ifind(struct ibucket *bk, uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = bk->head; ip; ip = ip->hnext)
+    if(ip->dev == dev && ip->inum == inum)
+      return ip;
+  return 0;
+}
+
+// Take a reference to ip, which is hashed in bucket bk.
+// Caller must hold bk->lock.
+static void
+iref(struct inode *ip)
+{
+  if(ip->ref++ == 0){
+    acquire(&itable.lrulock);
+    if(ip->next)
+      lruremove(ip);
+    release(&itable.lrulock);
+  }
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct ibucket *bk, *vb;
+  struct inode *ip, **pp;
+  int onlru;
 
-  acquire(&itable.lock);
+  bk = ihash(dev, inum);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) != 0){
+    iref(ip);
+    release(&bk->lock);
+    __sync_fetch_and_add(&itable.hits, 1);
+    return ip;
   }
+  release(&bk->lock);
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+  // Recycle an inode entry. Only one process does so at a time,
+  // so check again: someone may have brought the inode in while
+  // we were waiting for itable.lock.
+  acquire(&itable.lock);
+  acquire(&bk->lock);
+  if((ip = ifind(bk, dev, inum)) != 0){
+    iref(ip);
+    release(&bk->lock);
+    release(&itable.lock);
+    __sync_fetch_and_add(&itable.hits, 1);
+    return ip;
+  }
+  release(&bk->lock);
+  __sync_fetch_and_add(&itable.misses, 1);
+
+  for(;;){
+    acquire(&itable.lrulock);
+    if((ip = itable.lru.next) == &itable.lru)
+      panic("iget: no inodes");
+    lruremove(ip);
+    release(&itable.lrulock);
+    if(!ip->hashed)
+      break;
+
+    // iget() may have found it in the meantime; if so, iput()
+    // puts it back on the free list rather than us reusing it.
+    vb = ihash(ip->dev, ip->inum);
+    acquire(&vb->lock);
+    acquire(&itable.lrulock);
+    onlru = ip->next != 0;
+    release(&itable.lrulock);
+    if(ip->ref == 0 && !onlru){
+      for(pp = &vb->head; *pp != ip; pp = &(*pp)->hnext)
+        ;
+      *pp = ip->hnext;
+      ip->hashed = 0;
+      release(&vb->lock);
+      break;
+    }
+    release(&vb->lock);
+  }
+  if(ip->text)
+    textinval(ip);
 
-  ip = empty;
+  acquire(&bk->lock);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->hashed = 1;
+  ip->hnext = bk->head;
+  bk->head = ip;
+  release(&bk->lock);
   release(&itable.lock);
 
   return ip;
@@ -281,9 +635,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
   ip->ref++;
-  release(&itable.lock);
+  release(&bk->lock);
   return ip;
 }
 
@@ -308,8 +664,14 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->extblk = dip->extblk;
+    ip->dindirect = dip->dindirect;
+    ip->index = dip->index;
+    ip->nextent = -1;
+    ip->dfree = 0;
     brelse(bp);
+    ip->ranext = ip->rawin = ip->raend = 0;
     ip->valid = 1;
     if(ip->type == 0)
       panic("ilock: no type");
@@ -326,6 +688,37 @@ iunlock(struct inode *ip)
   releasesleep(&ip->lock);
 }
 
+// Lock the given inode shared with other readers, for callers
+// that only read it with stati(), readi() and dirlookup().
+// Those change nothing but hints, so first do with the inode
+// held alone what they would otherwise have to: read it from
+// disk, and count its extents, which an inline file has none of.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  for(;;){
+    acquiresleepshared(&ip->lock);
+    if(ip->valid && (ip->nextent >= 0 || isinline(ip)))
+      return;
+    releasesleepshared(&ip->lock);
+    ilock(ip);
+    extcount(ip);
+    iunlock(ip);
+  }
+}
+
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releasesleepshared(&ip->lock);
+}
+
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
 // be recycled.
@@ -336,7 +729,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct ibucket *bk = ihash(ip->dev, ip->inum);
+
+  acquire(&bk->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -345,20 +740,27 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(&bk->lock);
 
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
     ip->valid = 0;
+    if(ip->dev == TMPDEV)
+      tmpifree(ip->inum);
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(&bk->lock);
   }
 
-  ip->ref--;
-  release(&itable.lock);
+  if(--ip->ref == 0){
+    rsvdrop(ip);
+    acquire(&itable.lrulock);
+    lruappend(ip);
+    release(&itable.lrulock);
+  }
+  release(&bk->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -372,52 +774,249 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk, mostly as runs of consecutive blocks
+// (extents). The first NEXTENT extents are listed in ip->ext[],
+// the next NXEXTENT in block ip->extblk. Blocks are only ever
+// added at the end of a file, so a write that carries on where
+// the last one stopped normally just makes the last extent
+// longer. Once the extents are used up, the remaining blocks go
+// in the doubly-indirect tree at ip->dindirect.
+
+// Does ip keep its data in the inode? See INLINESIZE.
+static int
+isinline(struct inode *ip)
+{
+  return ip->type == T_FILE && ip->ext[0].start == 0;
+}
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
-static uint
-bmap(struct inode *ip, uint bn)
+// Where an inline file's data is: ext[], extblk and dindirect
+// are next to each other, as in struct dinode.
+static char*
+idata(struct inode *ip)
+{
+  return (char*)&ip->ext[0].len;
+}
+
+// Move an inline file's data to a block of its own, before it
+// grows past INLINESIZE. Returns -1 if out of disk space.
+static int
+unline(struct inode *ip)
 {
-  uint addr, *a;
+  char data[INLINESIZE];
   struct buf *bp;
+  uint addr;
+
+  memmove(data, idata(ip), INLINESIZE);
+  memset(idata(ip), 0, INLINESIZE);
+  ip->nextent = 0;
+  ip->extblocks = 0;
+  ip->extcursor = 0;
+  if((addr = bmap(ip, 0)) == 0){
+    memmove(idata(ip), data, INLINESIZE);
+    ip->nextent = -1;
+    return -1;
+  }
+  bp = bread(ip->dev, addr);
+  memmove(bp->data, data, ip->size);
+  log_write(bp);
+  brelse(bp);
+  return 0;
+}
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
-    }
-    return addr;
+// Count ip's extents and the blocks they map.
+static void
+extcount(struct inode *ip)
+{
+  struct buf *bp;
+  struct extent *e;
+  int i, n;
+  uint blocks;
+
+  if(ip->nextent >= 0)
+    return;
+  if(isinline(ip)){
+    // ext[] and extblk hold the file's data, not extents.
+    ip->nextent = 0;
+    ip->extblocks = 0;
+    ip->extcursor = 0;
+    return;
   }
-  bn -= NDIRECT;
+  blocks = 0;
+  for(n = 0; n < NEXTENT && ip->ext[n].len; n++)
+    blocks += ip->ext[n].len;
+  if(n == NEXTENT && ip->extblk){
+    bp = bread(ip->dev, ip->extblk);
+    e = (struct extent*)bp->data;
+    for(i = 0; i < NXEXTENT && e[i].len; i++)
+      blocks += e[i].len;
+    brelse(bp);
+    n += i;
+  }
+  ip->nextent = n;
+  ip->extblocks = blocks;
+  ip->extcursor = 0;
+}
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
+// Return the disk block of block bn of ip, which must be
+// mapped by the extents. The search starts at the extent
+// of the last lookup if that one is not past bn. Readers
+// holding ip->lock shared may race to update that hint, so
+// it is one word, loaded and stored whole.
+static uint
+extlookup(struct inode *ip, uint bn)
+{
+  struct buf *bp;
+  struct extent *e;
+  uint start, addr;
+  uint64 cur;
+  int i;
+
+  i = 0;
+  start = 0;
+  cur = __atomic_load_n(&ip->extcursor, __ATOMIC_RELAXED);
+  if((int)(cur & 0xffffffff) < ip->nextent && (cur >> 32) <= bn){
+    i = cur & 0xffffffff;
+    start = cur >> 32;
+  }
+  bp = 0;
+  addr = 0;
+  for(; i < ip->nextent; i++){
+    if(i < NEXTENT){
+      e = &ip->ext[i];
+    } else {
+      if(bp == 0)
+        bp = bread(ip->dev, ip->extblk);
+      e = (struct extent*)bp->data + (i - NEXTENT);
     }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
+    if(bn < start + e->len){
+      __atomic_store_n(&ip->extcursor, ((uint64)start << 32) | i, __ATOMIC_RELAXED);
+      addr = e->start + (bn - start);
+      break;
+    }
+    start += e->len;
+  }
+  if(bp)
+    brelse(bp);
+  if(addr == 0)
+    panic("extlookup");
+  return addr;
+}
+
+// Allocate the block after the last one the extents map,
+// right after the last extent if that block is free.
+// Returns 0 if out of disk space, or if the block would
+// need a new extent and all of them are in use.
+static uint
+extappend(struct inode *ip)
+{
+  struct buf *bp;
+  struct extent *e;
+  uint addr, goal;
+  int i;
+
+  bp = 0;
+  e = 0;
+  i = ip->nextent - 1;
+  if(i >= NEXTENT){
+    bp = bread(ip->dev, ip->extblk);
+    e = (struct extent*)bp->data + (i - NEXTENT);
+  } else if(i >= 0){
+    e = &ip->ext[i];
+  }
+  goal = e ? e->start + e->len : 0;
+
+  if((addr = balloc(ip->dev, goal)) == 0)
+    goto out;
+  rsvset(ip, addr);
+  if(e && addr == goal){
+    e->len++;
+  } else if(ip->nextent < NEXTENT){
+    e = &ip->ext[ip->nextent++];
+    e->start = addr;
+    e->len = 1;
+  } else if(ip->nextent < NEXTENT + NXEXTENT){
+    if(bp == 0){
+      if(ip->extblk == 0 && (ip->extblk = balloc(ip->dev, 0)) == 0){
+        bfree(ip->dev, addr);
+        addr = 0;
+        goto out;
       }
+      bp = bread(ip->dev, ip->extblk);
     }
+    e = (struct extent*)bp->data + (ip->nextent++ - NEXTENT);
+    e->start = addr;
+    e->len = 1;
+  } else {
+    bfree(ip->dev, addr);
+    addr = 0;
+    goto out;
+  }
+  ip->extblocks++;
+  if(bp)
+    log_write(bp);
+
+out:
+  if(bp)
     brelse(bp);
-    return addr;
+  return addr;
+}
+
+// Return entry i of indirect block addr, allocating a block
+// for it, next to the entry before, if it is empty.
+// returns 0 if out of disk space.
+static uint
+ientry(uint dev, uint addr, uint i)
+{
+  struct buf *bp;
+  uint *a, b;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  if((b = a[i]) == 0){
+    b = balloc(dev, i > 0 && a[i-1] ? a[i-1] + 1 : 0);
+    if(b){
+      a[i] = b;
+      log_write(bp);
+    }
+  }
+  brelse(bp);
+  return b;
+}
+
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one.
+// returns 0 if out of disk space.
+static uint
+bmap(struct inode *ip, uint bn)
+{
+  uint addr;
+
+  extcount(ip);
+  if(bn < ip->extblocks)
+    return extlookup(ip, bn);
+
+  if(ip->dindirect == 0){
+    addr = 0;
+    while(ip->extblocks <= bn){
+      if((addr = extappend(ip)) == 0)
+        break;
+    }
+    if(addr)
+      return addr;
+    if(ip->nextent < NEXTENT + NXEXTENT)
+      return 0;  // out of disk space
   }
 
-  panic("bmap: out of range");
+  bn -= ip->extblocks;
+  if(bn >= NDINDIRECT)
+    panic("bmap: out of range");
+  if(ip->dindirect == 0){
+    if((ip->dindirect = balloc(ip->dev, 0)) == 0)
+      return 0;
+  }
+  if((addr = ientry(ip->dev, ip->dindirect, bn / NINDIRECT)) == 0)
+    return 0;
+  return ientry(ip->dev, addr, bn % NINDIRECT);
 }
 
 // Truncate inode (discard contents).
@@ -426,34 +1025,71 @@ void
 itrunc(struct inode *ip)
 {
   int i, j;
-  struct buf *bp;
-  uint *a;
+  struct buf *bp, *bp2;
+  struct extent *e;
+  uint *a, *a2;
+
+  rsvdrop(ip);
+  if(ip->dev == TMPDEV){
+    tmptrunc(ip);
+    goto done;
+  }
+  if(isinline(ip)){
+    memset(idata(ip), 0, INLINESIZE);
+    goto done;
+  }
+  for(i = 0; i < NEXTENT; i++){
+    bfreerun(ip->dev, ip->ext[i].start, ip->ext[i].len);
+    ip->ext[i].start = ip->ext[i].len = 0;
+  }
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  if(ip->extblk){
+    bp = bread(ip->dev, ip->extblk);
+    e = (struct extent*)bp->data;
+    for(j = 0; j < NXEXTENT; j++)
+      bfreerun(ip->dev, e[j].start, e[j].len);
+    brelse(bp);
+    bfree(ip->dev, ip->extblk);
+    ip->extblk = 0;
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+  if(ip->dindirect){
+    bp = bread(ip->dev, ip->dindirect);
     a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i] == 0)
+        continue;
+      bp2 = bread(ip->dev, a[i]);
+      a2 = (uint*)bp2->data;
+      for(j = 0; j < NINDIRECT; j++){
+        if(a2[j])
+          bfree(ip->dev, a2[j]);
+      }
+      brelse(bp2);
+      bfree(ip->dev, a[i]);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, ip->dindirect);
+    ip->dindirect = 0;
+  }
+
+  if(ip->index){
+    bfree(ip->dev, ip->index);
+    ip->index = 0;
   }
 
+done:
+  ip->nextent = 0;
+  ip->extblocks = 0;
+  ip->extcursor = 0;
   ip->size = 0;
   iupdate(ip);
+  if(ip->text)
+    textinval(ip);
 }
 
 // Copy stat information from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, perhaps shared.
 void
 stati(struct inode *ip, struct stat *st)
 {
@@ -462,10 +1098,85 @@ stati(struct inode *ip, struct stat *st)
   st->type = ip->type;
   st->nlink = ip->nlink;
   st->size = ip->size;
+  // ilockshared() has counted them, unless ip is inline.
+  st->nextent = ip->nextent > 0 ? ip->nextent : 0;
+}
+
+// Return the type of inode inum on dev, reading it in if it
+// isn't cached. Must be called inside a transaction since it
+// calls iput().
+short
+itype(uint dev, uint inum)
+{
+  struct inode *ip;
+  short type;
+
+  ip = iget(dev, inum);
+  ilockshared(ip);
+  type = ip->type;
+  iunlockshared(ip);
+  iput(ip);
+  return type;
+}
+
+// Read-ahead window limits, in blocks.
+#define RAMIN 4
+#define RAMAX 32
+
+// Called by readi() before it reads blocks first..last.
+// If the read carries on where the last one left off, start
+// prefetching the blocks it needs and the window after them,
+// and double the window; any other access collapses it.
+// Caller must hold ip->lock, perhaps shared: readers that race
+// here can only make the window wrong, since every block below
+// the size is already mapped.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, nblocks;
+
+  if(first != ip->ranext && first + 1 != ip->ranext){
+    ip->rawin = 0;
+    ip->raend = 0;
+    ip->ranext = last + 1;
+    return;
+  }
+  if(first == ip->ranext)
+    ip->rawin = ip->rawin ? min(2*ip->rawin, RAMAX) : RAMIN;
+  ip->ranext = last + 1;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  end = min(last + 1 + ip->rawin, nblocks);
+  bn = ip->raend > first ? ip->raend : first;
+  for(; bn < end; bn++){
+    uint addr = bmap(ip, bn);
+    if(addr == 0)
+      break;
+    bprefetch(ip->dev, addr);
+  }
+  bkick();
+  ip->raend = bn;
+}
+
+// Count n bytes that readi() or writei() moved to or from user
+// memory against the current process, for getrusage().
+// Returns n.
+static int
+ioacct(int user, int n, int write)
+{
+  struct proc *p;
+
+  if(user && n > 0 && (p = myproc()) != 0){
+    if(write)
+      p->wbytes += n;
+    else
+      p->rbytes += n;
+  }
+  return n;
 }
 
 // Read data from inode.
-// Caller must hold ip->lock.
+// Caller must hold ip->lock, perhaps shared.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int
@@ -478,6 +1189,15 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     return 0;
   if(off + n > ip->size)
     n = ip->size - off;
+  if(ip->dev == TMPDEV)
+    return ioacct(user_dst, tmpread(ip, user_dst, dst, off, n), 0);
+  if(isinline(ip)){
+    if(either_copyout(user_dst, dst, idata(ip) + off, n) == -1)
+      return -1;
+    return ioacct(user_dst, n, 0);
+  }
+  if(n > 0)
+    readahead(ip, off/BSIZE, (off+n-1)/BSIZE);
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -492,7 +1212,7 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     }
     brelse(bp);
   }
-  return tot;
+  return ioacct(user_dst, tot, 0);
 }
 
 // Write data to inode.
@@ -512,6 +1232,27 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
+  if(ip->text)
+    textinval(ip);
+
+  if(ip->dev == TMPDEV){
+    tot = tmpwrite(ip, user_src, src, off, n);
+    if(off + tot > ip->size)
+      ip->size = off + tot;
+    return ioacct(user_src, tot, 1);
+  }
+  if(isinline(ip)){
+    if(off + n <= INLINESIZE){
+      if(either_copyin(idata(ip) + off, user_src, src, n) == -1)
+        return -1;
+      if(off + n > ip->size)
+        ip->size = off + n;
+      iupdate(ip);
+      return ioacct(user_src, n, 1);
+    }
+    if(ip->size > 0 && unline(ip) < 0)
+      return -1;
+  }
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     uint addr = bmap(ip, off/BSIZE);
@@ -532,10 +1273,10 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
-  // block to ip->addrs[].
+  // block to ip's extents.
   iupdate(ip);
 
-  return tot;
+  return ioacct(user_src, tot, 1);
 }
 
 // Directories
@@ -546,17 +1287,280 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory name cache.
+//
+// Remembers the result of looking up (dev, dir inum, name):
+// the inum it names, or 0 if the directory has no such entry.
+// Hashed into DCBUCKET sets of DCWAYS entries each, replaced
+// round-robin. Callers hold the directory's lock, and both
+// kinds of entries are dropped by dirlink() and unlink when
+// the directory changes, so an entry is never stale.
+
+#define DCBUCKET 61
+#define DCWAYS 4
+
+struct dcentry {
+  uint dev;
+  uint dir;
+  uint inum;       // 0 if dir has no entry name
+  int valid;
+  char name[DIRSIZ];
+};
+
+struct {
+  struct dcbucket {
+    struct seqlock lock;   // dclookup() doesn't take its spinlock
+    struct dcentry e[DCWAYS];
+    int next;      // entry to replace next
+  } bucket[DCBUCKET];
+  uint64 hits, neghits, misses;
+} dcache;
+
+static void
+dcinit(void)
+{
+  int i;
+
+  for(i = 0; i < DCBUCKET; i++)
+    initseqlock(&dcache.bucket[i].lock, "dcache");
+}
+
+static struct dcbucket*
+dchash(struct inode *dp, char *name)
+{
+  uint h;
+  int i;
+
+  h = dp->dev * 31 + dp->inum;
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.bucket[h % DCBUCKET];
+}
+
+static struct dcentry*
+dcfind(struct dcbucket *bk, struct inode *dp, char *name)
+{
+  struct dcentry *e;
+
+  for(e = bk->e; e < bk->e + DCWAYS; e++){
+    if(e->valid && e->dev == dp->dev && e->dir == dp->inum &&
+       namecmp(e->name, name) == 0)
+      return e;
+  }
+  return 0;
+}
+
+// Look up name in directory dp in the cache. Returns 1 and
+// sets *inum (0 for a known-missing name) on a hit.
+// Takes no lock, so lookups in the same bucket don't wait for
+// each other; a lookup that raced with dcenter() or dcinval()
+// is done again.
+static int
+dclookup(struct inode *dp, char *name, uint *inum)
+{
+  struct dcbucket *bk = dchash(dp, name);
+  struct dcentry *e;
+  uint s, n;
+
+  n = 0;
+  do {
+    s = readseqbegin(&bk->lock);
+    if((e = dcfind(bk, dp, name)) != 0)
+      n = e->inum;
+  } while(readseqretry(&bk->lock, s));
+
+  if(e == 0)
+    __atomic_fetch_add(&dcache.misses, 1, __ATOMIC_RELAXED);
+  else if(n)
+    __atomic_fetch_add(&dcache.hits, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_fetch_add(&dcache.neghits, 1, __ATOMIC_RELAXED);
+  if(e)
+    *inum = n;
+  return e != 0;
+}
+
+// Record that name in dp is inum (0: no such entry).
+static void
+dcenter(struct inode *dp, char *name, uint inum)
+{
+  struct dcbucket *bk = dchash(dp, name);
+  struct dcentry *e;
+
+  writeseqlock(&bk->lock);
+  if((e = dcfind(bk, dp, name)) == 0){
+    e = &bk->e[bk->next];
+    bk->next = (bk->next + 1) % DCWAYS;
+    e->dev = dp->dev;
+    e->dir = dp->inum;
+    strncpy(e->name, name, DIRSIZ);
+    e->valid = 1;
+  }
+  e->inum = inum;
+  writesequnlock(&bk->lock);
+}
+
+// Forget what the cache knows about name in dp, which the
+// caller is about to change. Caller must hold dp->lock.
+void
+dcinval(struct inode *dp, char *name)
+{
+  struct dcbucket *bk = dchash(dp, name);
+  struct dcentry *e;
+
+  writeseqlock(&bk->lock);
+  if((e = dcfind(bk, dp, name)) != 0)
+    e->valid = 0;
+  writesequnlock(&bk->lock);
+}
+
+int
+fsstats(char *buf, int sz)
+{
+  int m;
+
+  m = snprintf(buf, sz, "--- itable\ninodes %d hits %l misses %l\n",
+               itable.ninode, itable.hits, itable.misses);
+  m += snprintf(buf+m, sz-m, "--- dcache\nhits %l negative %l misses %l\n",
+                dcache.hits, dcache.neghits, dcache.misses);
+  return m;
+}
+
+// Directory hash index; see DXMIN in fs.h.
+
+// Put dirent number k, named name, in an empty slot near the
+// name's. Returns -1 if there is none.
+static int
+dxput(ushort *slot, char *name, uint k)
+{
+  uint i, n;
+
+  if(k + 1 > 0xffff)
+    return -1;
+  i = dirhash(name) % NDXSLOT;
+  for(n = 0; n < DXPROBE; n++, i = (i + 1) % NDXSLOT){
+    if(slot[i] == 0){
+      slot[i] = k + 1;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Build dp's index afresh from its dirents, or drop it if they
+// don't fit. Caller must hold dp->lock, in a transaction.
+static void
+dxbuild(struct inode *dp)
+{
+  struct buf *bp;
+  struct dirent de;
+  uint off;
+
+  if(dp->index == 0 && (dp->index = balloc(dp->dev, 0)) == 0)
+    return;
+  bp = bread(dp->dev, dp->index);
+  memset(bp->data, 0, BSIZE);
+  for(off = 0; off < dp->size; off += sizeof(de)){
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dxbuild read");
+    if(de.inum && dxput((ushort*)bp->data, de.name, off / sizeof(de)) < 0){
+      brelse(bp);
+      bfree(dp->dev, dp->index);
+      dp->index = 0;
+      iupdate(dp);
+      return;
+    }
+  }
+  log_write(bp);
+  brelse(bp);
+  iupdate(dp);
+}
+
+// Add the dirent at off, named name, to dp's index, building
+// it if dp has just reached DXMIN blocks, and rebuilding it if
+// the name's slots are full.
+static void
+dxadd(struct inode *dp, char *name, uint off)
+{
+  struct buf *bp;
+  int r;
+
+  if(dp->dev == TMPDEV)
+    return;
+  if(dp->index == 0){
+    if(off % BSIZE == 0 && off / BSIZE + 1 >= DXMIN && off + BSIZE >= dp->size)
+      dxbuild(dp);
+    return;
+  }
+  bp = bread(dp->dev, dp->index);
+  if((r = dxput((ushort*)bp->data, name, off / sizeof(struct dirent))) == 0)
+    log_write(bp);
+  brelse(bp);
+  if(r < 0)
+    dxbuild(dp);
+}
+
+// Look name up in dp's index. Returns the offset of its dirent
+// and sets *pinum, or returns -1 if dp has no such entry.
+static int
+dxlookup(struct inode *dp, char *name, uint *pinum)
+{
+  struct buf *bp;
+  struct dirent de;
+  ushort *slot;
+  uint i, n, off;
+  int found;
+
+  found = -1;
+  bp = bread(dp->dev, dp->index);
+  slot = (ushort*)bp->data;
+  i = dirhash(name) % NDXSLOT;
+  for(n = 0; n < DXPROBE && slot[i] != 0; n++, i = (i + 1) % NDXSLOT){
+    off = (slot[i] - 1) * sizeof(de);
+    if(off >= dp->size)
+      continue;
+    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+      panic("dxlookup read");
+    if(de.inum && namecmp(name, de.name) == 0){
+      *pinum = de.inum;
+      found = off;
+      break;
+    }
+  }
+  brelse(bp);
+  return found;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Lookups that don't need the offset try the name cache first;
+// a directory with an index looks there instead of at every
+// entry.
+// Caller must hold dp->lock, perhaps shared.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  int r;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(poff == 0 && dclookup(dp, name, &inum))
+    return inum ? iget(dp->dev, inum) : 0;
+
+  if(dp->index){
+    if((r = dxlookup(dp, name, &inum)) < 0){
+      dcenter(dp, name, 0);
+      return 0;
+    }
+    if(poff)
+      *poff = r;
+    dcenter(dp, name, inum);
+    return iget(dp->dev, inum);
+  }
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,10 +1571,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcenter(dp, name, inum);
       return iget(dp->dev, inum);
     }
   }
 
+  dcenter(dp, name, 0);
   return 0;
 }
 
@@ -590,7 +1596,7 @@ dirlink(struct inode *dp, char *name, uint inum)
   }
 
   // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  for(off = dp->dfree; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlink read");
     if(de.inum == 0)
@@ -599,12 +1605,24 @@ dirlink(struct inode *dp, char *name, uint inum)
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
+  dcinval(dp, name);
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
+  dp->dfree = off + sizeof(de);
+  dxadd(dp, name, off);
 
   return 0;
 }
 
+// The dirent at off in dp has been cleared.
+// Caller must hold dp->lock.
+void
+dirunlink(struct inode *dp, uint off)
+{
+  if(off < dp->dfree)
+    dp->dfree = off;
+}
+
 // Paths
 
 // Copy the next path element from path into name.
@@ -644,36 +1662,52 @@ skipelem(char *path, char *name)
   return path;
 }
 
-// Look up and return the inode for a path name.
+// Look up and return the inode for a path name, relative to
+// directory start if it isn't absolute, or to the current one
+// if start is 0.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
 // Must be called inside a transaction since it calls iput().
 static struct inode*
-namex(char *path, int nameiparent, char *name)
+namex(struct inode *start, char *path, int nameiparent, char *name)
 {
-  struct inode *ip, *next;
+  struct inode *ip, *next, *dp;
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
   else
-    ip = idup(myproc()->cwd);
+    ip = idup(start ? start : myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    // only reads ip, so walks through the same directories
+    // don't wait for each other.
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+    dp = ip;
+    if(ip == tmproot && namecmp(name, "..") == 0){
+      // out of the tmpfs: its root's parent is the mount point's.
+      iunlockshared(ip);
+      dp = tmpmnt;
+      ilockshared(dp);
+    }
+    next = dirlookup(dp, name, 0);
+    iunlockshared(dp);
+    iput(ip);
+    if(next == 0)
       return 0;
+    if(next == tmpmnt){
+      iput(next);
+      next = idup(tmproot);
     }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
@@ -687,11 +1721,56 @@ struct inode*
 namei(char *path)
 {
   char name[DIRSIZ];
-  return namex(path, 0, name);
+  return namex(0, path, 0, name);
 }
 
 struct inode*
 nameiparent(char *path, char *name)
 {
-  return namex(path, 1, name);
+  return namex(0, path, 1, name);
+}
+
+// namei() for a path relative to directory dp.
+struct inode*
+nameiat(struct inode *dp, char *path)
+{
+  char name[DIRSIZ];
+  return namex(dp, path, 0, name);
+}
+
+// Mount a tmpfs on /tmp, if the disk has such a directory.
+static void
+tmpmount(void)
+{
+  struct inode *mp, *ip;
+
+  tmpinit(itable.ninode / 2);
+  begin_op();
+  if((mp = namei("/tmp")) == 0){
+    end_op();
+    return;
+  }
+  ilock(mp);
+  if(mp->type != T_DIR || (ip = ialloc(TMPDEV, T_DIR)) == 0){
+    iunlockput(mp);
+    end_op();
+    return;
+  }
+  iunlock(mp);
+  ilock(ip);
+  ip->nlink = 1;
+  iupdate(ip);
+  if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", ip->inum) < 0)
+    panic("tmpmount");
+  iunlock(ip);
+  end_op();
+  tmpmnt = mp;
+  tmproot = ip;
+}
+
+// Is ip a mount point? It can't be unlinked.
+int
+ismount(struct inode *ip)
+{
+  return ip == tmpmnt;
 }
@@ -20,13 +20,25 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint logdev;       // Device holding the log, if not this one
 };
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// A run of len consecutive disk blocks starting at block start.
+// A file's extents map its blocks in order: the first extent
+// holds blocks 0..len-1 of the file, the next one the blocks
+// after those, and so on. An unused extent has len 0.
+struct extent {
+  uint start;
+  uint len;
+};
+
+#define NEXTENT 5                                  // extents in the inode
+#define NXEXTENT (BSIZE / sizeof(struct extent))   // extents in the extent block
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXFILE 1024   // max file size in blocks; the mapping has room for more
 
 // On-disk inode structure
 struct dinode {
@@ -35,9 +47,17 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT]; // First extents
+  uint extblk;          // Block of NXEXTENT more extents
+  uint dindirect;       // Doubly-indirect block, for blocks past the extents
+  uint index;           // T_DIR: block of its hash index, or 0
 };
 
+// A small file can keep its data in the inode, in place of
+// its extents: a T_FILE with no blocks has ext[0].start 0, and
+// up to INLINESIZE bytes of data after that, through dindirect.
+#define INLINESIZE (NEXTENT*sizeof(struct extent) + sizeof(uint))
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -58,3 +78,34 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory of DXMIN blocks or more has a hash index: a block
+// of NDXSLOT slots, each 0 if empty or 1 + the number of one of
+// its dirents. A name's dirent is pointed to by one of the slots
+// from dirhash(name) % NDXSLOT on, before an empty one and
+// within DXPROBE slots; a directory whose names don't fit that
+// way has no index and is searched entry by entry. Unlinked
+// and reused dirents stay in the index, so a slot's dirent may
+// hold another name, or none.
+#define DXMIN 2
+#define NDXSLOT (BSIZE / sizeof(ushort))
+#define DXPROBE 32   // a name's dirent is at most this far from its slot
+
+static inline uint
+dirhash(const char *name)
+{
+  uint h = 2166136261;   // FNV-1a
+  int i;
+
+  for(i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (uchar)name[i]) * 16777619;
+  return h;
+}
+
+// A directory entry in use as getdents() returns it, with the
+// type of the inode it names.
+struct dent {
+  ushort inum;
+  short type;
+  char name[DIRSIZ];
+};
+
@@ -1,6 +1,28 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or aligned runs of 2^order pages.
+//
+// Free memory lives in a buddy allocator, which hands out
+// blocks of 2^order pages and merges a freed block with its
+// buddy when that is free too. Single pages, by far the most
+// common request, go through per-CPU free lists in front of
+// it, so kalloc() and kfree() on different harts don't
+// contend. A CPU whose list is empty refills it with a batch
+// of pages from the buddy allocator, or steals from another
+// CPU once that runs dry; a list that grows too long gives a
+// batch back, so that freed pages can merge again.
+//
+// Every page has a reference count, so that page tables can
+// share pages copy-on-write; kfree() only frees a page when
+// the last reference goes away.
+//
+// kzalloc() returns zeroed pages. A kernel thread keeps a pool
+// of them zeroed ahead of time, off the fork/exec/fault paths.
+//
+// Built with KDEBUG (make KDEBUG=1), freed and newly allocated
+// pages are filled with junk to catch dangling references and
+// reads of uninitialized memory.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +31,17 @@
 #include "riscv.h"
 #include "defs.h"
 
+// Number of pages moved by one steal, refill or give-back.
+#define NSTEAL 32
+// Longest a per-CPU list gets before giving pages back.
+#define NCACHE (4*NSTEAL)
+
+// Largest block, in log2 pages (4 MiB).
+#define MAXORDER 10
+
+// Pages kept zeroed for kzalloc().
+#define NZPAGE 64
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,48 +51,281 @@ struct run {
   struct run *next;
 };
 
+// Reference counts of physical pages, changed atomically.
+static int refcnt[(PHYSTOP - KERNBASE) / PGSIZE];
+#define PA2REF(pa) (&refcnt[((uint64)(pa) - KERNBASE) / PGSIZE])
+
 struct {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;         // pages on freelist
+  uint64 nsteal;     // pages stolen from other CPUs
+} kmem[NCPU];
+
+// A free buddy block, on the list of its order.
+struct block {
+  struct block *next;
+  struct block *prev;
+};
+
+static struct {
+  struct spinlock lock;
+  struct block free[MAXORDER+1];  // list heads, by order
+  int nfree[MAXORDER+1];          // blocks on each list
+  uint64 npages;                  // free pages in all blocks
+  uchar order[(PHYSTOP - KERNBASE) / PGSIZE]; // 1+order of the free
+                                              // block starting at a page, or 0
+  uint64 nsplit, nmerge;
+} buddy;
+
+static struct {
+  struct spinlock lock;
+  struct run *list;
+  int n;
+  uint64 hits, misses;
+} zpool;
+
+#define PA2ORD(pa) (buddy.order[((uint64)(pa) - KERNBASE) / PGSIZE])
+
+// The buddy of the 2^k-page block at pa.
+static void*
+buddyof(void *pa, int k)
+{
+  return (void*)(KERNBASE + (((uint64)pa - KERNBASE) ^ ((uint64)PGSIZE << k)));
+}
+
+static void
+bpush(void *pa, int k)
+{
+  struct block *b = pa, *h = &buddy.free[k];
+
+  b->next = h->next;
+  b->prev = h;
+  h->next->prev = b;
+  h->next = b;
+  buddy.nfree[k]++;
+  buddy.npages += 1L << k;
+  PA2ORD(pa) = k + 1;
+}
+
+static void
+bremove(void *pa, int k)
+{
+  struct block *b = pa;
+
+  b->prev->next = b->next;
+  b->next->prev = b->prev;
+  buddy.nfree[k]--;
+  buddy.npages -= 1L << k;
+  PA2ORD(pa) = 0;
+}
+
+// Free the 2^k-page block at pa, merging it with its buddy
+// for as long as the buddy is free too.
+// Caller must hold buddy.lock.
+static void
+buddyfree(void *pa, int k)
+{
+  void *b;
+
+  for(; k < MAXORDER; k++){
+    b = buddyof(pa, k);
+    if((char*)b < end || (uint64)b >= PHYSTOP || PA2ORD(b) != k + 1)
+      break;
+    bremove(b, k);
+    buddy.nmerge++;
+    if(b < pa)
+      pa = b;
+  }
+  bpush(pa, k);
+}
+
+// Take a 2^k-page block, splitting a bigger one if need be.
+// Returns 0 if there is none. Caller must hold buddy.lock.
+static void*
+buddyalloc(int k)
+{
+  struct block *b;
+  int j;
+
+  for(j = k; j <= MAXORDER && buddy.free[j].next == &buddy.free[j]; j++)
+    ;
+  if(j > MAXORDER)
+    return 0;
+  b = buddy.free[j].next;
+  bremove(b, j);
+  while(j > k){
+    j--;
+    bpush((char*)b + ((uint64)PGSIZE << j), j);
+    buddy.nsplit++;
+  }
+  return b;
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "buddy");
+  initlock(&zpool.lock, "zpool");
+  for(i = 0; i <= MAXORDER; i++)
+    buddy.free[i].next = buddy.free[i].prev = &buddy.free[i];
   freerange(end, (void*)PHYSTOP);
 }
 
+// Give [pa_start, pa_end) to the buddy allocator, in the
+// biggest aligned blocks that fit, so that boot takes a step
+// per block rather than per page.
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
+  int k;
+
+  acquire(&buddy.lock);
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  while(p + PGSIZE <= (char*)pa_end){
+    for(k = 0; k < MAXORDER; k++){
+      if(((uint64)p - KERNBASE) % ((uint64)PGSIZE << (k+1)) != 0 ||
+         p + ((uint64)PGSIZE << (k+1)) > (char*)pa_end)
+        break;
+    }
+    buddyfree(p, k);
+    p += (uint64)PGSIZE << k;
+  }
+  release(&buddy.lock);
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Give the pages on list r back to the buddy allocator.
+static void
+giveback(struct run *r)
+{
+  struct run *next;
+
+  acquire(&buddy.lock);
+  for(; r; r = next){
+    next = r->next;
+    buddyfree(r, 0);
+  }
+  release(&buddy.lock);
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, and free it if that was the last one. The page
+// normally should have been returned by a call to kalloc().
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *back;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(PA2REF(pa), 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: page is free");
+
+#ifdef KDEBUG
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
+  back = 0;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  if(kmem[id].nfree > NCACHE){
+    // keep the first NCACHE-NSTEAL pages, give back the rest.
+    for(r = kmem[id].freelist, n = 1; n < NCACHE - NSTEAL; n++)
+      r = r->next;
+    back = r->next;
+    r->next = 0;
+    kmem[id].nfree = NCACHE - NSTEAL;
+  }
+  release(&kmem[id].lock);
+  pop_off();
+
+  if(back)
+    giveback(back);
+}
+
+// Take up to NSTEAL pages from the buddy allocator, or failing
+// that from some other CPU's list. Returns one page and puts
+// the rest on CPU id's list. Only one lock is held at a time,
+// so two CPUs stealing from each other cannot deadlock.
+// Caller must have interrupts off.
+static struct run *
+steal(int id)
+{
+  struct run *r, *last, *p;
+  int i, victim, n, stolen;
+
+  r = last = 0;
+  n = stolen = 0;
+  acquire(&buddy.lock);
+  while(n < NSTEAL && (p = buddyalloc(0)) != 0){
+    p->next = r;
+    r = p;
+    if(last == 0)
+      last = p;
+    n++;
+  }
+  release(&buddy.lock);
+
+  for(i = 1; r == 0 && i < NCPU; i++){
+    victim = (id + i) % NCPU;
+    acquire(&kmem[victim].lock);
+    r = kmem[victim].freelist;
+    if(r == 0){
+      release(&kmem[victim].lock);
+      continue;
+    }
+    last = r;
+    for(n = 1; n < NSTEAL && last->next; n++)
+      last = last->next;
+    kmem[victim].freelist = last->next;
+    kmem[victim].nfree -= n;
+    release(&kmem[victim].lock);
+    stolen = n;
+  }
+  if(r == 0)
+    return 0;
+
+  last->next = 0;
+  acquire(&kmem[id].lock);
+  if(r->next){
+    last->next = kmem[id].freelist;
+    kmem[id].freelist = r->next;
+    kmem[id].nfree += n - 1;
+  }
+  kmem[id].nsteal += stolen;
+  release(&kmem[id].lock);
+  return r;
+}
+
+// Take a page from the zeroed pool, or return 0.
+static struct run *
+zpop(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
+  if((r = zpool.list) != 0){
+    zpool.list = r->next;
+    zpool.n--;
+  }
+  release(&zpool.lock);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +335,233 @@ void *
 kalloc(void)
 {
   struct run *r;
+  int id;
+
+  for(;;){
+    push_off();
+    id = cpuid();
+    acquire(&kmem[id].lock);
+    r = kmem[id].freelist;
+    if(r){
+      kmem[id].freelist = r->next;
+      kmem[id].nfree--;
+    }
+    release(&kmem[id].lock);
+    if(r == 0)
+      r = steal(id);
+    pop_off();
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+    // Out of memory: use the zeroed pool, then take back
+    // text pages nobody maps.
+    if(r == 0)
+      r = zpop();
+    if(r || textreclaim() == 0)
+      break;
+  }
 
-  if(r)
+  if(r){
+#ifdef KDEBUG
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+    *PA2REF(r) = 1;
+  }
   return (void*)r;
 }
+
+// Allocate one page of zeroed physical memory.
+// Returns 0 if the memory cannot be allocated.
+void *
+kzalloc(void)
+{
+  struct run *r;
+
+  if((r = zpop()) != 0){
+    r->next = 0;  // the only word the pool changed
+    *PA2REF(r) = 1;
+    __sync_fetch_and_add(&zpool.hits, 1);
+    return r;
+  }
+  __sync_fetch_and_add(&zpool.misses, 1);
+  if((r = kalloc()) != 0)
+    memset(r, 0, PGSIZE);
+  return r;
+}
+
+// Kernel thread that tops the zeroed pool up once a tick.
+// Idle CPUs stop their ticks, so it rests while the system does.
+static void
+kzerod(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
+  for(;;){
+    while(zpool.n < NZPAGE){
+      release(&zpool.lock);
+      if((r = kalloc()) == 0){
+        acquire(&zpool.lock);
+        break;
+      }
+      memset(r, 0, PGSIZE);
+      acquire(&zpool.lock);
+      r->next = zpool.list;
+      zpool.list = r;
+      zpool.n++;
+    }
+    sleep(&ticks, &zpool.lock);
+  }
+}
+
+// Start the thread that keeps kzalloc()'s pool zeroed.
+void
+kzinit(void)
+{
+  kthread(kzerod, "kzerod");
+}
+
+// Move all pages on the per-CPU lists to the buddy allocator,
+// so that they can merge into bigger blocks.
+static void
+kdrain(void)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    r = kmem[i].freelist;
+    kmem[i].freelist = 0;
+    kmem[i].nfree = 0;
+    release(&kmem[i].lock);
+    giveback(r);
+  }
+}
+
+// Allocate 2^order contiguous pages, aligned to their size.
+// The block has one reference count, that of its first page;
+// free it with kfree_order(). Returns 0 if no free block is
+// big enough.
+void *
+kalloc_order(int order)
+{
+  void *pa;
+  int tries;
+
+  if(order < 0 || order > MAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+
+  for(tries = 0; ; tries++){
+    acquire(&buddy.lock);
+    pa = buddyalloc(order);
+    release(&buddy.lock);
+    if(pa || tries == 2)
+      break;
+    // the pages it needs may be cached on per-CPU lists,
+    // or held by the text cache.
+    if(tries == 1)
+      textreclaim();
+    kdrain();
+  }
+
+  if(pa){
+#ifdef KDEBUG
+    memset(pa, 5, (uint64)PGSIZE << order); // fill with junk
+#endif
+    *PA2REF(pa) = 1;
+  }
+  return pa;
+}
+
+// Drop a reference to a block from kalloc_order(order), and
+// free it if that was the last one.
+void
+kfree_order(void *pa, int order)
+{
+  int n;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || (uint64)pa % ((uint64)PGSIZE << order) != 0 ||
+     (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kfree_order");
+
+  if((n = __sync_sub_and_fetch(PA2REF(pa), 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree_order: block is free");
+
+#ifdef KDEBUG
+  memset(pa, 1, (uint64)PGSIZE << order);
+#endif
+  acquire(&buddy.lock);
+  buddyfree(pa, order);
+  release(&buddy.lock);
+}
+
+// Add a reference to an allocated page.
+void
+kdup(void *pa)
+{
+  if(__sync_fetch_and_add(PA2REF(pa), 1) < 1)
+    panic("kdup");
+}
+
+// Number of references to an allocated page.
+int
+krefs(void *pa)
+{
+  return __atomic_load_n(PA2REF(pa), __ATOMIC_SEQ_CST);
+}
+
+// Number of free pages, in the buddy allocator and on the
+// per-CPU lists.
+uint64
+kfreepages(void)
+{
+  uint64 n;
+  int i;
+
+  acquire(&buddy.lock);
+  n = buddy.npages;
+  release(&buddy.lock);
+  for(i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    n += kmem[i].nfree;
+    release(&kmem[i].lock);
+  }
+  return n;
+}
+
+// Print kmem statistics into buf for the statistics device.
+int
+kallocstats(char *buf, int sz)
+{
+  int i, n;
+
+  n = snprintf(buf, sz, "--- kmem\n");
+  for(i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    n += snprintf(buf+n, sz-n, "cpu %d: free %d stolen %l lock: #acquire() %l #test-and-set %l\n",
+                  i, kmem[i].nfree, kmem[i].nsteal, kmem[i].lock.n, kmem[i].lock.nts);
+    release(&kmem[i].lock);
+  }
+
+  // free blocks of each order show how fragmented memory is.
+  acquire(&buddy.lock);
+  n += snprintf(buf+n, sz-n, "buddy: free %l split %l merge %l blocks by order:",
+                buddy.npages, buddy.nsplit, buddy.nmerge);
+  for(i = 0; i <= MAXORDER; i++)
+    n += snprintf(buf+n, sz-n, " %d", buddy.nfree[i]);
+  n += snprintf(buf+n, sz-n, "\n");
+  release(&buddy.lock);
+
+  acquire(&zpool.lock);
+  n += snprintf(buf+n, sz-n, "zeroed: pool %d hits %l misses %l\n",
+                zpool.n, zpool.hits, zpool.misses);
+  release(&zpool.lock);
+  return n;
+}
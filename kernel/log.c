@@ -6,20 +6,40 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "timer.h"
 
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only seals a transaction when there
+// are no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// But if it thinks the open transaction is close to running
+// out of log space, it sleeps until that one has been sealed.
+//
+// The log is double-buffered. System calls add their blocks
+// to the open transaction while the previous one commits on a
+// background kernel thread (committer()). Sealing copies the
+// blocks into log-owned snapshots, so later system calls may
+// modify the cached buffers while the snapshots go to the disk.
+// The last system call of a transaction to finish waits until
+// the transaction is durable; system calls that start meanwhile
+// join the open transaction and share its commit. A transaction
+// nobody waits for, as when its system calls ended with
+// end_op_async(), commits after LOGDELAY ticks.
+//
+// Once sealed, a transaction's cached buffers are unpinned, so
+// the buffer cache may recycle them while the commit is still
+// going on. Until the blocks are installed, bread() of one of
+// them gets its data from the snapshot (logread()), not from
+// the disk's stale copy. A transaction counts as durable as
+// soon as its header is on disk; the installs, in block order,
+// and erasing the header happen after its waiters are woken.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,7 +48,14 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Log appends are queued together before one notification to
+// the disk.
+//
+// The log may live on a block device of its own (the superblock's
+// logdev), such as a faster disk, with its header at block logstart
+// of that device; installs still go to the file system's device.
+
+#define LOGDELAY 1   // ticks an unwaited transaction may stay open
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -37,49 +64,122 @@ struct logheader {
   int block[LOGSIZE];
 };
 
+// The transaction that FS system calls are adding blocks to.
+struct trans {
+  int outstanding; // how many FS sys calls are executing in it.
+  int n;
+  int block[LOGSIZE];
+  struct buf *buf[LOGSIZE]; // pinned cached buffer of each block
+  uint start;      // ticks when its first block was logged
+  int want;        // someone waits for it to commit, or for space
+};
+
 struct log {
   struct spinlock lock;
   int start;
   int size;
-  int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
-  int dev;
-  struct logheader lh;
+  int dev;         // holds the log
+  int fsdev;       // holds the file system
+  struct trans open;
+  int sealing;     // committer() waits for open.outstanding to drain
+  uint64 seq;      // sequence number of the open transaction
+  uint64 done;     // transactions up to this one are durable
+  struct logheader lh;          // the committing transaction
+  int installing;               // lh's blocks may not be home yet
+  struct buf *pinned[LOGSIZE];  // log blocks read by recovery
+  struct buf shadow[LOGSIZE];   // its snapshots
+  uint64 ops;      // statistics
+  uint64 commits;
+  uint64 blocks;
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void commit(uint64);
+static void committer(void);
 
 void
 initlog(int dev, struct superblock *sb)
 {
+  char *mem;
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
   log.size = sb->nlog;
-  log.dev = dev;
+  log.dev = sb->logdev ? sb->logdev : dev;
+  log.fsdev = dev;
+  if(log.dev >= NBDEV || bdevsw[log.dev].submit == 0)
+    panic("initlog: no log device");
+  log.seq = 1;
+
+  // The snapshots' data lives in pages of its own.
+  mem = 0;
+  for(i = 0; i < LOGSIZE; i++){
+    if(i % (PGSIZE/BSIZE) == 0 && (mem = kalloc()) == 0)
+      panic("initlog: kalloc");
+    log.shadow[i].dev = dev;
+    log.shadow[i].data = (uchar*)mem + (i % (PGSIZE/BSIZE))*BSIZE;
+  }
+
   recover_from_log();
+  kthread(committer, "logd");
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their home location.
+// After a commit the snapshots hold the data; during
+// recovery it has to be read from the log.
 static void
 install_trans(int recovering)
 {
   int tail;
+  struct buf *b;
 
   for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+    if(recovering)
+      log.pinned[tail] = bread(log.dev, log.start+tail+1); // read log block
+    b = recovering ? log.pinned[tail] : &log.shadow[tail];
+    bwriteat(b, log.fsdev, log.lh.block[tail]);  // write dst to disk
+  }
+  bkick();
+  for (tail = 0; tail < log.lh.n; tail++) {
+    if(recovering){
+      bwait(log.pinned[tail]);
+      brelse(log.pinned[tail]);
+      log.pinned[tail] = 0;
+    } else
+      bwait(&log.shadow[tail]);
+  }
+  acquire(&log.lock);
+  log.installing = 0;
+  release(&log.lock);
+}
+
+// If b's block is in the committing transaction and may not
+// have been installed yet, copy its data from the snapshot
+// and return 1. bread() calls this before reading from the
+// disk, since the transaction's buffers aren't pinned.
+int
+logread(struct buf *b)
+{
+  int i, found;
+
+  found = 0;
+  acquire(&log.lock);
+  if(log.installing && b->dev == log.fsdev){
+    for(i = 0; i < log.lh.n; i++){
+      if(log.lh.block[i] == b->blockno){
+        memmove(b->data, log.shadow[i].data, BSIZE);
+        found = 1;
+        break;
+      }
+    }
   }
+  release(&log.lock);
+  return found;
 }
 
 // Read the log header from disk into the in-memory log header
@@ -128,13 +228,16 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.sealing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
+    } else if(log.open.n + (log.open.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
+      log.open.want = 1;
+      wakeup(&log.open);
       sleep(&log, &log.lock);
     } else {
-      log.outstanding += 1;
+      log.open.outstanding += 1;
+      log.ops++;
       release(&log.lock);
       break;
     }
@@ -142,69 +245,196 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// if this was the last outstanding operation of a transaction
+// that wrote something, waits for the transaction to commit.
 void
 end_op(void)
 {
-  int do_commit = 0;
+  uint64 seq;
 
   acquire(&log.lock);
-  log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+  log.open.outstanding -= 1;
+  if(log.open.outstanding == 0 && log.open.n > 0){
+    seq = log.seq;
+    log.open.want = 1;
+    wakeup(&log.open);
+    while(log.done < seq)
+      sleep(&log.done, &log.lock);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
+    // the amount of reserved space. committer() may
+    // be waiting for the last op to finish.
     wakeup(&log);
+    wakeup(&log.open);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
-  }
+// end_op() for a system call whose writes needn't be durable
+// when it returns, such as a write to an O_ASYNC file. The
+// transaction commits after LOGDELAY ticks, with the next
+// end_op() of a system call that does wait, or in log_sync().
+void
+end_op_async(void)
+{
+  acquire(&log.lock);
+  log.open.outstanding -= 1;
+  wakeup(&log);
+  wakeup(&log.open);
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Wait until everything logged so far is durable. Caller must
+// not be in a transaction.
+void
+log_sync(void)
+{
+  uint64 seq;
+
+  acquire(&log.lock);
+  if(log.open.n > 0){
+    seq = log.seq;
+    log.open.want = 1;
+    wakeup(&log.open);
+  } else
+    seq = log.seq - 1;   // the one committing, if any
+  while(log.done < seq)
+    sleep(&log.done, &log.lock);
+  release(&log.lock);
+}
+
+// Copy modified blocks from the snapshots to log.
 static void
 write_log(void)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
-  }
+  for (tail = 0; tail < log.lh.n; tail++)
+    bwriteat(&log.shadow[tail], log.dev, log.start+tail+1);  // write the log
+  bkick();
+  for (tail = 0; tail < log.lh.n; tail++)
+    bwait(&log.shadow[tail]);
 }
 
+// Make the sealed transaction durable, tell its waiters, then
+// put it in place and erase it from the log.
 static void
-commit()
+commit(uint64 seq)
 {
   if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
+    write_log();     // Write modified blocks from snapshots to log
     write_head();    // Write header to disk -- the real commit
+  }
+  acquire(&log.lock);
+  log.done = seq;
+  wakeup(&log.done);
+  release(&log.lock);
+  if (log.lh.n > 0) {
     install_trans(0); // Now install writes to home locations
     log.lh.n = 0;
     write_head();    // Erase the transaction from the log
   }
 }
 
+// Sort the sealed transaction's blocks by block number, so
+// that the installs sweep across the disk in order.
+static void
+sortlog(void)
+{
+  int i, j, blockno;
+  struct buf *b;
+
+  for(i = 1; i < log.open.n; i++){
+    blockno = log.open.block[i];
+    b = log.open.buf[i];
+    for(j = i; j > 0 && log.open.block[j-1] > blockno; j--){
+      log.open.block[j] = log.open.block[j-1];
+      log.open.buf[j] = log.open.buf[j-1];
+    }
+    log.open.block[j] = blockno;
+    log.open.buf[j] = b;
+  }
+}
+
+// Should the open transaction be sealed and committed?
+// Caller must hold log.lock.
+static int
+commitwanted(void)
+{
+  if(log.open.n == 0)
+    return 0;
+  return log.open.want || ticks - log.open.start >= LOGDELAY;
+}
+
+// Body of the log's kernel thread, which commits one
+// transaction at a time while the next one fills up.
+static void
+committer(void)
+{
+  uint64 seq;
+  int i;
+  struct timer t;
+
+  acquire(&log.lock);
+  for(;;){
+    while(!commitwanted()){
+      if(log.open.n > 0){
+        // let more ops join, for a while. The timer makes sure
+        // a tick comes even if every CPU goes idle.
+        acquire(&tickslock);
+        timeradd(&t, log.open.start + LOGDELAY, &log.open);
+        release(&tickslock);
+        sleep(&log.open, &log.lock);
+        acquire(&tickslock);
+        timerdel(&t);
+        release(&tickslock);
+      } else
+        sleep(&log.open, &log.lock);
+    }
+
+    // Keep new ops out until the transaction's blocks are copied.
+    log.sealing = 1;
+    while(log.open.outstanding > 0)
+      sleep(&log.open, &log.lock);
+    release(&log.lock);
+
+    // No FS system calls are active, so the pinned buffers
+    // can't change while they are copied. After that the
+    // snapshots stand in for them.
+    sortlog();
+    for(i = 0; i < log.open.n; i++){
+      memmove(log.shadow[i].data, log.open.buf[i]->data, BSIZE);
+      log.lh.block[i] = log.open.block[i];
+    }
+
+    acquire(&log.lock);
+    log.lh.n = log.open.n;
+    log.installing = 1;
+    for(i = 0; i < log.open.n; i++){
+      bunpin(log.open.buf[i]);
+      log.open.buf[i] = 0;
+    }
+    seq = log.seq++;
+    log.commits++;
+    log.blocks += log.open.n;
+    log.open.n = 0;
+    log.open.want = 0;
+    log.sealing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    // call commit w/o holding locks, since not allowed
+    // to sleep with locks.
+    commit(seq);
+
+    acquire(&log.lock);
+  }
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// committer() will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,20 +447,34 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.open.n >= LOGSIZE || log.open.n >= log.size - 1)
     panic("too big a transaction");
-  if (log.outstanding < 1)
+  if (log.open.outstanding < 1)
     panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno)   // log absorption
+  for (i = 0; i < log.open.n; i++) {
+    if (log.open.block[i] == b->blockno)   // log absorption
       break;
   }
-  log.lh.block[i] = b->blockno;
-  if (i == log.lh.n) {  // Add new block to log?
+  log.open.block[i] = b->blockno;
+  if (i == log.open.n) {  // Add new block to log?
     bpin(b);
-    log.lh.n++;
+    log.open.buf[i] = b;
+    if(i == 0)
+      log.open.start = ticks;
+    log.open.n++;
   }
   release(&log.lock);
 }
 
+int
+logstats(char *buf, int sz)
+{
+  int m;
+
+  acquire(&log.lock);
+  m = snprintf(buf, sz, "--- log\nops %l commits %l blocks %l\n",
+               log.ops, log.commits, log.blocks);
+  release(&log.lock);
+  return m;
+}
@@ -24,13 +24,28 @@ main()
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
+    uartasync();     // kernel printf() through the uart's buffer
+    // the other harts need no more than the above, so let them
+    // set themselves up while this one does the rest.
+    __sync_synchronize();
+    started = 1;
     binit();         // buffer cache
     iinit();         // inode table
+    slabinit();      // object caches
     fileinit();      // file table
-    virtio_disk_init(); // emulated hard disk
+    pipeinit();      // pipe cache
+    vmainit();       // text page cache
+    shminit();       // shared memory segments
+    statsinit();     // statistics device
+    traceinit();     // trace device
+    profinit();      // profile device
+    if(virtio_disk_init(0) < 0) // emulated hard disk
+      panic("could not find virtio disk");
+    for(int n = 1; n < NDISK; n++)
+      virtio_disk_init(n);  // more disks, if any
+    ramdiskinit();   // RAM disk, if ramdisk= is set
     userinit();      // first user process
-    __sync_synchronize();
-    started = 1;
+    kzinit();        // background page zeroing
   } else {
     while(started == 0)
       ;
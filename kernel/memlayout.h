@@ -21,14 +21,19 @@
 #define UART0 0x10000000L
 #define UART0_IRQ 10
 
-// virtio mmio interface
+// virtio mmio interface, one page and one irq per slot.
 #define VIRTIO0 0x10001000
 #define VIRTIO0_IRQ 1
+#define VIRTIO(n) (VIRTIO0 + (n)*0x1000L)
+#define VIRTIO_IRQ(n) (VIRTIO0_IRQ + (n))
 
 // core local interruptor (CLINT), which contains the timer.
 #define CLINT 0x2000000L
+#define CLINT_MSIP(hartid) (CLINT + 4*(hartid)) // software interrupt
 #define CLINT_MTIMECMP(hartid) (CLINT + 0x4000 + 8*(hartid))
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
+#define CLINT_SIZE 0x10000
+#define TIMEBASE 10000000L // mtime cycles per second in qemu
 
 // qemu puts platform-level interrupt controller (PLIC) here.
 #define PLIC 0x0c000000L
@@ -62,6 +67,28 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap() areas, below UTOP
+//   trapframes of clone()d threads 1..NTHREAD-1
+//   USYSCALL (p->usyscall, read-only to the user)
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+#define USYSCALL (TRAPFRAME - PGSIZE)
+
+// where thread slot i of a process has its trapframe.
+#define TTRAPFRAME(i) ((i) == 0 ? TRAPFRAME : USYSCALL - (uint64)(i)*PGSIZE)
+
+// the top of the memory a process may use.
+#define UTOP (USYSCALL - (NTHREAD-1)*PGSIZE)
+
+#ifndef __ASSEMBLER__
+
+// What the kernel lets a process read at USYSCALL without a
+// system call; usertrapret() refreshes it on every return to
+// user space, so ticks is as fresh as the last timer interrupt.
+struct usyscall {
+  int pid;     // getpid()
+  uint ticks;  // uptime()
+  int cpu;     // the CPU the process is running on
+};
+#endif // __ASSEMBLER__
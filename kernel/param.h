@@ -1,13 +1,29 @@
 #define NPROC        64  // maximum number of processes
 #define NCPU          8  // maximum number of CPUs
-#define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
+#define HZ           10  // default clock ticks per second, boot arg hz=
+#define NPRIO         3  // scheduling priority levels
+#define NSYSCALL     64  // system call numbers sysstats() counts
+#define NOFILE       16  // open files per process before its table grows
+#define MAXFD      4096  // open files per process, at most
+#define NPOLL        64  // descriptors per poll()
+#define NTHREAD       8  // threads per process, counting the first
+#define NFILE       100  // open files per system, at least (boot arg nfile=)
 #define NINODE       50  // maximum number of active i-nodes
 #define NDEV         10  // maximum major device number
+#define NDISK         4  // virtio disks, block devices ROOTDEV..
 #define ROOTDEV       1  // device number of file system root disk
-#define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define RAMDEV  (ROOTDEV+NDISK)  // block device number of the RAM disk
+#define NBDEV   (RAMDEV+1)       // block device numbers
+#define TMPDEV  NBDEV    // device number of the tmpfs on /tmp
+#define MAXARG      256  // max exec arguments
+#define ARGMAX     4096  // max bytes of exec arguments, with their argv[]
+#define NVMA         16  // file-backed areas per process
+#define NSHM         16  // shared memory segments
+#define NSHMPAGE     32  // pages per shared memory segment
+#define MAXOPBLOCKS  32  // max # of blocks any FS op writes
+#ifndef LOGSIZE
+#define LOGSIZE      (MAXOPBLOCKS*4)  // max data blocks in on-disk log (make LOGSIZE=, <= 254)
+#endif
+#define NBUF         512  // default size of disk block cache (boot arg nbuf=)
+#define FSSIZE       4000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
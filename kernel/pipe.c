@@ -7,18 +7,41 @@
 #include "fs.h"
 #include "sleeplock.h"
 #include "file.h"
+#include "fcntl.h"
 
-#define PIPESIZE 512
+// A pipe's data lives in a ring of 2^order pages, one page to
+// start with; fcntl(F_SETPIPE_SZ) can grow or shrink it. Reads
+// and writes copy contiguous runs of the ring at a time.
+//
+// splice() moves data between the ring and the buffer cache
+// directly, with readi()/writei(), which can sleep, so it can't
+// hold pi->lock meanwhile. pipeget() instead marks the run it
+// hands out busy, which holds off other readers (or writers)
+// and resizing until pipeput().
+#define PIPEMAXORDER 4  // largest ring is 16 pages
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;
+  uint size;      // bytes in data, a power of two
+  int order;      // data is 2^order pages
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
+  int rbusy;      // pipeget() handed out data to read
+  int wbusy;      // pipeget() handed out space to write
   int readopen;   // read fd is still open
   int writeopen;  // write fd is still open
+  struct pollhead poll;  // poll() callers watching either end
 };
 
+static struct kmem_cache *pipecache;
+
+void
+pipeinit(void)
+{
+  pipecache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
+
 int
 pipealloc(struct file **f0, struct file **f1)
 {
@@ -28,12 +51,19 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == 0 || (*f1 = filealloc()) == 0)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == 0)
+  if((pi = kmem_cache_alloc(pipecache)) == 0)
+    goto bad;
+  if((pi->data = kalloc()) == 0)
     goto bad;
+  pi->size = PGSIZE;
+  pi->order = 0;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
   pi->nread = 0;
+  pi->rbusy = 0;
+  pi->wbusy = 0;
+  pi->poll.list = 0;
   initlock(&pi->lock, "pipe");
   (*f0)->type = FD_PIPE;
   (*f0)->readable = 1;
@@ -47,7 +77,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipecache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -66,17 +96,24 @@ pipeclose(struct pipe *pi, int writable)
     pi->readopen = 0;
     wakeup(&pi->nwrite);
   }
+  pollwake(&pi->poll);
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    freelock(&pi->lock);
+    kfree_order(pi->data, pi->order);
+    kmem_cache_free(pipecache, pi);
   } else
     release(&pi->lock);
 }
 
+// Write n bytes from src, a user address if user_src is 1 and
+// a kernel address otherwise. If nonblock is set, write what
+// fits, or return -1 if nothing does.
 int
-pipewrite(struct pipe *pi, uint64 addr, int n)
+pipewrite(struct pipe *pi, int user_src, uint64 src, int n, int nonblock)
 {
   int i = 0;
+  uint m, off;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
@@ -85,46 +122,204 @@ pipewrite(struct pipe *pi, uint64 addr, int n)
       release(&pi->lock);
       return -1;
     }
-    if(pi->nwrite == pi->nread + PIPESIZE){ //DOC: pipewrite-full
+    if(pi->nwrite == pi->nread + pi->size || pi->wbusy){ //DOC: pipewrite-full
+      if(nonblock){
+        if(i == 0)
+          i = -1;
+        break;
+      }
       wakeup(&pi->nread);
+      pollwake(&pi->poll);
       sleep(&pi->nwrite, &pi->lock);
     } else {
-      char ch;
-      if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+      // as much as fits before the ring's end or a full pipe.
+      off = pi->nwrite & (pi->size - 1);
+      m = pi->size - (pi->nwrite - pi->nread);
+      if(m > pi->size - off)
+        m = pi->size - off;
+      if(m > n - i)
+        m = n - i;
+      if(either_copyin(pi->data + off, user_src, src + i, m) == -1)
         break;
-      pi->data[pi->nwrite++ % PIPESIZE] = ch;
-      i++;
+      pi->nwrite += m;
+      i += m;
     }
   }
   wakeup(&pi->nread);
+  pollwake(&pi->poll);
   release(&pi->lock);
 
   return i;
 }
 
+// Read up to n bytes into user address addr. If nonblock is
+// set, return -1 rather than wait for the pipe to have some.
 int
-piperead(struct pipe *pi, uint64 addr, int n)
+piperead(struct pipe *pi, uint64 addr, int n, int nonblock)
 {
   int i;
+  uint m, off;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
-  while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
-    if(killed(pr)){
+  while((pi->nread == pi->nwrite && pi->writeopen) || pi->rbusy){  //DOC: pipe-empty
+    if(killed(pr) || nonblock){
       release(&pi->lock);
       return -1;
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
-    if(pi->nread == pi->nwrite)
-      break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+  for(i = 0; i < n && pi->nread != pi->nwrite; i += m){  //DOC: piperead-copy
+    off = pi->nread & (pi->size - 1);
+    m = pi->nwrite - pi->nread;
+    if(m > pi->size - off)
+      m = pi->size - off;
+    if(m > n - i)
+      m = n - i;
+    if(copyout(pr->pagetable, addr + i, pi->data + off, m) == -1)
       break;
+    pi->nread += m;
   }
   wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+  pollwake(&pi->poll);
   release(&pi->lock);
   return i;
 }
+
+// Make pi's ring the smallest power-of-two number of pages that
+// holds n bytes, or leave it be if n is 0. Fails if n is too big
+// or the pipe holds more than the new ring would.
+// Returns the ring's size in bytes, or -1.
+int
+pipesize(struct pipe *pi, int n)
+{
+  char *data, *old;
+  int order, oldorder;
+  uint i, size;
+
+  if(n < 0 || n > (PGSIZE << PIPEMAXORDER))
+    return -1;
+  if(n == 0)
+    return pi->size;
+  for(order = 0; (PGSIZE << order) < n; order++)
+    ;
+  size = PGSIZE << order;
+  if((data = kalloc_order(order)) == 0)
+    return -1;
+
+  acquire(&pi->lock);
+  while(pi->rbusy || pi->wbusy)
+    sleep(&pi->nwrite, &pi->lock);
+  if(pi->nwrite - pi->nread > size){
+    release(&pi->lock);
+    kfree_order(data, order);
+    return -1;
+  }
+  for(i = pi->nread; i != pi->nwrite; i++)
+    data[i & (size - 1)] = pi->data[i & (pi->size - 1)];
+  old = pi->data;
+  oldorder = pi->order;
+  pi->data = data;
+  pi->size = size;
+  pi->order = order;
+  // a bigger ring has room for a blocked writer.
+  wakeup(&pi->nwrite);
+  pollwake(&pi->poll);
+  release(&pi->lock);
+
+  kfree_order(old, oldorder);
+  return size;
+}
+
+// Hand out the next contiguous run of the ring, at most n bytes:
+// data to read from if write is 0, free space to write into if
+// write is 1. If wait is 1, first sleep until there is some.
+// Sets *p to the run and returns its length, after which the
+// caller must call pipeput(); or returns 0 at end of file or if
+// it would have to wait, and -1 if the other end is closed for
+// a write or the caller was killed.
+int
+pipeget(struct pipe *pi, int write, int wait, int n, char **p)
+{
+  struct proc *pr = myproc();
+  uint m, off;
+
+  acquire(&pi->lock);
+  for(;;){
+    if(killed(pr) || (write && pi->readopen == 0)){
+      release(&pi->lock);
+      return -1;
+    }
+    if(write)
+      m = pi->wbusy ? 0 : pi->size - (pi->nwrite - pi->nread);
+    else
+      m = pi->rbusy ? 0 : pi->nwrite - pi->nread;
+    if(m > 0 || !wait || (!write && !pi->rbusy && pi->writeopen == 0))
+      break;
+    if(write){
+      wakeup(&pi->nread);
+      sleep(&pi->nwrite, &pi->lock);
+    } else
+      sleep(&pi->nread, &pi->lock);
+  }
+  if(m > 0){
+    off = (write ? pi->nwrite : pi->nread) & (pi->size - 1);
+    if(m > pi->size - off)
+      m = pi->size - off;
+    if(m > n)
+      m = n;
+    *p = pi->data + off;
+    if(write)
+      pi->wbusy = 1;
+    else
+      pi->rbusy = 1;
+  }
+  release(&pi->lock);
+  return m;
+}
+
+// Finish with a run from pipeget(): n bytes of it were written,
+// or n bytes were read and may be dropped from the pipe.
+void
+pipeput(struct pipe *pi, int write, int n)
+{
+  acquire(&pi->lock);
+  if(write){
+    pi->nwrite += n;
+    pi->wbusy = 0;
+  } else {
+    pi->nread += n;
+    pi->rbusy = 0;
+  }
+  wakeup(&pi->nread);
+  wakeup(&pi->nwrite);
+  pollwake(&pi->poll);
+  release(&pi->lock);
+}
+
+// What the read end of pi, or the write end if writable, could
+// do now without waiting, as POLLIN etc. Puts e on the pipe's
+// poll list if it isn't 0.
+int
+pipepoll(struct pipe *pi, int writable, struct pollent *e)
+{
+  int r;
+
+  r = 0;
+  acquire(&pi->lock);
+  if(e)
+    pollqueue(&pi->poll, e);
+  if(writable){
+    if(pi->readopen == 0)
+      r |= POLLERR;
+    else if(pi->nwrite != pi->nread + pi->size && !pi->wbusy)
+      r |= POLLOUT;
+  } else {
+    if(pi->nwrite != pi->nread && !pi->rbusy)
+      r |= POLLIN;
+    if(pi->writeopen == 0)
+      r |= POLLHUP;
+  }
+  release(&pi->lock);
+  return r;
+}
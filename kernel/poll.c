@@ -0,0 +1,169 @@
+//
+// poll(): wait for any of several descriptors to be ready.
+//
+// Pipes and the console keep a pollhead, a list of the poll()
+// callers watching them, and call pollwake() whenever they
+// change in a way that may let a read or write go ahead. A
+// caller puts one pollent on the list of each file it watches,
+// looks at them all, and sleeps until one is woken or the
+// timeout, in ticks, runs out. The lists and the ready flags
+// are guarded by tickslock, which the sleep is under too, as in
+// sys_sleep(), so neither a wakeup nor the timer can slip in
+// between looking and sleeping.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fs.h"
+#include "sleeplock.h"
+#include "file.h"
+#include "fcntl.h"
+#include "timer.h"
+
+// What poll() works with, in a page of its own.
+struct pollwork {
+  struct pollfd fds[NPOLL];
+  struct pollent ent[NPOLL];
+  int ready;
+};
+
+// Put e on h's list. Caller holds the lock that guards what h
+// is for, so e can't miss a change after its owner looked.
+void
+pollqueue(struct pollhead *h, struct pollent *e)
+{
+  acquire(&tickslock);
+  e->h = h;
+  e->prev = 0;
+  e->next = h->list;
+  if(h->list)
+    h->list->prev = e;
+  h->list = e;
+  release(&tickslock);
+}
+
+// Wake the poll() callers watching h.
+void
+pollwake(struct pollhead *h)
+{
+  struct pollent *e;
+
+  if(h->list == 0)
+    return;
+  acquire(&tickslock);
+  for(e = h->list; e; e = e->next){
+    *e->ready = 1;
+    wakeup(e->ready);
+  }
+  release(&tickslock);
+}
+
+static void
+pollunqueue(struct pollent *e)
+{
+  if(e->h == 0)
+    return;
+  if(e->prev)
+    e->prev->next = e->next;
+  else
+    e->h->list = e->next;
+  if(e->next)
+    e->next->prev = e->prev;
+  e->h = 0;
+}
+
+// Look at each of w's n descriptors, putting entries on the
+// lists of the files if queue is set. Returns how many are ready.
+static int
+pollscan(struct pollwork *w, int n, int queue)
+{
+  struct proc *p = myproc();
+  struct pollfd *pf;
+  struct file *f;
+  int i, r;
+
+  r = 0;
+  for(i = 0; i < n; i++){
+    pf = &w->fds[i];
+    pf->revents = 0;
+    if(pf->fd < 0)
+      continue;
+    if(pf->fd >= p->nofile || (f = p->ofile[pf->fd]) == 0)
+      pf->revents = POLLNVAL;
+    else
+      pf->revents = filepoll(f, queue ? &w->ent[i] : 0) &
+                    (pf->events | POLLERR | POLLHUP);
+    if(pf->revents)
+      r++;
+  }
+  return r;
+}
+
+// Wait until one of the n pollfds at user address addr is ready,
+// for at most timeout ticks, or for ever if timeout is negative.
+// Fills in their revents. Returns how many are ready, 0 if the
+// timeout ran out, or -1.
+int
+poll(uint64 addr, int n, int timeout)
+{
+  struct proc *p = myproc();
+  struct pollwork *w;
+  struct timer t;
+  uint when;
+  int i, r;
+
+  if(n < 0 || n > NPOLL)
+    return -1;
+  if((w = kalloc()) == 0)
+    return -1;
+  if(copyin(p->pagetable, (char*)w->fds, addr, n * sizeof(struct pollfd)) < 0){
+    kfree(w);
+    return -1;
+  }
+  w->ready = 0;
+  for(i = 0; i < n; i++){
+    w->ent[i].h = 0;
+    w->ent[i].ready = &w->ready;
+  }
+
+  when = 0;
+  if(timeout > 0){
+    acquire(&tickslock);
+    when = ticks + timeout;
+    timeradd(&t, when, &w->ready);
+    release(&tickslock);
+  }
+  r = pollscan(w, n, timeout != 0);
+  while(r == 0 && timeout != 0){
+    acquire(&tickslock);
+    while(!w->ready && !(timeout > 0 && (int)(ticks - when) >= 0)){
+      if(killed(p))
+        break;
+      sleep(&w->ready, &tickslock);
+    }
+    if(!w->ready){
+      release(&tickslock);
+      r = killed(p) ? -1 : 0;
+      break;
+    }
+    w->ready = 0;
+    release(&tickslock);
+    r = pollscan(w, n, 0);
+  }
+
+  acquire(&tickslock);
+  for(i = 0; i < n; i++)
+    pollunqueue(&w->ent[i]);
+  if(timeout > 0)
+    timerdel(&t);
+  release(&tickslock);
+
+  if(r >= 0 && copyout(p->pagetable, addr, (char*)w->fds, n * sizeof(struct pollfd)) < 0)
+    r = -1;
+  kfree(w);
+  return r;
+}
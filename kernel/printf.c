@@ -119,6 +119,7 @@ void
 panic(char *s)
 {
   pr.locking = 0;
+  uartflush();
   printf("panic: ");
   printf(s);
   printf("\n");
@@ -3,7 +3,10 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
 #include "proc.h"
+#include "trace.h"
+#include "rusage.h"
 #include "defs.h"
 
 struct cpu cpus[NCPU];
@@ -16,10 +19,93 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
+// Per-CPU queues of RUNNABLE processes. runnable() appends to
+// the queue of the CPU it runs on; scheduler() takes from the
+// head of its own queue, or from other CPUs' queues when its
+// own is empty. A CPU with nothing to run waits for an
+// interrupt, and runnable() sends one to an idle CPU.
+// A p->lock may be held when acquiring a runq lock.
+//
+// Each queue is a multilevel feedback queue: one FIFO list per
+// priority, 0 the highest, and the highest non-empty list runs
+// first. A process starts at priority 0 and drops a level each
+// time the timer preempts it (preempt()); sleeping keeps its
+// level, so interactive processes stay on top of CPU-bound ones.
+// Every BOOSTTICKS ticks everyone goes back to the top, so low
+// levels can't starve. setpriority() pins a process's level.
+//
+// setaffinity() limits the CPUs that may run a process. A
+// process is queued on the CPU it last ran on if it may still
+// run there, so that it finds its caches warm, and a CPU only
+// steals the processes it may run. runq[i].nallow counts the
+// queued processes, in all queues, that CPU i may run.
+#define BOOSTTICKS 10
+#define ALLCPUS ((1L << NCPU) - 1)
+
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  int n;
+  uint boost;      // boost period (ticks/BOOSTTICKS) of the last boost
+  uint64 nsteal;   // processes taken from other CPUs' queues
+  int nallow;      // queued processes this CPU may run
+} runq[NCPU];
+
+// Bit i is set while CPU i is idle in scheduler().
+static uint64 idle;
+
+// Bit i is set once CPU i has entered scheduler().
+static uint64 online;
+
+// Sleeping processes, hashed by wait channel, so that wakeup()
+// only looks at processes that might be sleeping on its chan.
+// sleep() adds a process to its bucket before it sleeps and
+// removes it after it wakes up, so a listed process may
+// already be awake; wakeup() checks under p->lock. A waitq
+// lock is acquired before any p->lock, never after.
+#define NWAITQ 64
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+static struct waitq*
+wqhash(void *chan)
+{
+  return &waitq[((uint64)chan >> 3) % NWAITQ];
+}
+
+// Processes that share a page table. fork() and exec() start a
+// group of one; clone() adds a thread to its caller's group,
+// with the same memory but its own trapframe, mapped in its own
+// slot, and its own stack. The group's page table, usyscall
+// page and size go when the last of them is freed. The first
+// process is the group's leader, whose pid getpid() returns in
+// all of them; when it exits, the others are killed, and when
+// another exits, only it ends. tg_lock protects ref, live and
+// slots, and is taken after any other lock.
+struct tgroup {
+  int ref;                 // procs using the page table, zombies too
+  int live;                // of those, ones that haven't exited
+  uint64 slots;            // bit i is set if TTRAPFRAME(i) is in use
+  struct sleeplock vmlock; // serializes changes to the page table
+} tgroups[NPROC];
+
+struct spinlock tg_lock;
+
+// Sleeping on a futex word, hashed by the word's physical
+// address, which threads sharing the page see alike.
+#define NFUTEX 16
+
+struct spinlock futexlock[NFUTEX];
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
@@ -51,10 +137,21 @@ procinit(void)
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  initlock(&tg_lock, "tgroup");
+  for(int i = 0; i < NPROC; i++)
+    initsleeplock(&tgroups[i].vmlock, "tgvm");
+  for(int i = 0; i < NFUTEX; i++)
+    initlock(&futexlock[i], "futex");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
       p->kstack = KSTACK((int) (p - proc));
+      p->asid = (int) (p - proc) + 1;
+      fdinit(p);
   }
 }
 
@@ -102,12 +199,32 @@ allocpid()
   return pid;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Start a group of one for p, with the first trapframe slot.
+static struct tgroup*
+tgalloc(void)
+{
+  struct tgroup *tg;
+
+  acquire(&tg_lock);
+  for(tg = tgroups; tg < &tgroups[NPROC]; tg++){
+    if(tg->ref == 0){
+      tg->ref = 1;
+      tg->live = 1;
+      tg->slots = 1;
+      release(&tg_lock);
+      return tg;
+    }
+  }
+  release(&tg_lock);
+  return 0;
+}
+
+// Look in the process table for an UNUSED proc. If found, give
+// it a pid, a trapframe and a context to start in the kernel,
+// and return with p->lock held. It has no memory yet, nor a
+// group. If there are no free procs or no memory, return 0.
 static struct proc*
-allocproc(void)
+allocslot(void)
 {
   struct proc *p;
 
@@ -124,6 +241,11 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->prio = 0;
+  p->fixprio = -1;
+  p->boost = ticks / BOOSTTICKS;
+  p->affinity = ALLCPUS;
+  p->lastcpu = -1;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -132,6 +254,40 @@ found:
     return 0;
   }
 
+  // Set up new context to start executing at forkret,
+  // which returns to user space.
+  memset(&p->context, 0, sizeof(p->context));
+  p->context.ra = (uint64)forkret;
+  p->context.sp = p->kstack + PGSIZE;
+
+  return p;
+}
+
+// Allocate a proc as allocslot() does, in a group of its own,
+// with an empty user page table.
+// Returns with p->lock held, or 0.
+static struct proc*
+allocproc(void)
+{
+  struct proc *p;
+
+  if((p = allocslot()) == 0)
+    return 0;
+  p->tgid = p->pid;
+  if((p->tg = tgalloc()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+
+  // Allocate the page the user reads at USYSCALL.
+  if((p->usyscall = (struct usyscall *)kzalloc()) == 0){
+    freeproc(p);
+    release(&p->lock);
+    return 0;
+  }
+  p->usyscall->pid = p->pid;
+
   // An empty user page table.
   p->pagetable = proc_pagetable(p);
   if(p->pagetable == 0){
@@ -140,39 +296,68 @@ found:
     return 0;
   }
 
-  // Set up new context to start executing at forkret,
-  // which returns to user space.
-  memset(&p->context, 0, sizeof(p->context));
-  p->context.ra = (uint64)forkret;
-  p->context.sp = p->kstack + PGSIZE;
-
   return p;
 }
 
+// Drop the mapping of thread slot i's trapframe from pagetable.
+// No TLB flush: only the thread that had the slot used it, with
+// its own ASID, and a new user of the ASID flushes it anyway.
+static void
+tfunmap(pagetable_t pagetable, int i)
+{
+  pte_t *pte;
+
+  if((pte = walk(pagetable, TTRAPFRAME(i), 0)) != 0)
+    *pte = 0;
+}
+
 // free a proc structure and the data hanging from it,
-// including user pages.
+// including user pages if no other thread is using them.
 // p->lock must be held.
 static void
 freeproc(struct proc *p)
 {
+  int last = 1;
+
+  if(p->tg){
+    acquire(&tg_lock);
+    p->tg->slots &= ~(1L << p->tslot);
+    last = --p->tg->ref == 0;
+    release(&tg_lock);
+  }
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if(p->pagetable)
-    proc_freepagetable(p->pagetable, p->sz);
+  if(p->pagetable){
+    tfunmap(p->pagetable, p->tslot);
+    if(last)
+      proc_freepagetable(p->pagetable, p->sz);
+  }
+  if(p->usyscall && last)
+    kfree((void*)p->usyscall);
+  p->usyscall = 0;
   p->pagetable = 0;
+  p->tg = 0;
+  p->tgid = 0;
+  p->tslot = 0;
+  p->ustack = 0;
   p->sz = 0;
   p->pid = 0;
+  p->kfn = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  memset(p->syscount, 0, sizeof(p->syscount));
+  memset(p->systime, 0, sizeof(p->systime));
+  p->cputime = p->nfault = p->rbytes = p->wbytes = 0;
+  fdtabfree(p);
   p->state = UNUSED;
 }
 
 // Create a user page table for a given process, with no user memory,
-// but with trampoline and trapframe pages.
+// but with trampoline, trapframe and usyscall pages.
 pagetable_t
 proc_pagetable(struct proc *p)
 {
@@ -183,6 +368,10 @@ proc_pagetable(struct proc *p)
   if(pagetable == 0)
     return 0;
 
+  // it will use p->asid, which may still have entries from an
+  // earlier page table in CPUs' TLBs.
+  p->tlbstale = ~0L;
+
   // map the trampoline code (for system call return)
   // at the highest user virtual address.
   // only the supervisor uses it, on the way
@@ -202,6 +391,16 @@ proc_pagetable(struct proc *p)
     return 0;
   }
 
+  // map the usyscall page below the trapframe, for the user to
+  // read.
+  if(mappages(pagetable, USYSCALL, PGSIZE,
+              (uint64)(p->usyscall), PTE_R | PTE_U) < 0){
+    uvmunmap(pagetable, TRAPFRAME, 1, 0);
+    uvmunmap(pagetable, TRAMPOLINE, 1, 0);
+    uvmfree(pagetable, 0);
+    return 0;
+  }
+
   return pagetable;
 }
 
@@ -212,6 +411,7 @@ proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
   uvmunmap(pagetable, TRAMPOLINE, 1, 0);
   uvmunmap(pagetable, TRAPFRAME, 1, 0);
+  uvmunmap(pagetable, USYSCALL, 1, 0);
   uvmfree(pagetable, sz);
 }
 
@@ -249,12 +449,67 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  runnable(p);
+
+  release(&p->lock);
+}
+
+// Start a kernel thread running fn(), which must not return.
+// A kernel thread has no user memory and no parent, and
+// never leaves the kernel.
+void
+kthread(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread");
+
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+  runnable(p);
 
   release(&p->lock);
 }
 
+// Lock p's page table against changes by the other threads
+// that share it: page faults, sbrk(), clone() and fork().
+void
+tgvmlock(struct proc *p)
+{
+  acquiresleep(&p->tg->vmlock);
+}
+
+void
+tgvmunlock(struct proc *p)
+{
+  releasesleep(&p->tg->vmlock);
+}
+
+// Do other procs share p's page table?
+int
+tgshared(struct proc *p)
+{
+  return p->tg && p->tg->ref > 1;
+}
+
+// Set the size of every proc in p's group to sz.
+static void
+tgsetsz(struct proc *p, uint64 sz)
+{
+  struct proc *pp;
+
+  acquire(&tg_lock);
+  for(pp = proc; pp < &proc[NPROC]; pp++)
+    if(pp->tg == p->tg)
+      pp->sz = sz;
+  release(&tg_lock);
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; usertrap() allocates
+// the pages when they are first touched.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -262,15 +517,21 @@ growproc(int n)
   uint64 sz;
   struct proc *p = myproc();
 
+  tgvmlock(p);
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > vmatop(p)){
+      tgvmunlock(p);
       return -1;
     }
-  } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    tgsetsz(p, sz + n);
+  } else if(n < 0 && sz + n < sz){
+    // shrink the size first, so that no thread faults the
+    // pages back in.
+    tgsetsz(p, sz + n);
+    uvmdealloc(p->pagetable, sz, sz + n);
   }
-  p->sz = sz;
+  tgvmunlock(p);
   return 0;
 }
 
@@ -279,12 +540,17 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *p = myproc();
 
+  // keep the parent's other threads from changing its memory
+  // while it is copied.
+  tgvmlock(p);
+
   // Allocate process.
   if((np = allocproc()) == 0){
+    tgvmunlock(p);
     return -1;
   }
 
@@ -292,9 +558,11 @@ fork(void)
   if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
     freeproc(np);
     release(&np->lock);
+    tgvmunlock(p);
     return -1;
   }
   np->sz = p->sz;
+  tgvmunlock(p);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -303,12 +571,18 @@ fork(void)
   np->trapframe->a0 = 0;
 
   // increment reference counts on open file descriptors.
-  for(i = 0; i < NOFILE; i++)
-    if(p->ofile[i])
-      np->ofile[i] = filedup(p->ofile[i]);
+  if(fdcopy(np, p) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
   np->cwd = idup(p->cwd);
+  vmacopy(np->vma, p->vma);
 
   safestrcpy(np->name, p->name, sizeof(p->name));
+  np->fixprio = p->fixprio;
+  np->prio = p->fixprio >= 0 ? p->fixprio : 0;
+  np->affinity = p->affinity;
 
   pid = np->pid;
 
@@ -319,7 +593,70 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  runnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Start a new process running path with the argc arguments
+// packed in args (see execproc()), as fork() and
+// exec() would, but loading the program straight into it rather
+// than copying the caller's memory only to throw it away. For
+// i < nfds, the child's file descriptor i is the caller's
+// fds[i], or none if that is -1; it has no others. If nfds is
+// -1 it has all of the caller's. Returns the child's pid, or -1.
+int
+spawn(char *path, char *args, int argc, int *fds, int nfds)
+{
+  int i, pid;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  if(nfds > NOFILE)
+    return -1;
+  for(i = 0; i < nfds; i++)
+    if(fds[i] < -1 || fds[i] >= p->nofile || (fds[i] >= 0 && p->ofile[fds[i]] == 0))
+      return -1;
+
+  if((np = allocproc()) == 0)
+    return -1;
+  np->fixprio = p->fixprio;
+  np->prio = p->fixprio >= 0 ? p->fixprio : 0;
+  np->affinity = p->affinity;
+  memset(np->trapframe, 0, sizeof(*np->trapframe));
+  pid = np->pid;
+  // nothing runs np yet, and loading it sleeps.
+  release(&np->lock);
+
+  if((argc = execproc(np, path, args, argc)) < 0){
+    acquire(&np->lock);
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->trapframe->a0 = argc;
+
+  if(nfds < 0){
+    if(fdcopy(np, p) < 0){
+      acquire(&np->lock);
+      freeproc(np);
+      release(&np->lock);
+      return -1;
+    }
+  } else {
+    for(i = 0; i < nfds; i++)
+      if(fds[i] >= 0)
+        fdset(np, i, filedup(p->ofile[fds[i]]));
+  }
+  np->cwd = idup(p->cwd);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  acquire(&np->lock);
+  runnable(np);
   release(&np->lock);
 
   return pid;
@@ -340,24 +677,62 @@ reparent(struct proc *p)
   }
 }
 
+// Kill the other threads in p's group, and wait until they
+// have all exited.
+static void
+tgkill(struct proc *p)
+{
+  struct proc *pp;
+
+  for(pp = proc; pp < &proc[NPROC]; pp++){
+    if(pp != p && pp->tg == p->tg){
+      acquire(&pp->lock);
+      if(pp->tg == p->tg){
+        pp->killed = 1;
+        if(pp->state == SLEEPING)
+          runnable(pp);
+      }
+      release(&pp->lock);
+    }
+  }
+  acquire(&tg_lock);
+  while(p->tg->live > 1)
+    sleep(p->tg, &tg_lock);
+  release(&tg_lock);
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
-// until its parent calls wait().
+// until its parent calls wait(), or join() for a thread.
+// A group's leader takes its threads with it.
 void
 exit(int status)
 {
   struct proc *p = myproc();
+  int last;
 
   if(p == initproc)
     panic("init exiting");
 
+  if(p->pid == p->tgid)
+    tgkill(p);
+
   // Close all open files.
-  for(int fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd]){
-      struct file *f = p->ofile[fd];
-      fileclose(f);
-      p->ofile[fd] = 0;
-    }
+  fdcloseall(p);
+
+  acquire(&tg_lock);
+  last = --p->tg->live == 0;
+  release(&tg_lock);
+  wakeup(p->tg);
+
+  // the last one out writes back and unmaps the mmap() areas;
+  // the others only drop their references to the files.
+  if(last){
+    vmaclear(p);
+  } else {
+    begin_op();
+    vmafree(p->vma);
+    end_op();
   }
 
   begin_op();
@@ -385,14 +760,24 @@ exit(int status)
   panic("zombie exit");
 }
 
-// Wait for a child process to exit and return its pid.
-// Return -1 if this process has no children.
-int
-wait(uint64 addr)
+// Wait for a child to exit and return its pid. Waits for
+// the threads p made if thread is set, else for the processes
+// it forked, copying out the exit status, or for a thread the
+// stack it was given, to addr if that isn't 0.
+// Return -1 if this process has no such children.
+static int
+waitchild(uint64 addr, int thread)
 {
   struct proc *pp;
   int havekids, pid;
   struct proc *p = myproc();
+  void *src;
+  int n;
+
+  // copyout() below is done holding spin-locks.
+  n = thread ? sizeof(pp->ustack) : sizeof(pp->xstate);
+  if(addr != 0)
+    vmtouch(addr, n, 1);
 
   acquire(&wait_lock);
 
@@ -400,7 +785,7 @@ wait(uint64 addr)
     // Scan through table looking for exited children.
     havekids = 0;
     for(pp = proc; pp < &proc[NPROC]; pp++){
-      if(pp->parent == p){
+      if(pp->parent == p && (pp->tg == p->tg) == thread){
         // make sure the child isn't still in exit() or swtch().
         acquire(&pp->lock);
 
@@ -408,8 +793,8 @@ wait(uint64 addr)
         if(pp->state == ZOMBIE){
           // Found one.
           pid = pp->pid;
-          if(addr != 0 && copyout(p->pagetable, addr, (char *)&pp->xstate,
-                                  sizeof(pp->xstate)) < 0) {
+          src = thread ? (void*)&pp->ustack : (void*)&pp->xstate;
+          if(addr != 0 && copyout(p->pagetable, addr, src, n) < 0) {
             release(&pp->lock);
             release(&wait_lock);
             return -1;
@@ -434,6 +819,262 @@ wait(uint64 addr)
   }
 }
 
+int
+wait(uint64 addr)
+{
+  return waitchild(addr, 0);
+}
+
+// Wait for a thread this one made with clone() to exit, and
+// copy the stack clone() was given to addr.
+int
+join(uint64 addr)
+{
+  return waitchild(addr, 1);
+}
+
+// Start a thread in the current process's group, running
+// fn(arg) in user space on stack, with the same memory and a
+// copy of the open files. Returns the thread's pid.
+int
+clone(uint64 fn, uint64 arg, uint64 stack)
+{
+  int pid, slot;
+  struct proc *np;
+  struct proc *p = myproc();
+
+  tgvmlock(p);
+  if((np = allocslot()) == 0){
+    tgvmunlock(p);
+    return -1;
+  }
+
+  // take a trapframe slot, and map the trapframe there.
+  acquire(&tg_lock);
+  for(slot = 1; slot < NTHREAD; slot++)
+    if((p->tg->slots & (1L << slot)) == 0)
+      break;
+  if(slot < NTHREAD){
+    p->tg->slots |= 1L << slot;
+    p->tg->ref++;
+    np->tg = p->tg;
+    np->tslot = slot;
+  }
+  release(&tg_lock);
+  if(np->tg == 0){
+    freeproc(np);
+    release(&np->lock);
+    tgvmunlock(p);
+    return -1;
+  }
+  np->pagetable = p->pagetable;
+  np->usyscall = p->usyscall;
+  np->sz = p->sz;
+  if(mappages(p->pagetable, TTRAPFRAME(slot), PGSIZE,
+              (uint64)np->trapframe, PTE_R | PTE_W) < 0){
+    freeproc(np);
+    release(&np->lock);
+    tgvmunlock(p);
+    return -1;
+  }
+  tgvmunlock(p);
+  np->tgid = p->tgid;
+  // its ASID may have entries from an earlier page table.
+  np->tlbstale = ~0L;
+
+  *(np->trapframe) = *(p->trapframe);
+  np->trapframe->epc = fn;
+  np->trapframe->a0 = arg;
+  np->trapframe->sp = stack;
+  np->ustack = stack;
+
+  if(fdcopy(np, p) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->cwd = idup(p->cwd);
+  vmacopy(np->vma, p->vma);
+
+  safestrcpy(np->name, p->name, sizeof(p->name));
+  np->fixprio = p->fixprio;
+  np->prio = p->fixprio >= 0 ? p->fixprio : 0;
+  np->affinity = p->affinity;
+
+  pid = np->pid;
+
+  release(&np->lock);
+
+  acquire(&tg_lock);
+  p->tg->live++;
+  release(&tg_lock);
+
+  acquire(&wait_lock);
+  np->parent = p;
+  release(&wait_lock);
+
+  // the leader may be exiting, and have missed np.
+  if(killed(p))
+    setkilled(np);
+
+  acquire(&np->lock);
+  runnable(np);
+  release(&np->lock);
+
+  return pid;
+}
+
+// Add or remove (d = 1 or -1) a queued process with affinity
+// mask m to the nallow counts.
+static void
+allow(uint64 m, int d)
+{
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    if(m & (1L << i))
+      __sync_fetch_and_add(&runq[i].nallow, d);
+}
+
+// Make p RUNNABLE and queue it on the run queue of the CPU it
+// last ran on, or else this CPU's, or else the first one its
+// affinity allows. If a CPU that may run p is idle, interrupt
+// it so that it can take p.
+// Caller must hold p->lock.
+void
+runnable(struct proc *p)
+{
+  struct runq *rq;
+  uint64 m;
+  int id, me;
+
+  if(!holding(&p->lock))
+    panic("runnable");
+  p->state = RUNNABLE;
+  if(p->boost != ticks / BOOSTTICKS){
+    p->boost = ticks / BOOSTTICKS;
+    p->prio = p->fixprio >= 0 ? p->fixprio : 0;
+  }
+
+  me = cpuid();
+  if(p->lastcpu >= 0 && (p->affinity & (1L << p->lastcpu)))
+    id = p->lastcpu;
+  else if(p->affinity & (1L << me))
+    id = me;
+  else
+    id = __builtin_ctzl(p->affinity);
+  rq = &runq[id];
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  p->qmask = p->affinity;
+  if(rq->tail[p->prio])
+    rq->tail[p->prio]->rqnext = p;
+  else
+    rq->head[p->prio] = p;
+  rq->tail[p->prio] = p;
+  rq->n++;
+  allow(p->qmask, 1);
+  release(&rq->lock);
+
+  // pairs with the check in scheduler(): either it sees the
+  // queued process, or we see its idle bit.
+  __sync_synchronize();
+  m = idle & p->qmask & ~(1L << me);
+  if(m & (1L << id))
+    ipi(id);
+  else if(m)
+    ipi(__builtin_ctzl(m));
+}
+
+// Take the first process of the highest priority in CPU id's
+// run queue that CPU self may run, or 0. Moves everyone whose
+// priority setpriority() hasn't fixed up to the top list first
+// if a boost is due, as runnable() does.
+static struct proc*
+rqpop(int id, int self)
+{
+  struct runq *rq = &runq[id];
+  struct proc *p, *prev, *next;
+  int i;
+
+  if(rq->n == 0)
+    return 0;   // racy peek, to spare the lock
+  acquire(&rq->lock);
+  if(rq->boost != ticks / BOOSTTICKS){
+    rq->boost = ticks / BOOSTTICKS;
+    for(i = 1; i < NPRIO; i++){
+      prev = 0;
+      for(p = rq->head[i]; p; p = next){
+        next = p->rqnext;
+        if(p->fixprio >= 0){
+          prev = p;   // setpriority() pinned it here
+          continue;
+        }
+        if(prev)
+          prev->rqnext = next;
+        else
+          rq->head[i] = next;
+        if(rq->tail[i] == p)
+          rq->tail[i] = prev;
+        p->prio = 0;
+        p->rqnext = 0;
+        if(rq->tail[0])
+          rq->tail[0]->rqnext = p;
+        else
+          rq->head[0] = p;
+        rq->tail[0] = p;
+      }
+    }
+  }
+  for(i = 0; i < NPRIO; i++){
+    prev = 0;
+    for(p = rq->head[i]; p; prev = p, p = p->rqnext){
+      if((p->qmask & (1L << self)) == 0)
+        continue;
+      if(prev)
+        prev->rqnext = p->rqnext;
+      else
+        rq->head[i] = p->rqnext;
+      if(rq->tail[i] == p)
+        rq->tail[i] = prev;
+      rq->n--;
+      allow(p->qmask, -1);
+      release(&rq->lock);
+      return p;
+    }
+  }
+  release(&rq->lock);
+  return 0;
+}
+
+// Find a process for CPU id to run: its own queue's first,
+// else one from the other CPUs' queues.
+static struct proc*
+pick(int id)
+{
+  struct proc *p;
+  int i;
+
+  if((p = rqpop(id, id)) != 0)
+    return p;
+  if(runq[id].nallow == 0)
+    return 0;
+  for(i = 1; i < NCPU; i++){
+    if((p = rqpop((id + i) % NCPU, id)) != 0){
+      runq[id].nsteal++;
+      return p;
+    }
+  }
+  return 0;
+}
+
+// Is any queued process one that CPU id may run?
+static int
+anyrunnable(int id)
+{
+  return runq[id].nallow != 0;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
@@ -446,28 +1087,53 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
+  __sync_fetch_and_or(&online, 1L << id);
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+    if((p = pick(id)) == 0){
+      // Nothing to run: stop the tick and wait for an interrupt.
+      // With interrupts off, one that arrives after the check
+      // still ends wfi.
+      intr_off();
+      __sync_fetch_and_or(&idle, 1L << id);
+      if(!anyrunnable(id)){
+        tickstop(id);
+        asm volatile("wfi");
+        tickstart(id);
       }
+      __sync_fetch_and_and(&idle, ~(1L << id));
+      continue;
+    }
+
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler: queued process not runnable");
+    if((p->affinity & (1L << id)) == 0){
+      // setaffinity() moved it off this CPU while it was queued.
+      runnable(p);
       release(&p->lock);
+      continue;
     }
+    p->lastcpu = id;
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    trace(TR_SWITCH, 0, 0);
+    p->runstart = mtime();
+    swtch(&c->context, &p->context);
+    p->cputime += mtime() - p->runstart;
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -504,11 +1170,148 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  runnable(p);
+  sched();
+  release(&p->lock);
+}
+
+// Give up the CPU because the timer went off, dropping
+// a priority level if it isn't pinned or at the bottom.
+// Keeps the CPU if there is nothing else for it to run.
+void
+preempt(void)
+{
+  struct proc *p = myproc();
+  acquire(&p->lock);
+  if(p->fixprio < 0 && p->prio < NPRIO-1)
+    p->prio++;
+  if(!anyrunnable(p->lastcpu) && (p->affinity & (1L << p->lastcpu))){
+    release(&p->lock);
+    return;
+  }
+  runnable(p);
   sched();
   release(&p->lock);
 }
 
+// Pin the priority of process pid at prio, 0 being the
+// highest, or let it float again if prio is -1.
+int
+setpriority(int pid, int prio)
+{
+  struct proc *p;
+
+  if(prio < -1 || prio >= NPRIO)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      p->fixprio = prio;
+      p->prio = prio >= 0 ? prio : 0;
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// Copy process pid's count of system call num, and the
+// cycles spent in them, to *count and *time.
+int
+procsyscount(int pid, int num, uint64 *count, uint64 *time)
+{
+  struct proc *p;
+
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      *count = p->syscount[num];
+      *time = p->systime[num];
+      release(&p->lock);
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
+// System calls p has made.
+static uint64
+nsyscalls(struct proc *p)
+{
+  uint64 n;
+  int i;
+
+  n = 0;
+  for(i = 0; i < NSYSCALL; i++)
+    n += p->syscount[i];
+  return n;
+}
+
+// Copy the resource use of process pid, or of every process if
+// pid is 0, to the array of n struct rusage at user address
+// addr. Returns the number copied, or -1.
+int
+procrusage(int pid, uint64 addr, int n)
+{
+  struct rusage ru;
+  struct proc *p;
+  int k;
+
+  k = 0;
+  for(p = proc; p < &proc[NPROC] && k < n; p++){
+    acquire(&p->lock);
+    if(p->state == UNUSED || (pid != 0 && p->pid != pid)){
+      release(&p->lock);
+      continue;
+    }
+    ru.pid = p->pid;
+    ru.state = p->state;
+    safestrcpy(ru.name, p->name, sizeof(ru.name));
+    ru.cputime = p->cputime;
+    if(p->state == RUNNING)
+      ru.cputime += mtime() - p->runstart;
+    ru.syscalls = nsyscalls(p);
+    ru.faults = p->nfault;
+    ru.rbytes = p->rbytes;
+    ru.wbytes = p->wbytes;
+    release(&p->lock);
+    if(copyout(myproc()->pagetable, addr + k*sizeof(ru), (char*)&ru, sizeof(ru)) < 0)
+      return -1;
+    k++;
+  }
+  if(pid != 0 && k == 0)
+    return -1;
+  return k;
+}
+
+// Let only the CPUs in mask run process pid; bits for CPUs
+// that are not running are ignored. If that rules out the CPU
+// the caller is on, it moves at once.
+int
+setaffinity(int pid, uint64 mask)
+{
+  struct proc *p;
+
+  mask &= online;
+  if(mask == 0)
+    return -1;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED){
+      p->affinity = mask;
+      release(&p->lock);
+      // a running process's lastcpu is the CPU it's on.
+      if(p == myproc() && (mask & (1L << p->lastcpu)) == 0)
+        yield();
+      return 0;
+    }
+    release(&p->lock);
+  }
+  return -1;
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void
@@ -530,12 +1333,36 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's first scheduling swtches here.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = wqhash(chan);
+
+  // Join chan's wait queue while still holding lk, so that
+  // a wakeup() made after lk is released will find us.
+  acquire(&wq->lock);
+  p->wprev = 0;
+  p->wnext = wq->head;
+  if(wq->head)
+    wq->head->wprev = p;
+  wq->head = p;
+  release(&wq->lock);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
@@ -555,28 +1382,166 @@ sleep(void *chan, struct spinlock *lk)
 
   // Tidy up.
   p->chan = 0;
+  release(&p->lock);
+
+  acquire(&wq->lock);
+  if(p->wprev)
+    p->wprev->wnext = p->wnext;
+  else
+    wq->head = p->wnext;
+  if(p->wnext)
+    p->wnext->wprev = p->wprev;
+  release(&wq->lock);
 
   // Reacquire original lock.
-  release(&p->lock);
   acquire(lk);
 }
 
-// Wake up all processes sleeping on chan.
+// Wake up at most n of the processes sleeping on chan, or all
+// of them if n is -1, and return how many woke.
 // Must be called without any p->lock.
-void
-wakeup(void *chan)
+int
+wakeupn(void *chan, int n)
 {
   struct proc *p;
+  struct waitq *wq = wqhash(chan);
+  int woke = 0;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
+  if(wq->head == 0)
+    return 0;   // racy peek; see sleep()
+  acquire(&wq->lock);
+  for(p = wq->head; p && woke != n; p = p->wnext) {
     if(p != myproc()){
       acquire(&p->lock);
       if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
+        runnable(p);
+        woke++;
       }
       release(&p->lock);
     }
   }
+  release(&wq->lock);
+  return woke;
+}
+
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void
+wakeup(void *chan)
+{
+  wakeupn(chan, -1);
+}
+
+// The wait channel of the futex word at user address addr of
+// the current process, its physical address, or 0.
+static void*
+futexchan(uint64 addr)
+{
+  uint64 pa;
+
+  if(addr % sizeof(int) != 0)
+    return 0;
+  if((pa = walkaddr(myproc()->pagetable, addr)) == 0)
+    return 0;
+  return (void*)(pa + addr % PGSIZE);
+}
+
+static struct spinlock*
+futexhash(void *chan)
+{
+  return &futexlock[((uint64)chan >> 2) % NFUTEX];
+}
+
+// Sleep until futex_wake() on addr, if the int there is still
+// val. Returns 0 once woken, -1 if the int wasn't val, or if
+// the process was killed.
+int
+futex_wait(uint64 addr, int val)
+{
+  struct proc *p = myproc();
+  struct spinlock *lk;
+  void *chan;
+  int v;
+
+  // give the word a page of its own now if it is copy-on-write,
+  // so that storing to it doesn't move it from under a sleeper,
+  // and since copyin() below holds a spin-lock.
+  vmtouch(addr, sizeof(int), 1);
+  if((chan = futexchan(addr)) == 0)
+    return -1;
+  lk = futexhash(chan);
+  acquire(lk);
+  if(copyin(p->pagetable, (char*)&v, addr, sizeof(v)) < 0 || v != val ||
+     killed(p)){
+    release(lk);
+    return -1;
+  }
+  sleep(chan, lk);
+  release(lk);
+  return killed(p) ? -1 : 0;
+}
+
+// Wake at most n of the processes sleeping in futex_wait() on
+// addr. Returns the number woken.
+int
+futex_wake(uint64 addr, int n)
+{
+  struct spinlock *lk;
+  void *chan;
+  int woke;
+
+  if(n <= 0 || (chan = futexchan(addr)) == 0)
+    return 0;
+  lk = futexhash(chan);
+  acquire(lk);
+  woke = wakeupn(chan, n);
+  release(lk);
+  return woke;
+}
+
+// The other procs in p's group may have entries from its page
+// table cached, under their ASIDs: make them flush before they
+// next run, and interrupt the CPUs running them now, waiting
+// until they flush. A caller holding spin-locks can't wait, as
+// the others may be spinning for one with interrupts off; it
+// only interrupts them, and they flush very soon after.
+// Interrupts must be off.
+void
+tlbshootdown(struct proc *p)
+{
+  struct proc *pp;
+  struct cpu *c;
+  int wait;
+
+  if(!tgshared(p))
+    return;
+  for(pp = proc; pp < &proc[NPROC]; pp++)
+    if(pp != p && pp->pagetable == p->pagetable)
+      __sync_fetch_and_or(&pp->tlbstale, ~0L);
+  __sync_synchronize();
+  wait = mycpu()->noff == 1;
+  for(c = cpus; c < &cpus[NCPU]; c++){
+    pp = __atomic_load_n(&c->proc, __ATOMIC_RELAXED);
+    if(c == mycpu() || pp == 0 || pp->pagetable != p->pagetable)
+      continue;
+    __atomic_store_n(&c->tlbreq, 1, __ATOMIC_RELEASE);
+    ipi(c - cpus);
+    // another CPU may be waiting on this one likewise.
+    while(wait && __atomic_load_n(&c->tlbreq, __ATOMIC_ACQUIRE))
+      tlbintr();
+  }
+}
+
+// Flush this CPU's TLB if tlbshootdown() asked it to.
+void
+tlbintr(void)
+{
+  struct cpu *c = mycpu();
+
+  if(__atomic_load_n(&c->tlbreq, __ATOMIC_ACQUIRE)){
+    sfence_vma();
+    __atomic_store_n(&c->tlbreq, 0, __ATOMIC_RELEASE);
+  }
 }
 
 // Kill the process with the given pid.
@@ -593,7 +1558,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        runnable(p);
       }
       release(&p->lock);
       return 0;
@@ -678,6 +1643,25 @@ procdump(void)
     else
       state = "???";
     printf("%d %s %s", p->pid, state, p->name);
+    printf(" cpu %dms sys %d faults %d read %d write %d",
+           (int)(p->cputime / (TIMEBASE / 1000)), (int)nsyscalls(p),
+           (int)p->nfault, (int)p->rbytes, (int)p->wbytes);
     printf("\n");
   }
 }
+
+// Print run queue statistics into buf for the statistics device.
+int
+procstats(char *buf, int sz)
+{
+  int i, n;
+
+  n = snprintf(buf, sz, "--- runq\n");
+  for(i = 0; i < NCPU; i++){
+    acquire(&runq[i].lock);
+    n += snprintf(buf+n, sz-n, "cpu %d: queued %d stolen %l lock: #acquire() %l #test-and-set %l\n",
+                  i, runq[i].n, runq[i].nsteal, runq[i].lock.n, runq[i].lock.nts);
+    release(&runq[i].lock);
+  }
+  return n;
+}
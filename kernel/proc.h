@@ -24,13 +24,17 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int tlbreq;                 // Set by tlbshootdown() until this CPU flushes
+  uint tick;                  // The last tick this CPU's timer saw.
 };
 
 extern struct cpu cpus[NCPU];
 
 // per-process data for the trap handling code in trampoline.S.
 // sits in a page by itself just under the trampoline page in the
-// user page table. not specially mapped in the kernel page table.
+// user page table, or, for a thread clone() made, in its own
+// slot lower down (TTRAPFRAME()). not specially mapped in the
+// kernel page table.
 // uservec in trampoline.S saves user registers in the trapframe,
 // then initializes registers from the trapframe's
 // kernel_sp, kernel_hartid, kernel_satp, and jumps to kernel_trap.
@@ -77,10 +81,32 @@ struct trapframe {
   /* 264 */ uint64 t4;
   /* 272 */ uint64 t5;
   /* 280 */ uint64 t6;
+  /* 288 */ uint64 kernel_flush;  // no ASIDs: flush the TLB on satp switches
+  /* 296 */ uint64 kernel_syscall; // usersyscall()
 };
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A range of user memory whose pages are read in from a file
+// when first touched (vma.c), or are those of a shared memory
+// segment (shm.c).
+struct vma {
+  uint64 start;                // page-aligned
+  uint64 end;                  // page-aligned; 0 if the slot is unused
+  int perm;                    // PTE_R, PTE_W, PTE_X
+  int flags;                   // MAP_SHARED or MAP_PRIVATE; 0 for exec()
+  struct inode *ip;            // backing file, or 0
+  struct shmseg *shm;          // else the segment attached
+  uint off;                    // file or segment offset of start
+  uint filesz;                 // bytes from the file; zeros after that
+};
+
+struct shmseg;
+
+// Processes sharing a page table: a process and the threads
+// clone() made in it (proc.c).
+struct tgroup;
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -91,6 +117,19 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int prio;                    // Run queue level, 0 highest
+  int fixprio;                 // Level pinned by setpriority(), or -1
+  uint boost;                  // Boost period prio was last reset in
+  uint64 affinity;             // CPUs that may run it, bit i for CPU i
+  int lastcpu;                 // CPU it last ran on, or -1
+
+  // the run queue's lock must be held when using this:
+  struct proc *rqnext;         // Next RUNNABLE process in its run queue
+  uint64 qmask;                // affinity when it was queued
+
+  // the wait queue's lock must be held when using these:
+  struct proc *wnext;          // Wait queue of the chan slept on
+  struct proc *wprev;
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
@@ -100,8 +139,28 @@ struct proc {
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
+  struct usyscall *usyscall;   // page the user reads at USYSCALL
+  struct tgroup *tg;           // Procs sharing pagetable, usyscall and sz
+  int tgid;                    // pid of the first of them, for getpid()
+  int tslot;                   // trapframe is mapped at TTRAPFRAME(tslot)
+  uint64 ustack;               // stack clone() was given, for join()
+  int asid;                    // Address space ID of pagetable
+  uint64 tlbstale;             // CPUs that must flush asid before using it
   struct context context;      // swtch() here to run process
-  struct file *ofile[NOFILE];  // Open files
+  struct file **ofile;         // Open files, nofile slots (file.c)
+  int nofile;
+  int fdlow;                   // descriptors below this are in use
+  uint64 fdmap[MAXFD/64];      // descriptors in use
+  struct file *ofile0[NOFILE]; // ofile until it outgrows them
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // File-backed memory
+  uint64 syscount[NSYSCALL];   // System calls made, by number
+  uint64 systime[NSYSCALL];    // mtime cycles spent in them
+  uint64 cputime;              // mtime cycles on a CPU (scheduler())
+  uint64 runstart;             // mtime when it last started running
+  uint64 nfault;               // page faults taken in user code
+  uint64 rbytes;               // bytes readi() copied to user memory
+  uint64 wbytes;               // bytes writei() copied from it
   char name[16];               // Process name (debugging)
+  void (*kfn)(void);           // Body of a kernel thread, else 0
 };
@@ -0,0 +1,135 @@
+//
+// sampling profiler.
+//
+// While profiling, each CPU's timer interrupts it profrate times
+// a tick instead of once (devintr() in trap.c), and usertrap()
+// and kerneltrap() record where each timer interrupt found the
+// CPU in the CPU's own ring, as trace.c does its records: with
+// interrupts off, taking no lock, overwriting the oldest sample
+// when the ring is full. Reading the profile device (major PROF)
+// copies out whole samples it hasn't returned before. Writing a
+// number n to it takes n samples a tick, up to PROFMAX; 0 stops.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "prof.h"
+#include "defs.h"
+
+#define PROFSIZE 2048     // samples per CPU, a power of two
+
+struct profring {
+  uint64 head;            // number of samples ever taken
+  struct profsample s[PROFSIZE];
+};
+
+static struct profring rings[NCPU];
+
+static struct {
+  struct sleeplock lock;
+  uint64 tail[NCPU];      // next sample to read from each ring
+} reader;
+
+volatile int profrate;    // samples per tick, 0 if not profiling
+
+// record that a timer interrupt found this CPU at pc, in user
+// code if user is set. called with interrupts off.
+void
+profsample(uint64 pc, int user)
+{
+  struct profring *r;
+  struct profsample *s;
+  struct proc *p;
+  int id;
+
+  if(!profrate)
+    return;
+
+  id = cpuid();
+  r = &rings[id];
+  p = mycpu()->proc;
+  s = &r->s[r->head % PROFSIZE];
+  s->pc = pc;
+  s->cpu = id;
+  s->user = user;
+  s->pid = p ? p->pid : 0;
+  safestrcpy(s->name, p ? p->name : "", sizeof(s->name));
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+// has sample i of r been overwritten, or is it being?
+static int
+profold(struct profring *r, uint64 i)
+{
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - i > PROFSIZE - 1;
+}
+
+static int
+profwrite(int user_src, uint64 src, int n)
+{
+  char buf[8];
+  int i, rate;
+
+  if(n < 1 || n > sizeof(buf) || either_copyin(buf, user_src, src, n) == -1)
+    return -1;
+  rate = 0;
+  for(i = 0; i < n && buf[i] != '\n'; i++){
+    if(buf[i] < '0' || buf[i] > '9')
+      return -1;
+    rate = rate*10 + buf[i] - '0';
+  }
+  if(i == 0 || rate > PROFMAX)
+    return -1;
+  profrate = rate;
+  return n;
+}
+
+static int
+profread(int user_dst, uint64 dst, int n)
+{
+  struct profsample s;
+  struct profring *r;
+  uint64 h, t;
+  int i, m;
+
+  acquiresleep(&reader.lock);
+  m = 0;
+  for(i = 0; i < NCPU; i++){
+    r = &rings[i];
+    t = reader.tail[i];
+    h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if(h - t > PROFSIZE - 1)
+      t = h - (PROFSIZE - 1);  // lost the ones before t
+    for(; t < h && n - m >= sizeof(s); t++){
+      s = r->s[t % PROFSIZE];
+      // drop a sample the CPU overwrote while we copied it.
+      if(profold(r, t))
+        continue;
+      if(either_copyout(user_dst, dst + m, &s, sizeof(s)) == -1){
+        m = -1;
+        goto out;
+      }
+      m += sizeof(s);
+    }
+    reader.tail[i] = t;
+  }
+out:
+  releasesleep(&reader.lock);
+  return m;
+}
+
+void
+profinit(void)
+{
+  initsleeplock(&reader.lock, "profile");
+
+  devsw[PROF].read = profread;
+  devsw[PROF].write = profwrite;
+}
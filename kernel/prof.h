@@ -0,0 +1,11 @@
+// profiler samples, as read from the profile device (major PROF).
+
+#define PROFMAX 100    // most samples per tick
+
+struct profsample {
+  uint64 pc;           // where the timer interrupted
+  int pid;             // current process, or 0
+  ushort cpu;
+  ushort user;         // 1 if pc is in the process's user code
+  char name[16];       // the process's name, for its symbols
+};
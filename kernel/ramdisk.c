@@ -1,45 +1,56 @@
 //
-// ramdisk that uses the disk image loaded by qemu -initrd fs.img
+// a disk in memory: block device RAMDEV, of ramdisk= blocks
+// (boot arg, 0 for none), zeroed at boot and lost at shutdown.
+// it has no queue: transfers are copies done by the time
+// submit returns.
 //
 
 #include "types.h"
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
-#include "memlayout.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
 
-void
-ramdiskinit(void)
+#define BPP (PGSIZE / BSIZE)   // blocks per page
+#define NRAMPAGE 1024          // at most 4MB
+
+static struct {
+  uint nblocks;
+  char *page[NRAMPAGE];
+} ram;
+
+static int
+ramdisksubmit(int dev, struct buf *b, uint blockno, int write, int wait)
 {
+  char *addr;
+
+  if(blockno >= ram.nblocks)
+    panic("ramdisk: blockno too big");
+  addr = ram.page[blockno / BPP] + (blockno % BPP) * BSIZE;
+  if(write)
+    memmove(addr, b->data, BSIZE);
+  else
+    memmove(b->data, addr, BSIZE);
+  return 0;
 }
 
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
 void
-ramdiskrw(struct buf *b)
+ramdiskinit(void)
 {
-  if(!holdingsleep(&b->lock))
-    panic("ramdiskrw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("ramdiskrw: nothing to do");
-
-  if(b->blockno >= FSSIZE)
-    panic("ramdiskrw: blockno too big");
+  int n, i;
 
-  uint64 diskaddr = b->blockno * BSIZE;
-  char *addr = (char *)RAMDISK + diskaddr;
-
-  if(b->flags & B_DIRTY){
-    // write
-    memmove(addr, b->data, BSIZE);
-    b->flags &= ~B_DIRTY;
-  } else {
-    // read
-    memmove(b->data, addr, BSIZE);
-    b->flags |= B_VALID;
+  n = bootarg("ramdisk", 0);
+  if(n > NRAMPAGE * BPP)
+    n = NRAMPAGE * BPP;
+  for(i = 0; i < (n + BPP - 1) / BPP; i++){
+    if((ram.page[i] = kalloc()) == 0)
+      panic("ramdiskinit: kalloc");
+    memset(ram.page[i], 0, PGSIZE);
   }
+  ram.nblocks = n;
+  if(n > 0)
+    bdevsw[RAMDEV].submit = ramdisksubmit;
 }
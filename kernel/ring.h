@@ -0,0 +1,40 @@
+// A batch of system calls for ring_enter(), in the caller's own
+// memory. The caller fills sq[] entries at sqtail and advances
+// it; ring_enter() runs entries from sqhead on, posting each
+// result to cq[] at cqtail; the caller takes results from
+// cqhead. Indexes count up forever; entry i is at i % RINGSIZE.
+
+#define RINGSIZE 32  // entries in each queue, a power of two
+
+#define RING_NOP    0
+#define RING_READ   1  // read(fd, addr, n)
+#define RING_WRITE  2  // write(fd, addr, n)
+#define RING_OPEN   3  // open(addr, n)
+#define RING_CLOSE  4  // close(fd)
+#define RING_FSTAT  5  // fstat(fd, addr)
+#define RING_STAT   6  // stat(addr, (struct stat*)buf)
+
+struct ringsqe {
+  int op;       // RING_*
+  int fd;
+  uint64 addr;  // buffer or path
+  uint64 buf;   // RING_STAT's struct stat
+  int n;        // byte count, or open mode
+  int pad;
+  uint64 data;  // handed back in the completion
+};
+
+struct ringcqe {
+  uint64 data;  // the sqe's data
+  int res;      // what the system call returned
+  int pad;
+};
+
+struct ring {
+  uint sqhead;  // next entry ring_enter() will run
+  uint sqtail;  // next free entry, advanced by the caller
+  uint cqhead;  // next result to take, advanced by the caller
+  uint cqtail;  // next result ring_enter() will post
+  struct ringsqe sq[RINGSIZE];
+  struct ringcqe cq[RINGSIZE];
+};
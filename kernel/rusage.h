@@ -0,0 +1,12 @@
+// per-process resource use, as returned by getrusage().
+
+struct rusage {
+  int pid;
+  int state;               // enum procstate in proc.h
+  char name[16];
+  uint64 cputime;          // mtime cycles on a CPU
+  uint64 syscalls;         // system calls made
+  uint64 faults;           // page faults taken in user code
+  uint64 rbytes;           // bytes read from files
+  uint64 wbytes;           // bytes written to files
+};
@@ -0,0 +1,60 @@
+// Sequence locks.
+//
+// A reader does:
+//   do {
+//     s = readseqbegin(sl);
+//     ... copy the data out ...
+//   } while(readseqretry(sl, s));
+// and must not trust what it copied until readseqretry()
+// returns 0, since a writer may change it at any time.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "seqlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+void
+initseqlock(struct seqlock *sl, char *name)
+{
+  initlock(&sl->lk, name);
+  sl->seq = 0;
+}
+
+void
+writeseqlock(struct seqlock *sl)
+{
+  acquire(&sl->lk);
+  __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELAXED);
+  // the data's stores must come after seq turns odd.
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void
+writesequnlock(struct seqlock *sl)
+{
+  __atomic_store_n(&sl->seq, sl->seq + 1, __ATOMIC_RELEASE);
+  release(&sl->lk);
+}
+
+// Returns the sequence number to hand readseqretry(),
+// once no writer is active.
+uint
+readseqbegin(struct seqlock *sl)
+{
+  uint s;
+
+  while((s = __atomic_load_n(&sl->seq, __ATOMIC_ACQUIRE)) & 1)
+    ;
+  return s;
+}
+
+// Did a writer change the data since readseqbegin() returned s?
+int
+readseqretry(struct seqlock *sl, uint s)
+{
+  // the data's loads must come before seq is checked.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&sl->seq, __ATOMIC_RELAXED) != s;
+}
@@ -0,0 +1,8 @@
+// Sequence lock, for small data that is read far more often
+// than it is written. Writers hold lk and make seq odd while
+// they change the data; readers take no lock, and read again
+// if seq was odd or moved while they read.
+struct seqlock {
+  uint seq;
+  struct spinlock lk;
+};
@@ -0,0 +1,163 @@
+//
+// Shared memory segments.
+//
+// shmget() names a segment of up to NSHMPAGE pages by a key
+// that processes agree on; key 0 always makes a new one, for a
+// process to share with the children it forks. shmat() maps it
+// as an area (vma.c) of the caller's memory, and stores to it
+// are seen by every process that has it attached, with no
+// copying. A segment's pages are allocated when first touched,
+// and freed with the last of its attachments. fork()'s children
+// inherit the attachments; exec() and exit() drop them.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
+#include "defs.h"
+
+struct shmseg {
+  int used;
+  int key;
+  int ref;                 // areas attached to it
+  int npages;
+  void *pages[NSHMPAGE];   // 0 until first touched
+};
+
+static struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shm;
+
+void
+shminit(void)
+{
+  initlock(&shm.lock, "shm");
+}
+
+// Return the id of the segment with key, or of a new segment
+// of size bytes if there is none or key is 0. Returns -1 if the
+// segment is smaller than size, or there's no room for one.
+// A new segment stays until it has been attached and detached.
+int
+shmget(int key, uint64 size)
+{
+  struct shmseg *s, *free;
+  int n;
+
+  if(size == 0 || size > NSHMPAGE*PGSIZE)
+    return -1;
+  n = PGROUNDUP(size) / PGSIZE;
+  free = 0;
+  acquire(&shm.lock);
+  for(s = shm.seg; s < &shm.seg[NSHM]; s++){
+    if(s->used && key != 0 && s->key == key){
+      release(&shm.lock);
+      return s->npages >= n ? s - shm.seg : -1;
+    }
+    if(!s->used && free == 0)
+      free = s;
+  }
+  if((s = free) == 0){
+    release(&shm.lock);
+    return -1;
+  }
+  s->used = 1;
+  s->key = key;
+  s->ref = 0;
+  s->npages = n;
+  release(&shm.lock);
+  return s - shm.seg;
+}
+
+// Attach segment id to the current process, at the highest
+// free address below UTOP. Returns the address, or -1.
+uint64
+shmat(int id)
+{
+  struct proc *p = myproc();
+  struct shmseg *s;
+  uint64 a, len;
+
+  if(id < 0 || id >= NSHM || tgshared(p))
+    return -1;
+  s = &shm.seg[id];
+  acquire(&shm.lock);
+  if(!s->used){
+    release(&shm.lock);
+    return -1;
+  }
+  s->ref++;
+  len = (uint64)s->npages * PGSIZE;
+  release(&shm.lock);
+
+  if((a = vmagap(p, len)) == -1 ||
+     vmaadd(p->vma, a, len, PTE_R | PTE_W, MAP_SHARED, 0, 0, len) < 0){
+    shmput(s);
+    return -1;
+  }
+  vmafind(p, a)->shm = s;
+  return a;
+}
+
+// Detach the segment attached at addr from the current process.
+int
+shmdt(uint64 addr)
+{
+  struct vma *v;
+
+  if((v = vmafind(myproc(), addr)) == 0 || v->shm == 0 || v->start != addr)
+    return -1;
+  return munmap(v->start, v->end - v->start);
+}
+
+// Return page i of s, allocating it on first use, with a
+// reference for the caller; or 0.
+void*
+shmpage(struct shmseg *s, int i)
+{
+  void *pa;
+
+  acquire(&shm.lock);
+  if(i < 0 || i >= s->npages){
+    release(&shm.lock);
+    return 0;
+  }
+  if(s->pages[i] == 0)
+    s->pages[i] = kzalloc();
+  if((pa = s->pages[i]) != 0)
+    kdup(pa);
+  release(&shm.lock);
+  return pa;
+}
+
+// Another area has s attached, as fork() copies them.
+void
+shmdup(struct shmseg *s)
+{
+  acquire(&shm.lock);
+  s->ref++;
+  release(&shm.lock);
+}
+
+// An area no longer has s attached. The last one frees it.
+void
+shmput(struct shmseg *s)
+{
+  int i;
+
+  acquire(&shm.lock);
+  if(--s->ref == 0){
+    for(i = 0; i < s->npages; i++){
+      if(s->pages[i])
+        kfree(s->pages[i]);
+      s->pages[i] = 0;
+    }
+    s->used = 0;
+  }
+  release(&shm.lock);
+}
@@ -0,0 +1,169 @@
+//
+// Object caches, for kernel objects much smaller than a page.
+//
+// A cache hands out objects of one size, carved from pages it
+// takes from kalloc(). Each CPU keeps a magazine of up to
+// MAGSIZE free objects, which kmem_cache_alloc() and
+// kmem_cache_free() use with interrupts off and no lock. An
+// empty magazine takes MAGSIZE/2 objects from the cache's
+// shared depot, under its lock, and the depot carves a new page
+// when it runs out; a full one gives half back. Pages stay with
+// their cache for good.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+
+#define NCACHE 16
+#define MAGSIZE 16
+
+struct magazine {
+  int n;
+  void *obj[MAGSIZE];
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;                  // object size, a multiple of 8
+  struct spinlock lock;
+  void *depot;                // free objects, linked through their first word
+  int ndepot;
+  struct magazine mag[NCPU];
+  int npages;
+  uint64 nalloc;              // objects handed out, on the slow path too
+};
+
+static struct {
+  struct spinlock lock;
+  struct kmem_cache cache[NCACHE];
+  int n;
+} caches;
+
+void
+slabinit(void)
+{
+  initlock(&caches.lock, "caches");
+}
+
+// Make a cache of objects of size bytes, at most a page.
+// name must stay valid: it is kept for the statistics.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size == 0 || size > PGSIZE)
+    panic("kmem_cache_create: size");
+  acquire(&caches.lock);
+  if(caches.n == NCACHE)
+    panic("kmem_cache_create: too many");
+  c = &caches.cache[caches.n++];
+  release(&caches.lock);
+  c->name = name;
+  c->size = size;
+  initlock(&c->lock, "slab");
+  return c;
+}
+
+// Move up to MAGSIZE/2 objects from c's depot to m, carving a
+// new page first if the depot is empty. Returns 0 if there was
+// no memory. Caller must hold c->lock.
+static int
+depotget(struct kmem_cache *c, struct magazine *m)
+{
+  char *pa;
+  void *o;
+  uint off;
+
+  if(c->depot == 0){
+    if((pa = kalloc()) == 0)
+      return 0;
+    for(off = 0; off + c->size <= PGSIZE; off += c->size){
+      *(void**)(pa + off) = c->depot;
+      c->depot = pa + off;
+      c->ndepot++;
+    }
+    c->npages++;
+  }
+  while(m->n < MAGSIZE/2 && (o = c->depot) != 0){
+    c->depot = *(void**)o;
+    c->ndepot--;
+    m->obj[m->n++] = o;
+  }
+  return 1;
+}
+
+// Return a new object from c, or 0 if memory ran out. Its
+// contents are whatever the last user left.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *o;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == 0){
+    acquire(&c->lock);
+    if(!depotget(c, m)){
+      release(&c->lock);
+      pop_off();
+      return 0;
+    }
+    release(&c->lock);
+  }
+  o = m->obj[--m->n];
+  c->nalloc++;   // racy, for statistics only
+  pop_off();
+  return o;
+}
+
+// Give object o back to c.
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  struct magazine *m;
+  void *p;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  if(m->n == MAGSIZE){
+    acquire(&c->lock);
+    while(m->n > MAGSIZE/2){
+      p = m->obj[--m->n];
+      *(void**)p = c->depot;
+      c->depot = p;
+      c->ndepot++;
+    }
+    release(&c->lock);
+  }
+  m->obj[m->n++] = o;
+  pop_off();
+}
+
+// Print the caches' sizes and use into buf for the statistics
+// device.
+int
+slabstats(char *buf, int sz)
+{
+  struct kmem_cache *c;
+  int n, i, cached;
+
+  n = snprintf(buf, sz, "--- slab\n");
+  for(c = caches.cache; c < caches.cache + caches.n; c++){
+    acquire(&c->lock);
+    cached = c->ndepot;
+    for(i = 0; i < NCPU; i++)
+      cached += c->mag[i].n;
+    n += snprintf(buf+n, sz-n, "%s: size %d pages %d free %d allocs %l\n",
+                  c->name, c->size, c->npages, cached, c->nalloc);
+    release(&c->lock);
+  }
+  return n;
+}
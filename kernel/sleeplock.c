@@ -9,37 +9,136 @@
 #include "proc.h"
 #include "sleeplock.h"
 
+// how long a waiter spins for a lock whose holder is running,
+// in mtime cycles, before it sleeps: about what the two
+// context switches that sleeping costs would take.
+#define SPINTIME (TIMEBASE / 100000)
+
+// The holder of lk is running on another CPU, so it may well
+// let go soon. Caller holds lk->lk.
+static int
+ownerrunning(struct sleeplock *lk)
+{
+  return lk->locked && lk->owner && lk->owner != myproc() &&
+         lk->owner->state == RUNNING;
+}
+
+// Wait without lk->lk for up to SPINTIME, while lk's holder
+// stays running. It's only a hint: lk->owner's proc may
+// change under us, but its memory stays in the proc table.
+// Caller holds lk->lk, and still does on return.
+static void
+spinwait(struct sleeplock *lk)
+{
+  uint64 end = r_time() + SPINTIME;
+  struct proc *o;
+
+  release(&lk->lk);
+  while(__atomic_load_n(&lk->locked, __ATOMIC_RELAXED) &&
+        (o = __atomic_load_n(&lk->owner, __ATOMIC_RELAXED)) != 0 &&
+        o->state == RUNNING && r_time() < end)
+    ;
+  acquire(&lk->lk);
+}
+
 void
 initsleeplock(struct sleeplock *lk, char *name)
 {
   initlock(&lk->lk, "sleep lock");
   lk->name = name;
   lk->locked = 0;
+  lk->readers = 0;
+  lk->wwait = 0;
   lk->pid = 0;
+  lk->owner = 0;
 }
 
+// Held locks are often let go within microseconds, so spin a
+// while before sleeping if the holder is running; once per
+// acquire, so a long hold costs one SPINTIME at most.
 void
 acquiresleep(struct sleeplock *lk)
 {
+  int spun = 0;
+
   acquire(&lk->lk);
-  while (lk->locked) {
+  lk->wwait++;
+  while (lk->locked || lk->readers) {
+    if(!spun && ownerrunning(lk)){
+      spun = 1;
+      spinwait(lk);
+      continue;
+    }
     sleep(lk, &lk->lk);
   }
+  lk->wwait--;
   lk->locked = 1;
   lk->pid = myproc()->pid;
+  lk->owner = myproc();
   release(&lk->lk);
 }
 
+// Acquire lk only if that doesn't mean sleeping.
+// Returns 1 if the lock was acquired.
+int
+tryacquiresleep(struct sleeplock *lk)
+{
+  int r;
+
+  acquire(&lk->lk);
+  r = !lk->locked && !lk->readers;
+  if(r){
+    lk->locked = 1;
+    lk->pid = myproc()->pid;
+    lk->owner = myproc();
+  }
+  release(&lk->lk);
+  return r;
+}
+
 void
 releasesleep(struct sleeplock *lk)
 {
   acquire(&lk->lk);
   lk->locked = 0;
   lk->pid = 0;
+  lk->owner = 0;
   wakeup(lk);
   release(&lk->lk);
 }
 
+// Acquire lk shared with other readers. Waits while anyone
+// holds lk alone or is waiting to, so readers can't keep a
+// writer out for ever.
+void
+acquiresleepshared(struct sleeplock *lk)
+{
+  int spun = 0;
+
+  acquire(&lk->lk);
+  while (lk->locked || lk->wwait) {
+    if(!spun && ownerrunning(lk)){
+      spun = 1;
+      spinwait(lk);
+      continue;
+    }
+    sleep(lk, &lk->lk);
+  }
+  lk->readers++;
+  release(&lk->lk);
+}
+
+void
+releasesleepshared(struct sleeplock *lk)
+{
+  acquire(&lk->lk);
+  if(lk->readers < 1)
+    panic("releasesleepshared");
+  if(--lk->readers == 0)
+    wakeup(lk);
+  release(&lk->lk);
+}
+
 int
 holdingsleep(struct sleeplock *lk)
 {
@@ -50,6 +149,3 @@ holdingsleep(struct sleeplock *lk)
   release(&lk->lk);
   return r;
 }
-
-
-
@@ -1,10 +1,14 @@
-// Long-term locks for processes
+// Long-term locks for processes. Held either by one process
+// (acquiresleep()), or shared by readers (acquiresleepshared()).
 struct sleeplock {
   uint locked;       // Is the lock held?
+  int readers;       // Processes sharing it
+  int wwait;         // Processes waiting to hold it alone
   struct spinlock lk; // spinlock protecting this sleep lock
   
   // For debugging:
   char *name;        // Name of lock.
   int pid;           // Process holding lock
+  struct proc *owner; // and its proc, for waiters to watch
 };
 
@@ -8,12 +8,118 @@
 #include "proc.h"
 #include "defs.h"
 
+#define NLOCKCLASS 32  // lock names lockstats() can tell apart
+#define LOCKTOP    10  // lock names it reports
+
+// the counts of all locks with one name.
+struct lockclass {
+  char *name;
+  int nlock;
+  uint64 n;
+  uint64 nts;
+  uint64 maxhold;
+};
+
+// every lock initlock() has seen, so lockstats() can find them.
+// a lock in memory that's freed must be taken off with freelock(),
+// which keeps its counts in retired[].
+static struct {
+  struct spinlock lock;
+  struct spinlock *head;
+  struct lockclass retired[NLOCKCLASS];
+  struct lockclass report[NLOCKCLASS];  // for lockstats()
+} locks = { .lock = { .name = "locks" } };
+
 void
 initlock(struct spinlock *lk, char *name)
 {
   lk->name = name;
-  lk->locked = 0;
+  lk->ticket = 0;
+  lk->owner = 0;
   lk->cpu = 0;
+  lk->n = 0;
+  lk->nts = 0;
+  lk->maxhold = 0;
+
+  acquire(&locks.lock);
+  lk->prev = 0;
+  lk->next = locks.head;
+  if(locks.head)
+    locks.head->prev = lk;
+  locks.head = lk;
+  release(&locks.lock);
+}
+
+// Add lk's counts to the class for its name in cls[].
+// Names past NLOCKCLASS go uncounted.
+static void
+lockclassadd(struct lockclass *cls, struct spinlock *lk)
+{
+  struct lockclass *c;
+
+  for(c = cls; c < &cls[NLOCKCLASS]; c++){
+    if(c->name == 0 || strncmp(c->name, lk->name, 32) == 0)
+      break;
+  }
+  if(c == &cls[NLOCKCLASS])
+    return;
+  c->name = lk->name;
+  c->nlock++;
+  c->n += lk->n;
+  c->nts += lk->nts;
+  if(lk->maxhold > c->maxhold)
+    c->maxhold = lk->maxhold;
+}
+
+// Take lk, which is about to be freed, off the list of locks.
+void
+freelock(struct spinlock *lk)
+{
+  acquire(&locks.lock);
+  lockclassadd(locks.retired, lk);
+  if(lk->prev)
+    lk->prev->next = lk->next;
+  else
+    locks.head = lk->next;
+  if(lk->next)
+    lk->next->prev = lk->prev;
+  release(&locks.lock);
+}
+
+// Report the lock names whose locks were spun for most,
+// summed over the locks with each name, including freed ones.
+// ("#test-and-set" in the report counts the spins.)
+int
+lockstats(char *buf, int sz)
+{
+  struct lockclass *c, *d, t;
+  struct spinlock *lk;
+  int n;
+
+  acquire(&locks.lock);
+  memmove(locks.report, locks.retired, sizeof(locks.report));
+  for(c = locks.report; c < &locks.report[NLOCKCLASS]; c++)
+    c->nlock = 0;   // just count locks still in use
+  for(lk = locks.head; lk; lk = lk->next)
+    lockclassadd(locks.report, lk);
+
+  // sort by spins, most first.
+  for(c = locks.report; c < &locks.report[NLOCKCLASS] && c->name; c++){
+    for(d = c + 1; d < &locks.report[NLOCKCLASS] && d->name; d++){
+      if(d->nts > c->nts){
+        t = *c;
+        *c = *d;
+        *d = t;
+      }
+    }
+  }
+
+  n = snprintf(buf, sz, "--- locks\n");
+  for(c = locks.report; c < &locks.report[LOCKTOP] && c->name; c++)
+    n += snprintf(buf+n, sz-n, "%s: locks %d #acquire() %l #test-and-set %l max hold %l\n",
+                  c->name, c->nlock, c->n, c->nts, c->maxhold);
+  release(&locks.lock);
+  return n;
 }
 
 // Acquire the lock.
@@ -21,16 +127,24 @@ initlock(struct spinlock *lk, char *name)
 void
 acquire(struct spinlock *lk)
 {
+  uint64 spins;
+  uint t;
+
   push_off(); // disable interrupts to avoid deadlock.
   if(holding(lk))
     panic("acquire");
 
-  // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
+  // Take a ticket, and wait for it to be served. Waiters only
+  // load lk->owner, so the cache line isn't written while
+  // they spin, and they get the lock first come, first served.
+  // On RISC-V, the fetch-and-add turns into an atomic add:
   //   a5 = 1
-  //   s1 = &lk->locked
-  //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  //   s1 = &lk->ticket
+  //   amoadd.w a5, a5, (s1)
+  t = __atomic_fetch_add(&lk->ticket, 1, __ATOMIC_RELAXED);
+  spins = 0;
+  while(__atomic_load_n(&lk->owner, __ATOMIC_ACQUIRE) != t)
+    spins++;
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -39,16 +153,26 @@ acquire(struct spinlock *lk)
   __sync_synchronize();
 
   // Record info about lock acquisition for holding() and debugging.
+  // The counters are only written while holding the lock, so they
+  // need no atomic instructions of their own.
   lk->cpu = mycpu();
+  lk->n++;
+  lk->nts += spins;
+  lk->tacq = r_time();
 }
 
 // Release the lock.
 void
 release(struct spinlock *lk)
 {
+  uint64 t;
+
   if(!holding(lk))
     panic("release");
 
+  t = r_time() - lk->tacq;
+  if(t > lk->maxhold)
+    lk->maxhold = t;
   lk->cpu = 0;
 
   // Tell the C compiler and the CPU to not move loads or stores
@@ -59,14 +183,10 @@ release(struct spinlock *lk)
   // On RISC-V, this emits a fence instruction.
   __sync_synchronize();
 
-  // Release the lock, equivalent to lk->locked = 0.
-  // This code doesn't use a C assignment, since the C standard
-  // implies that an assignment might be implemented with
-  // multiple store instructions.
-  // On RISC-V, sync_lock_release turns into an atomic swap:
-  //   s1 = &lk->locked
-  //   amoswap.w zero, zero, (s1)
-  __sync_lock_release(&lk->locked);
+  // Release the lock by serving the next ticket. Only the
+  // holder writes lk->owner, so a plain add will do, but it
+  // must be a single store, which __atomic_store_n() ensures.
+  __atomic_store_n(&lk->owner, lk->owner + 1, __ATOMIC_RELEASE);
 
   pop_off();
 }
@@ -77,7 +197,7 @@ int
 holding(struct spinlock *lk)
 {
   int r;
-  r = (lk->locked && lk->cpu == mycpu());
+  r = (lk->ticket != lk->owner && lk->cpu == mycpu());
   return r;
 }
 
@@ -1,9 +1,19 @@
-// Mutual exclusion lock.
+// Mutual exclusion lock. A ticket lock: CPUs get the lock in
+// the order they asked for it. Held if ticket != owner.
 struct spinlock {
-  uint locked;       // Is the lock held?
+  uint ticket;       // Ticket the next acquire() will take.
+  uint owner;        // Ticket of the holder, or of the next CPU to hold it.
 
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For contention statistics:
+  uint64 n;          // Number of times the lock was acquired.
+  uint64 nts;        // Number of times waiters spun for it.
+  uint64 tacq;       // r_time() when it was last acquired.
+  uint64 maxhold;    // Longest it has been held, in mtime cycles.
+  struct spinlock *next;  // List of all locks, for lockstats().
+  struct spinlock *prev;
 };
 
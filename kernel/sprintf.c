@@ -0,0 +1,108 @@
+//
+// formatted output into a buffer -- snprintf.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+static char digits[] = "0123456789abcdef";
+
+static int
+sputc(char *s, int sz, int off, char c)
+{
+  if(off < sz)
+    s[off] = c;
+  return 1;
+}
+
+static int
+sprintint(char *s, int sz, int off, uint64 x, int base, int neg)
+{
+  char buf[24];
+  int i, n;
+
+  i = 0;
+  do {
+    buf[i++] = digits[x % base];
+  } while((x /= base) != 0);
+
+  if(neg)
+    buf[i++] = '-';
+
+  n = 0;
+  while(--i >= 0)
+    n += sputc(s, sz, off+n, buf[i]);
+  return n;
+}
+
+// Print into buf, writing at most sz bytes.
+// Understands %d, %x, %l (uint64), %p, %s.
+// Returns the number of bytes stored in buf, which
+// is sz if the output did not fit, so callers can
+// append with buf+n and sz-n. Unlike C's snprintf,
+// buf is not NUL-terminated.
+int
+snprintf(char *buf, int sz, char *fmt, ...)
+{
+  va_list ap;
+  int i, c, d;
+  int off = 0;
+  char *s;
+
+  if(fmt == 0)
+    panic("null fmt");
+
+  va_start(ap, fmt);
+  for(i = 0; off < sz && (c = fmt[i] & 0xff) != 0; i++){
+    if(c != '%'){
+      off += sputc(buf, sz, off, c);
+      continue;
+    }
+    c = fmt[++i] & 0xff;
+    if(c == 0)
+      break;
+    switch(c){
+    case 'd':
+      d = va_arg(ap, int);
+      off += sprintint(buf, sz, off, d < 0 ? -(uint64)d : d, 10, d < 0);
+      break;
+    case 'x':
+      off += sprintint(buf, sz, off, va_arg(ap, uint), 16, 0);
+      break;
+    case 'l':
+      off += sprintint(buf, sz, off, va_arg(ap, uint64), 10, 0);
+      break;
+    case 'p':
+      off += sputc(buf, sz, off, '0');
+      off += sputc(buf, sz, off, 'x');
+      off += sprintint(buf, sz, off, va_arg(ap, uint64), 16, 0);
+      break;
+    case 's':
+      if((s = va_arg(ap, char*)) == 0)
+        s = "(null)";
+      for(; *s && off < sz; s++)
+        off += sputc(buf, sz, off, *s);
+      break;
+    case '%':
+      off += sputc(buf, sz, off, '%');
+      break;
+    default:
+      // Print unknown % sequence to draw attention.
+      off += sputc(buf, sz, off, '%');
+      off += sputc(buf, sz, off, c);
+      break;
+    }
+  }
+  va_end(ap);
+  if(off > sz)
+    off = sz;
+  return off < 0 ? 0 : off;
+}
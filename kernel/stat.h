@@ -8,4 +8,5 @@ struct stat {
   short type;  // Type of file
   short nlink; // Number of links to file
   uint64 size; // Size of file in bytes
+  int nextent; // Extents holding its data (fs.c)
 };
@@ -0,0 +1,85 @@
+//
+// kernel statistics device.
+//
+// Reading the "statistics" device (major STATS) returns a text
+// report assembled from the subsystems' *stats() functions.
+// The report is generated on the first read and handed out
+// in pieces by later reads; a read at the end returns 0 and
+// the next read starts a fresh report.
+//
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 8192
+
+static struct {
+  struct sleeplock lock;
+  char buf[BUFSZ];
+  int sz;
+  int off;
+} stats;
+
+static int
+statsfill(char *buf, int sz)
+{
+  int n;
+
+  n = 0;
+  n += kallocstats(buf+n, sz-n);
+  n += slabstats(buf+n, sz-n);
+  n += bcachestats(buf+n, sz-n);
+  n += logstats(buf+n, sz-n);
+  n += fsstats(buf+n, sz-n);
+  n += tmpstats(buf+n, sz-n);
+  n += textstats(buf+n, sz-n);
+  n += procstats(buf+n, sz-n);
+  n += lockstats(buf+n, sz-n);
+  return n;
+}
+
+static int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+static int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  acquiresleep(&stats.lock);
+  if(stats.sz == 0)
+    stats.sz = statsfill(stats.buf, BUFSZ);
+  m = stats.sz - stats.off;
+  if(m > 0){
+    if(m > n)
+      m = n;
+    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) == -1)
+      m = -1;
+    else
+      stats.off += m;
+  } else {
+    m = 0;
+    stats.sz = 0;
+    stats.off = 0;
+  }
+  releasesleep(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initsleeplock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
@@ -5,6 +5,8 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "syscall.h"
+#include "trace.h"
+#include "sysstat.h"
 #include "defs.h"
 
 // Fetch the uint64 at addr from the current process.
@@ -101,6 +103,32 @@ extern uint64 sys_unlink(void);
 extern uint64 sys_link(void);
 extern uint64 sys_mkdir(void);
 extern uint64 sys_close(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_setaffinity(void);
+extern uint64 sys_fcntl(void);
+extern uint64 sys_splice(void);
+extern uint64 sys_tee(void);
+extern uint64 sys_ring_enter(void);
+extern uint64 sys_sysstats(void);
+extern uint64 sys_clone(void);
+extern uint64 sys_join(void);
+extern uint64 sys_futex_wait(void);
+extern uint64 sys_futex_wake(void);
+extern uint64 sys_shmget(void);
+extern uint64 sys_shmat(void);
+extern uint64 sys_shmdt(void);
+extern uint64 sys_spawn(void);
+extern uint64 sys_getdents(void);
+extern uint64 sys_fstatat(void);
+extern uint64 sys_pread(void);
+extern uint64 sys_pwrite(void);
+extern uint64 sys_readv(void);
+extern uint64 sys_writev(void);
+extern uint64 sys_fsync(void);
+extern uint64 sys_poll(void);
+extern uint64 sys_getrusage(void);
 
 // An array mapping syscall numbers from syscall.h
 // to the function that handles the system call.
@@ -126,19 +154,111 @@ static uint64 (*syscalls[])(void) = {
 [SYS_link]    sys_link,
 [SYS_mkdir]   sys_mkdir,
 [SYS_close]   sys_close,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_setpriority] sys_setpriority,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_fcntl]   sys_fcntl,
+[SYS_splice]  sys_splice,
+[SYS_tee]     sys_tee,
+[SYS_ring_enter] sys_ring_enter,
+[SYS_sysstats] sys_sysstats,
+[SYS_clone]   sys_clone,
+[SYS_join]    sys_join,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_shmget]  sys_shmget,
+[SYS_shmat]   sys_shmat,
+[SYS_shmdt]   sys_shmdt,
+[SYS_spawn]   sys_spawn,
+[SYS_getdents] sys_getdents,
+[SYS_fstatat] sys_fstatat,
+[SYS_pread]   sys_pread,
+[SYS_pwrite]  sys_pwrite,
+[SYS_readv]   sys_readv,
+[SYS_writev]  sys_writev,
+[SYS_fsync]   sys_fsync,
+[SYS_poll]    sys_poll,
+[SYS_getrusage] sys_getrusage,
 };
 
+// counts for all processes, by system call number.
+// updated with atomic adds, since CPUs share them.
+static struct sysstat sysstat[NSYSCALL];
+
+// Count a call to num that took t cycles.
+static void
+syscount(struct proc *p, int num, uint64 t)
+{
+  struct sysstat *st = &sysstat[num];
+  uint64 m;
+  int b;
+
+  if(num >= NSYSCALL)
+    return;
+
+  // only p updates its own counts.
+  p->syscount[num]++;
+  p->systime[num] += t;
+
+  __atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&st->time, t, __ATOMIC_RELAXED);
+  m = __atomic_load_n(&st->max, __ATOMIC_RELAXED);
+  while(t > m &&
+        !__atomic_compare_exchange_n(&st->max, &m, t, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  for(b = 0; b < NSYSHIST-1 && (t >> (b+1)) != 0; b++)
+    ;
+  __atomic_fetch_add(&st->hist[b], 1, __ATOMIC_RELAXED);
+}
+
+// Copy the statistics of the first n system call numbers to
+// addr, from process pid's counts, or all processes' if pid
+// is 0. A process has only count and time. Returns the number
+// copied.
+uint64
+sys_sysstats(void)
+{
+  struct sysstat st;
+  uint64 addr;
+  int pid, n, i;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  argint(2, &n);
+  if(n < 0)
+    return -1;
+  if(n > NSYSCALL)
+    n = NSYSCALL;
+  for(i = 0; i < n; i++){
+    if(pid == 0){
+      st = sysstat[i];
+    } else {
+      memset(&st, 0, sizeof(st));
+      if(procsyscount(pid, i, &st.count, &st.time) < 0)
+        return -1;
+    }
+    if(copyout(myproc()->pagetable, addr + i*sizeof(st), (char*)&st, sizeof(st)) < 0)
+      return -1;
+  }
+  return n;
+}
+
 void
 syscall(void)
 {
   int num;
+  uint64 t0;
   struct proc *p = myproc();
 
   num = p->trapframe->a7;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     // Use num to lookup the system call function for num, call it,
     // and store its return value in p->trapframe->a0
+    t0 = mtime();
     p->trapframe->a0 = syscalls[num]();
+    syscount(p, num, mtime() - t0);
+    trace(TR_SYSCALL, num, p->trapframe->a0);
   } else {
     printf("%d %s: unknown sys call %d\n",
             p->pid, p->name, num);
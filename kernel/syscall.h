@@ -20,3 +20,29 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_mmap   22
+#define SYS_munmap 23
+#define SYS_setpriority 24
+#define SYS_setaffinity 25
+#define SYS_fcntl  26
+#define SYS_splice 27
+#define SYS_tee    28
+#define SYS_ring_enter 29
+#define SYS_sysstats 30
+#define SYS_clone  31
+#define SYS_join   32
+#define SYS_futex_wait 33
+#define SYS_futex_wake 34
+#define SYS_shmget 35
+#define SYS_shmat  36
+#define SYS_shmdt  37
+#define SYS_spawn  38
+#define SYS_getdents 39
+#define SYS_fstatat 40
+#define SYS_pread  41
+#define SYS_pwrite 42
+#define SYS_readv  43
+#define SYS_writev 44
+#define SYS_fsync  45
+#define SYS_poll   46
+#define SYS_getrusage 47
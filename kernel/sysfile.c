@@ -15,6 +15,18 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "ring.h"
+
+// The open file that is descriptor fd, or 0.
+static struct file*
+fdfile(int fd)
+{
+  struct proc *p = myproc();
+
+  if(fd < 0 || fd >= p->nofile)
+    return 0;
+  return p->ofile[fd];
+}
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -25,7 +37,7 @@ argfd(int n, int *pfd, struct file **pf)
   struct file *f;
 
   argint(n, &fd);
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if((f = fdfile(fd)) == 0)
     return -1;
   if(pfd)
     *pfd = fd;
@@ -34,23 +46,6 @@ argfd(int n, int *pfd, struct file **pf)
   return 0;
 }
 
-// Allocate a file descriptor for the given file.
-// Takes over file reference from caller on success.
-static int
-fdalloc(struct file *f)
-{
-  int fd;
-  struct proc *p = myproc();
-
-  for(fd = 0; fd < NOFILE; fd++){
-    if(p->ofile[fd] == 0){
-      p->ofile[fd] = f;
-      return fd;
-    }
-  }
-  return -1;
-}
-
 uint64
 sys_dup(void)
 {
@@ -59,7 +54,7 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(myproc(), f)) < 0)
     return -1;
   filedup(f);
   return fd;
@@ -94,6 +89,89 @@ sys_write(void)
   return filewrite(f, p, n);
 }
 
+// read() and write() at an explicit offset, which they leave
+// as it is.
+uint64
+sys_pread(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, 0, &f) < 0 || n < 0 || off < 0)
+    return -1;
+  return filepread(f, p, n, off);
+}
+
+uint64
+sys_pwrite(void)
+{
+  struct file *f;
+  int n, off;
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  argint(3, &off);
+  if(argfd(0, 0, &f) < 0 || n < 0 || off < 0)
+    return -1;
+  return filepwrite(f, p, n, off);
+}
+
+// Fetch readv()'s or writev()'s buffers into iov.
+static int
+argiov(struct iovec *iov, int *n)
+{
+  uint64 p;
+
+  argaddr(1, &p);
+  argint(2, n);
+  if(*n < 0 || *n > IOV_MAX)
+    return -1;
+  return copyin(myproc()->pagetable, (char*)iov, p, *n * sizeof(iov[0]));
+}
+
+uint64
+sys_readv(void)
+{
+  struct iovec iov[IOV_MAX];
+  struct file *f;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argiov(iov, &n) < 0)
+    return -1;
+  return filereadv(f, iov, n);
+}
+
+uint64
+sys_writev(void)
+{
+  struct iovec iov[IOV_MAX];
+  struct file *f;
+  int n;
+
+  if(argfd(0, 0, &f) < 0 || argiov(iov, &n) < 0)
+    return -1;
+  return filewritev(f, iov, n);
+}
+
+// Wait until every write so far, O_ASYNC or not, is on the
+// disk. The log commits all files together, so this serves
+// for fdatasync() too.
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  log_sync();
+  return 0;
+}
+
 uint64
 sys_close(void)
 {
@@ -102,11 +180,31 @@ sys_close(void)
 
   if(argfd(0, &fd, &f) < 0)
     return -1;
-  myproc()->ofile[fd] = 0;
+  fdfree(myproc(), fd);
   fileclose(f);
   return 0;
 }
 
+// Look up path and copy its struct stat to user address st.
+static int
+statpath(char *path, uint64 st)
+{
+  struct inode *ip;
+  struct stat sb;
+
+  begin_op();
+  if((ip = namei(path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilockshared(ip);
+  stati(ip, &sb);
+  iunlockshared(ip);
+  iput(ip);
+  end_op();
+  return copyout(myproc()->pagetable, st, (char*)&sb, sizeof(sb));
+}
+
 uint64
 sys_fstat(void)
 {
@@ -119,6 +217,52 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+// Read directory fd's entries in use, many at a time.
+uint64
+sys_getdents(void)
+{
+  struct file *f;
+  uint64 p;
+  int n;
+
+  argaddr(1, &p);
+  argint(2, &n);
+  if(argfd(0, 0, &f) < 0 || n < 0)
+    return -1;
+  return filegetdents(f, p, n);
+}
+
+// stat() the path relative to directory fd, so walking a tree
+// needn't look up each path from the root.
+uint64
+sys_fstatat(void)
+{
+  char path[MAXPATH];
+  struct file *f;
+  struct inode *ip;
+  struct stat st;
+  uint64 addr;
+
+  argaddr(2, &addr);
+  if(argfd(0, 0, &f) < 0 || argstr(1, path, MAXPATH) < 0)
+    return -1;
+  if(f->type != FD_INODE)
+    return -1;
+  begin_op();
+  if((ip = nameiat(f->ip, path)) == 0){
+    end_op();
+    return -1;
+  }
+  ilockshared(ip);
+  stati(ip, &st);
+  iunlockshared(ip);
+  iput(ip);
+  end_op();
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -211,6 +355,10 @@ sys_unlink(void)
   if((ip = dirlookup(dp, name, &off)) == 0)
     goto bad;
   ilock(ip);
+  if(ismount(ip)){
+    iunlockput(ip);
+    goto bad;
+  }
 
   if(ip->nlink < 1)
     panic("unlink: nlink < 1");
@@ -220,8 +368,10 @@ sys_unlink(void)
   }
 
   memset(&de, 0, sizeof(de));
+  dcinval(dp, name);
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dirunlink(dp, off);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -301,18 +451,13 @@ create(char *path, short type, short major, short minor)
   return 0;
 }
 
-uint64
-sys_open(void)
+// Open path with mode omode, for open() and ring_enter().
+static int
+openpath(char *path, int omode)
 {
-  char path[MAXPATH];
-  int fd, omode;
+  int fd;
   struct file *f;
   struct inode *ip;
-  int n;
-
-  argint(1, &omode);
-  if((n = argstr(0, path, MAXPATH)) < 0)
-    return -1;
 
   begin_op();
 
@@ -341,7 +486,7 @@ sys_open(void)
     return -1;
   }
 
-  if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
+  if((f = filealloc()) == 0 || (fd = fdalloc(myproc(), f)) < 0){
     if(f)
       fileclose(f);
     iunlockput(ip);
@@ -359,6 +504,8 @@ sys_open(void)
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
   f->writable = (omode & O_WRONLY) || (omode & O_RDWR);
+  f->async = (omode & O_ASYNC) != 0;
+  f->nonblock = (omode & O_NONBLOCK) != 0;
 
   if((omode & O_TRUNC) && ip->type == T_FILE){
     itrunc(ip);
@@ -370,6 +517,18 @@ sys_open(void)
   return fd;
 }
 
+uint64
+sys_open(void)
+{
+  char path[MAXPATH];
+  int omode;
+
+  argint(1, &omode);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  return openpath(path, omode);
+}
+
 uint64
 sys_mkdir(void)
 {
@@ -431,47 +590,74 @@ sys_chdir(void)
   return 0;
 }
 
+// Copy the strings of the user's argv array at uargv into the
+// page args, packed one after another. Returns argc, or -1 if
+// there are more than MAXARG, or if they and the argv[] that
+// exec() puts below them on the stack don't fit in ARGMAX bytes.
+static int
+fetchargs(uint64 uargv, char *args)
+{
+  int argc, n, len;
+  uint64 uarg;
+
+  len = 0;
+  for(argc = 0;; argc++){
+    if(fetchaddr(uargv+sizeof(uint64)*argc, &uarg) < 0)
+      return -1;
+    if(uarg == 0)
+      return argc;
+    if(argc >= MAXARG)
+      return -1;
+    if((n = fetchstr(uarg, args + len, ARGMAX - len)) < 0)
+      return -1;
+    len += n + 1;
+    if(len + (argc+2)*sizeof(uint64) > ARGMAX)
+      return -1;
+  }
+}
+
 uint64
 sys_exec(void)
 {
-  char path[MAXPATH], *argv[MAXARG];
-  int i;
-  uint64 uargv, uarg;
+  char path[MAXPATH], *args;
+  uint64 uargv;
+  int argc, ret;
 
   argaddr(1, &uargv);
   if(argstr(0, path, MAXPATH) < 0) {
     return -1;
   }
-  memset(argv, 0, sizeof(argv));
-  for(i=0;; i++){
-    if(i >= NELEM(argv)){
-      goto bad;
-    }
-    if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
-    }
-    if(uarg == 0){
-      argv[i] = 0;
-      break;
-    }
-    argv[i] = kalloc();
-    if(argv[i] == 0)
-      goto bad;
-    if(fetchstr(uarg, argv[i], PGSIZE) < 0)
-      goto bad;
-  }
-
-  int ret = exec(path, argv);
+  if((args = kalloc()) == 0)
+    return -1;
+  ret = -1;
+  if((argc = fetchargs(uargv, args)) >= 0)
+    ret = exec(path, args, argc);
+  kfree(args);
+  return ret;
+}
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *args;
+  int fds[NOFILE], nfds, argc, ret;
+  uint64 uargv, ufds;
 
+  argaddr(1, &uargv);
+  argaddr(2, &ufds);
+  argint(3, &nfds);
+  if(argstr(0, path, MAXPATH) < 0)
+    return -1;
+  if(nfds > NOFILE ||
+     (nfds > 0 && copyin(myproc()->pagetable, (char*)fds, ufds, nfds*sizeof(int)) < 0))
+    return -1;
+  if((args = kalloc()) == 0)
+    return -1;
+  ret = -1;
+  if((argc = fetchargs(uargv, args)) >= 0)
+    ret = spawn(path, args, argc, fds, nfds < 0 ? -1 : nfds);
+  kfree(args);
   return ret;
-
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
 }
 
 uint64
@@ -486,20 +672,187 @@ sys_pipe(void)
   if(pipealloc(&rf, &wf) < 0)
     return -1;
   fd0 = -1;
-  if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
+  if((fd0 = fdalloc(p, rf)) < 0 || (fd1 = fdalloc(p, wf)) < 0){
     if(fd0 >= 0)
-      p->ofile[fd0] = 0;
+      fdfree(p, fd0);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   if(copyout(p->pagetable, fdarray, (char*)&fd0, sizeof(fd0)) < 0 ||
      copyout(p->pagetable, fdarray+sizeof(fd0), (char *)&fd1, sizeof(fd1)) < 0){
-    p->ofile[fd0] = 0;
-    p->ofile[fd1] = 0;
+    fdfree(p, fd0);
+    fdfree(p, fd1);
     fileclose(rf);
     fileclose(wf);
     return -1;
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 len;
+  int prot, flags, off;
+  struct file *f;
+
+  // the address argument is only a hint, and ignored.
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
+
+uint64
+sys_fcntl(void)
+{
+  int cmd, arg;
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  argint(1, &cmd);
+  argint(2, &arg);
+  if(cmd == F_GETFL)
+    return f->nonblock ? O_NONBLOCK : 0;
+  if(cmd == F_SETFL){
+    f->nonblock = (arg & O_NONBLOCK) != 0;
+    return 0;
+  }
+  if(f->type != FD_PIPE)
+    return -1;
+  if(cmd == F_GETPIPE_SZ)
+    return pipesize(f->pipe, 0);
+  if(cmd == F_SETPIPE_SZ && arg > 0)
+    return pipesize(f->pipe, arg);
+  return -1;
+}
+
+// Wait for one of several descriptors to be ready.
+uint64
+sys_poll(void)
+{
+  uint64 fds;
+  int n, timeout;
+
+  argaddr(0, &fds);
+  argint(1, &n);
+  argint(2, &timeout);
+  return poll(fds, n, timeout);
+}
+
+// Move bytes from one file to another without copying them
+// through user space; one of the files must be a pipe.
+uint64
+sys_splice(void)
+{
+  int n;
+  struct file *fin, *fout;
+
+  if(argfd(0, 0, &fin) < 0 || argfd(1, 0, &fout) < 0)
+    return -1;
+  argint(2, &n);
+  return filesplice(fin, fout, n, 0);
+}
+
+// Copy bytes from one pipe to another, leaving them in the first.
+uint64
+sys_tee(void)
+{
+  int n;
+  struct file *fin, *fout;
+
+  if(argfd(0, 0, &fin) < 0 || argfd(1, 0, &fout) < 0)
+    return -1;
+  argint(2, &n);
+  return filesplice(fin, fout, n, 1);
+}
+
+// Run one ring_enter() entry, returning what the system call
+// would have.
+static int
+ringop(struct ringsqe *e)
+{
+  char path[MAXPATH];
+  struct file *f;
+
+  switch(e->op){
+  case RING_NOP:
+    return 0;
+  case RING_OPEN:
+  case RING_STAT:
+    if(fetchstr(e->addr, path, MAXPATH) < 0)
+      return -1;
+    if(e->op == RING_OPEN)
+      return openpath(path, e->n);
+    return statpath(path, e->buf);
+  }
+
+  if((f = fdfile(e->fd)) == 0)
+    return -1;
+  switch(e->op){
+  case RING_READ:
+    return fileread(f, e->addr, e->n);
+  case RING_WRITE:
+    return filewrite(f, e->addr, e->n);
+  case RING_CLOSE:
+    fdfree(myproc(), e->fd);
+    fileclose(f);
+    return 0;
+  case RING_FSTAT:
+    return filestat(f, e->addr);
+  }
+  return -1;
+}
+
+// Run up to n queued entries of the struct ring at user address
+// addr, in order, for the price of one trap. Stops early if the
+// completion queue fills. Returns the number of entries run.
+uint64
+sys_ring_enter(void)
+{
+  uint64 addr;
+  int n, i;
+  uint h[4];  // sqhead, sqtail, cqhead, cqtail
+  struct ring *r;  // user address, never dereferenced
+  struct ringsqe e;
+  struct ringcqe c;
+  pagetable_t pt = myproc()->pagetable;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  r = (struct ring*)addr;
+  if(copyin(pt, (char*)h, addr, sizeof(h)) < 0)
+    return -1;
+  for(i = 0; i < n && h[0] != h[1] && h[3] - h[2] < RINGSIZE; i++){
+    if(killed(myproc()))
+      break;
+    if(copyin(pt, (char*)&e, (uint64)&r->sq[h[0] % RINGSIZE], sizeof(e)) < 0)
+      return -1;
+    c.data = e.data;
+    c.res = ringop(&e);
+    c.pad = 0;
+    if(copyout(pt, (uint64)&r->cq[h[3] % RINGSIZE], (char*)&c, sizeof(c)) < 0)
+      return -1;
+    h[0]++;
+    h[3]++;
+  }
+  if(copyout(pt, (uint64)&r->sqhead, (char*)&h[0], sizeof(uint)) < 0 ||
+     copyout(pt, (uint64)&r->cqtail, (char*)&h[3], sizeof(uint)) < 0)
+    return -1;
+  return i;
+}
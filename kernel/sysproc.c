@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "timer.h"
 
 uint64
 sys_exit(void)
@@ -18,7 +19,7 @@ sys_exit(void)
 uint64
 sys_getpid(void)
 {
-  return myproc()->pid;
+  return myproc()->tgid;
 }
 
 uint64
@@ -53,17 +54,21 @@ sys_sleep(void)
 {
   int n;
   uint ticks0;
+  struct timer t;
 
   argint(0, &n);
   acquire(&tickslock);
   ticks0 = ticks;
+  timeradd(&t, ticks0 + n, &t);
   while(ticks - ticks0 < n){
     if(killed(myproc())){
+      timerdel(&t);
       release(&tickslock);
       return -1;
     }
-    sleep(&ticks, &tickslock);
+    sleep(&t, &tickslock);
   }
+  timerdel(&t);
   release(&tickslock);
   return 0;
 }
@@ -77,6 +82,38 @@ sys_kill(void)
   return kill(pid);
 }
 
+uint64
+sys_setpriority(void)
+{
+  int pid, prio;
+
+  argint(0, &pid);
+  argint(1, &prio);
+  return setpriority(pid, prio);
+}
+
+uint64
+sys_setaffinity(void)
+{
+  int pid, mask;
+
+  argint(0, &pid);
+  argint(1, &mask);
+  return setaffinity(pid, (uint)mask);
+}
+
+uint64
+sys_getrusage(void)
+{
+  int pid, n;
+  uint64 addr;
+
+  argint(0, &pid);
+  argaddr(1, &addr);
+  argint(2, &n);
+  return procrusage(pid, addr, n);
+}
+
 // return how many clock tick interrupts have occurred
 // since start.
 uint64
@@ -89,3 +126,74 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+uint64
+sys_clone(void)
+{
+  uint64 fn, arg, stack;
+
+  argaddr(0, &fn);
+  argaddr(1, &arg);
+  argaddr(2, &stack);
+  return clone(fn, arg, stack);
+}
+
+uint64
+sys_join(void)
+{
+  uint64 stack;
+
+  argaddr(0, &stack);
+  return join(stack);
+}
+
+uint64
+sys_futex_wait(void)
+{
+  uint64 addr;
+  int val;
+
+  argaddr(0, &addr);
+  argint(1, &val);
+  return futex_wait(addr, val);
+}
+
+uint64
+sys_futex_wake(void)
+{
+  uint64 addr;
+  int n;
+
+  argaddr(0, &addr);
+  argint(1, &n);
+  return futex_wake(addr, n);
+}
+
+uint64
+sys_shmget(void)
+{
+  int key;
+  uint64 size;
+
+  argint(0, &key);
+  argaddr(1, &size);
+  return shmget(key, size);
+}
+
+uint64
+sys_shmat(void)
+{
+  int id;
+
+  argint(0, &id);
+  return shmat(id);
+}
+
+uint64
+sys_shmdt(void)
+{
+  uint64 addr;
+
+  argaddr(0, &addr);
+  return shmdt(addr);
+}
@@ -0,0 +1,11 @@
+// system call statistics, as returned by sysstats().
+
+#define NSYSHIST 24    // latency histogram buckets
+
+struct sysstat {
+  uint64 count;            // calls made
+  uint64 time;             // mtime cycles spent in them
+  uint64 max;              // longest call
+  uint64 hist[NSYSHIST];   // calls that took [2^i, 2^(i+1)) cycles;
+                           // hist[0] also has 0, the last all longer
+};
@@ -0,0 +1,7 @@
+// A wakeup(chan) due when ticks reaches when, set up by
+// timeradd(). Timers are kept in a list sorted by when.
+struct timer {
+  uint when;
+  void *chan;
+  struct timer *next;
+};
@@ -0,0 +1,149 @@
+//
+// A file system in memory, mounted on /tmp.
+//
+// Its inodes are ordinary in-memory inodes on device TMPDEV,
+// with nothing behind them on disk: an inode keeps a reference
+// to itself in the inode table for as long as it has links
+// (fs.c), and its data is in kalloc()ed pages, found through a
+// page of pointers, ip->tmap. readi() and writei() pass TMPDEV
+// inodes to tmpread() and tmpwrite(), so its directories are
+// dirents just like on disk, and namex() crosses over at the
+// mount point. Nothing here uses the log or the buffer cache.
+//
+
+#include "types.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define TMPINODES 256
+#define NTMAP (PGSIZE / sizeof(char*))   // data pages per file
+
+static struct {
+  struct spinlock lock;
+  uchar used[TMPINODES / 8];   // inode numbers in use
+  int max;                      // highest inode number allowed
+  int ninode;
+  uint64 npages;                // data and map pages in use
+} tmp;
+
+// Allow up to max tmpfs inodes.
+void
+tmpinit(int max)
+{
+  initlock(&tmp.lock, "tmpfs");
+  tmp.max = max < TMPINODES ? max : TMPINODES;
+}
+
+// Return a free inode number, or 0 if there is none.
+uint
+tmpialloc(void)
+{
+  uint inum;
+
+  acquire(&tmp.lock);
+  for(inum = 1; inum < tmp.max; inum++){
+    if((tmp.used[inum/8] & (1 << (inum%8))) == 0){
+      tmp.used[inum/8] |= 1 << (inum%8);
+      tmp.ninode++;
+      release(&tmp.lock);
+      return inum;
+    }
+  }
+  release(&tmp.lock);
+  return 0;
+}
+
+void
+tmpifree(uint inum)
+{
+  acquire(&tmp.lock);
+  if((tmp.used[inum/8] & (1 << (inum%8))) == 0)
+    panic("tmpifree");
+  tmp.used[inum/8] &= ~(1 << (inum%8));
+  tmp.ninode--;
+  release(&tmp.lock);
+}
+
+// Read n bytes at off, all below ip->size, like readi().
+int
+tmpread(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m;
+  char *pg;
+
+  for(tot = 0; tot < n; tot += m, off += m, dst += m){
+    m = n - tot;
+    if(m > PGSIZE - off % PGSIZE)
+      m = PGSIZE - off % PGSIZE;
+    if(ip->tmap == 0 || (pg = ip->tmap[off / PGSIZE]) == 0)
+      panic("tmpread");
+    if(either_copyout(user_dst, dst, pg + off % PGSIZE, m) == -1)
+      return -1;
+  }
+  return tot;
+}
+
+// Write n bytes at off, which is at most ip->size, adding
+// pages as needed. Returns the number of bytes written, which
+// is short if memory runs out. Caller updates ip->size.
+int
+tmpwrite(struct inode *ip, int user_src, uint64 src, uint off, uint n)
+{
+  uint tot, m;
+  char **pp;
+
+  if(ip->tmap == 0){
+    if((ip->tmap = kalloc()) == 0)
+      return 0;
+    memset(ip->tmap, 0, PGSIZE);
+    __sync_fetch_and_add(&tmp.npages, 1);
+  }
+  for(tot = 0; tot < n; tot += m, off += m, src += m){
+    if(off / PGSIZE >= NTMAP)
+      break;
+    pp = &ip->tmap[off / PGSIZE];
+    if(*pp == 0){
+      if((*pp = kalloc()) == 0)
+        break;
+      __sync_fetch_and_add(&tmp.npages, 1);
+    }
+    m = n - tot;
+    if(m > PGSIZE - off % PGSIZE)
+      m = PGSIZE - off % PGSIZE;
+    if(either_copyin(*pp + off % PGSIZE, user_src, src, m) == -1)
+      break;
+  }
+  return tot;
+}
+
+// Free ip's pages.
+void
+tmptrunc(struct inode *ip)
+{
+  int i, n;
+
+  if(ip->tmap == 0)
+    return;
+  n = 1;
+  for(i = 0; i < NTMAP; i++){
+    if(ip->tmap[i]){
+      kfree(ip->tmap[i]);
+      n++;
+    }
+  }
+  kfree(ip->tmap);
+  ip->tmap = 0;
+  __sync_fetch_and_sub(&tmp.npages, n);
+}
+
+int
+tmpstats(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- tmpfs\ninodes %d pages %l\n",
+                  tmp.ninode, tmp.npages);
+}
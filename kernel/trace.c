@@ -0,0 +1,133 @@
+//
+// kernel trace buffer.
+//
+// Each CPU appends records to its own ring with interrupts
+// off, so recording takes no lock and never waits; a full
+// ring overwrites its oldest records. Reading the trace device
+// (major TRACE) copies out whole records it hasn't returned
+// before, one CPU's ring after another. Writing '1' to it
+// starts tracing and '0' stops it.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "trace.h"
+#include "defs.h"
+
+#define TRACESIZE 512     // records per CPU, a power of two
+#define TRACEBATCH 16     // records per copyout
+
+struct tracering {
+  uint64 head;            // number of records ever appended
+  struct tracerec rec[TRACESIZE];
+};
+
+static struct tracering rings[NCPU];
+
+static struct {
+  struct sleeplock lock;
+  uint64 tail[NCPU];      // next record to read from each ring
+} reader;
+
+static volatile int tracing;
+
+// append a record to this CPU's ring.
+// rec[head % TRACESIZE] is written before head moves past it,
+// so a reader may only trust the TRACESIZE-1 records below head.
+void
+trace(int type, uint64 a, uint64 b)
+{
+  struct tracering *r;
+  struct tracerec *t;
+  struct proc *p;
+  int id;
+
+  if(!tracing)
+    return;
+
+  push_off();
+  id = cpuid();
+  r = &rings[id];
+  p = mycpu()->proc;
+  t = &r->rec[r->head % TRACESIZE];
+  t->time = mtime();
+  t->cpu = id;
+  t->type = type;
+  t->pid = p ? p->pid : 0;
+  t->a = a;
+  t->b = b;
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+  pop_off();
+}
+
+// has record i of r been overwritten, or is it being?
+static int
+traceold(struct tracering *r, uint64 i)
+{
+  return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - i > TRACESIZE - 1;
+}
+
+static int
+tracewrite(int user_src, uint64 src, int n)
+{
+  char c;
+
+  if(n < 1 || either_copyin(&c, user_src, src, 1) == -1)
+    return -1;
+  if(c != '0' && c != '1')
+    return -1;
+  tracing = c == '1';
+  return n;
+}
+
+static int
+traceread(int user_dst, uint64 dst, int n)
+{
+  struct tracerec buf[TRACEBATCH];
+  struct tracering *r;
+  uint64 h, t;
+  int i, m, k;
+
+  acquiresleep(&reader.lock);
+  m = 0;
+  for(i = 0; i < NCPU; i++){
+    r = &rings[i];
+    t = reader.tail[i];
+    h = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if(h - t > TRACESIZE - 1)
+      t = h - (TRACESIZE - 1);  // lost the ones before t
+    while(t < h && n - m >= sizeof(struct tracerec)){
+      for(k = 0; k < TRACEBATCH && t < h && n - m - k*sizeof(buf[0]) >= sizeof(buf[0]); t++){
+        buf[k] = r->rec[t % TRACESIZE];
+        // drop a record the CPU overwrote while we copied it.
+        if(!traceold(r, t))
+          k++;
+      }
+      if(either_copyout(user_dst, dst + m, buf, k * sizeof(buf[0])) == -1){
+        m = -1;
+        goto out;
+      }
+      m += k * sizeof(buf[0]);
+    }
+    reader.tail[i] = t;
+  }
+out:
+  releasesleep(&reader.lock);
+  return m;
+}
+
+void
+traceinit(void)
+{
+  initsleeplock(&reader.lock, "trace");
+
+  devsw[TRACE].read = traceread;
+  devsw[TRACE].write = tracewrite;
+}
@@ -0,0 +1,15 @@
+// kernel trace records, as read from the trace device (major TRACE).
+
+#define TR_SYSCALL 1   // a = system call number, b = its return value
+#define TR_SWITCH  2   // scheduler switched to pid
+#define TR_BGET    3   // a = block number, b = 1 if it was cached
+#define TR_DISK    4   // a = block number, b = 1 for a write
+
+struct tracerec {
+  uint64 time;         // mtime when recorded
+  ushort cpu;
+  ushort type;         // TR_*
+  int pid;             // current process, or 0
+  uint64 a;
+  uint64 b;
+};
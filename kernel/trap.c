@@ -4,22 +4,65 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "timer.h"
 #include "defs.h"
 
+// ticks counts clock ticks since boot, computed from the CLINT's
+// mtime, so it stays right while CPUs have their ticks stopped.
+// Each CPU's timer interrupts it once a tick, on tick boundaries
+// (boot arg hz= sets the rate), or profrate times a tick while
+// profiling (prof.c), and the first CPU to take a tick advances
+// ticks and fires the timers that are due. An idle CPU
+// stops its ticks (tickstop()), except that CPU 0 wakes up for
+// the earliest timer. tickslock protects ticks and timers.
 struct spinlock tickslock;
 uint ticks;
+static uint64 tickcycles;     // mtime cycles per tick
+static uint64 mtime0;         // mtime when ticks was 0
+static struct timer *timers;  // sorted by when
 
 extern char trampoline[], uservec[], userret[];
+extern uint64 timer_scratch[NCPU][7]; // start.c
 
 // in kernelvec.S, calls kerneltrap().
 void kernelvec();
 
 extern int devintr();
 
+// what usersyscall() returns to uservec in a0 and a1.
+struct satpret {
+  uint64 satp;
+  uint64 flush;
+};
+
+static uint64 prepret(struct proc *p);
+
+// the CLINT's mtime, through the time CSR, which start()
+// lets supervisor mode read, to save an MMIO load.
+uint64
+mtime(void)
+{
+  return r_time();
+}
+
+// mtime at the start of the tick after this one.
+static uint64
+nexttick(void)
+{
+  return mtime0 + ((mtime() - mtime0) / tickcycles + 1) * tickcycles;
+}
+
 void
 trapinit(void)
 {
+  int hz;
+
   initlock(&tickslock, "time");
+  hz = bootarg("hz", HZ);
+  if(hz < 1 || hz > 1000)
+    hz = HZ;
+  tickcycles = TIMEBASE / hz;
+  mtime0 = mtime();
 }
 
 // set up to take exceptions and traps while in the kernel.
@@ -27,6 +70,11 @@ void
 trapinithart(void)
 {
   w_stvec((uint64)kernelvec);
+
+  // switch to the configured tick, and line this CPU's
+  // ticks up with the others'.
+  timer_scratch[cpuid()][4] = tickcycles;
+  *(volatile uint64*)CLINT_MTIMECMP(cpuid()) = nexttick();
 }
 
 //
@@ -65,6 +113,10 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p, r_stval(), r_scause() == 15) == 0){
+    // page fault on a lazily allocated, copy-on-write or file page
+    p->nfault++;
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
@@ -73,24 +125,50 @@ usertrap(void)
     setkilled(p);
   }
 
+  if(which_dev >= 2)
+    profsample(p->trapframe->epc, 1);
+
   if(killed(p))
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
+  // give up the CPU if this is a tick.
   if(which_dev == 2)
-    yield();
+    preempt();
 
   usertrapret();
 }
 
-//
-// return to user space
-//
-void
-usertrapret(void)
+// system calls other than those in FULLFRAME (trampoline.S) come
+// here from uservec, which saved only what usertrap() and the C
+// calling convention can't do without. returns to uservec, which
+// switches satp as the result says and returns to user space.
+struct satpret
+usersyscall(void)
 {
   struct proc *p = myproc();
+  struct satpret r;
+
+  w_stvec((uint64)kernelvec);
+  p->trapframe->epc = r_sepc() + 4;
 
+  if(killed(p))
+    exit(-1);
+  intr_on();
+  syscall();
+  if(killed(p))
+    exit(-1);
+
+  r.satp = prepret(p);
+  r.flush = !asids;
+  w_sscratch(TTRAPFRAME(p->tslot));
+  return r;
+}
+
+// set up for the return to user space, and return the satp
+// of p's page table.
+static uint64
+prepret(struct proc *p)
+{
   // we're about to switch the destination of traps from
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
@@ -105,8 +183,12 @@ usertrapret(void)
   p->trapframe->kernel_satp = r_satp();         // kernel page table
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
+  p->trapframe->kernel_syscall = (uint64)usersyscall;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
 
+  p->usyscall->ticks = ticks;
+  p->usyscall->cpu = cpuid();
+
   // set up the registers that trampoline.S's sret will use
   // to get to user space.
   
@@ -119,14 +201,32 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  // flush this CPU's TLB entries for the process's address
+  // space if its page table changed since this CPU last ran it.
+  if(p->tlbstale & (1L << cpuid())){
+    __sync_fetch_and_and(&p->tlbstale, ~(1L << cpuid()));
+    sfence_vma_asid(p->asid);
+  }
+  p->trapframe->kernel_flush = !asids;
+
+  // the user page table to switch to.
+  return MAKE_SATP(p->pagetable, p->asid);
+}
+
+//
+// return to user space
+//
+void
+usertrapret(void)
+{
+  struct proc *p = myproc();
+  uint64 satp = prepret(p);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
   uint64 trampoline_userret = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64))trampoline_userret)(satp);
+  ((void (*)(uint64, uint64, uint64))trampoline_userret)(satp, !asids, TTRAPFRAME(p->tslot));
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -150,28 +250,148 @@ kerneltrap()
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
+  if(which_dev >= 2)
+    profsample(sepc, 0);
+
+  // give up the CPU if this is a tick.
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
-    yield();
+    preempt();
 
-  // the yield() may have caused some traps to occur,
+  // the preempt() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
   w_sepc(sepc);
   w_sstatus(sstatus);
 }
 
+// Interrupt CPU id, waking it if it is waiting in wfi.
+// It arrives as a machine-mode software interrupt, which
+// timervec in kernelvec.S passes on as a supervisor one.
+void
+ipi(int id)
+{
+  *(volatile uint32*)CLINT_MSIP(id) = 1;
+}
+
+// Bring ticks up to date with mtime, and fire the timers that
+// are due.
 void
 clockintr()
 {
+  struct timer *t;
+  uint now;
+
+  now = (mtime() - mtime0) / tickcycles;
+  if(now == ticks)
+    return;   // another CPU took this tick
   acquire(&tickslock);
-  ticks++;
-  wakeup(&ticks);
+  if(now != ticks){
+    ticks = now;
+    while((t = timers) != 0 && (int)(ticks - t->when) >= 0){
+      timers = t->next;
+      wakeup(t->chan);
+    }
+    wakeup(&ticks);
+  }
   release(&tickslock);
 }
 
+// Arrange for wakeup(chan) once ticks reaches when. The timer
+// stays listed until it fires or timerdel() removes it.
+// Caller must hold tickslock.
+void
+timeradd(struct timer *t, uint when, void *chan)
+{
+  struct timer **pp;
+
+  if(!holding(&tickslock))
+    panic("timeradd");
+  t->when = when;
+  t->chan = chan;
+  for(pp = &timers; *pp && (int)((*pp)->when - when) <= 0; pp = &(*pp)->next)
+    ;
+  t->next = *pp;
+  *pp = t;
+  // an idle CPU 0 may be waiting for a later timer.
+  if(pp == &timers && cpuid() != 0)
+    ipi(0);
+}
+
+// Remove t, if it hasn't fired yet.
+// Caller must hold tickslock.
+void
+timerdel(struct timer *t)
+{
+  struct timer **pp;
+
+  if(!holding(&tickslock))
+    panic("timerdel");
+  for(pp = &timers; *pp; pp = &(*pp)->next){
+    if(*pp == t){
+      *pp = t->next;
+      break;
+    }
+  }
+}
+
+// Stop CPU id's ticks, as it is about to go idle in wfi. CPU 0
+// instead sleeps until the earliest timer is due, if there is one.
+// Caller must have interrupts off.
+void
+tickstop(int id)
+{
+  uint64 when = -1;
+
+  if(id == 0){
+    clockintr();
+    acquire(&tickslock);
+    if(timers){
+      if((int)(timers->when - ticks) <= 0)
+        when = nexttick();
+      else
+        when = nexttick() + (uint64)(timers->when - ticks - 1) * tickcycles;
+    }
+    release(&tickslock);
+  }
+  *(volatile uint64*)CLINT_MTIMECMP(id) = when;
+}
+
+// Restart CPU id's ticks after tickstop(), catching ticks up.
+// Caller must have interrupts off.
+void
+tickstart(int id)
+{
+  clockintr();
+  *(volatile uint64*)CLINT_MTIMECMP(id) = nexttick();
+}
+
+// a timer interrupt: bring ticks up to date, and move this CPU's
+// timer to the profiler's rate if that has changed. returns 2 if
+// the CPU has reached a new tick, or 3 if this is one of the
+// profiler's interrupts in between.
+static int
+timerintr(void)
+{
+  struct cpu *c = mycpu();
+  uint64 *scratch = timer_scratch[cpuid()];
+  uint64 iv;
+
+  clockintr();
+  iv = profrate > 0 ? tickcycles / profrate : tickcycles;
+  if(scratch[4] != iv){
+    scratch[4] = iv;
+    *(volatile uint64*)CLINT_MTIMECMP(cpuid()) =
+      mtime0 + ((mtime() - mtime0) / iv + 1) * iv;
+  }
+  if(c->tick == ticks)
+    return 3;
+  c->tick = ticks;
+  return 2;
+}
+
 // check if it's an external interrupt or software interrupt,
 // and handle it.
-// returns 2 if timer interrupt,
+// returns 2 if timer interrupt at a tick,
+// 3 if a profiler's timer interrupt between ticks,
 // 1 if other device,
 // 0 if not recognized.
 int
@@ -188,8 +408,8 @@ devintr()
 
     if(irq == UART0_IRQ){
       uartintr();
-    } else if(irq == VIRTIO0_IRQ){
-      virtio_disk_intr();
+    } else if(irq >= VIRTIO_IRQ(0) && irq < VIRTIO_IRQ(NDISK)){
+      virtio_disk_intr(irq - VIRTIO0_IRQ);
     } else if(irq){
       printf("unexpected interrupt irq=%d\n", irq);
     }
@@ -203,17 +423,20 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
-    // forwarded by timervec in kernelvec.S.
+    // or another hart's ipi(), forwarded by timervec in
+    // kernelvec.S. Only ticks advance the clock and preempt.
+    int which = 1;
 
-    if(cpuid() == 0){
-      clockintr();
-    }
+    tlbintr();
+
+    if(__sync_lock_test_and_set(&timer_scratch[cpuid()][6], 0))
+      which = timerintr();
     
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
-    return 2;
+    return which;
   } else {
     return 0;
   }
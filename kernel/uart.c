@@ -38,16 +38,22 @@
 #define ReadReg(reg) (*(Reg(reg)))
 #define WriteReg(reg, v) (*(Reg(reg)) = (v))
 
-// the transmit output buffer.
+// the transmit output buffer. write()s add to it in bulk, and
+// so do kernel printf()s once uartasync() has been called;
+// uartstart() moves up to a FIFO's worth to the UART each time
+// the UART says its transmit FIFO is empty.
 struct spinlock uart_tx_lock;
-#define UART_TX_BUF_SIZE 32
+#define UART_TX_BUF_SIZE 2048
+#define UART_FIFO 16          // bytes the 16550's transmit FIFO holds
 char uart_tx_buf[UART_TX_BUF_SIZE];
 uint64 uart_tx_w; // write next to uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE]
 uint64 uart_tx_r; // read next from uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]
+static int async; // kernel output goes through the buffer too
 
 extern volatile int panicked; // from printf.c
 
 void uartstart();
+static int uartsend();
 
 void
 uartinit(void)
@@ -77,32 +83,44 @@ uartinit(void)
   initlock(&uart_tx_lock, "uart");
 }
 
-// add a character to the output buffer and tell the
+// add n characters to the output buffer and tell the
 // UART to start sending if it isn't already.
-// blocks if the output buffer is full.
+// blocks while the output buffer is full.
 // because it may block, it can't be called
 // from interrupts; it's only suitable for use
 // by write().
 void
-uartputc(int c)
+uartwrite(const char *s, int n)
 {
+  int i;
+
   acquire(&uart_tx_lock);
 
   if(panicked){
     for(;;)
       ;
   }
-  while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
-    // buffer is full.
-    // wait for uartstart() to open up space in the buffer.
-    sleep(&uart_tx_r, &uart_tx_lock);
+  for(i = 0; i < n; i++){
+    while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
+      // buffer is full.
+      // wait for uartstart() to open up space in the buffer.
+      uartstart();
+      sleep(&uart_tx_r, &uart_tx_lock);
+    }
+    uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = s[i];
+    uart_tx_w += 1;
   }
-  uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = c;
-  uart_tx_w += 1;
   uartstart();
   release(&uart_tx_lock);
 }
 
+void
+uartputc(int c)
+{
+  char ch = c;
+
+  uartwrite(&ch, 1);
+}
 
 // alternate version of uartputc() that doesn't 
 // use interrupts, for use by kernel printf() and
@@ -126,34 +144,91 @@ uartputc_sync(int c)
   pop_off();
 }
 
-// if the UART is idle, and a character is waiting
-// in the transmit buffer, send it.
+// output for kernel printf() and echoes, which mustn't sleep:
+// after uartasync(), append c to the output buffer, spinning
+// only if it is full; before, the same as uartputc_sync().
+void
+uartputc_async(int c)
+{
+  if(!async){
+    uartputc_sync(c);
+    return;
+  }
+
+  acquire(&uart_tx_lock);
+  if(panicked){
+    for(;;)
+      ;
+  }
+  while(uart_tx_w == uart_tx_r + UART_TX_BUF_SIZE){
+    // send from the head of the buffer, to keep the order.
+    // no wakeup(): the caller may hold any lock.
+    uartsend();
+  }
+  uart_tx_buf[uart_tx_w % UART_TX_BUF_SIZE] = c;
+  uart_tx_w += 1;
+  uartsend();
+  release(&uart_tx_lock);
+}
+
+// let kernel printf() use the output buffer, now that
+// UART interrupts can drain it.
+void
+uartasync(void)
+{
+  async = 1;
+}
+
+// for panic(): send whatever the output buffer holds now, and
+// the rest of kernel printf()s straight to the UART. doesn't
+// take uart_tx_lock, since this CPU may hold it.
+void
+uartflush(void)
+{
+  async = 0;
+  while(uart_tx_r != uart_tx_w){
+    while((ReadReg(LSR) & LSR_TX_IDLE) == 0)
+      ;
+    WriteReg(THR, uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]);
+    uart_tx_r += 1;
+  }
+}
+
+// if the UART's transmit FIFO is empty, refill it from the
+// transmit buffer. returns the number of bytes sent.
+// caller must hold uart_tx_lock.
+static int
+uartsend()
+{
+  int n;
+
+  if(uart_tx_w == uart_tx_r){
+    // transmit buffer is empty.
+    return 0;
+  }
+  if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
+    // the UART is still sending what it has,
+    // so we cannot give it more.
+    // it will interrupt when it's ready for more.
+    return 0;
+  }
+  for(n = 0; n < UART_FIFO && uart_tx_r != uart_tx_w; n++){
+    WriteReg(THR, uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE]);
+    uart_tx_r += 1;
+  }
+  return n;
+}
+
+// if the UART is idle, and characters are waiting
+// in the transmit buffer, send them.
 // caller must hold uart_tx_lock.
 // called from both the top- and bottom-half.
 void
 uartstart()
 {
-  while(1){
-    if(uart_tx_w == uart_tx_r){
-      // transmit buffer is empty.
-      return;
-    }
-    
-    if((ReadReg(LSR) & LSR_TX_IDLE) == 0){
-      // the UART transmit holding register is full,
-      // so we cannot give it another byte.
-      // it will interrupt when it's ready for a new byte.
-      return;
-    }
-    
-    int c = uart_tx_buf[uart_tx_r % UART_TX_BUF_SIZE];
-    uart_tx_r += 1;
-    
-    // maybe uartputc() is waiting for space in the buffer.
+  // maybe uartwrite() is waiting for space in the buffer.
+  if(uartsend())
     wakeup(&uart_tx_r);
-    
-    WriteReg(THR, c);
-  }
 }
 
 // read one input character from the UART.
@@ -4,6 +4,15 @@
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
 //
+// each of the first NDISK virtio mmio slots may hold a disk;
+// the one in slot n is block device ROOTDEV+n, reached from
+// bio.c through bdevsw[].
+//
+// a disk offering VIRTIO_BLK_F_MQ (qemu's num-queues=) gets up to
+// one request queue per hart, each with its own rings and lock, so
+// harts submitting at once don't contend. mmio has one interrupt
+// per device, so the interrupt handler drains every queue.
+//
 
 #include "types.h"
 #include "riscv.h"
@@ -17,9 +26,13 @@
 #include "virtio.h"
 
 // the address of virtio mmio register r.
-#define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
+#define R(dk, r) ((volatile uint32 *)(VIRTIO(dk->n) + (r)))
 
-static struct disk {
+// queues per disk, at most; with VIRTIO_BLK_F_MQ each hart
+// submits through its own.
+#define NVQ NCPU
+
+struct vq {
   // a set (not a ring) of DMA descriptors, with which the
   // driver tells the device where to read and write individual
   // disk operations. there are NUM descriptors.
@@ -53,112 +66,164 @@ static struct disk {
   // disk command headers.
   // one-for-one with descriptors, for convenience.
   struct virtio_blk_req ops[NUM];
-  
-  struct spinlock vdisk_lock;
-  
-} disk;
 
-void
-virtio_disk_init(void)
+  // if the device supports indirect descriptors, each request
+  // takes one ring descriptor pointing at its own three-entry
+  // table here, so NUM requests can be in flight instead of NUM/3.
+  struct virtq_desc indirect[NUM][3];
+
+  // avail->idx as of the last notify; requests queued after
+  // it haven't been announced to the device yet.
+  uint16 kicked_idx;
+
+  int id;          // queue number
+  struct spinlock lock;
+};
+
+static struct disk {
+  int n;           // virtio mmio slot
+  int dev;         // block device number
+  int use_indirect;
+  int nq;          // queues in use
+  struct vq vq[NVQ];
+} disk[NDISK];
+
+static int virtio_disk_submit(int, struct buf*, uint, int, int);
+static void virtio_disk_kick(int);
+static void virtio_disk_wait(struct buf*);
+
+// set up queue q of dk.
+static void
+initvq(struct disk *dk, struct vq *vq, int q)
+{
+  initlock(&vq->lock, "virtio_disk");
+  vq->id = q;
+
+  // initialize queue q.
+  *R(dk, VIRTIO_MMIO_QUEUE_SEL) = q;
+
+  // ensure queue q is not in use.
+  if(*R(dk, VIRTIO_MMIO_QUEUE_READY))
+    panic("virtio disk should not be ready");
+
+  // check maximum queue size.
+  uint32 max = *R(dk, VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if(max == 0)
+    panic("virtio disk has no queue");
+  if(max < NUM)
+    panic("virtio disk max queue too short");
+
+  // allocate and zero queue memory.
+  vq->desc = kalloc();
+  vq->avail = kalloc();
+  vq->used = kalloc();
+  if(!vq->desc || !vq->avail || !vq->used)
+    panic("virtio disk kalloc");
+  memset(vq->desc, 0, PGSIZE);
+  memset(vq->avail, 0, PGSIZE);
+  memset(vq->used, 0, PGSIZE);
+
+  // set queue size.
+  *R(dk, VIRTIO_MMIO_QUEUE_NUM) = NUM;
+
+  // write physical addresses.
+  *R(dk, VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)vq->desc;
+  *R(dk, VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)vq->desc >> 32;
+  *R(dk, VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)vq->avail;
+  *R(dk, VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)vq->avail >> 32;
+  *R(dk, VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)vq->used;
+  *R(dk, VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)vq->used >> 32;
+
+  // queue is ready.
+  *R(dk, VIRTIO_MMIO_QUEUE_READY) = 0x1;
+
+  // all NUM descriptors start out unused.
+  for(int i = 0; i < NUM; i++)
+    vq->free[i] = 1;
+}
+
+// Set up the disk in virtio mmio slot n, if there is one, as
+// block device ROOTDEV+n. Returns -1 if the slot holds no disk.
+int
+virtio_disk_init(int n)
 {
+  struct disk *dk = &disk[n];
   uint32 status = 0;
+  int q;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
+  dk->n = n;
 
-  if(*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
-     *R(VIRTIO_MMIO_VERSION) != 2 ||
-     *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
-     *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
-    panic("could not find virtio disk");
+  if(*R(dk, VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
+     *R(dk, VIRTIO_MMIO_VERSION) != 2 ||
+     *R(dk, VIRTIO_MMIO_DEVICE_ID) != 2 ||
+     *R(dk, VIRTIO_MMIO_VENDOR_ID) != 0x554d4551){
+    return -1;
   }
   
   // reset device
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
   // set ACKNOWLEDGE status bit
   status |= VIRTIO_CONFIG_S_ACKNOWLEDGE;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
   // set DRIVER status bit
   status |= VIRTIO_CONFIG_S_DRIVER;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
   // negotiate features
-  uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  uint64 features = *R(dk, VIRTIO_MMIO_DEVICE_FEATURES);
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
-  *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  dk->use_indirect = (features >> VIRTIO_RING_F_INDIRECT_DESC) & 1;
+  *R(dk, VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
   // re-read status to ensure FEATURES_OK is set.
-  status = *R(VIRTIO_MMIO_STATUS);
+  status = *R(dk, VIRTIO_MMIO_STATUS);
   if(!(status & VIRTIO_CONFIG_S_FEATURES_OK))
     panic("virtio disk FEATURES_OK unset");
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-
-  // ensure queue 0 is not in use.
-  if(*R(VIRTIO_MMIO_QUEUE_READY))
-    panic("virtio disk should not be ready");
-
-  // check maximum queue size.
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if(max == 0)
-    panic("virtio disk has no queue 0");
-  if(max < NUM)
-    panic("virtio disk max queue too short");
-
-  // allocate and zero queue memory.
-  disk.desc = kalloc();
-  disk.avail = kalloc();
-  disk.used = kalloc();
-  if(!disk.desc || !disk.avail || !disk.used)
-    panic("virtio disk kalloc");
-  memset(disk.desc, 0, PGSIZE);
-  memset(disk.avail, 0, PGSIZE);
-  memset(disk.used, 0, PGSIZE);
-
-  // set queue size.
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-
-  // write physical addresses.
-  *R(VIRTIO_MMIO_QUEUE_DESC_LOW) = (uint64)disk.desc;
-  *R(VIRTIO_MMIO_QUEUE_DESC_HIGH) = (uint64)disk.desc >> 32;
-  *R(VIRTIO_MMIO_DRIVER_DESC_LOW) = (uint64)disk.avail;
-  *R(VIRTIO_MMIO_DRIVER_DESC_HIGH) = (uint64)disk.avail >> 32;
-  *R(VIRTIO_MMIO_DEVICE_DESC_LOW) = (uint64)disk.used;
-  *R(VIRTIO_MMIO_DEVICE_DESC_HIGH) = (uint64)disk.used >> 32;
-
-  // queue is ready.
-  *R(VIRTIO_MMIO_QUEUE_READY) = 0x1;
-
-  // all NUM descriptors start out unused.
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  // with VIRTIO_BLK_F_MQ the device says how many request
+  // queues it has; use up to one per hart.
+  dk->nq = 1;
+  if(features & (1 << VIRTIO_BLK_F_MQ))
+    dk->nq = *(volatile uint16 *)(VIRTIO(n) + VIRTIO_MMIO_CONFIG +
+                                  VIRTIO_BLK_CFG_NUM_QUEUES);
+  if(dk->nq > NVQ)
+    dk->nq = NVQ;
+  if(dk->nq < 1)
+    dk->nq = 1;
+  for(q = 0; q < dk->nq; q++)
+    initvq(dk, &dk->vq[q], q);
 
   // tell device we're completely ready.
   status |= VIRTIO_CONFIG_S_DRIVER_OK;
-  *R(VIRTIO_MMIO_STATUS) = status;
+  *R(dk, VIRTIO_MMIO_STATUS) = status;
 
-  // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
+  dk->dev = ROOTDEV + n;
+  bdevsw[dk->dev].submit = virtio_disk_submit;
+  bdevsw[dk->dev].kick = virtio_disk_kick;
+  bdevsw[dk->dev].wait = virtio_disk_wait;
+
+  // plic.c and trap.c arrange for interrupts from VIRTIO_IRQ(n),
+  // one line for all of the disk's queues.
+  return 0;
 }
 
 // find a free descriptor, mark it non-free, return its index.
 static int
-alloc_desc()
+alloc_desc(struct vq *vq)
 {
   for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
+    if(vq->free[i]){
+      vq->free[i] = 0;
       return i;
     }
   }
@@ -167,28 +232,28 @@ alloc_desc()
 
 // mark a descriptor as free.
 static void
-free_desc(int i)
+free_desc(struct vq *vq, int i)
 {
   if(i >= NUM)
     panic("free_desc 1");
-  if(disk.free[i])
+  if(vq->free[i])
     panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
+  wakeup(&vq->free[0]);
 }
 
 // free a chain of descriptors.
 static void
-free_chain(int i)
+free_chain(struct vq *vq, int i)
 {
   while(1){
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
+    int flag = vq->desc[i].flags;
+    int nxt = vq->desc[i].next;
+    free_desc(vq, i);
     if(flag & VRING_DESC_F_NEXT)
       i = nxt;
     else
@@ -199,129 +264,228 @@ free_chain(int i)
 // allocate three descriptors (they need not be contiguous).
 // disk transfers always use three descriptors.
 static int
-alloc3_desc(int *idx)
+alloc3_desc(struct vq *vq, int *idx)
 {
   for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
+    idx[i] = alloc_desc(vq);
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
+        free_desc(vq, idx[j]);
       return -1;
     }
   }
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// tell the device about requests queued on vq since the last
+// notify. caller must hold vq->lock.
+static void
+kick(struct disk *dk, struct vq *vq)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
-
-  // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-
-  // format the three descriptors.
-  // qemu's virtio-blk.c reads them.
+  if(vq->kicked_idx == vq->avail->idx)
+    return;
+  __sync_synchronize();
+  *R(dk, VIRTIO_MMIO_QUEUE_NOTIFY) = vq->id; // value is queue number
+  vq->kicked_idx = vq->avail->idx;
+}
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
+// fill in the three descriptors of a request in d[],
+// which are linked through idx[] unless indirect.
+static void
+fill_req(struct vq *vq, struct virtq_desc *d, int *idx, int head, struct buf *b,
+         uint blockno, int write)
+{
+  struct virtio_blk_req *buf0 = &vq->ops[head];
 
   if(write)
     buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
     buf0->type = VIRTIO_BLK_T_IN; // read the disk
   buf0->reserved = 0;
-  buf0->sector = sector;
+  buf0->sector = (uint64)blockno * (BSIZE / 512);
 
-  disk.desc[idx[0]].addr = (uint64) buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  d[idx[0]].addr = (uint64) buf0;
+  d[idx[0]].len = sizeof(struct virtio_blk_req);
+  d[idx[0]].flags = VRING_DESC_F_NEXT;
+  d[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
+  d[idx[1]].addr = (uint64) b->data;
+  d[idx[1]].len = BSIZE;
   if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    d[idx[1]].flags = 0; // device reads b->data
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+    d[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
+  d[idx[1]].flags |= VRING_DESC_F_NEXT;
+  d[idx[1]].next = idx[2];
+
+  vq->info[head].status = 0xff; // device writes 0 on success
+  d[idx[2]].addr = (uint64) &vq->info[head].status;
+  d[idx[2]].len = 1;
+  d[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
+  d[idx[2]].next = 0;
+}
+
+// queue a transfer between b->data and disk block blockno on
+// vq, without notifying the device. if the ring is full, notify
+// the device of what is already queued and sleep for free
+// descriptors if wait is set; otherwise return -1.
+// caller must hold vq->lock.
+static int
+submit(struct disk *dk, struct vq *vq, struct buf *b, uint blockno,
+       int write, int wait)
+{
+  int idx[3], head;
+
+  // the spec's Section 5.2 says that legacy block operations use
+  // three descriptors: one for type/reserved/sector, one for the
+  // data, one for a 1-byte status result.
+  while(1){
+    if(dk->use_indirect){
+      if((idx[0] = alloc_desc(vq)) >= 0)
+        break;
+    } else if(alloc3_desc(vq, idx) == 0) {
+      break;
+    }
+    if(!wait)
+      return -1;
+    kick(dk, vq);
+    sleep(&vq->free[0], &vq->lock);
+  }
+  head = idx[0];
 
-  disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  // format the descriptors.
+  // qemu's virtio-blk.c reads them.
+  if(dk->use_indirect){
+    int t[3] = { 0, 1, 2 };
+    fill_req(vq, vq->indirect[head], t, head, b, blockno, write);
+    vq->desc[head].addr = (uint64) vq->indirect[head];
+    vq->desc[head].len = sizeof(vq->indirect[head]);
+    vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+    vq->desc[head].next = 0;
+  } else {
+    fill_req(vq, vq->desc, idx, head, b, blockno, write);
+  }
 
   // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  b->disk = dk->dev;
+  b->vq = vq->id;
+  vq->info[head].b = b;
 
   // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  vq->avail->ring[vq->avail->idx % NUM] = head;
 
   __sync_synchronize();
 
-  // tell the device another avail ring entry is available.
-  disk.avail->idx += 1; // not % NUM ...
+  // make another avail ring entry available; kick() tells the device.
+  vq->avail->idx += 1; // not % NUM ...
 
-  __sync_synchronize();
+  return 0;
+}
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+// Queue a transfer between b->data and block blockno of disk
+// dev, which need not be b->blockno, without waiting for it or
+// telling the device; virtio_disk_kick() does that, so a caller
+// can queue many requests and notify once. virtio_disk_intr()
+// clears b->disk and calls b->done, if set, when the transfer
+// finishes. If wait is 0, returns -1 instead of sleeping when
+// there are no free descriptors. The request goes on this
+// hart's queue; moving to another hart meanwhile only costs
+// some sharing.
+static int
+virtio_disk_submit(int dev, struct buf *b, uint blockno, int write, int wait)
+{
+  struct disk *dk = &disk[dev - ROOTDEV];
+  struct vq *vq = &dk->vq[cpuid() % dk->nq];
+  int r;
+
+  acquire(&vq->lock);
+  r = submit(dk, vq, b, blockno, write, wait);
+  release(&vq->lock);
+  return r;
+}
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
-  }
+// Notify disk dev of all queued requests.
+static void
+virtio_disk_kick(int dev)
+{
+  struct disk *dk = &disk[dev - ROOTDEV];
+  struct vq *vq;
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  for(vq = dk->vq; vq < &dk->vq[dk->nq]; vq++){
+    acquire(&vq->lock);
+    kick(dk, vq);
+    release(&vq->lock);
+  }
+}
 
-  release(&disk.vdisk_lock);
+// Wait for a transfer queued by virtio_disk_submit().
+static void
+virtio_disk_wait(struct buf *b)
+{
+  int dev = b->disk;
+  struct disk *dk;
+  struct vq *vq;
+
+  if(dev == 0)
+    return;
+  dk = &disk[dev - ROOTDEV];
+  vq = &dk->vq[b->vq];
+  acquire(&vq->lock);
+  kick(dk, vq);
+  while(b->disk) {
+    sleep(b, &vq->lock);
+  }
+  release(&vq->lock);
 }
 
+// Interrupt from the disk in mmio slot n: look at the used
+// rings of all its queues, each under its own lock.
 void
-virtio_disk_intr()
+virtio_disk_intr(int n)
 {
-  acquire(&disk.vdisk_lock);
+  struct disk *dk;
+  struct vq *vq;
+
+  if(n >= NDISK || disk[n].dev == 0)
+    return;
+  dk = &disk[n];
 
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
+  // the "used" rings, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+  *R(dk, VIRTIO_MMIO_INTERRUPT_ACK) = *R(dk, VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  for(vq = dk->vq; vq < &dk->vq[dk->nq]; vq++){
+    acquire(&vq->lock);
 
-  while(disk.used_idx != disk.used->idx){
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
+    // the device increments vq->used->idx when it
+    // adds an entry to the used ring.
 
-    if(disk.info[id].status != 0)
-      panic("virtio_disk_intr status");
+    while(vq->used_idx != vq->used->idx){
+      __sync_synchronize();
+      int id = vq->used->ring[vq->used_idx % NUM].id;
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+      if(vq->info[id].status != 0)
+        panic("virtio_disk_intr status");
 
-    disk.used_idx += 1;
-  }
+      struct buf *b = vq->info[id].b;
+      vq->info[id].b = 0;
+      free_chain(vq, id);
+      b->disk = 0;   // disk is done with buf
+      // b->done may drop the last reference to b, so
+      // b->disk must be clear before it runs.
+      if(b->done)
+        b->done(b);
+      wakeup(b);
 
-  release(&disk.vdisk_lock);
+      vq->used_idx += 1;
+    }
+
+    release(&vq->lock);
+  }
 }
@@ -3,6 +3,8 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
 
@@ -11,10 +13,14 @@
  */
 pagetable_t kernel_pagetable;
 
+int asids;  // does satp hold enough ASID bits? see kvminithart().
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static pte_t *walkto(pagetable_t, uint64, int, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -27,12 +33,15 @@ kvmmake(void)
   // uart registers
   kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
 
-  // virtio mmio disk interface
-  kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  // virtio mmio disk interfaces
+  kvmmap(kpgtbl, VIRTIO0, VIRTIO0, NDISK*PGSIZE, PTE_R | PTE_W);
 
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
+  // CLINT, for ipi() and to stop and start the timer.
+  kvmmap(kpgtbl, CLINT, CLINT, CLINT_SIZE, PTE_R | PTE_W);
+
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
@@ -64,12 +73,53 @@ kvminithart()
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
-  w_satp(MAKE_SATP(kernel_pagetable));
+  // see how many ASID bits satp keeps; processes use 1..NPROC,
+  // the kernel 0.
+  w_satp(MAKE_SATP(kernel_pagetable, 0) | SATP_ASID_MASK);
+  asids = ((r_satp() & SATP_ASID_MASK) >> SATP_ASID_SHIFT) >= NPROC;
+  w_satp(MAKE_SATP(kernel_pagetable, 0));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Flush the TLB after a change to the PTE for va in user page
+// table pagetable, or to all its PTEs if va is MAXVA. If the
+// page table is the current process's, flush this CPU's entry
+// now and make other CPUs flush the process's ASID before they
+// next run it (usertrapret()). Otherwise the page table is a
+// new one, which is flushed everywhere before first use, or is
+// being freed. Without ASIDs, every trap flushes the TLB anyway.
+// Threads sharing the page table have ASIDs of their own, and
+// the ones running now must flush at once, unless the change
+// only added a mapping (revoke is 0): a stale entry for that
+// just earns a fault that vmfault() retries.
+static void
+tlbflush1(pagetable_t pagetable, uint64 va, int revoke)
+{
+  struct proc *p = myproc();
+
+  if(p == 0 || p->pagetable != pagetable)
+    return;
+  push_off();
+  if(revoke)
+    tlbshootdown(p);
+  if(asids){
+    __sync_fetch_and_or(&p->tlbstale, ~(1L << cpuid()));
+    if(va >= MAXVA)
+      sfence_vma_asid(p->asid);
+    else
+      sfence_vma_page(va, p->asid);
+  }
+  pop_off();
+}
+
+void
+tlbflush(pagetable_t pagetable, uint64 va)
+{
+  tlbflush1(pagetable, va, 1);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -82,24 +132,37 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A level-1 PTE can be a leaf itself, mapping a 2 MiB
+// megapage; walk() then returns it. Only the kernel's direct
+// map uses megapages, so walks of user page tables always
+// end at level 0.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walkto(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but stop at the PTE of the given level.
+static pte_t *
+walkto(pagetable_t pagetable, uint64 va, int alloc, int leaf)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
+  for(int level = 2; level > leaf; level--) {
     pte_t *pte = &pagetable[PX(level, va)];
     if(*pte & PTE_V) {
+      if(*pte & (PTE_R|PTE_W|PTE_X))
+        return pte;  // megapage
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
+      if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
         return 0;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(leaf, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -139,10 +202,11 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
+// Kernel mappings use a megapage for each aligned 2 MiB.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
 
   if(size == 0)
@@ -151,15 +215,21 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    sz = PGSIZE;
+    if((perm & PTE_U) == 0 && a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 &&
+       last - a >= MEGAPGSIZE - PGSIZE)
+      sz = MEGAPGSIZE;
+    if((pte = walkto(pagetable, a, 1, sz == MEGAPGSIZE)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(perm & PTE_U)
+      tlbflush1(pagetable, a, 0);
+    if(a + sz > last)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
@@ -177,17 +247,18 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    // pages that were never touched have no PTE.
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
-    if(do_free){
-      uint64 pa = PTE2PA(*pte);
-      kfree((void*)pa);
-    }
+    uint64 pa = PTE2PA(*pte);
     *pte = 0;
+    tlbflush(pagetable, a);
+    if(do_free)
+      kfree((void*)pa);
   }
 }
 
@@ -197,10 +268,9 @@ pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -233,12 +303,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz, int xperm)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_R|PTE_U|xperm) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -298,8 +367,9 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 
 // Given a parent process's page table, copy
 // its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Copies the page table; the physical pages are
+// shared, and writable ones become copy-on-write
+// in both page tables.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
@@ -308,30 +378,142 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;  // not touched yet
+    // share the page; whoever writes it first gets a copy.
+    if(*pte & PTE_W)
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
   }
+  tlbflush(old, MAXVA);
   return 0;
 
  err:
+  tlbflush(old, MAXVA);
   uvmunmap(new, 0, i / PGSIZE, 1);
   return -1;
 }
 
+// Give pagetable its own writable copy of the copy-on-write
+// page holding va, or just make the page writable if nothing
+// else shares it. Returns 0 on success, -1 if va isn't in a
+// copy-on-write page or there is no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefs((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    tlbflush(pagetable, va);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (void*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  tlbflush(pagetable, va);
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a page fault at va in a page table whose user
+// memory ends at sz: a store to a copy-on-write page gets its
+// own copy, and an address below sz without a page yet gets a
+// zeroed one. Returns 0 if the access can be retried, -1 if
+// it is a real fault or memory ran out.
+int
+uvmfault(pagetable_t pagetable, uint64 va, uint64 sz, int write)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(pagetable, va);
+    return -1;
+  }
+  if(va >= sz)
+    return -1;
+  if((mem = kzalloc()) == 0)
+    return -1;
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_R|PTE_W|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// The level-0 page-table page that a copy's last lookup ended
+// in. Consecutive user pages mostly share one, so copyin() and
+// friends walk the page table once per 2 MiB rather than once
+// per page. Page-table pages of a user page table are only
+// freed with the whole table, so the pointer stays good.
+struct uwalk {
+  uint64 tag;    // va >> PXSHIFT(1) of the cached table
+  pte_t *l0;     // 0 if nothing is cached
+};
+
+static pte_t *
+uwalk(pagetable_t pagetable, uint64 va, struct uwalk *w)
+{
+  pte_t *pte;
+
+  if(w->l0 && (va >> PXSHIFT(1)) == w->tag)
+    return &w->l0[PX(0, va)];
+  if((pte = walk(pagetable, va, 0)) != 0){
+    w->l0 = (pte_t*)PGROUNDDOWN((uint64)pte);
+    w->tag = va >> PXSHIFT(1);
+  }
+  return pte;
+}
+
+// Return the physical address of user page va0 for copying
+// into the kernel, or out of it if write is set, faulting the
+// page in as usertrap() would for the current process.
+// Returns 0 if the page is not accessible.
+static uint64
+uvmpage(pagetable_t pagetable, uint64 va0, int write, struct uwalk *w)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+
+  if(va0 >= MAXVA)
+    return 0;
+  pte = uwalk(pagetable, va0, w);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_W) == 0)){
+    if(p && p->pagetable == pagetable){
+      if(vmfault(p, va0, write) != 0)
+        return 0;
+    } else if(uvmfault(pagetable, va0, 0, write) != 0)
+      return 0;
+    pte = uwalk(pagetable, va0, w);
+  }
+  if((*pte & PTE_U) == 0)
+    return 0;
+  return PTE2PA(*pte);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -343,6 +525,7 @@ uvmclear(pagetable_t pagetable, uint64 va)
   if(pte == 0)
     panic("uvmclear");
   *pte &= ~PTE_U;
+  tlbflush(pagetable, va);
 }
 
 // Copy from kernel to user.
@@ -352,10 +535,11 @@ int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
   uint64 n, va0, pa0;
+  struct uwalk w = { 0, 0 };
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 1, &w);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -377,10 +561,11 @@ int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
   uint64 n, va0, pa0;
+  struct uwalk w = { 0, 0 };
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0, &w);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -404,10 +589,11 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
+  struct uwalk w = { 0, 0 };
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmpage(pagetable, va0, 0, &w);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
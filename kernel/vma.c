@@ -0,0 +1,562 @@
+//
+// Virtual memory areas.
+//
+// A process's VMAs describe ranges of its address space whose
+// pages come from a file: the page-fault handler reads each
+// page in on its first touch. Pages past the file data in an
+// area (the bss) are zero-filled.
+//
+// File pages are kept in a small cache, so that processes that
+// run the same program share its text. A read-only area maps
+// the cached page directly; a writable one maps it
+// copy-on-write. The cache holds a reference to each of its
+// pages. It forgets the pages of a file when the file is
+// written or its inode leaves the inode table, and gives up
+// unmapped pages when kalloc() runs out of memory.
+//
+// mmap() adds areas too, placed top-down below UTOP.
+// A shared writable area gets private pages that are written
+// back to the file, through the log, when they are unmapped.
+// So does shmat(), for areas that map a shared memory segment's
+// pages instead of a file's.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "proc.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "defs.h"
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define NTPAGE 512     // cached file pages
+#define NTBUCKET 61
+
+struct tpage {
+  uint dev;
+  uint inum;
+  uint off;            // file offset of the page
+  uint n;              // bytes of file data in it; the rest is zero
+  void *pa;            // 0 if the entry is free
+  struct tpage *hnext; // hash chain
+};
+
+static struct {
+  struct spinlock lock;
+  struct tpage page[NTPAGE];
+  struct tpage *bucket[NTBUCKET];
+  int hand;            // next entry to look at for replacement
+  int n;               // entries in use
+  uint64 hits, misses, reclaimed;
+} text;
+
+void
+vmainit(void)
+{
+  initlock(&text.lock, "text");
+}
+
+static struct tpage**
+tbucket(uint dev, uint inum, uint off)
+{
+  return &text.bucket[((dev * 31 + inum) * 31 + off / PGSIZE) % NTBUCKET];
+}
+
+static struct tpage*
+tfind(uint dev, uint inum, uint off, uint n)
+{
+  struct tpage *t;
+
+  for(t = *tbucket(dev, inum, off); t; t = t->hnext)
+    if(t->dev == dev && t->inum == inum && t->off == off && t->n == n)
+      return t;
+  return 0;
+}
+
+// Drop entry t and the cache's reference to its page.
+// Caller must hold text.lock.
+static void
+tdrop(struct tpage *t)
+{
+  struct tpage **pp;
+
+  for(pp = tbucket(t->dev, t->inum, t->off); *pp != t; pp = &(*pp)->hnext)
+    ;
+  *pp = t->hnext;
+  kfree(t->pa);
+  t->pa = 0;
+  text.n--;
+}
+
+// Find a free entry, dropping one whose page nobody maps if
+// need be. Returns 0 if all pages are in use.
+// Caller must hold text.lock.
+static struct tpage*
+tslot(void)
+{
+  struct tpage *t;
+  int i;
+
+  for(i = 0; i < NTPAGE; i++){
+    t = &text.page[text.hand];
+    text.hand = (text.hand + 1) % NTPAGE;
+    if(t->pa && krefs(t->pa) == 1)
+      tdrop(t);
+    if(t->pa == 0)
+      return t;
+  }
+  return 0;
+}
+
+// Return a page holding the n (<= PGSIZE) bytes of ip at off,
+// followed by zeros, with a reference for the caller.
+// Returns 0 if out of memory or the file can't be read.
+static void*
+textget(struct inode *ip, uint off, uint n)
+{
+  struct tpage *t;
+  char *mem;
+
+  acquire(&text.lock);
+  if((t = tfind(ip->dev, ip->inum, off, n)) != 0){
+    kdup(t->pa);
+    text.hits++;
+    release(&text.lock);
+    return t->pa;
+  }
+  text.misses++;
+  release(&text.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  ilockshared(ip);
+  if(readi(ip, 0, (uint64)mem, off, n) != n){
+    iunlockshared(ip);
+    kfree(mem);
+    return 0;
+  }
+  memset(mem + n, 0, PGSIZE - n);
+
+  // Insert the page while holding ip->lock, so that a write
+  // to the file can't come between reading and caching it.
+  // If someone else cached it meanwhile, just use ours.
+  // Readers sharing ip->lock may all set ip->text; only
+  // writers, who hold it alone, clear it.
+  acquire(&text.lock);
+  if(tfind(ip->dev, ip->inum, off, n) == 0 && (t = tslot()) != 0){
+    t->dev = ip->dev;
+    t->inum = ip->inum;
+    t->off = off;
+    t->n = n;
+    t->pa = mem;
+    kdup(mem);
+    t->hnext = *tbucket(ip->dev, ip->inum, off);
+    *tbucket(ip->dev, ip->inum, off) = t;
+    text.n++;
+    ip->text = 1;
+  }
+  release(&text.lock);
+  iunlockshared(ip);
+  return mem;
+}
+
+// Forget the cached pages of ip, which is about to change or
+// leave the inode table. Caller must hold ip->lock, or be the
+// only one with a pointer to ip.
+void
+textinval(struct inode *ip)
+{
+  struct tpage *t;
+
+  acquire(&text.lock);
+  for(t = text.page; t < text.page + NTPAGE; t++)
+    if(t->pa && t->dev == ip->dev && t->inum == ip->inum)
+      tdrop(t);
+  release(&text.lock);
+  ip->text = 0;
+}
+
+// Give back cached pages that no process maps.
+// Called by kalloc() when it runs out of memory.
+// Returns the number of pages freed.
+int
+textreclaim(void)
+{
+  struct tpage *t;
+  int n;
+
+  n = 0;
+  acquire(&text.lock);
+  for(t = text.page; t < text.page + NTPAGE; t++){
+    if(t->pa && krefs(t->pa) == 1){
+      tdrop(t);
+      n++;
+    }
+  }
+  text.reclaimed += n;
+  release(&text.lock);
+  return n;
+}
+
+int
+textstats(char *buf, int sz)
+{
+  int m;
+
+  acquire(&text.lock);
+  m = snprintf(buf, sz, "--- text\npages %d hits %l misses %l reclaimed %l\n",
+               text.n, text.hits, text.misses, text.reclaimed);
+  release(&text.lock);
+  return m;
+}
+
+// Find the area of p that holds va.
+struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->end && va >= v->start && va < v->end)
+      return v;
+  return 0;
+}
+
+// Add to the NVMA areas in vma an area of n bytes at va,
+// page-aligned, backed by filesz bytes of ip starting at off
+// and then zeros. flags is 0 for exec()'s areas, else mmap()'s
+// MAP_SHARED or MAP_PRIVATE. Takes a reference to ip, if it
+// isn't 0, as for a shared memory segment.
+// Returns 0, or -1 if there's no room for another area.
+int
+vmaadd(struct vma *vma, uint64 va, uint64 n, int perm, int flags,
+       struct inode *ip, uint off, uint filesz)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++){
+    if(v->end == 0){
+      v->start = va;
+      v->end = PGROUNDUP(va + n);
+      v->perm = perm;
+      v->flags = flags;
+      v->ip = ip ? idup(ip) : 0;
+      v->shm = 0;
+      v->off = off;
+      v->filesz = filesz;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Copy the areas in from to to, as fork() does. uvmcopy() only
+// shares pages below the process size, so the child reads the pages of
+// mmap() areas in again: stores a parent has made to a private
+// area, or not yet written back to a shared one, aren't seen.
+void
+vmacopy(struct vma *to, struct vma *from)
+{
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    to[i] = from[i];
+    if(to[i].ip)
+      idup(to[i].ip);
+    if(to[i].shm)
+      shmdup(to[i].shm);
+  }
+}
+
+// Drop all areas in vma. Pages already mapped stay mapped.
+// Must be called inside a transaction, since it calls iput().
+void
+vmafree(struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < vma + NVMA; v++){
+    if(v->ip)
+      iput(v->ip);
+    if(v->shm)
+      shmput(v->shm);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// Handle a page fault at va in p: map the page of the area
+// holding va, or hand the fault to uvmfault() if va isn't in
+// an area. Returns 0 if the access can be retried, -1 if it
+// is a real fault or memory ran out.
+static int
+vmfault1(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  pte_t *pte;
+  uint64 a, n;
+  void *mem;
+  int perm;
+
+  if(va >= MAXVA)
+    return -1;
+  if((v = vmafind(p, va)) == 0)
+    return uvmfault(p->pagetable, va, p->sz, write);
+
+  a = PGROUNDDOWN(va);
+  pte = walk(p->pagetable, a, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(p->pagetable, a);
+    return -1;
+  }
+  if(write && (v->perm & PTE_W) == 0)
+    return -1;
+
+  perm = v->perm | PTE_U;
+  if(v->shm){
+    if((mem = shmpage(v->shm, (v->off + (a - v->start)) / PGSIZE)) == 0)
+      return -1;
+    if(mappages(p->pagetable, a, PGSIZE, (uint64)mem, perm) != 0){
+      kfree(mem);
+      return -1;
+    }
+    return 0;
+  }
+  n = a - v->start < v->filesz ? min(v->filesz - (a - v->start), PGSIZE) : 0;
+  if(n == 0){
+    if((mem = kzalloc()) == 0)
+      return -1;
+  } else {
+    if((mem = textget(v->ip, v->off + (a - v->start), n)) == 0)
+      return -1;
+    if(perm & PTE_W)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  }
+  if(mappages(p->pagetable, a, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  // a shared writable page mustn't be the cache's page, which
+  // would see the stores before they reach the file.
+  if((write || (v->flags & MAP_SHARED)) && (perm & PTE_COW))
+    return uvmcow(p->pagetable, a);
+  return 0;
+}
+
+// Threads sharing a page table fault one at a time, and one
+// may find that another has mapped the page, or that its TLB
+// missed a new mapping; it only needs to retry.
+int
+vmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  int r;
+
+  tgvmlock(p);
+  pte = va < MAXVA ? walk(p->pagetable, va, 0) : 0;
+  if(tgshared(p) && pte && (*pte & (PTE_V|PTE_U)) == (PTE_V|PTE_U) &&
+     (*pte & (write ? PTE_W : PTE_R))){
+    sfence_vma_page(PGROUNDDOWN(va), p->asid);
+    r = 0;
+  } else {
+    r = vmfault1(p, va, write);
+  }
+  tgvmunlock(p);
+  return r;
+}
+
+// Write the pages of [start, end) of p's area v back to its
+// file, if it is a shared area, and then unmap them. Every
+// writable page goes back: the kernel's stores, by copyout()
+// for one, are through its own mapping and leave PTE_D clear.
+static void
+vmaflush(struct proc *p, struct vma *v, uint64 start, uint64 end)
+{
+  uint64 a;
+  pte_t *pte;
+  uint off, n;
+
+  if(v->ip && (v->flags & MAP_SHARED) && (v->perm & PTE_W)){
+    for(a = start; a < end; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte == 0 || (*pte & PTE_V) == 0 || (*pte & PTE_W) == 0)
+        continue;
+      off = v->off + (a - v->start);
+      begin_op();
+      ilock(v->ip);
+      // don't grow the file, which may have shrunk.
+      if(off < v->ip->size){
+        n = min(v->ip->size - off, PGSIZE);
+        writei(v->ip, 0, PTE2PA(*pte), off, n);
+      }
+      iunlock(v->ip);
+      end_op();
+    }
+  }
+  uvmunmap(p->pagetable, start, (end - start) / PGSIZE, 1);
+}
+
+// Drop all areas of p, as exit() and exec() do, writing back
+// and unmapping the pages of mmap()'s areas. exec()'s pages
+// are freed along with the page table.
+void
+vmaclear(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->end && v->flags)
+      vmaflush(p, v, v->start, v->end);
+  begin_op();
+  vmafree(p->vma);
+  end_op();
+}
+
+// The top of the address range sbrk() may grow p into: the
+// start of the lowest mmap() area above p->sz.
+uint64
+vmatop(struct proc *p)
+{
+  struct vma *v;
+  uint64 top;
+
+  top = UTOP;
+  for(v = p->vma; v < p->vma + NVMA; v++)
+    if(v->end && v->start >= p->sz && v->start < top)
+      top = v->start;
+  return top;
+}
+
+// The highest gap of len (page-aligned) bytes in p between the
+// heap and UTOP that no area is in, or -1.
+uint64
+vmagap(struct proc *p, uint64 len)
+{
+  struct vma *v;
+  uint64 a, top;
+  int i;
+
+  top = UTOP;
+  for(i = 0; i <= NVMA; i++){
+    a = top - len;
+    if(top < len || a < PGROUNDUP(p->sz))
+      return -1;
+    for(v = p->vma; v < p->vma + NVMA; v++)
+      if(v->end && v->start < a + len && a < v->end)
+        break;
+    if(v == p->vma + NVMA)
+      return a;
+    top = v->start;
+  }
+  return -1;
+}
+
+// Map len bytes of f starting at off, which must be page-aligned,
+// into the current process at the highest free address below
+// UTOP. prot is PROT_ bits, flags one of MAP_SHARED or
+// MAP_PRIVATE. Returns the address, or -1.
+uint64
+mmap(uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  uint64 a;
+  uint filesz;
+  int perm;
+
+  // each thread has its own copy of the areas.
+  if(tgshared(p))
+    return -1;
+  if(len == 0 || len > UTOP || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if((prot & PROT_WRITE) && flags == MAP_SHARED && !f->writable)
+    return -1;
+  len = PGROUNDUP(len);
+  if((a = vmagap(p, len)) == -1)
+    return -1;
+
+  perm = PTE_R;
+  if(prot & PROT_WRITE)
+    perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  ilock(f->ip);
+  filesz = off < f->ip->size ? min(f->ip->size - off, len) : 0;
+  iunlock(f->ip);
+  if(vmaadd(p->vma, a, len, perm, flags, f->ip, off, filesz) < 0)
+    return -1;
+  return a;
+}
+
+// Unmap [addr, addr+len) of the current process, which must be
+// the start or the end (or all) of an area that mmap() made.
+// Returns 0, or -1.
+int
+munmap(uint64 addr, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 end, d;
+
+  if(tgshared(p))
+    return -1;
+  if(addr % PGSIZE != 0 || len == 0 || addr + len < addr)
+    return -1;
+  end = PGROUNDUP(addr + len);
+  if((v = vmafind(p, addr)) == 0 || v->flags == 0 || end > v->end)
+    return -1;
+  if(addr != v->start && end != v->end)
+    return -1;
+
+  vmaflush(p, v, addr, end);
+  if(addr == v->start){
+    d = end - addr;
+    v->start = end;
+    v->off += d;
+    v->filesz = v->filesz > d ? v->filesz - d : 0;
+  } else {
+    v->end = addr;
+    v->filesz = min(v->filesz, v->end - v->start);
+  }
+  if(v->start == v->end){
+    if(v->shm){
+      shmput(v->shm);
+    } else {
+      begin_op();
+      iput(v->ip);
+      end_op();
+    }
+    memset(v, 0, sizeof(*v));
+  }
+  return 0;
+}
+
+// Fault in the pages of [va, va+len) of the current process
+// before a copy that will be made with a spin-lock held, where
+// neither reading a file in nor waiting for another thread's
+// fault is possible.
+void
+vmtouch(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  uint64 a;
+  pte_t *pte;
+
+  for(a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE){
+    pte = walk(p->pagetable, a, 0);
+    if(pte && (*pte & PTE_V) && (!write || (*pte & PTE_W)))
+      continue;
+    if(vmfault(p, a, write) != 0)
+      break;
+  }
+}
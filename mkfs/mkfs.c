@@ -19,16 +19,25 @@
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
-
-int nbitmap = FSSIZE/(BSIZE*8) + 1;
-int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+//
+// The whole image is built in memory and written out at the
+// end with one sequential write. Its size, log and number of
+// inodes can be set with -s, -l and -i. With -L dev the log is
+// at the start of block device dev instead, and takes no room
+// in the image; that device's first block must be zero.
+
+int fssize = FSSIZE;
+int ninodes = NINODES;
+int nlog = LOGSIZE+1;  // header block plus LOGSIZE blocks
+int logdev;            // device holding the log, 0 for this one
+int ndisklog;          // log blocks in the image
+int nbitmap;
+int ninodeblocks;
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
-int fsfd;
+char *img;    // the image, fssize blocks
 struct superblock sb;
-char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
 
@@ -38,8 +47,12 @@ void wsect(uint, void*);
 void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
+struct dinode *dinode(uint inum);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+void iinline(uint inum, void *p, int n);
+void dxbuild(uint inum);
+void wimage(char *path);
 void die(const char *);
 
 // convert to riscv byte order
@@ -65,51 +78,88 @@ xint(uint x)
   return y;
 }
 
+void
+usage(void)
+{
+  fprintf(stderr, "Usage: mkfs [-s blocks] [-l logblocks] [-i inodes] [-L logdev] fs.img files...\n");
+  exit(1);
+}
+
 int
 main(int argc, char *argv[])
 {
-  int i, cc, fd;
+  int i, cc, fd, n;
   uint rootino, inum, off;
   struct dirent de;
   char buf[BSIZE];
-  struct dinode din;
+  struct dinode *dip;
+  char *out;
 
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
-  if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
-    exit(1);
+  for(i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2){
+    if(strcmp(argv[i], "-s") == 0)
+      fssize = atoi(argv[i+1]);
+    else if(strcmp(argv[i], "-l") == 0)
+      nlog = atoi(argv[i+1]);
+    else if(strcmp(argv[i], "-i") == 0)
+      ninodes = atoi(argv[i+1]);
+    else if(strcmp(argv[i], "-L") == 0)
+      logdev = atoi(argv[i+1]);
+    else
+      usage();
   }
+  if(i >= argc)
+    usage();
+  out = argv[i++];
 
   assert((BSIZE % sizeof(struct dinode)) == 0);
   assert((BSIZE % sizeof(struct dirent)) == 0);
 
-  fsfd = open(argv[1], O_RDWR|O_CREAT|O_TRUNC, 0666);
-  if(fsfd < 0)
-    die(argv[1]);
+  // The kernel's transactions need LOGSIZE log blocks, and
+  // dirents hold 16-bit inode numbers.
+  if(nlog < LOGSIZE+1){
+    fprintf(stderr, "mkfs: need at least %d log blocks\n", LOGSIZE+1);
+    exit(1);
+  }
+  if(ninodes < 2 || ninodes > 65535){
+    fprintf(stderr, "mkfs: bad number of inodes %d\n", ninodes);
+    exit(1);
+  }
+  if(logdev < 0 || logdev >= NBDEV || logdev == ROOTDEV){
+    fprintf(stderr, "mkfs: bad log device %d\n", logdev);
+    exit(1);
+  }
+  ndisklog = logdev ? 0 : nlog;
 
   // 1 fs block = 1 disk sector
-  nmeta = 2 + nlog + ninodeblocks + nbitmap;
-  nblocks = FSSIZE - nmeta;
+  nbitmap = fssize/(BSIZE*8) + 1;
+  ninodeblocks = ninodes / IPB + 1;
+  nmeta = 2 + ndisklog + ninodeblocks + nbitmap;
+  nblocks = fssize - nmeta;
+  if(nblocks < 1){
+    fprintf(stderr, "mkfs: %d blocks is too small\n", fssize);
+    exit(1);
+  }
+  if((img = calloc(fssize, BSIZE)) == 0)
+    die("calloc");
 
   sb.magic = FSMAGIC;
-  sb.size = xint(FSSIZE);
+  sb.size = xint(fssize);
   sb.nblocks = xint(nblocks);
-  sb.ninodes = xint(NINODES);
+  sb.ninodes = xint(ninodes);
   sb.nlog = xint(nlog);
-  sb.logstart = xint(2);
-  sb.inodestart = xint(2+nlog);
-  sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.logstart = xint(logdev ? 0 : 2);
+  sb.inodestart = xint(2+ndisklog);
+  sb.bmapstart = xint(2+ndisklog+ninodeblocks);
+  sb.logdev = xint(logdev);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
-         nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
+         nmeta, ndisklog, ninodeblocks, nbitmap, nblocks, fssize);
 
   freeblock = nmeta;     // the first free block that we can allocate
 
-  for(i = 0; i < FSSIZE; i++)
-    wsect(i, zeroes);
-
   memset(buf, 0, sizeof(buf));
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
@@ -127,14 +177,30 @@ main(int argc, char *argv[])
   strcpy(de.name, "..");
   iappend(rootino, &de, sizeof(de));
 
-  for(i = 2; i < argc; i++){
-    // get rid of "user/"
+  // An empty /tmp, for the kernel to mount its tmpfs on.
+  inum = ialloc(T_DIR);
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strcpy(de.name, "tmp");
+  iappend(rootino, &de, sizeof(de));
+  strcpy(de.name, ".");
+  iappend(inum, &de, sizeof(de));
+  de.inum = xshort(rootino);
+  strcpy(de.name, "..");
+  iappend(inum, &de, sizeof(de));
+  dip = dinode(rootino);
+  dip->nlink = xshort(xshort(dip->nlink) + 1);
+
+  for(; i < argc; i++){
+    // get rid of "user/" or "kernel/"
     char *shortname;
     if(strncmp(argv[i], "user/", 5) == 0)
       shortname = argv[i] + 5;
+    else if(strncmp(argv[i], "kernel/", 7) == 0)
+      shortname = argv[i] + 7;
     else
       shortname = argv[i];
-    
+
     assert(index(shortname, '/') == 0);
 
     if((fd = open(argv[i], 0)) < 0)
@@ -154,20 +220,31 @@ main(int argc, char *argv[])
     strncpy(de.name, shortname, DIRSIZ);
     iappend(rootino, &de, sizeof(de));
 
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
+    // A file of at most INLINESIZE bytes goes in its inode.
+    if((cc = read(fd, buf, sizeof(buf))) >= 0 && cc <= INLINESIZE){
+      if((n = read(fd, buf + cc, 1)) == 0){
+        iinline(inum, buf, cc);
+        close(fd);
+        continue;
+      }
+      cc += n;
+    }
+    do
       iappend(inum, buf, cc);
+    while((cc = read(fd, buf, sizeof(buf))) > 0);
 
     close(fd);
   }
 
   // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
+  dip = dinode(rootino);
+  off = xint(dip->size);
   off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  dip->size = xint(off);
+  dxbuild(rootino);
 
   balloc(freeblock);
+  wimage(out);
 
   exit(0);
 }
@@ -175,46 +252,35 @@ main(int argc, char *argv[])
 void
 wsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(write(fsfd, buf, BSIZE) != BSIZE)
-    die("write");
+  assert(sec < fssize);
+  memmove(img + sec * BSIZE, buf, BSIZE);
+}
+
+// The inode inum in the image, to change in place.
+struct dinode*
+dinode(uint inum)
+{
+  assert(inum < ninodes);
+  return (struct dinode*)(img + IBLOCK(inum, sb) * BSIZE) + inum % IPB;
 }
 
 void
 winode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *dip = *ip;
-  wsect(bn, buf);
+  *dinode(inum) = *ip;
 }
 
 void
 rinode(uint inum, struct dinode *ip)
 {
-  char buf[BSIZE];
-  uint bn;
-  struct dinode *dip;
-
-  bn = IBLOCK(inum, sb);
-  rsect(bn, buf);
-  dip = ((struct dinode*)buf) + (inum % IPB);
-  *ip = *dip;
+  *ip = *dinode(inum);
 }
 
 void
 rsect(uint sec, void *buf)
 {
-  if(lseek(fsfd, sec * BSIZE, 0) != sec * BSIZE)
-    die("lseek");
-  if(read(fsfd, buf, BSIZE) != BSIZE)
-    die("read");
+  assert(sec < fssize);
+  memmove(buf, img + sec * BSIZE, BSIZE);
 }
 
 uint
@@ -223,6 +289,11 @@ ialloc(ushort type)
   uint inum = freeinode++;
   struct dinode din;
 
+  if(inum >= ninodes){
+    fprintf(stderr, "mkfs: out of inodes\n");
+    exit(1);
+  }
+
   bzero(&din, sizeof(din));
   din.type = xshort(type);
   din.nlink = xshort(1);
@@ -234,63 +305,141 @@ ialloc(ushort type)
 void
 balloc(int used)
 {
-  uchar buf[BSIZE];
+  uchar *bits = (uchar*)img + xint(sb.bmapstart) * BSIZE;
   int i;
 
   printf("balloc: first %d blocks have been allocated\n", used);
-  assert(used < BSIZE*8);
-  bzero(buf, BSIZE);
+  assert(used <= fssize);
   for(i = 0; i < used; i++){
-    buf[i/8] = buf[i/8] | (0x1 << (i%8));
+    bits[i/8] = bits[i/8] | (0x1 << (i%8));
   }
-  printf("balloc: write bitmap block at sector %d\n", sb.bmapstart);
-  wsect(sb.bmapstart, buf);
+  printf("balloc: write %d bitmap blocks at sector %d\n", nbitmap, xint(sb.bmapstart));
 }
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of the file din, which
+// may be one past its end; then allocate the next free block,
+// extending the last extent when they are adjacent.
+uint
+fmap(struct dinode *din, uint fbn)
+{
+  uint start, len;
+  int i;
+
+  start = 0;
+  for(i = 0; i < NEXTENT && xint(din->ext[i].len) > 0; i++){
+    len = xint(din->ext[i].len);
+    if(fbn < start + len)
+      return xint(din->ext[i].start) + fbn - start;
+    start += len;
+  }
+  assert(fbn == start);
+  if(freeblock >= fssize){
+    fprintf(stderr, "mkfs: out of blocks\n");
+    exit(1);
+  }
+  if(i > 0 && xint(din->ext[i-1].start) + xint(din->ext[i-1].len) == freeblock){
+    din->ext[i-1].len = xint(xint(din->ext[i-1].len) + 1);
+  } else {
+    assert(i < NEXTENT);
+    din->ext[i].start = xint(freeblock);
+    din->ext[i].len = xint(1);
+  }
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
   char *p = (char*)xp;
   uint fbn, off, n1;
-  struct dinode din;
-  char buf[BSIZE];
-  uint indirect[NINDIRECT];
+  struct dinode *din;
   uint x;
 
-  rinode(inum, &din);
-  off = xint(din.size);
+  din = dinode(inum);
+  off = xint(din->size);
   // printf("append inum %d at off %d sz %d\n", inum, off, n);
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = fmap(din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
-    rsect(x, buf);
-    bcopy(p, buf + off - (fbn * BSIZE), n1);
-    wsect(x, buf);
+    bcopy(p, img + x * BSIZE + off - (fbn * BSIZE), n1);
     n -= n1;
     off += n1;
     p += n1;
   }
-  din.size = xint(off);
-  winode(inum, &din);
+  din->size = xint(off);
+}
+
+// Keep the n bytes at p in the inode of the new, empty file
+// inum, instead of in a block.
+void
+iinline(uint inum, void *p, int n)
+{
+  struct dinode *din;
+
+  din = dinode(inum);
+  assert(n <= INLINESIZE && xint(din->size) == 0);
+  memmove((char*)&din->ext[0].len, p, n);
+  din->size = xint(n);
+}
+
+// Give directory inum a hash index, as the kernel would, if it
+// has DXMIN blocks or more and its names fit in one.
+void
+dxbuild(uint inum)
+{
+  struct dinode *din;
+  struct dirent de[BSIZE / sizeof(struct dirent)];
+  ushort slot[NDXSLOT];
+  uint fbn, size, i, h, n;
+
+  din = dinode(inum);
+  size = xint(din->size);
+  if(size / BSIZE < DXMIN)
+    return;
+  bzero(slot, sizeof(slot));
+  for(fbn = 0; fbn * BSIZE < size; fbn++){
+    rsect(fmap(din, fbn), de);
+    for(i = 0; i < BSIZE / sizeof(de[0]); i++){
+      if(de[i].inum == 0)
+        continue;
+      h = dirhash(de[i].name) % NDXSLOT;
+      for(n = 0; n < DXPROBE && slot[h] != 0; n++)
+        h = (h + 1) % NDXSLOT;
+      if(n == DXPROBE)
+        return;
+      slot[h] = xshort(fbn * (BSIZE / sizeof(de[0])) + i + 1);
+    }
+  }
+  if(freeblock >= fssize){
+    fprintf(stderr, "mkfs: out of blocks\n");
+    exit(1);
+  }
+  din->index = xint(freeblock);
+  wsect(freeblock++, slot);
+}
+
+// Write the image to path in one go.
+void
+wimage(char *path)
+{
+  size_t len, done;
+  ssize_t n;
+  int fd;
+
+  fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+  if(fd < 0)
+    die(path);
+  len = (size_t)fssize * BSIZE;
+  for(done = 0; done < len; done += n){
+    if((n = write(fd, img + done, len - done)) <= 0)
+      die("write");
+  }
+  if(close(fd) < 0)
+    die(path);
 }
 
 void
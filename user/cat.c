@@ -9,6 +9,13 @@ cat(int fd)
 {
   int n;
 
+  // if fd or the output is a pipe, the kernel can move the
+  // data itself; fall back to read() and write() if not.
+  while((n = splice(fd, 1, 8192)) > 0)
+    ;
+  if(n == 0)
+    return;
+
   while((n = read(fd, buf, sizeof(buf))) > 0) {
     if (write(1, buf, n) != n) {
       fprintf(2, "cat: write error\n");
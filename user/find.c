@@ -26,8 +26,8 @@ void
 help(char* path, char* target)
 {
     char buf[512], *p;
-    int fd;
-    struct dirent de;
+    int fd, i, n;
+    struct dent de[8];
     struct stat st;
 
     if((fd = open(path, 0)) < 0){
@@ -58,25 +58,20 @@ help(char* path, char* target)
         strcpy(buf, path);
         p = buf+strlen(buf);
         *p++ = '/';
-        while(read(fd, &de, sizeof(de)) == sizeof(de)){
-            // printf("de name[%s] de size[%d]\n", de.name, sizeof(de));
-            if(de.inum == 0 || strcmp(de.name, ".") == 0 || strcmp(de.name, "..") == 0)
-                continue;
-            memmove(p, de.name, DIRSIZ);
-            p[DIRSIZ] = 0;
-            if(stat(buf, &st) < 0){
-                printf("ls: cannot stat %s\n", buf);
-                continue;
-            }
-            // printf("buf[%s], fmtname(buf) = %s\n", buf, fmtname(buf));
-            // printf("target = %s, strcmp(fmtname(buf), target) = %d\n", target, strcmp(fmtname(buf), target));
-            if(strcmp(fmtname(buf), target) == 0)
-            {
-                printf("%s\n", buf);
-            }
-            if(st.type == T_DIR)
-            {
-                help(buf, target);
+        while((n = getdents(fd, de, sizeof(de))) > 0){
+            for(i = 0; i < n / sizeof(de[0]); i++){
+                if(strcmp(de[i].name, ".") == 0 || strcmp(de[i].name, "..") == 0)
+                    continue;
+                memmove(p, de[i].name, DIRSIZ);
+                p[DIRSIZ] = 0;
+                if(strcmp(fmtname(buf), target) == 0)
+                {
+                    printf("%s\n", buf);
+                }
+                if(de[i].type == T_DIR)
+                {
+                    help(buf, target);
+                }
             }
         }
         break;
@@ -84,13 +79,206 @@ help(char* path, char* target)
     close(fd);
 }
 
+// find -j N: N worker threads take directories from a shared
+// queue, so reads of different directories overlap. Each sends
+// the paths it finds, a directory's worth at a time, down one
+// pipe to the main thread, which prints them. stdio and malloc()
+// aren't safe for threads, so the workers only write(), and
+// malloc() and free() happen under the queue's lock.
+#define MAXWORKER 7
+
+struct work {
+    struct work *next;
+    char path[1];
+};
+
+struct work *queue;
+int pending;      // directories queued or being read
+int qlock;        // a futex: 1 when held
+int qgen;         // bumped when there is work, or none left
+int out;          // pipe to the main thread
+char *target;
+
+void
+lock(void)
+{
+    while(__sync_lock_test_and_set(&qlock, 1))
+        futex_wait(&qlock, 1);
+}
+
+void
+unlock(void)
+{
+    __sync_lock_release(&qlock);
+    futex_wake(&qlock, 1);
+}
+
+// Queue directory path. Returns -1 if out of memory.
+int
+push(char *path)
+{
+    struct work *w;
+
+    lock();
+    if((w = malloc(sizeof(*w) + strlen(path))) == 0){
+        unlock();
+        return -1;
+    }
+    strcpy(w->path, path);
+    w->next = queue;
+    queue = w;
+    pending++;
+    qgen++;
+    unlock();
+    futex_wake(&qgen, 1);
+    return 0;
+}
+
+// Add line s to the n bytes of obuf, which are headed for the
+// main thread, sending them first if there is no room.
+void
+putline(char *obuf, int *n, char *s)
+{
+    int len = strlen(s);
+
+    if(*n + len + 1 > 512){
+        write(out, obuf, *n);
+        *n = 0;
+    }
+    memmove(obuf + *n, s, len);
+    obuf[*n + len] = '\n';
+    *n += len + 1;
+}
+
+// Look through one directory, queueing its subdirectories.
+// fmtname()'s buffer would be shared, so this compares the names
+// in place.
+void
+scan(char *path)
+{
+    char buf[512], obuf[512], *p;
+    int fd, i, n, on;
+    struct dent de[8];
+
+    if(strlen(path) + 1 + DIRSIZ + 1 > sizeof buf){
+        write(2, "find: path too long\n", 20);
+        return;
+    }
+    if((fd = open(path, 0)) < 0){
+        strcpy(buf, path);
+        strcpy(buf + strlen(buf), ": cannot open\n");
+        write(2, buf, strlen(buf));
+        return;
+    }
+    strcpy(buf, path);
+    p = buf+strlen(buf);
+    *p++ = '/';
+    on = 0;
+    while((n = getdents(fd, de, sizeof(de))) > 0){
+        for(i = 0; i < n / sizeof(de[0]); i++){
+            if(strcmp(de[i].name, ".") == 0 || strcmp(de[i].name, "..") == 0)
+                continue;
+            memmove(p, de[i].name, DIRSIZ);
+            p[DIRSIZ] = 0;
+            if(strcmp(p, target) == 0)
+                putline(obuf, &on, buf);
+            if(de[i].type == T_DIR && push(buf) < 0)
+                write(2, "find: out of memory\n", 20);
+        }
+    }
+    close(fd);
+    if(on > 0)
+        write(out, obuf, on);
+}
+
+void
+worker(void *arg)
+{
+    struct work *w;
+    int g, done;
+
+    for(;;){
+        lock();
+        while(queue == 0 && pending > 0){
+            g = qgen;
+            unlock();
+            futex_wait(&qgen, g);
+            lock();
+        }
+        if((w = queue) == 0){
+            unlock();
+            return;
+        }
+        queue = w->next;
+        unlock();
+
+        scan(w->path);
+
+        lock();
+        free(w);
+        if((done = --pending == 0) != 0)
+            qgen++;
+        unlock();
+        if(done)
+            futex_wake(&qgen, MAXWORKER);
+    }
+}
+
+// Search directory path with up to nworker threads.
+void
+parfind(char *path, int nworker)
+{
+    int fds[2], i, n, started;
+    char buf[512];
+
+    if(pipe(fds) < 0 || push(path) < 0){
+        fprintf(2, "find: cannot start workers\n");
+        exit(1);
+    }
+    out = fds[1];
+    started = 0;
+    for(i = 0; i < nworker && i < MAXWORKER; i++){
+        lock();   // thread_create() malloc()s
+        if(thread_create(worker, 0) >= 0)
+            started++;
+        unlock();
+    }
+    close(fds[1]);
+    if(started == 0){
+        close(fds[0]);
+        help(path, target);
+        return;
+    }
+    while((n = read(fds[0], buf, sizeof(buf))) > 0)
+        write(1, buf, n);
+    close(fds[0]);
+    while(thread_join() >= 0)
+        ;
+}
+
 int
 main(int argc, char* argv[])
 {
-    char* path = argv[1];
-    char* target = argv[2];
+    struct stat st;
+    char* path;
+    int nworker = 0;
+
+    if(argc >= 3 && strcmp(argv[1], "-j") == 0){
+        nworker = atoi(argv[2]);
+        argc -= 2;
+        argv += 2;
+    }
+    if(argc < 3){
+        fprintf(2, "usage: find [-j nworker] path name\n");
+        exit(1);
+    }
+    path = argv[1];
+    target = argv[2];
     // printf("path = %s, target = %s\n", path, target);
-    help(path, target);
+    if(nworker > 0 && stat(path, &st) == 0 && st.type == T_DIR)
+        parfind(path, nworker);
+    else
+        help(path, target);
     
     exit(0);
 }
\ No newline at end of file
@@ -1,38 +1,167 @@
 // Simple grep.  Only supports ^ . * $ operators.
+//
+// The pattern is compiled to an NFA (see compile()) whose states
+// fit in the bits of a word, and each line is run through it in
+// one pass, so .* can't make it backtrack. A pattern too long
+// for that falls back to the backtracking match().
 
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
 
-char buf[1024];
+#define BUFSZ 4096
+
+char buf[BUFSZ+1];
+char obuf[BUFSZ];
+int on;
 int match(char*, char*);
 
+#define MAXRE 63
+
+// The pattern without ^ and a final $, as items that each match
+// one character: c, or any if c is -1, once or, if star, any
+// number of times. State i is "item i next"; state nre matches.
+struct {
+  int c;
+  int star;
+} re[MAXRE];
+int nre;
+int anchored;      // pattern began with ^
+int dollar;        // pattern ended with $
+uint64 closure[MAXRE+1];  // state i and those a starred item lets it skip to
+
+// Compile pattern into re[]. Returns 0 if it has too many items.
+int
+compile(char *pattern)
+{
+  char *p = pattern;
+  int i;
+
+  anchored = *p == '^';
+  if(anchored)
+    p++;
+  dollar = 0;
+  for(nre = 0; *p; nre++){
+    if(p[0] == '$' && p[1] == '\0'){
+      dollar = 1;
+      break;
+    }
+    if(nre == MAXRE)
+      return 0;
+    re[nre].c = *p == '.' ? -1 : (uchar)*p;
+    re[nre].star = p[1] == '*';
+    p += re[nre].star ? 2 : 1;
+  }
+  closure[nre] = 1UL << nre;
+  for(i = nre - 1; i >= 0; i--)
+    closure[i] = (1UL << i) | (re[i].star ? closure[i+1] : 0);
+  return 1;
+}
+
+// Does the compiled pattern match somewhere in the n bytes at
+// line? While only the start state is live, jump straight to
+// the next occurrence of a literal first item.
+int
+nfamatch(char *line, int n)
+{
+  uint64 cur, next, start, accept;
+  int i, k, lit;
+  char *q;
+
+  start = closure[0];
+  accept = 1UL << nre;
+  lit = nre > 0 && !re[0].star && re[0].c != -1 ? re[0].c : -1;
+  cur = start;
+  for(i = 0; ; i++){
+    if((cur & accept) && !dollar)
+      return 1;
+    if(!anchored && lit != -1 && cur == start){
+      if((q = memchr(line + i, lit, n - i)) == 0)
+        return 0;
+      i = q - line;
+    }
+    if(i == n)
+      break;
+    next = 0;
+    for(k = 0; k < nre; k++){
+      if((cur & (1UL << k)) && (re[k].c == -1 || re[k].c == (uchar)line[i]))
+        next |= closure[re[k].star ? k : k+1];
+    }
+    if(!anchored)
+      next |= start;
+    else if(next == 0)
+      return 0;
+    cur = next;
+  }
+  return (cur & accept) != 0;
+}
+
+// Queue the n bytes at p for standard output.
+void
+emit(char *p, int n)
+{
+  if(on + n > sizeof(obuf)){
+    write(1, obuf, on);
+    on = 0;
+  }
+  if(n > sizeof(obuf)){
+    write(1, p, n);
+    return;
+  }
+  memmove(obuf + on, p, n);
+  on += n;
+}
+
+int
+matchline(char *pattern, int nfa, char *p, int n)
+{
+  int r;
+
+  if(nfa)
+    return nfamatch(p, n);
+  p[n] = '\0';
+  r = match(pattern, p);
+  p[n] = '\n';
+  return r;
+}
+
 void
 grep(char *pattern, int fd)
 {
-  int n, m;
+  int n, m, nfa;
   char *p, *q;
 
+  nfa = compile(pattern);
   m = 0;
-  while((n = read(fd, buf+m, sizeof(buf)-m-1)) > 0){
-    m += n;
-    buf[m] = '\0';
+  for(;;){
+    n = read(fd, buf+m, BUFSZ-m);
+    if(n > 0)
+      m += n;
+    else if(m == 0)
+      break;
+    else
+      buf[m++] = '\n';      // last line has no newline
     p = buf;
-    while((q = strchr(p, '\n')) != 0){
-      *q = 0;
-      if(match(pattern, p)){
-        *q = '\n';
-        write(1, p, q+1 - p);
-      }
+    while((q = memchr(p, '\n', buf + m - p)) != 0){
+      if(matchline(pattern, nfa, p, q - p))
+        emit(p, q+1 - p);
       p = q+1;
     }
-    if(m > 0){
-      m -= p - buf;
-      memmove(buf, p, m);
+    if(p == buf && m == BUFSZ){
+      // a line longer than buf: look at it in pieces.
+      buf[m] = '\n';
+      if(matchline(pattern, nfa, buf, m))
+        emit(buf, m);
+      p = buf + m;
     }
+    m -= p - buf;
+    memmove(buf, p, m);
+    if(n <= 0)
+      break;
   }
+  write(1, obuf, on);
+  on = 0;
 }
-
 int
 main(int argc, char *argv[])
 {
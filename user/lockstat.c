@@ -0,0 +1,51 @@
+// lockstat: print the most contended locks, from the
+// "--- locks" part of the kernel's statistics report.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+char buf[8192];
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, m;
+  char *p, *e;
+
+  if((fd = open("/statistics", O_RDONLY)) < 0){
+    mknod("/statistics", STATS, 0);
+    if((fd = open("/statistics", O_RDONLY)) < 0){
+      fprintf(2, "lockstat: cannot open /statistics\n");
+      exit(1);
+    }
+  }
+  n = 0;
+  while(n < sizeof(buf) - 1 && (m = read(fd, buf+n, sizeof(buf)-1-n)) > 0)
+    n += m;
+  close(fd);
+  buf[n] = 0;
+
+  for(p = buf; *p; p = e + 1){
+    if((e = strchr(p, '\n')) == 0)
+      break;
+    if(memcmp(p, "--- locks\n", 10) == 0)
+      break;
+  }
+  if(e == 0 || *p == 0){
+    fprintf(2, "lockstat: no lock statistics\n");
+    exit(1);
+  }
+  // print up to the next section.
+  for(p = e + 1; *p && memcmp(p, "---", 3) != 0; p = e + 1){
+    if((e = strchr(p, '\n')) == 0)
+      e = p + strlen(p) - 1;
+    write(1, p, e + 1 - p);
+  }
+  exit(0);
+}
@@ -26,8 +26,8 @@ void
 ls(char *path)
 {
   char buf[512], *p;
-  int fd;
-  struct dirent de;
+  int fd, i, n;
+  struct dent de[32];
   struct stat st;
 
   if((fd = open(path, 0)) < 0){
@@ -55,16 +55,16 @@ ls(char *path)
     strcpy(buf, path);
     p = buf+strlen(buf);
     *p++ = '/';
-    while(read(fd, &de, sizeof(de)) == sizeof(de)){
-      if(de.inum == 0)
-        continue;
-      memmove(p, de.name, DIRSIZ);
-      p[DIRSIZ] = 0;
-      if(stat(buf, &st) < 0){
-        printf("ls: cannot stat %s\n", buf);
-        continue;
+    while((n = getdents(fd, de, sizeof(de))) > 0){
+      for(i = 0; i < n / sizeof(de[0]); i++){
+        memmove(p, de[i].name, DIRSIZ);
+        p[DIRSIZ] = 0;
+        if(fstatat(fd, p, &st) < 0){
+          printf("ls: cannot stat %s\n", buf);
+          continue;
+        }
+        printf("%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
       }
-      printf("%s %d %d %d\n", fmtname(buf), st.type, st.ino, st.size);
     }
     break;
   }
@@ -0,0 +1,679 @@
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "user/user.h"
+
+//
+// Micro-benchmarks, to see how fast common operations are and
+// to catch regressions. Each benchmark runs for at least
+// MINTICKS clock ticks and prints one line:
+//
+//   name ops ticks ops/s p50 p90 p99
+//
+// the number of operations done, the ticks they took, the ops
+// per second, and the 50th, 90th and 99th percentile time of an
+// op in ns, from the mtime of the last NSAMPLE ops, for scripts
+// to pick up. The mem* benchmarks go through 64 KiB per op. The
+// contend_N benchmarks run N processes at once, each on its own
+// CPU while there are enough, all calling uptime(), which takes
+// tickslock; the line has their ops summed and the percentiles
+// of the slowest. An op of the malloc_* benchmarks is NALLOC
+// malloc()s and free()s, of small blocks from the size classes
+// or of large ones from the K&R free list.
+//
+// syscall_null is getpid(), the round trip of a system call that
+// does nothing. fork_wait forks a child that exits at once, and
+// fork_exec one that execs this program with nothing to run.
+// pipe_pingpong sends a byte to a child and back, and pipe_bulk
+// 64 KiB to a child that throws it away. file_create makes and
+// unlinks an empty file. file_{read,write}_{seq,rand} move a
+// block at a time through a file of FILESZ bytes in order or at
+// random. sbrk_grow grows memory by a page and touches it,
+// giving it back every SBRKMAX pages. path_N opens and closes a
+// file N directories down.
+//
+// perftests              runs them all
+// perftests name...      runs those whose name starts with a name
+// perftests -p N name... runs each in N processes at once
+//
+// Processes running a benchmark at once each do its setup and
+// cleanup themselves, in a directory of their own.
+//
+
+#define MINTICKS 10
+
+#define BUFSZ (64*1024)
+#define NSAMPLE 1024
+
+static char src[BUFSZ + 16];
+static char dst[BUFSZ + 16];
+
+// a byte-at-a-time copy, as memmove() used to be, for comparison.
+static void
+bytecopy(char *d, const char *s, int n)
+{
+  while(n-- > 0)
+    *d++ = *s++;
+}
+
+void
+memmove_aligned(void)
+{
+  memmove(dst, src, BUFSZ);
+}
+
+void
+memmove_unaligned(void)
+{
+  memmove(dst + 1, src + 2, BUFSZ);
+}
+
+void
+memmove_overlap(void)
+{
+  memmove(src + 8, src, BUFSZ);
+}
+
+void
+memmove_bytes(void)
+{
+  bytecopy(dst, src, BUFSZ);
+}
+
+void
+memset_64k(void)
+{
+  memset(dst, 'x', BUFSZ);
+}
+
+void
+memcmp_64k(void)
+{
+  if(memcmp(dst, dst + 8, BUFSZ) != 0){
+    printf("memcmp_64k: buffers differ\n");
+    exit(1);
+  }
+}
+
+void
+memchr_64k(void)
+{
+  if(memchr(dst, 'z', BUFSZ) != 0){
+    printf("memchr_64k: found a byte that isn't there\n");
+    exit(1);
+  }
+}
+
+void
+memcmp_setup(void)
+{
+  memset(dst, 'y', sizeof(dst));
+}
+
+#define NALLOC 64
+
+static void *blocks[NALLOC];
+
+// allocate NALLOC blocks of about sz bytes, then free them in
+// an order that isn't the reverse of malloc()'s.
+static void
+mallocfree(uint sz)
+{
+  int i;
+
+  for(i = 0; i < NALLOC; i++){
+    if((blocks[i] = malloc(sz + (i % 4) * 8)) == 0){
+      printf("malloc failed\n");
+      exit(1);
+    }
+  }
+  for(i = 0; i < NALLOC; i += 2)
+    free(blocks[i]);
+  for(i = 1; i < NALLOC; i += 2)
+    free(blocks[i]);
+}
+
+void
+malloc_small(void)
+{
+  mallocfree(24);
+}
+
+void
+malloc_large(void)
+{
+  mallocfree(8192);
+}
+
+void
+syscall_null(void)
+{
+  getpid();
+}
+
+// one system call that takes a spinlock all CPUs share.
+void
+contend(void)
+{
+  uptime();
+}
+
+void
+fork_wait(void)
+{
+  int pid;
+
+  if((pid = fork()) < 0){
+    printf("fork_wait: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0)
+    exit(0);
+  wait(0);
+}
+
+void
+fork_exec(void)
+{
+  char *argv[] = { "/perftests", "-", 0 };  // no such benchmark
+  int pid;
+
+  if((pid = fork()) < 0){
+    printf("fork_exec: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    exec(argv[0], argv);
+    printf("fork_exec: exec failed\n");
+    exit(1);
+  }
+  wait(0);
+}
+
+// the pipes to and from the child of the pipe_* benchmarks.
+static int topipe[2], frompipe[2];
+
+// start a child that reads what comes down topipe until it is
+// closed, and sends each byte back up frompipe if echo is set.
+static void
+pipechild(int echo)
+{
+  char buf[512];
+  int n, pid;
+
+  if(pipe(topipe) < 0 || pipe(frompipe) < 0){
+    printf("pipe failed\n");
+    exit(1);
+  }
+  if((pid = fork()) < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(topipe[1]);
+    close(frompipe[0]);
+    while((n = read(topipe[0], buf, echo ? 1 : sizeof(buf))) > 0){
+      if(echo && write(frompipe[1], buf, n) != n)
+        break;
+    }
+    exit(0);
+  }
+  close(topipe[0]);
+  close(frompipe[1]);
+}
+
+void
+pingpong_setup(void)
+{
+  pipechild(1);
+}
+
+void
+bulk_setup(void)
+{
+  pipechild(0);
+}
+
+void
+pipe_cleanup(void)
+{
+  close(topipe[1]);
+  close(frompipe[0]);
+  wait(0);
+}
+
+void
+pipe_pingpong(void)
+{
+  char c = 'x';
+
+  if(write(topipe[1], &c, 1) != 1 || read(frompipe[0], &c, 1) != 1){
+    printf("pipe_pingpong: lost the child\n");
+    exit(1);
+  }
+}
+
+void
+pipe_bulk(void)
+{
+  if(write(topipe[1], src, BUFSZ) != BUFSZ){
+    printf("pipe_bulk: write failed\n");
+    exit(1);
+  }
+}
+
+void
+file_create(void)
+{
+  int fd;
+
+  if((fd = open("pt.create", O_CREATE | O_WRONLY)) < 0){
+    printf("file_create: create failed\n");
+    exit(1);
+  }
+  close(fd);
+  if(unlink("pt.create") < 0){
+    printf("file_create: unlink failed\n");
+    exit(1);
+  }
+}
+
+#define FILESZ (256*1024)
+#define FBLK 1024
+
+static int ffd;
+static uint foff;
+static uint seed = 1;
+
+// a block offset in the file, the next one in order or one at
+// random.
+static uint
+nextoff(int rand)
+{
+  if(rand){
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % (FILESZ / FBLK) * FBLK;
+  }
+  foff = (foff + FBLK) % FILESZ;
+  return foff;
+}
+
+// make the file, all FILESZ bytes of it.
+void
+file_setup(void)
+{
+  int i;
+
+  unlink("pt.file");
+  if((ffd = open("pt.file", O_CREATE | O_RDWR)) < 0){
+    printf("file_setup: create failed\n");
+    exit(1);
+  }
+  for(i = 0; i < FILESZ; i += BUFSZ){
+    if(write(ffd, src, BUFSZ) != BUFSZ){
+      printf("file_setup: write failed\n");
+      exit(1);
+    }
+  }
+  foff = 0;
+}
+
+void
+file_cleanup(void)
+{
+  close(ffd);
+  unlink("pt.file");
+}
+
+static void
+fileop(int write, int rand)
+{
+  uint off = nextoff(rand);
+  int n;
+
+  n = write ? pwrite(ffd, src, FBLK, off) : pread(ffd, dst, FBLK, off);
+  if(n != FBLK){
+    printf("file: %s failed at %d\n", write ? "pwrite" : "pread", off);
+    exit(1);
+  }
+}
+
+void
+file_read_seq(void)
+{
+  fileop(0, 0);
+}
+
+void
+file_read_rand(void)
+{
+  fileop(0, 1);
+}
+
+void
+file_write_seq(void)
+{
+  fileop(1, 0);
+}
+
+void
+file_write_rand(void)
+{
+  fileop(1, 1);
+}
+
+#define SBRKMAX 256
+
+static int nsbrk;
+
+void
+sbrk_grow(void)
+{
+  char *p;
+
+  if(nsbrk == SBRKMAX){
+    sbrk(-SBRKMAX * PGSIZE);
+    nsbrk = 0;
+  }
+  if((p = sbrk(PGSIZE)) == (char*)-1){
+    printf("sbrk_grow: sbrk failed\n");
+    exit(1);
+  }
+  *p = 1;
+  nsbrk++;
+}
+
+void
+sbrk_cleanup(void)
+{
+  sbrk(-nsbrk * PGSIZE);
+  nsbrk = 0;
+}
+
+#define PATHMAX 8
+
+static char deep[] = "pt.d/d/d/d/d/d/d/d";   // PATHMAX directories
+
+// open and close the file "f" in the first n of the directories.
+static void
+openat(int n)
+{
+  char path[sizeof(deep) + 2];
+  int fd;
+
+  memmove(path, deep, 2*n + 2);
+  memmove(path + 2*n + 2, "/f", 3);
+  if((fd = open(path, O_RDONLY)) < 0){
+    printf("path: open %s failed\n", path);
+    exit(1);
+  }
+  close(fd);
+}
+
+// make the directories, and a file "f" in each.
+void
+path_setup(void)
+{
+  char path[sizeof(deep) + 2];
+  int i, fd;
+
+  for(i = 0; i < PATHMAX; i++){
+    memmove(path, deep, 2*i + 4);
+    path[2*i + 4] = 0;
+    mkdir(path);
+    memmove(path + 2*i + 4, "/f", 3);
+    if((fd = open(path, O_CREATE | O_RDONLY)) < 0){
+      printf("path_setup: create %s failed\n", path);
+      exit(1);
+    }
+    close(fd);
+  }
+}
+
+void
+path_cleanup(void)
+{
+  char path[sizeof(deep) + 2];
+  int i;
+
+  for(i = PATHMAX - 1; i >= 0; i--){
+    memmove(path, deep, 2*i + 4);
+    memmove(path + 2*i + 4, "/f", 3);
+    unlink(path);
+    path[2*i + 4] = 0;
+    unlink(path);
+  }
+}
+
+void
+path_1(void)
+{
+  openat(1);
+}
+
+void
+path_8(void)
+{
+  openat(PATHMAX);
+}
+
+struct bench {
+  void (*f)(void);
+  void (*setup)(void);
+  char *name;
+  int nproc;               // processes to run f in at once, if > 0
+  void (*cleanup)(void);
+} benches[] = {
+  {memmove_aligned, 0, "memmove_aligned"},
+  {memmove_unaligned, 0, "memmove_unaligned"},
+  {memmove_overlap, 0, "memmove_overlap"},
+  {memmove_bytes, 0, "memmove_bytes"},
+  {memset_64k, 0, "memset_64k"},
+  {memcmp_64k, memcmp_setup, "memcmp_64k"},
+  {memchr_64k, memcmp_setup, "memchr_64k"},
+  {malloc_small, 0, "malloc_small"},
+  {malloc_large, 0, "malloc_large"},
+  {syscall_null, 0, "syscall_null"},
+  {fork_wait, 0, "fork_wait"},
+  {fork_exec, 0, "fork_exec"},
+  {pipe_pingpong, pingpong_setup, "pipe_pingpong", 0, pipe_cleanup},
+  {pipe_bulk, bulk_setup, "pipe_bulk", 0, pipe_cleanup},
+  {file_create, 0, "file_create"},
+  {file_read_seq, file_setup, "file_read_seq", 0, file_cleanup},
+  {file_read_rand, file_setup, "file_read_rand", 0, file_cleanup},
+  {file_write_seq, file_setup, "file_write_seq", 0, file_cleanup},
+  {file_write_rand, file_setup, "file_write_rand", 0, file_cleanup},
+  {sbrk_grow, 0, "sbrk_grow", 0, sbrk_cleanup},
+  {path_1, path_setup, "path_1", 0, path_cleanup},
+  {path_8, path_setup, "path_8", 0, path_cleanup},
+  {contend, 0, "contend_1", 1},
+  {contend, 0, "contend_2", 2},
+  {contend, 0, "contend_4", 4},
+  {contend, 0, "contend_8", 8},
+  { 0, 0, 0},
+};
+
+// what one run of a benchmark found.
+struct result {
+  int ops;
+  int ticks;
+  uint64 cycles;           // mtime the ops took
+  uint64 pct[3];           // p50, p90 and p99 of an op, in mtime
+};
+
+static uint lat[NSAMPLE];
+
+// sort the n latencies in a, a Shell sort, as NSAMPLE is small.
+static void
+sortlat(uint *a, int n)
+{
+  int gap, i, j;
+  uint x;
+
+  for(gap = n/2; gap > 0; gap /= 2){
+    for(i = gap; i < n; i++){
+      x = a[i];
+      for(j = i; j >= gap && a[j-gap] > x; j -= gap)
+        a[j] = a[j-gap];
+      a[j] = x;
+    }
+  }
+}
+
+// Run b->f until MINTICKS have gone by, timing each op, and
+// fill in *r.
+void
+timed(struct bench *b, struct result *r)
+{
+  int start, n, ns;
+  uint64 t0, t1, begin;
+
+  // start on a tick boundary.
+  start = uuptime();
+  while(uuptime() == start)
+    ;
+  start = uuptime();
+  begin = t0 = utime();
+  n = 0;
+  do {
+    b->f();
+    t1 = utime();
+    lat[n % NSAMPLE] = t1 - t0;
+    t0 = t1;
+    n++;
+  } while((r->ticks = uuptime() - start) < MINTICKS);
+  r->ops = n;
+  r->cycles = t1 - begin;
+  ns = n < NSAMPLE ? n : NSAMPLE;
+  sortlat(lat, ns);
+  r->pct[0] = lat[ns * 50 / 100];
+  r->pct[1] = lat[ns * 90 / 100];
+  r->pct[2] = lat[ns * 99 / 100];
+}
+
+void
+report(struct bench *b, struct result *r)
+{
+  uint64 opss;
+
+  opss = r->cycles ? (uint64)r->ops * TIMEBASE / r->cycles : 0;
+  printf("%s %d %d %l %l %l %l\n", b->name, r->ops, r->ticks, opss,
+         r->pct[0] * (1000000000 / TIMEBASE),
+         r->pct[1] * (1000000000 / TIMEBASE),
+         r->pct[2] * (1000000000 / TIMEBASE));
+}
+
+// Run b in nproc processes, the i'th on CPU i if there is
+// one, and report all their ops over the longest any took,
+// with the percentiles of the slowest.
+void
+runpar(struct bench *b, int nproc)
+{
+  struct result r, sum;
+  int fds[2], i, pid;
+  char dir[6];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", b->name);
+    exit(1);
+  }
+  for(i = 0; i < nproc; i++){
+    if((pid = fork()) < 0){
+      printf("%s: fork failed\n", b->name);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      setaffinity(getpid(), 1 << i);  // fails past the last CPU
+      memmove(dir, "pt.", 3);
+      dir[3] = 'a' + i / 26;
+      dir[4] = 'a' + i % 26;
+      dir[5] = 0;
+      if(mkdir(dir) < 0 || chdir(dir) < 0){
+        printf("%s: mkdir %s failed\n", b->name, dir);
+        exit(1);
+      }
+      if(b->setup)
+        b->setup();
+      timed(b, &r);
+      if(b->cleanup)
+        b->cleanup();
+      chdir("..");
+      unlink(dir);
+      write(fds[1], &r, sizeof(r));
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  memset(&sum, 0, sizeof(sum));
+  while(read(fds[0], &r, sizeof(r)) == sizeof(r)){
+    sum.ops += r.ops;
+    if(r.ticks > sum.ticks)
+      sum.ticks = r.ticks;
+    if(r.cycles > sum.cycles)
+      sum.cycles = r.cycles;
+    for(i = 0; i < 3; i++){
+      if(r.pct[i] > sum.pct[i])
+        sum.pct[i] = r.pct[i];
+    }
+  }
+  close(fds[0]);
+  for(i = 0; i < nproc; i++)
+    wait(0);
+  report(b, &sum);
+}
+
+// Run b until MINTICKS have gone by, in nproc processes if
+// there's more than one, and report.
+void
+run(struct bench *b, int nproc)
+{
+  struct result r;
+
+  if(nproc > 1){
+    runpar(b, nproc);
+    return;
+  }
+  if(b->setup)
+    b->setup();
+  timed(b, &r);
+  report(b, &r);
+  if(b->cleanup)
+    b->cleanup();
+}
+
+// does b's name start with one of the n names?
+int
+chosen(struct bench *b, char **names, int n)
+{
+  int i;
+
+  if(n == 0)
+    return 1;
+  for(i = 0; i < n; i++){
+    if(strlen(b->name) >= strlen(names[i]) &&
+       memcmp(b->name, names[i], strlen(names[i])) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct bench *b;
+  int nproc = 0;
+
+  argv++, argc--;
+  if(argc >= 2 && strcmp(argv[0], "-p") == 0){
+    nproc = atoi(argv[1]);
+    argv += 2, argc -= 2;
+  }
+  for(b = benches; b->name; b++){
+    if(chosen(b, argv, argc))
+      run(b, nproc ? nproc : b->nproc);
+  }
+  exit(0);
+}
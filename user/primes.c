@@ -2,65 +2,182 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 
-void help(int vals[35], int num)
+// primes [-q] [max [per]]: the primes up to max (default 35),
+// with a pipeline of at most MAXSTAGE processes. Numbers go down
+// the pipes BATCH at a time. Each stage keeps the first per primes it reads
+// (default PER) as its filters and passes what survives them
+// to the next; the last stage keeps all it needs. Once a
+// stage's prime squared is past max, whatever survives is prime
+// and the stage prints it without starting another. Before the
+// numbers, each stage sends on how many primes came before, so
+// the last can print the count; -q prints only that.
+#define MAXSTAGE 8
+#define PER 32
+#define BATCH 256
+#define MAXFILTER 5000   // primes below sqrt(2^31)
+
+int quiet;
+int per;
+int filter[MAXFILTER];
+int buf[BATCH], outbuf[BATCH];   // static: stages start inside stage()
+
+// Read up to n ints from fd into v, whole ones only.
+int readints(int fd, int *v, int n)
 {
-    if(num == 0)
+    int got = 0, m;
+
+    while(got == 0 || got % 4 != 0)
     {
-        return;
+        if((m = read(fd, (char*)v + got, n*4 - got)) <= 0)
+        {
+            return got / 4;
+        }
+        got += m;
     }
-    fprintf(1, "prime %d\n", vals[0]);
+    return got / 4;
+}
+
+void stage(int in, int max)
+{
+    int nfilter, before, n, i, j, x, on, out, done, next, depth = 0;
     int p[2];
-    pipe(p);
-    if(fork() == 0)
-    {   
-        close(p[1]);
-        int sieveNum;
-        read(p[0], &sieveNum, 4);
-        int passVal[35] = {0};
-        int passNum = 0;
-        int val;
-        while(read(p[0], &val, 4))
+
+    // a child that starts the next stage carries on here with
+    // the new pipe as its input.
+    for(;;)
+    {
+        nfilter = on = done = 0;
+        out = next = -1;
+        if(readints(in, &before, 1) != 1)
         {
-            if(val % sieveNum != 0)
-            {
-                passVal[passNum] = val;
-                passNum ++;
-            }
-            else
+            exit(0);
+        }
+        while(next < 0 && (n = readints(in, buf, BATCH)) > 0)
+        {
+            for(i = 0; i < n && next < 0; i++)
             {
-                fprintf(1, "sieveNum %d pass %d\n", sieveNum, val);
+                x = buf[i];
+                for(j = 0; j < nfilter && x % filter[j] != 0; j++)
+                    ;
+                if(j < nfilter)
+                {
+                    continue;
+                }
+                if(out < 0)
+                {
+                    // x is prime.
+                    before++;
+                    if(!quiet)
+                    {
+                        printf("prime %d\n", x);
+                    }
+                    if(done)
+                    {
+                        continue;
+                    }
+                    if((uint64)x * x > max)
+                    {
+                        done = 1;
+                        continue;
+                    }
+                    if(nfilter < MAXFILTER)
+                    {
+                        filter[nfilter++] = x;
+                    }
+                    if(nfilter == per && depth < MAXSTAGE - 1)
+                    {
+                        fflush(1);
+                        pipe(p);
+                        if(fork() == 0)
+                        {
+                            close(p[1]);
+                            close(in);
+                            next = p[0];
+                            continue;
+                        }
+                        close(p[0]);
+                        out = p[1];
+                        write(out, &before, 4);
+                    }
+                    continue;
+                }
+                outbuf[on++] = x;
+                if(on == BATCH)
+                {
+                    write(out, outbuf, on*4);
+                    on = 0;
+                }
             }
         }
-        fprintf(1, "passNum[%d]\n", passNum);
-        for(int i = 0; i < passNum; ++i)
+        if(next >= 0)
+        {
+            in = next;
+            depth++;
+            continue;
+        }
+        close(in);
+        if(out < 0)
+        {
+            printf("%d primes up to %d\n", before, max);
+            exit(0);
+        }
+        if(on > 0)
         {
-            fprintf(1, "passVal[%d] %d\n",i, passVal[i]);
+            write(out, outbuf, on*4);
         }
-        help(passVal, passNum);
+        close(out);
+        wait(0);
         exit(0);
     }
-    else
+}
+
+// Feed 2..max to the first stage.
+void batched(int max)
+{
+    int p[2], n, x, zero = 0;
+
+    pipe(p);
+    if(fork() == 0)
+    {
+        close(p[1]);
+        stage(p[0], max);
+    }
+    close(p[0]);
+    write(p[1], &zero, 4);
+    n = 0;
+    for(x = 2; x <= max && x > 0; x++)
     {
-        close(p[0]);
-        for(int i = 0; i < num; ++i)
+        buf[n++] = x;
+        if(n == BATCH)
         {
-            write(p[1], &vals[i], 4);
+            write(p[1], buf, n*4);
+            n = 0;
         }
-        close(p[1]);
-        wait(0);
-        exit(0);
     }
+    if(n > 0)
+    {
+        write(p[1], buf, n*4);
+    }
+    close(p[1]);
+    wait(0);
+    exit(0);
 }
 
 int
 main(int argc, char* argv[])
 {
-    int vals[35];
-    int num = 34;
-    for(int i = 0; i < num; ++i)
+    int i = 1;
+
+    if(i < argc && strcmp(argv[i], "-q") == 0)
     {
-        vals[i] = i + 2;
+        quiet = 1;
+        i++;
     }
-    help(vals, num);
+    per = i + 1 < argc ? atoi(argv[i + 1]) : PER;
+    if(per < 1)
+    {
+        per = PER;
+    }
+    batched(i < argc ? atoi(argv[i]) : 35);
     exit(0);
-}
\ No newline at end of file
+}
@@ -9,7 +9,7 @@ static char digits[] = "0123456789ABCDEF";
 static void
 putc(int fd, char c)
 {
-  write(fd, &c, 1);
+  fputc(fd, c);
 }
 
 static void
@@ -47,7 +47,8 @@ printptr(int fd, uint64 x) {
     putc(fd, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
-// Print to the given fd. Only understands %d, %x, %p, %s.
+// Print to the given fd, through its buffer (ulib.c). Only
+// understands %d, %x, %p, %s.
 void
 vprintf(int fd, const char *fmt, va_list ap)
 {
@@ -92,6 +93,8 @@ vprintf(int fd, const char *fmt, va_list ap)
       state = 0;
     }
   }
+  if(fd == 2)
+    fflush(fd);
 }
 
 void
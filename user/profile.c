@@ -0,0 +1,261 @@
+// profile: sample where the CPUs spend their time, and report
+// the functions the samples fell in, looked up in /kernel.sym
+// and in /name.sym for a program called name.
+//
+//   profile on [n] | off   start, taking n samples a tick, or stop
+//   profile                report and consume the samples so far
+//   profile cmd args       profile cmd, then report
+//
+// each line of the report is: samples, percent of all samples,
+// kernel or the program's name, and the function, hottest first.
+// the kernel keeps the last 2048 samples of each CPU, 20 seconds
+// at the default rate of DEFRATE samples a tick.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/prof.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+#define DEFRATE "10"
+#define NTAB 32        // programs with symbols
+#define NTOP 30        // lines in the report
+
+// the symbols of the kernel or of one program, sorted by address,
+// and the samples that fell in each.
+struct symtab {
+  char name[16];       // "" for the kernel
+  int n;
+  uint64 *addr;
+  char **sym;
+  int *count;
+  int unknown;         // samples before the first symbol, or with no symbols
+} tabs[NTAB];
+int ntab;
+
+struct profsample buf[64];
+int total;
+
+// does s end with suffix?
+int
+endswith(char *s, char *suffix)
+{
+  int n = strlen(s), m = strlen(suffix);
+
+  return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+// read the "address name" lines of path into t, skipping section
+// and file names, and sort them.
+void
+loadsyms(struct symtab *t, char *path)
+{
+  struct stat st;
+  char *text, *p, *e, *nl;
+  uint64 a, x;
+  char *s;
+  int fd, i, j, gap;
+
+  if((fd = open(path, O_RDONLY)) < 0)
+    return;
+  if(fstat(fd, &st) < 0 || (text = malloc(st.size + 1)) == 0){
+    close(fd);
+    return;
+  }
+  if(read(fd, text, st.size) != st.size){
+    close(fd);
+    free(text);
+    return;
+  }
+  close(fd);
+  text[st.size] = 0;
+
+  for(i = 0, p = text; *p; p++)
+    if(*p == '\n')
+      i++;
+  t->addr = malloc(i * sizeof(t->addr[0]));
+  t->sym = malloc(i * sizeof(t->sym[0]));
+  t->count = malloc(i * sizeof(t->count[0]));
+  if(t->addr == 0 || t->sym == 0 || t->count == 0){
+    fprintf(2, "profile: out of memory\n");
+    exit(1);
+  }
+
+  for(p = text; (nl = strchr(p, '\n')) != 0; p = nl + 1){
+    *nl = 0;
+    a = 0;
+    for(e = p; (*e >= '0' && *e <= '9') || (*e >= 'a' && *e <= 'f'); e++)
+      a = a*16 + (*e <= '9' ? *e - '0' : *e - 'a' + 10);
+    if(*e != ' ' || e[1] == 0 || e[1] == '.' ||
+       endswith(e+1, ".c") || endswith(e+1, ".S"))
+      continue;
+    t->addr[t->n] = a;
+    t->sym[t->n] = e + 1;
+    t->count[t->n] = 0;
+    t->n++;
+  }
+
+  // a Shell sort, by address.
+  for(gap = t->n/2; gap > 0; gap /= 2){
+    for(i = gap; i < t->n; i++){
+      x = t->addr[i];
+      s = t->sym[i];
+      for(j = i; j >= gap && t->addr[j-gap] > x; j -= gap){
+        t->addr[j] = t->addr[j-gap];
+        t->sym[j] = t->sym[j-gap];
+      }
+      t->addr[j] = x;
+      t->sym[j] = s;
+    }
+  }
+}
+
+// the symbol table for a sample, loading it the first time.
+struct symtab*
+tabfor(struct profsample *s)
+{
+  char *name = s->user ? s->name : "";
+  struct symtab *t;
+  char path[24];
+  int i;
+
+  for(i = 0; i < ntab; i++)
+    if(strcmp(tabs[i].name, name) == 0)
+      return &tabs[i];
+  if(ntab == NTAB)
+    return 0;
+  t = &tabs[ntab++];
+  strcpy(t->name, name);
+  strcpy(path, "/");
+  strcpy(path + 1, *name ? name : "kernel");
+  strcpy(path + strlen(path), ".sym");
+  loadsyms(t, path);
+  return t;
+}
+
+// count s against the last symbol at or below its pc.
+void
+count(struct profsample *s)
+{
+  struct symtab *t;
+  int lo, hi, mid;
+
+  total++;
+  if((t = tabfor(s)) == 0)
+    return;
+  lo = -1;
+  hi = t->n;
+  while(hi - lo > 1){
+    mid = (lo + hi) / 2;
+    if(t->addr[mid] <= s->pc)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  if(lo < 0)
+    t->unknown++;
+  else
+    t->count[lo]++;
+}
+
+// print the NTOP symbols with the most samples.
+void
+report(void)
+{
+  int i, j, k, bt, bi, best, n;
+  char *where, *sym;
+
+  printf("%d samples\n", total);
+  for(k = 0; k < NTOP; k++){
+    best = 0;
+    bt = bi = -1;
+    for(i = 0; i < ntab; i++){
+      if(tabs[i].unknown > best){
+        best = tabs[i].unknown;
+        bt = i;
+        bi = -1;
+      }
+      for(j = 0; j < tabs[i].n; j++){
+        if(tabs[i].count[j] > best){
+          best = tabs[i].count[j];
+          bt = i;
+          bi = j;
+        }
+      }
+    }
+    if(bt < 0)
+      break;
+    where = tabs[bt].name[0] ? tabs[bt].name : "kernel";
+    if(bi < 0){
+      sym = "?";
+      n = tabs[bt].unknown;
+      tabs[bt].unknown = 0;
+    } else {
+      sym = tabs[bt].sym[bi];
+      n = tabs[bt].count[bi];
+      tabs[bt].count[bi] = 0;
+    }
+    printf("%d %d%% %s %s\n", n, n * 100 / total, where, sym);
+  }
+}
+
+void
+drain(int fd)
+{
+  int i, n;
+
+  while((n = read(fd, buf, sizeof(buf))) > 0)
+    for(i = 0; i < n / sizeof(buf[0]); i++)
+      count(&buf[i]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, pid;
+  char *rate;
+
+  if((fd = open("/prof", O_RDWR)) < 0){
+    mknod("/prof", PROF, 0);
+    if((fd = open("/prof", O_RDWR)) < 0){
+      fprintf(2, "profile: cannot open /prof\n");
+      exit(1);
+    }
+  }
+  if(argc >= 2 && strcmp(argv[1], "on") == 0){
+    rate = argc > 2 ? argv[2] : DEFRATE;
+    if(write(fd, rate, strlen(rate)) < 0){
+      fprintf(2, "profile: bad rate %s\n", rate);
+      exit(1);
+    }
+  } else if(argc == 2 && strcmp(argv[1], "off") == 0){
+    write(fd, "0", 1);
+  } else if(argc >= 2){
+    while(read(fd, buf, sizeof(buf)) > 0)
+      ;   // drop samples from before cmd
+    write(fd, DEFRATE, strlen(DEFRATE));
+    pid = fork();
+    if(pid < 0){
+      fprintf(2, "profile: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv+1);
+      fprintf(2, "profile: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+    write(fd, "0", 1);
+    drain(fd);
+    report();
+  } else {
+    drain(fd);
+    report();
+  }
+  close(fd);
+  exit(0);
+}
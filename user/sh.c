@@ -1,6 +1,7 @@
 // Shell.
 
 #include "kernel/types.h"
+#include "kernel/stat.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
 
@@ -12,6 +13,9 @@
 #define BACK  5
 
 #define MAXARGS 10
+#define MAXSTAGE 8     // commands in a pipeline spawnline() runs
+#define ARENA 2048     // bytes for one line's parse tree
+#define NPATH 16       // command paths resolve() remembers
 
 struct cmd {
   int type;
@@ -52,8 +56,14 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int spawnline(char*);
+char *resolve(char*);
+void forget(char*);
 void runcmd(struct cmd*) __attribute__((noreturn));
 
+char arena[ARENA];   // for the parse tree; see salloc()
+int arenaused;
+
 // Execute cmd.  Never returns.
 void
 runcmd(struct cmd *cmd)
@@ -76,7 +86,7 @@ runcmd(struct cmd *cmd)
     ecmd = (struct execcmd*)cmd;
     if(ecmd->argv[0] == 0)
       exit(1);
-    exec(ecmd->argv[0], ecmd->argv);
+    exec(resolve(ecmd->argv[0]), ecmd->argv);
     fprintf(2, "exec %s failed\n", ecmd->argv[0]);
     break;
 
@@ -146,7 +156,7 @@ int
 main(void)
 {
   static char buf[100];
-  int fd;
+  int fd, n;
 
   // Ensure that three file descriptors are open.
   while((fd = open("console", O_RDWR)) >= 0){
@@ -158,16 +168,22 @@ main(void)
 
   // Read and run input commands.
   while(getcmd(buf, sizeof(buf)) >= 0){
+    arenaused = 0;
     if(buf[0] == 'c' && buf[1] == 'd' && buf[2] == ' '){
       // Chdir must be called by the parent, not the child.
       buf[strlen(buf)-1] = 0;  // chop \n
       if(chdir(buf+3) < 0)
         fprintf(2, "cannot cd %s\n", buf+3);
+      forget(0);   // names found in the old directory
       continue;
     }
-    if(fork1() == 0)
-      runcmd(parsecmd(buf));
-    wait(0);
+    if((n = spawnline(buf)) < 0){
+      if(fork1() == 0)
+        runcmd(parsecmd(buf));
+      n = 1;
+    }
+    while(n-- > 0)
+      wait(0);
   }
   exit(0);
 }
@@ -190,15 +206,76 @@ fork1(void)
   return pid;
 }
 
+// Commands are found by name in the current directory, or else
+// in /. resolve() remembers where, so a script running the same
+// commands over and over doesn't look for them each time; the
+// entries go when cd changes directory, or when one turns out to
+// be wrong.
+struct {
+  char name[16];
+  char path[17];
+} paths[NPATH];
+int npath;
+
+char*
+resolve(char *name)
+{
+  struct stat st;
+  char path[17];
+  int i;
+
+  if(strchr(name, '/') || strlen(name) >= sizeof(paths[0].name))
+    return name;
+  for(i = 0; i < NPATH; i++)
+    if(paths[i].name[0] && strcmp(paths[i].name, name) == 0)
+      return paths[i].path;
+  if(stat(name, &st) < 0){
+    path[0] = '/';
+    strcpy(path+1, name);
+    if(stat(path, &st) < 0)
+      return name;
+  } else
+    strcpy(path, name);
+  i = npath++ % NPATH;
+  strcpy(paths[i].name, name);
+  strcpy(paths[i].path, path);
+  return paths[i].path;
+}
+
+// Forget where name is, or every name if it is 0.
+void
+forget(char *name)
+{
+  int i;
+
+  for(i = 0; i < NPATH; i++)
+    if(name == 0 || strcmp(paths[i].name, name) == 0)
+      paths[i].name[0] = 0;
+}
+
 //PAGEBREAK!
-// Constructors
+// Constructors. The nodes come from an arena, which main()
+// empties for each line.
+
+void*
+salloc(int n)
+{
+  void *p;
+
+  n = (n + 7) & ~7;
+  if(arenaused + n > ARENA)
+    panic("line too complex");
+  p = arena + arenaused;
+  arenaused += n;
+  return p;
+}
 
 struct cmd*
 execcmd(void)
 {
   struct execcmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = salloc(sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = EXEC;
   return (struct cmd*)cmd;
@@ -209,7 +286,7 @@ redircmd(struct cmd *subcmd, char *file, char *efile, int mode, int fd)
 {
   struct redircmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = salloc(sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = REDIR;
   cmd->cmd = subcmd;
@@ -225,7 +302,7 @@ pipecmd(struct cmd *left, struct cmd *right)
 {
   struct pipecmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = salloc(sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = PIPE;
   cmd->left = left;
@@ -238,7 +315,7 @@ listcmd(struct cmd *left, struct cmd *right)
 {
   struct listcmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = salloc(sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = LIST;
   cmd->left = left;
@@ -251,7 +328,7 @@ backcmd(struct cmd *subcmd)
 {
   struct backcmd *cmd;
 
-  cmd = malloc(sizeof(*cmd));
+  cmd = salloc(sizeof(*cmd));
   memset(cmd, 0, sizeof(*cmd));
   cmd->type = BACK;
   cmd->cmd = subcmd;
@@ -492,3 +569,102 @@ nulterminate(struct cmd *cmd)
   }
   return cmd;
 }
+
+// Run a line that is a pipeline of up to MAXSTAGE commands, each
+// with < or > redirections at most, with spawn(): one process per
+// command and none for the shell itself, and no copy of the
+// shell's memory as fork() makes. Returns the number of commands
+// started, for main() to wait for; or -1 if the line is anything
+// else, for runcmd() to run in a child; buf is left alone then.
+int
+spawnline(char *buf)
+{
+  struct {
+    char *argv[MAXARGS], *eargv[MAXARGS];
+    char *file[2], *efile[2];
+    int mode[2];
+  } st[MAXSTAGE];
+  char *s, *es, *q, *eq, *path;
+  int tok, argc, i, j, fd, nst, n, p[2], in, fds[3];
+
+  s = buf;
+  es = s + strlen(s);
+  nst = 0;
+  argc = 0;
+  memset(st, 0, sizeof(st));
+  while((tok = gettoken(&s, es, &q, &eq)) != 0){
+    if(tok == 'a'){
+      if(argc >= MAXARGS-1)
+        return -1;
+      st[nst].argv[argc] = q;
+      st[nst].eargv[argc++] = eq;
+      continue;
+    }
+    if(tok == '|'){
+      if(argc == 0 || nst == MAXSTAGE-1)
+        return -1;
+      nst++;
+      argc = 0;
+      continue;
+    }
+    if(tok != '<' && tok != '>' && tok != '+')
+      return -1;
+    fd = tok == '<' ? 0 : 1;
+    if(st[nst].file[fd] || gettoken(&s, es, &q, &eq) != 'a')
+      return -1;
+    st[nst].file[fd] = q;
+    st[nst].efile[fd] = eq;
+    st[nst].mode[fd] = tok == '<' ? O_RDONLY : tok == '>' ? O_WRONLY|O_CREATE|O_TRUNC : O_WRONLY|O_CREATE;
+  }
+  if(argc == 0)
+    return -1;
+  nst++;
+
+  for(i = 0; i < nst; i++){
+    for(j = 0; st[i].argv[j]; j++)
+      *st[i].eargv[j] = 0;
+    for(fd = 0; fd < 2; fd++)
+      if(st[i].file[fd])
+        *st[i].efile[fd] = 0;
+  }
+
+  // in is what the next command reads: the last one's pipe.
+  n = 0;
+  in = 0;
+  for(i = 0; i < nst; i++){
+    fds[0] = in;
+    fds[1] = 1;
+    fds[2] = 2;
+    p[0] = -1;
+    if(i < nst-1 && pipe(p) < 0){
+      fprintf(2, "pipe failed\n");
+      break;
+    }
+    if(p[0] >= 0)
+      fds[1] = p[1];
+    for(fd = 0; fd < 2; fd++){
+      if(st[i].file[fd] == 0)
+        continue;
+      if(fds[fd] != fd)
+        close(fds[fd]);
+      if((fds[fd] = open(st[i].file[fd], st[i].mode[fd])) < 0)
+        fprintf(2, "open %s failed\n", st[i].file[fd]);
+    }
+    if(fds[0] >= 0 && fds[1] >= 0){
+      path = resolve(st[i].argv[0]);
+      if(spawn(path, st[i].argv, fds, 3) >= 0)
+        n++;
+      else {
+        fprintf(2, "exec %s failed\n", st[i].argv[0]);
+        forget(st[i].argv[0]);
+      }
+    }
+    for(fd = 0; fd < 2; fd++)
+      if(fds[fd] > 2)
+        close(fds[fd]);
+    in = p[0];
+  }
+  if(in > 2)
+    close(in);
+  return n;
+}
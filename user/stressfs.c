@@ -19,6 +19,7 @@ main(int argc, char *argv[])
   int fd, i;
   char path[] = "stressfs0";
   char data[512];
+  struct iovec iov[5];
 
   printf("stressfs starting\n");
   memset(data, 'a', sizeof(data));
@@ -30,10 +31,17 @@ main(int argc, char *argv[])
   printf("write %d\n", i);
 
   path[8] += i;
-  fd = open(path, O_CREATE | O_RDWR);
-  for(i = 0; i < 20; i++)
+  // the 20 records go in 4 writev()s of 5.
+  for(i = 0; i < 5; i++){
+    iov[i].base = data;
+    iov[i].len = sizeof(data);
+  }
+  // and reach the disk together, at the fsync().
+  fd = open(path, O_CREATE | O_RDWR | O_ASYNC);
+  for(i = 0; i < 20; i += 5)
 //    printf(fd, "%d\n", i);
-    write(fd, data, sizeof(data));
+    writev(fd, iov, 5);
+  fsync(fd);
   close(fd);
 
   printf("read\n");
@@ -0,0 +1,100 @@
+// sysstats: print system call counts and latencies.
+//
+//   sysstats [-h] [pid]
+//
+// for all processes, or just pid. each line is: name, calls,
+// total mtime cycles, cycles per call, longest call. -h adds
+// the latency histogram, which only the all-process counts have.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/syscall.h"
+#include "kernel/sysstat.h"
+#include "user/user.h"
+
+char *names[] = {
+[SYS_fork]    "fork",
+[SYS_exit]    "exit",
+[SYS_wait]    "wait",
+[SYS_pipe]    "pipe",
+[SYS_read]    "read",
+[SYS_kill]    "kill",
+[SYS_exec]    "exec",
+[SYS_fstat]   "fstat",
+[SYS_chdir]   "chdir",
+[SYS_dup]     "dup",
+[SYS_getpid]  "getpid",
+[SYS_sbrk]    "sbrk",
+[SYS_sleep]   "sleep",
+[SYS_uptime]  "uptime",
+[SYS_open]    "open",
+[SYS_write]   "write",
+[SYS_mknod]   "mknod",
+[SYS_unlink]  "unlink",
+[SYS_link]    "link",
+[SYS_mkdir]   "mkdir",
+[SYS_close]   "close",
+[SYS_mmap]    "mmap",
+[SYS_munmap]  "munmap",
+[SYS_setpriority] "setpriority",
+[SYS_setaffinity] "setaffinity",
+[SYS_fcntl]   "fcntl",
+[SYS_splice]  "splice",
+[SYS_tee]     "tee",
+[SYS_ring_enter] "ring_enter",
+[SYS_sysstats] "sysstats",
+[SYS_clone]   "clone",
+[SYS_join]    "join",
+[SYS_futex_wait] "futex_wait",
+[SYS_futex_wake] "futex_wake",
+[SYS_shmget]  "shmget",
+[SYS_shmat]   "shmat",
+[SYS_shmdt]   "shmdt",
+[SYS_spawn]   "spawn",
+[SYS_getdents] "getdents",
+[SYS_fstatat] "fstatat",
+[SYS_pread]   "pread",
+[SYS_pwrite]  "pwrite",
+[SYS_readv]   "readv",
+[SYS_writev]  "writev",
+[SYS_fsync]   "fsync",
+[SYS_poll]    "poll",
+[SYS_getrusage] "getrusage",
+};
+
+struct sysstat st[NSYSCALL];
+
+int
+main(int argc, char *argv[])
+{
+  int i, j, n, pid, hist;
+
+  hist = 0;
+  if(argc > 1 && strcmp(argv[1], "-h") == 0){
+    hist = 1;
+    argc--;
+    argv++;
+  }
+  pid = argc > 1 ? atoi(argv[1]) : 0;
+
+  if((n = sysstats(pid, st, NSYSCALL)) < 0){
+    fprintf(2, "sysstats: no process %d\n", pid);
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    if(st[i].count == 0)
+      continue;
+    if(i < sizeof(names)/sizeof(names[0]) && names[i])
+      printf("%s", names[i]);
+    else
+      printf("sys%d", i);
+    printf(" %d %d %d %d\n", (int)st[i].count, (int)st[i].time,
+           (int)(st[i].time / st[i].count), (int)st[i].max);
+    if(hist){
+      for(j = 0; j < NSYSHIST; j++)
+        if(st[i].hist[j])
+          printf("  <%d %d\n", 1 << (j+1), (int)st[i].hist[j]);
+    }
+  }
+  exit(0);
+}
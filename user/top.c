@@ -0,0 +1,103 @@
+// top: show which processes use the CPU and the file system.
+//
+//   top [ticks [rounds]]
+//
+// samples getrusage() every ticks (default 10) for rounds rounds
+// (default 5, 0 for ever) and prints, for each process, what it
+// used since the last sample: pid, state, percent of one CPU,
+// system calls, page faults, bytes read and written, and name,
+// busiest first. one sample is a single system call that copies
+// out NPROC small records, so top itself barely shows up.
+
+#include "kernel/types.h"
+#include "kernel/param.h"
+#include "kernel/rusage.h"
+#include "user/user.h"
+
+char *states[] = { "unused", "used", "sleep", "runble", "run", "zombie" };
+
+struct rusage cur[NPROC], last[NPROC];
+int ncur, nlast;
+uint64 dcpu[NPROC];
+int order[NPROC];
+
+// the previous sample of pid, or 0 for a new process.
+struct rusage*
+before(int pid)
+{
+  int i;
+
+  for(i = 0; i < nlast; i++)
+    if(last[i].pid == pid)
+      return &last[i];
+  return 0;
+}
+
+void
+show(uint64 elapsed)
+{
+  static struct rusage zero;
+  struct rusage *r, *o;
+  int i, j, x;
+
+  for(i = 0; i < ncur; i++){
+    if((o = before(cur[i].pid)) == 0)
+      o = &zero;
+    dcpu[i] = cur[i].cputime - o->cputime;
+    order[i] = i;
+  }
+  // an insertion sort, by CPU time.
+  for(i = 1; i < ncur; i++){
+    x = order[i];
+    for(j = i; j > 0 && dcpu[order[j-1]] < dcpu[x]; j--)
+      order[j] = order[j-1];
+    order[j] = x;
+  }
+
+  printf("pid state cpu%% syscalls faults read write name\n");
+  for(i = 0; i < ncur; i++){
+    r = &cur[order[i]];
+    if((o = before(r->pid)) == 0)
+      o = &zero;
+    printf("%d %s %d %l %l %l %l %s\n", r->pid,
+           r->state >= 0 && r->state < sizeof(states)/sizeof(states[0]) ?
+           states[r->state] : "?",
+           elapsed ? (int)(dcpu[order[i]] * 100 / elapsed) : 0,
+           r->syscalls - o->syscalls, r->faults - o->faults,
+           r->rbytes - o->rbytes, r->wbytes - o->wbytes, r->name);
+  }
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int ticks, rounds, k;
+  uint64 t0, t1;
+
+  ticks = argc > 1 ? atoi(argv[1]) : 10;
+  rounds = argc > 2 ? atoi(argv[2]) : 5;
+  if(ticks <= 0){
+    fprintf(2, "usage: top [ticks [rounds]]\n");
+    exit(1);
+  }
+
+  t0 = utime();
+  if((nlast = getrusage(0, last, NPROC)) < 0){
+    fprintf(2, "top: getrusage failed\n");
+    exit(1);
+  }
+  for(k = 0; rounds == 0 || k < rounds; k++){
+    sleep(ticks);
+    t1 = utime();
+    if((ncur = getrusage(0, cur, NPROC)) < 0){
+      fprintf(2, "top: getrusage failed\n");
+      exit(1);
+    }
+    show(t1 - t0);
+    memmove(last, cur, ncur * sizeof(cur[0]));
+    nlast = ncur;
+    t0 = t1;
+  }
+  exit(0);
+}
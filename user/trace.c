@@ -0,0 +1,84 @@
+// trace: start or stop kernel tracing, or print the trace.
+//
+//   trace on | off
+//   trace            print and consume the records so far
+//   trace cmd args   trace cmd, then print
+//
+// each line is: mtime since the first record, cpu, pid, event, a, b.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
+#include "kernel/fs.h"
+#include "kernel/file.h"
+#include "kernel/trace.h"
+#include "user/user.h"
+#include "kernel/fcntl.h"
+
+char *names[] = {
+[TR_SYSCALL]  "syscall",
+[TR_SWITCH]   "switch",
+[TR_BGET]     "bget",
+[TR_DISK]     "disk",
+};
+
+struct tracerec buf[64];
+uint64 t0;             // time of the first record printed
+
+void
+dump(int fd)
+{
+  int i, n;
+  struct tracerec *r;
+
+  while((n = read(fd, buf, sizeof(buf))) > 0){
+    for(i = 0; i < n / sizeof(buf[0]); i++){
+      r = &buf[i];
+      if(t0 == 0)
+        t0 = r->time;
+      // records come one CPU at a time, so times can go backwards.
+      printf("%d %d %d %s %d %d\n", (int)(r->time - t0), r->cpu, r->pid,
+             r->type < sizeof(names)/sizeof(names[0]) && names[r->type] ? names[r->type] : "?",
+             (int)r->a, (int)r->b);
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, pid;
+
+  if((fd = open("/trace", O_RDWR)) < 0){
+    mknod("/trace", TRACE, 0);
+    if((fd = open("/trace", O_RDWR)) < 0){
+      fprintf(2, "trace: cannot open /trace\n");
+      exit(1);
+    }
+  }
+  if(argc == 2 && strcmp(argv[1], "on") == 0){
+    write(fd, "1", 1);
+  } else if(argc == 2 && strcmp(argv[1], "off") == 0){
+    write(fd, "0", 1);
+  } else if(argc >= 2){
+    write(fd, "1", 1);
+    pid = fork();
+    if(pid < 0){
+      fprintf(2, "trace: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv+1);
+      fprintf(2, "trace: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+    write(fd, "0", 1);
+    dump(fd);
+  } else {
+    dump(fd);
+  }
+  close(fd);
+  exit(0);
+}
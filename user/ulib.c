@@ -1,6 +1,8 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
 #include "user/user.h"
 
 //
@@ -43,14 +45,40 @@ strlen(const char *s)
   return n;
 }
 
+// memset(), memmove() and memcmp() work a word at a time,
+// like the kernel's versions in kernel/string.c.
+
+#define WSIZE sizeof(uint64)
+#define WMASK (WSIZE - 1)
+
 void*
 memset(void *dst, int c, uint n)
 {
-  char *cdst = (char *) dst;
-  int i;
-  for(i = 0; i < n; i++){
-    cdst[i] = c;
+  uchar *d = dst;
+  uint64 w, *wd;
+
+  while(n > 0 && ((uint64)d & WMASK) != 0){
+    *d++ = c;
+    n--;
+  }
+  if(n >= WSIZE){
+    w = (uchar)c;
+    w |= w << 8;
+    w |= w << 16;
+    w |= w << 32;
+    wd = (uint64*)d;
+    for(; n >= 4*WSIZE; n -= 4*WSIZE, wd += 4){
+      wd[0] = w;
+      wd[1] = w;
+      wd[2] = w;
+      wd[3] = w;
+    }
+    for(; n >= WSIZE; n -= WSIZE)
+      *wd++ = w;
+    d = (uchar*)wd;
   }
+  while(n-- > 0)
+    *d++ = c;
   return dst;
 }
 
@@ -63,12 +91,168 @@ strchr(const char *s, char c)
   return 0;
 }
 
+// Find byte c in the n bytes at v, a word at a time: a word
+// holds c if xor-ing it with c in every byte leaves a zero byte.
+void*
+memchr(const void *v, int c, uint n)
+{
+  const uchar *s = v;
+  uint64 w, x;
+
+  c = (uchar)c;
+  while(n > 0 && ((uint64)s & WMASK) != 0){
+    if(*s == c)
+      return (void*)s;
+    s++, n--;
+  }
+  w = c;
+  w |= w << 8;
+  w |= w << 16;
+  w |= w << 32;
+  for(; n >= WSIZE; s += WSIZE, n -= WSIZE){
+    x = *(uint64*)s ^ w;
+    if(((x - 0x0101010101010101UL) & ~x & 0x8080808080808080UL) != 0)
+      break;
+  }
+  for(; n > 0; s++, n--)
+    if(*s == c)
+      return (void*)s;
+  return 0;
+}
+
+// Buffered I/O. fputc(), and so printf(), collect an fd's output
+// in a buffer of its own, written out when it fills, at each
+// newline if the fd is a device such as the console, and by
+// fflush(). close(), fork(), exec(), spawn() and exit() flush
+// first, so output is neither lost nor written twice; output to
+// fd 2 is written at the end of each printf(). fgets() reads
+// ahead into a buffer; gets() reads that way only when the
+// standard input is a device, whose reads end at a newline, so
+// it never takes input meant for a child process. Threads must
+// not use any of this at once.
+#define NIOBUF 8
+#define IOBUFSZ 512
+
+struct iobuf {
+  int used;
+  int fd;
+  int out;       // holds output, else read-ahead input
+  int tty;       // fd is a device
+  int n;         // bytes in buf
+  int off;       // next input byte to hand out
+  char buf[IOBUFSZ];
+};
+
+static struct iobuf iobuf[NIOBUF];
+static struct iobuf *lastbuf;
+
+// Return fd's output (out 1) or input buffer, making one if
+// needed; or 0 if they are all in use.
+static struct iobuf*
+getbuf(int fd, int out)
+{
+  struct iobuf *b, *free;
+  struct stat st;
+
+  if((b = lastbuf) != 0 && b->used && b->fd == fd && b->out == out)
+    return b;
+  free = 0;
+  for(b = iobuf; b < iobuf + NIOBUF; b++){
+    if(b->used && b->fd == fd && b->out == out)
+      return lastbuf = b;
+    if(!b->used && free == 0)
+      free = b;
+  }
+  if((b = free) == 0)
+    return 0;
+  b->used = 1;
+  b->fd = fd;
+  b->out = out;
+  b->tty = fstat(fd, &st) == 0 && st.type == T_DEVICE;
+  b->n = b->off = 0;
+  return lastbuf = b;
+}
+
+static void
+bflush(struct iobuf *b)
+{
+  int i, m;
+
+  for(i = 0; i < b->n; i += m)
+    if((m = write(b->fd, b->buf + i, b->n - i)) <= 0)
+      break;
+  b->n = 0;
+}
+
+void
+fputc(int fd, char c)
+{
+  struct iobuf *b;
+
+  if((b = getbuf(fd, 1)) == 0){
+    write(fd, &c, 1);
+    return;
+  }
+  if(b->n >= IOBUFSZ)
+    bflush(b);
+  b->buf[b->n++] = c;
+  if(b->n == IOBUFSZ || (c == '\n' && b->tty))
+    bflush(b);
+}
+
+// Write out fd's buffered output, or every fd's if fd is -1.
+void
+fflush(int fd)
+{
+  struct iobuf *b;
+
+  for(b = iobuf; b < iobuf + NIOBUF; b++)
+    if(b->used && b->out && (fd == -1 || b->fd == fd))
+      bflush(b);
+}
+
+// Read a line of up to max-1 bytes from fd into buf, through
+// fd's input buffer.
+char*
+fgets(int fd, char *buf, int max)
+{
+  struct iobuf *b;
+  int i, cc;
+  char c;
+
+  b = getbuf(fd, 0);
+  for(i=0; i+1 < max; ){
+    if(b == 0){
+      if(read(fd, &c, 1) < 1)
+        break;
+    } else {
+      if(b->off == b->n){
+        if(b->tty)
+          fflush(-1);   // show any prompt
+        if((cc = read(fd, b->buf, IOBUFSZ)) < 1)
+          break;
+        b->n = cc;
+        b->off = 0;
+      }
+      c = b->buf[b->off++];
+    }
+    buf[i++] = c;
+    if(c == '\n' || c == '\r')
+      break;
+  }
+  buf[i] = '\0';
+  return buf;
+}
+
 char*
 gets(char *buf, int max)
 {
+  struct iobuf *b;
   int i, cc;
   char c;
 
+  if((b = getbuf(0, 0)) != 0 && b->tty)
+    return fgets(0, buf, max);
   for(i=0; i+1 < max; ){
     cc = read(0, &c, 1);
     if(cc < 1)
@@ -81,6 +265,57 @@ gets(char *buf, int max)
   return buf;
 }
 
+// The system calls that must see buffered output written first.
+int _fork(void);
+int _exit(int) __attribute__((noreturn));
+int _close(int);
+int _exec(const char*, char**);
+int _spawn(const char*, char**, int*, int);
+
+int
+fork(void)
+{
+  fflush(-1);
+  return _fork();
+}
+
+int
+exit(int status)
+{
+  fflush(-1);
+  _exit(status);
+}
+
+// Drop fd's buffers along with it.
+int
+close(int fd)
+{
+  struct iobuf *b;
+
+  for(b = iobuf; b < iobuf + NIOBUF; b++){
+    if(b->used && b->fd == fd){
+      if(b->out)
+        bflush(b);
+      b->used = 0;
+    }
+  }
+  return _close(fd);
+}
+
+int
+exec(const char *path, char **argv)
+{
+  fflush(-1);
+  return _exec(path, argv);
+}
+
+int
+spawn(const char *path, char **argv, int *fds, int nfds)
+{
+  fflush(-1);
+  return _spawn(path, argv, fds, nfds);
+}
+
 int
 stat(const char *n, struct stat *st)
 {
@@ -107,36 +342,94 @@ atoi(const char *s)
 }
 
 void*
-memmove(void *vdst, const void *vsrc, int n)
+memmove(void *dst, const void *src, int n)
 {
-  char *dst;
-  const char *src;
+  const uchar *s;
+  uchar *d;
+  const uint64 *ws;
+  uint64 *wd;
+  int words;
 
-  dst = vdst;
-  src = vsrc;
-  if (src > dst) {
+  if(n <= 0)
+    return dst;
+  
+  s = src;
+  d = dst;
+  // word copies only if src and dst can be aligned together.
+  words = (((uint64)s ^ (uint64)d) & WMASK) == 0;
+  if(s < d && s + n > d){
+    s += n;
+    d += n;
+    if(words){
+      while(n > 0 && ((uint64)d & WMASK) != 0){
+        *--d = *--s;
+        n--;
+      }
+      ws = (const uint64*)s;
+      wd = (uint64*)d;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE){
+        wd -= 4, ws -= 4;
+        wd[3] = ws[3];
+        wd[2] = ws[2];
+        wd[1] = ws[1];
+        wd[0] = ws[0];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *--wd = *--ws;
+      s = (const uchar*)ws;
+      d = (uchar*)wd;
+    }
     while(n-- > 0)
-      *dst++ = *src++;
+      *--d = *--s;
   } else {
-    dst += n;
-    src += n;
+    if(words){
+      while(n > 0 && ((uint64)d & WMASK) != 0){
+        *d++ = *s++;
+        n--;
+      }
+      ws = (const uint64*)s;
+      wd = (uint64*)d;
+      for(; n >= 4*WSIZE; n -= 4*WSIZE, wd += 4, ws += 4){
+        wd[0] = ws[0];
+        wd[1] = ws[1];
+        wd[2] = ws[2];
+        wd[3] = ws[3];
+      }
+      for(; n >= WSIZE; n -= WSIZE)
+        *wd++ = *ws++;
+      s = (const uchar*)ws;
+      d = (uchar*)wd;
+    }
     while(n-- > 0)
-      *--dst = *--src;
+      *d++ = *s++;
   }
-  return vdst;
+
+  return dst;
 }
 
 int
-memcmp(const void *s1, const void *s2, uint n)
+memcmp(const void *v1, const void *v2, uint n)
 {
-  const char *p1 = s1, *p2 = s2;
-  while (n-- > 0) {
-    if (*p1 != *p2) {
-      return *p1 - *p2;
+  const uchar *s1, *s2;
+
+  s1 = v1;
+  s2 = v2;
+  if((((uint64)s1 ^ (uint64)s2) & WMASK) == 0){
+    while(n > 0 && ((uint64)s1 & WMASK) != 0){
+      if(*s1 != *s2)
+        return *s1 - *s2;
+      s1++, s2++, n--;
     }
-    p1++;
-    p2++;
+    // skip equal words; the bytes below find the difference.
+    while(n >= WSIZE && *(uint64*)s1 == *(uint64*)s2)
+      s1 += WSIZE, s2 += WSIZE, n -= WSIZE;
+  }
+  while(n-- > 0){
+    if(*s1 != *s2)
+      return *s1 - *s2;
+    s1++, s2++;
   }
+
   return 0;
 }
 
@@ -145,3 +438,70 @@ memcpy(void *dst, const void *src, uint n)
 {
   return memmove(dst, src, n);
 }
+
+// getpid() and uptime() without a system call, from the page
+// the kernel keeps up to date at USYSCALL.
+int
+ugetpid(void)
+{
+  return ((volatile struct usyscall*)USYSCALL)->pid;
+}
+
+int
+uuptime(void)
+{
+  return ((volatile struct usyscall*)USYSCALL)->ticks;
+}
+
+// the CLINT's mtime, TIMEBASE cycles a second, from the time
+// CSR, which start() lets user mode read.
+uint64
+utime(void)
+{
+  return r_time();
+}
+
+// Threads: thread_create() runs fn(arg) in a thread of its own
+// on a stack from malloc(), which thread_join() frees once the
+// thread has finished. The top of the stack holds fn and arg
+// for threadstart().
+#define TSTACKSIZE 4096
+
+static void
+threadstart(void *a)
+{
+  void **top = a;
+
+  ((void (*)(void*))top[0])(top[1]);
+  _exit(0);   // stdio's buffers are the process's, not this thread's
+}
+
+int
+thread_create(void (*fn)(void*), void *arg)
+{
+  char *stack;
+  void **top;
+  int tid;
+
+  if((stack = malloc(TSTACKSIZE)) == 0)
+    return -1;
+  top = (void**)(stack + TSTACKSIZE) - 2;
+  top[0] = (void*)fn;
+  top[1] = arg;
+  if((tid = clone(threadstart, top, top)) < 0)
+    free(stack);
+  return tid;
+}
+
+// Wait for a thread this one created to finish, and return
+// its pid, or -1 if there is none.
+int
+thread_join(void)
+{
+  void *top;
+  int tid;
+
+  if((tid = join(&top)) >= 0)
+    free((char*)top + 2*sizeof(void*) - TSTACKSIZE);
+  return tid;
+}
@@ -5,6 +5,14 @@
 
 // Memory allocator by Kernighan and Ritchie,
 // The C programming Language, 2nd ed.  Section 8.7.
+//
+// Small blocks come from segregated size classes instead: class
+// c holds blocks of 32<<c bytes, header included, on a list of
+// its own, so malloc() and free() of one take no search. An
+// empty class is refilled with a CHUNK from sbrk() at a time.
+// A class block's header has SLAB|c in s.size; K&R sizes, in
+// units, never reach SLAB. Blocks too big for any class go to
+// the K&R free list, as before.
 
 typedef long Align;
 
@@ -21,12 +29,56 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
+#define NCLASS 8             // 32 to 4096 bytes
+#define CHUNK (16*1024)      // bytes sbrk()ed for a class at a time
+#define SLAB 0x80000000
+
+static Header *classfree[NCLASS];
+
+// The smallest class whose blocks hold n bytes, or -1.
+static int
+sizeclass(uint n)
+{
+  int c;
+
+  for(c = 0; c < NCLASS; c++)
+    if(n <= (32 << c) - sizeof(Header))
+      return c;
+  return -1;
+}
+
+// Carve a CHUNK from sbrk() into blocks of class c.
+static int
+refill(int c)
+{
+  char *p;
+  Header *hp;
+  uint sz = 32 << c;
+  int i;
+
+  p = sbrk(CHUNK);
+  if(p == (char*)-1)
+    return -1;
+  for(i = 0; i + sz <= CHUNK; i += sz){
+    hp = (Header*)(p + i);
+    hp->s.size = SLAB | c;
+    hp->s.ptr = classfree[c];
+    classfree[c] = hp;
+  }
+  return 0;
+}
+
 void
 free(void *ap)
 {
   Header *bp, *p;
 
   bp = (Header*)ap - 1;
+  if(bp->s.size & SLAB){
+    bp->s.ptr = classfree[bp->s.size & ~SLAB];
+    classfree[bp->s.size & ~SLAB] = bp;
+    return;
+  }
   for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
     if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
       break;
@@ -65,6 +117,15 @@ malloc(uint nbytes)
 {
   Header *p, *prevp;
   uint nunits;
+  int c;
+
+  if((c = sizeclass(nbytes)) >= 0){
+    if(classfree[c] == 0 && refill(c) < 0)
+      return 0;
+    p = classfree[c];
+    classfree[c] = p->s.ptr;
+    return (void*)(p + 1);
+  }
 
   nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
   if((prevp = freep) == 0){
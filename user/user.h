@@ -1,4 +1,10 @@
 struct stat;
+struct ring;
+struct sysstat;
+struct dent;
+struct iovec;
+struct pollfd;
+struct rusage;
 
 // system calls
 int fork(void);
@@ -22,16 +28,46 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void *mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int setpriority(int, int);
+int setaffinity(int, uint);
+int fcntl(int, int, int);
+int splice(int, int, int);
+int tee(int, int, int);
+int ring_enter(struct ring*, int);
+int sysstats(int, struct sysstat*, int);
+int clone(void(*)(void*), void*, void*);
+int join(void**);
+int futex_wait(int*, int);
+int futex_wake(int*, int);
+int shmget(int, int);
+void *shmat(int);
+int shmdt(void*);
+int spawn(const char*, char**, int*, int);
+int getdents(int, struct dent*, int);
+int fstatat(int, const char*, struct stat*);
+int pread(int, void*, int, uint);
+int pwrite(int, const void*, int, uint);
+int readv(int, const struct iovec*, int);
+int writev(int, const struct iovec*, int);
+int fsync(int);
+int poll(struct pollfd*, int, int);
+int getrusage(int, struct rusage*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
 void *memmove(void*, const void*, int);
 char* strchr(const char*, char c);
+void* memchr(const void*, int, uint);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
 char* gets(char*, int max);
+char* fgets(int, char*, int max);
+void fputc(int, char);
+void fflush(int);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
@@ -39,3 +75,8 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+int ugetpid(void);
+int uuptime(void);
+uint64 utime(void);
+int thread_create(void (*)(void*), void*);
+int thread_join(void);
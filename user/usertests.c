@@ -2,8 +2,15 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
 #include "user/user.h"
+#include "kernel/spinlock.h"
+#include "kernel/sleeplock.h"
 #include "kernel/fs.h"
+#include "kernel/file.h"
 #include "kernel/fcntl.h"
+#include "kernel/ring.h"
+#include "kernel/trace.h"
+#include "kernel/sysstat.h"
+#include "kernel/rusage.h"
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
@@ -730,6 +737,78 @@ exectest(char *s)
 
 }
 
+// several processes running the same program at once share its
+// text; copies to and from pages of a program that haven't been
+// touched yet have to fault them in.
+char tsdata[2*PGSIZE] = { 1 };
+
+void
+textshare(char *s)
+{
+  enum { N = 8 };
+  char *echoargv[] = { "echo", "OK", 0 };
+  char name[8], buf[3];
+  int fd, i, pid, xstatus, fds[2];
+
+  for(i = 0; i < N; i++){
+    name[0] = 't';
+    name[1] = 's';
+    name[2] = '0' + i;
+    name[3] = '\0';
+    unlink(name);
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(1);
+      if(open(name, O_CREATE|O_WRONLY) != 1){
+        printf("%s: create failed\n", s);
+        exit(1);
+      }
+      exec("echo", echoargv);
+      printf("%s: exec echo failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(xstatus);
+  }
+  for(i = 0; i < N; i++){
+    name[2] = '0' + i;
+    fd = open(name, O_RDONLY);
+    if(fd < 0 || read(fd, buf, 2) != 2 || buf[0] != 'O' || buf[1] != 'K'){
+      printf("%s: wrong output\n", s);
+      exit(1);
+    }
+    close(fd);
+    unlink(name);
+  }
+
+  // read into initialized data, write from text.
+  fd = open("echo", O_RDONLY);
+  if(fd < 0 || read(fd, tsdata, sizeof(tsdata)) <= 0){
+    printf("%s: read into data failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], (char*)textshare, 64) != 64 || read(fds[0], tsdata, 64) != 64 ||
+     memcmp(tsdata, (char*)textshare, 64) != 0){
+    printf("%s: pipe i/o from text failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  exit(0);
+}
+
 // simple fork and pipe read/write
 
 void
@@ -785,268 +864,1803 @@ pipe1(char *s)
   }
 }
 
-
-// test if child is killed (status = -1)
+// fcntl() grows and shrinks a pipe's buffer, keeping its data.
 void
-killstatus(char *s)
+pipesize(char *s)
 {
-  int xst;
-  
-  for(int i = 0; i < 100; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("%s: fork failed\n", s);
+  int fds[2], i, n, sz;
+  static char pbuf[24000];
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[1], F_GETPIPE_SZ, 0) != 4096){
+    printf("%s: default pipe size is not a page\n", s);
+    exit(1);
+  }
+  if(fcntl(0, F_GETPIPE_SZ, 0) != -1 || fcntl(fds[1], F_SETPIPE_SZ, 1 << 20) != -1){
+    printf("%s: bad fcntl() succeeded\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(pbuf); i++)
+    pbuf[i] = i % 251;
+  // none of these writes must block, with no reader reading.
+  if(write(fds[1], pbuf, 4000) != 4000){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if((sz = fcntl(fds[1], F_SETPIPE_SZ, 20000)) != 32768){
+    printf("%s: F_SETPIPE_SZ returned %d\n", s, sz);
+    exit(1);
+  }
+  if(write(fds[1], pbuf + 4000, sizeof(pbuf) - 4000) != sizeof(pbuf) - 4000){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(fcntl(fds[0], F_SETPIPE_SZ, 4096) != -1){
+    printf("%s: shrank a pipe below its contents\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  for(i = 0; (n = read(fds[0], buf, sizeof(buf))) > 0; i += n){
+    if(i + n > sizeof(pbuf) || memcmp(buf, pbuf + i, n) != 0){
+      printf("%s: pipe data differs\n", s);
       exit(1);
     }
-    if(pid1 == 0){
-      while(1) {
-        getpid();
-      }
-      exit(0);
-    }
-    sleep(1);
-    kill(pid1);
-    wait(&xst);
-    if(xst != -1) {
-       printf("%s: status should be -1\n", s);
-       exit(1);
-    }
   }
-  exit(0);
+  if(i != sizeof(pbuf)){
+    printf("%s: read %d bytes, not %d\n", s, i, sizeof(pbuf));
+    exit(1);
+  }
+  close(fds[0]);
 }
 
-// meant to be run w/ at most two CPUs
+// splice() a file through a pipe into another file, and tee()
+// a pipe into another pipe.
 void
-preempt(char *s)
+splicetest(char *s)
 {
-  int pid1, pid2, pid3;
-  int pfds[2];
+  int fd, fds[2], fds2[2], i, n, pid, xst;
+  enum { SZ = 3*4096 + 100 };
 
-  pid1 = fork();
-  if(pid1 < 0) {
-    printf("%s: fork failed", s);
+  unlink("splicein");
+  unlink("spliceout");
+  fd = open("splicein", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
     exit(1);
   }
-  if(pid1 == 0)
-    for(;;)
-      ;
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 23;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
 
-  pid2 = fork();
-  if(pid2 < 0) {
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
     printf("%s: fork failed\n", s);
     exit(1);
   }
-  if(pid2 == 0)
-    for(;;)
+  if(pid == 0){
+    close(fds[0]);
+    fd = open("splicein", O_RDONLY);
+    while((n = splice(fd, fds[1], 5000)) > 0)
       ;
+    exit(n < 0);
+  }
+  close(fds[1]);
+  fd = open("spliceout", O_CREATE|O_WRONLY);
+  while((n = splice(fds[0], fd, 5000)) > 0)
+    ;
+  close(fd);
+  close(fds[0]);
+  wait(&xst);
+  if(n < 0 || xst != 0){
+    printf("%s: splice failed\n", s);
+    exit(1);
+  }
+  fd = open("spliceout", O_RDONLY);
+  memset(buf, 0, SZ);
+  if(read(fd, buf, SZ + 1) != SZ){
+    printf("%s: spliced file has the wrong size\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < SZ; i++){
+    if(buf[i] != 'a' + i % 23){
+      printf("%s: spliced data differs\n", s);
+      exit(1);
+    }
+  }
+  unlink("splicein");
+  unlink("spliceout");
 
-  pipe(pfds);
-  pid3 = fork();
-  if(pid3 < 0) {
-     printf("%s: fork failed\n", s);
-     exit(1);
+  // a console and a file can't be spliced.
+  if(splice(0, 1, 10) != -1){
+    printf("%s: splice without a pipe succeeded\n", s);
+    exit(1);
   }
-  if(pid3 == 0){
-    close(pfds[0]);
-    if(write(pfds[1], "x", 1) != 1)
-      printf("%s: preempt write error", s);
-    close(pfds[1]);
-    for(;;)
-      ;
+
+  if(pipe(fds) < 0 || pipe(fds2) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  write(fds[1], "hello", 5);
+  if(tee(fds[0], fds2[1], 5) != 5 || tee(fds[0], fds[1], 5) != -1){
+    printf("%s: tee failed\n", s);
+    exit(1);
   }
+  memset(buf, 0, 10);
+  if(read(fds[0], buf, 10) != 5 || memcmp(buf, "hello", 5) != 0 ||
+     read(fds2[0], buf + 5, 10) != 5 || memcmp(buf + 5, "hello", 5) != 0){
+    printf("%s: tee'd data differs\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  close(fds2[0]);
+  close(fds2[1]);
+}
 
-  close(pfds[1]);
-  if(read(pfds[0], buf, sizeof(buf)) != 1){
-    printf("%s: preempt read error", s);
-    return;
+static void
+ringpush(struct ring *r, int op, int fd, void *addr, void *b, int n)
+{
+  struct ringsqe *e = &r->sq[r->sqtail % RINGSIZE];
+
+  e->op = op;
+  e->fd = fd;
+  e->addr = (uint64)addr;
+  e->buf = (uint64)b;
+  e->n = n;
+  e->data = r->sqtail;
+  r->sqtail++;
+}
+
+// batches of file system calls through ring_enter().
+void
+ringtest(char *s)
+{
+  static struct ring r;
+  struct stat st1, st2;
+  struct ringcqe *c;
+  int fd, i, n;
+  char b[8];
+  static int want[] = { 3, 3, 0, 0, 0, 0, -1 };
+
+  unlink("ringfile");
+  fd = open("ringfile", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
   }
-  close(pfds[0]);
-  printf("kill... ");
-  kill(pid1);
-  kill(pid2);
-  kill(pid3);
-  printf("wait... ");
-  wait(0);
-  wait(0);
-  wait(0);
+  ringpush(&r, RING_WRITE, fd, "abc", 0, 3);
+  ringpush(&r, RING_WRITE, fd, "def", 0, 3);
+  ringpush(&r, RING_FSTAT, fd, &st1, 0, 0);
+  ringpush(&r, RING_CLOSE, fd, 0, 0, 0);
+  ringpush(&r, RING_STAT, 0, "ringfile", &st2, 0);
+  ringpush(&r, RING_NOP, 0, 0, 0, 0);
+  ringpush(&r, RING_READ, fd, b, 0, 1);  // fd is closed by now
+  if((n = ring_enter(&r, 100)) != 7 || r.sqhead != r.sqtail || r.cqtail - r.cqhead != 7){
+    printf("%s: ring_enter ran %d\n", s, n);
+    exit(1);
+  }
+  for(i = 0; i < 7; i++){
+    c = &r.cq[r.cqhead % RINGSIZE];
+    if(c->data != r.cqhead || c->res != want[i]){
+      printf("%s: entry %d returned %d\n", s, i, c->res);
+      exit(1);
+    }
+    r.cqhead++;
+  }
+  if(st1.size != 6 || st2.size != 6 || st1.ino != st2.ino){
+    printf("%s: bad stat\n", s);
+    exit(1);
+  }
+
+  // a full completion queue stops a batch.
+  for(i = 0; i < RINGSIZE; i++)
+    ringpush(&r, RING_OPEN, 0, "ringfile", 0, O_RDONLY);
+  if(ring_enter(&r, 100) != RINGSIZE){
+    printf("%s: ring_enter failed\n", s);
+    exit(1);
+  }
+  ringpush(&r, RING_NOP, 0, 0, 0, 0);
+  if(ring_enter(&r, 100) != 0){
+    printf("%s: ring_enter ignored a full queue\n", s);
+    exit(1);
+  }
+  for(i = 0; i < RINGSIZE; i++){
+    c = &r.cq[r.cqhead % RINGSIZE];
+    if(c->res >= 0)
+      close(c->res);
+    r.cqhead++;
+  }
+  if(ring_enter(&r, 100) != 1){
+    printf("%s: ring_enter did not resume\n", s);
+    exit(1);
+  }
+  r.cqhead++;
+
+  fd = open("ringfile", O_RDONLY);
+  memset(b, 0, sizeof(b));
+  ringpush(&r, RING_READ, fd, b, 0, 6);
+  ringpush(&r, RING_CLOSE, fd, 0, 0, 0);
+  if(ring_enter(&r, 100) != 2 || strcmp(b, "abcdef") != 0){
+    printf("%s: ring read failed\n", s);
+    exit(1);
+  }
+  r.cqhead += 2;
+  unlink("ringfile");
 }
 
-// try to find any races between exit and wait
+
+// a process pinned at the top priority keeps getting the CPU
+// promptly while CPU-bound processes pinned at the bottom run.
 void
-exitwait(char *s)
+priority(char *s)
 {
-  int i, pid;
+  enum { NHOG = 4 };
+  int pids[NHOG], i, t0, t1;
 
-  for(i = 0; i < 100; i++){
-    pid = fork();
-    if(pid < 0){
+  if(setpriority(getpid(), NPRIO) != -1 || setpriority(getpid(), -2) != -1){
+    printf("%s: bad priority accepted\n", s);
+    exit(1);
+  }
+  if(setpriority(0x7fffffff, 0) != -1){
+    printf("%s: setpriority of a missing pid succeeded\n", s);
+    exit(1);
+  }
+  if(setpriority(getpid(), 0) != 0){
+    printf("%s: setpriority failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NHOG; i++){
+    pids[i] = fork();
+    if(pids[i] < 0){
       printf("%s: fork failed\n", s);
       exit(1);
     }
-    if(pid){
-      int xstate;
-      if(wait(&xstate) != pid){
-        printf("%s: wait wrong pid\n", s);
-        exit(1);
-      }
-      if(i != xstate) {
-        printf("%s: wait wrong exit status\n", s);
-        exit(1);
-      }
-    } else {
-      exit(i);
+    if(pids[i] == 0){
+      setpriority(getpid(), NPRIO-1);
+      for(;;)
+        ;
     }
   }
+  t0 = uptime();
+  for(i = 0; i < 10; i++)
+    sleep(1);
+  t1 = uptime();
+  for(i = 0; i < NHOG; i++){
+    kill(pids[i]);
+    wait(0);
+  }
+  setpriority(getpid(), -1);
+  if(t1 - t0 > 40){
+    printf("%s: 10 sleeps of a tick took %d ticks\n", s, t1 - t0);
+    exit(1);
+  }
+  exit(0);
 }
 
-// try to find races in the reparenting
-// code that handles a parent exiting
-// when it still has live children.
+// processes pinned to each CPU in turn run there, and only there.
 void
-reparent(char *s)
+affinity(char *s)
 {
-  int master_pid = getpid();
-  for(int i = 0; i < 200; i++){
-    int pid = fork();
+  volatile struct usyscall *u = (struct usyscall*)USYSCALL;
+  int i, pid, xst;
+  volatile int j;
+
+  if(setaffinity(getpid(), 0) != -1){
+    printf("%s: empty affinity accepted\n", s);
+    exit(1);
+  }
+  if(setaffinity(0x7fffffff, 1) != -1){
+    printf("%s: setaffinity of a missing pid succeeded\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCPU; i++){
+    pid = fork();
     if(pid < 0){
       printf("%s: fork failed\n", s);
       exit(1);
     }
-    if(pid){
-      if(wait(0) != pid){
-        printf("%s: wait wrong pid\n", s);
+    if(pid == 0){
+      // a CPU that isn't running can't be chosen.
+      if(setaffinity(getpid(), 1 << i) < 0)
+        exit(0);
+      if(u->cpu != i){
+        printf("%s: pinned to cpu %d but on %d\n", s, i, u->cpu);
         exit(1);
       }
-    } else {
-      int pid2 = fork();
-      if(pid2 < 0){
-        kill(master_pid);
+      for(j = 0; j < 1000000; j++)
+        ;
+      sleep(1);
+      // back from a sleep, and so from the run queues.
+      if(u->cpu != i){
+        printf("%s: pinned to cpu %d but woke on %d\n", s, i, u->cpu);
         exit(1);
       }
       exit(0);
     }
   }
+  for(i = 0; i < NCPU; i++){
+    wait(&xst);
+    if(xst != 0)
+      exit(1);
+  }
+  if(setaffinity(getpid(), 1) != 0 || setaffinity(getpid(), ~0) != 0){
+    printf("%s: setaffinity failed\n", s);
+    exit(1);
+  }
   exit(0);
 }
 
-// what if two children exit() at the same time?
+// sleep(n) wakes up after n ticks, not much later, even when
+// nothing else runs and the CPUs stop their ticks.
 void
-twochildren(char *s)
+sleeptime(char *s)
 {
-  for(int i = 0; i < 1000; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("%s: fork failed\n", s);
+  int n, t0, t1;
+
+  for(n = 1; n <= 4; n++){
+    t0 = uptime();
+    if(sleep(n) < 0){
+      printf("%s: sleep failed\n", s);
       exit(1);
     }
-    if(pid1 == 0){
-      exit(0);
-    } else {
+    t1 = uptime();
+    if(t1 - t0 < n || t1 - t0 > n + 3){
+      printf("%s: sleep(%d) took %d ticks\n", s, n, t1 - t0);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// the USYSCALL page matches the system calls, and is read-only.
+void
+usyscall(char *s)
+{
+  int pid, xst, t0, t1;
+
+  if(ugetpid() != getpid()){
+    printf("%s: ugetpid() %d, getpid() %d\n", s, ugetpid(), getpid());
+    exit(1);
+  }
+  t0 = uptime();
+  t1 = uuptime();
+  if(t1 < t0 || t1 > uptime()){
+    printf("%s: uuptime() %d, uptime() %d\n", s, t1, t0);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(ugetpid() != getpid())
+      exit(1);
+    *(volatile int*)USYSCALL = 0;
+    exit(2);
+  }
+  wait(&xst);
+  if(xst != -1){
+    printf("%s: child exit status %d, not killed\n", s, xst);
+    exit(1);
+  }
+}
+
+// the trace device records this process's system calls.
+void
+tracetest(char *s)
+{
+  static struct tracerec r[32];
+  int fd, i, n, pid, found;
+
+  if((fd = open("/trace", O_RDWR)) < 0){
+    mknod("/trace", TRACE, 0);
+    if((fd = open("/trace", O_RDWR)) < 0){
+      printf("%s: cannot open /trace\n", s);
+      exit(1);
+    }
+  }
+  if(write(fd, "x", 1) != -1){
+    printf("%s: trace device accepted 'x'\n", s);
+    exit(1);
+  }
+  // skip what earlier tracing left.
+  while(read(fd, r, sizeof(r)) > 0)
+    ;
+
+  if(write(fd, "1", 1) != 1){
+    printf("%s: cannot start tracing\n", s);
+    exit(1);
+  }
+  pid = getpid();
+  write(fd, "0", 1);
+
+  found = 0;
+  while((n = read(fd, r, sizeof(r))) > 0){
+    if(n % sizeof(r[0]) != 0){
+      printf("%s: read returned part of a record\n", s);
+      exit(1);
+    }
+    for(i = 0; i < n / sizeof(r[0]); i++){
+      if(r[i].type == TR_SYSCALL && r[i].pid == pid &&
+         r[i].a == SYS_getpid && r[i].b == pid)
+        found = 1;
+    }
+  }
+  if(n < 0){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  if(!found){
+    printf("%s: no record of getpid()\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// sysstats() counts this process's system calls, and everyone's.
+void
+sysstatstest(char *s)
+{
+  static struct sysstat mine[NSYSCALL], all[NSYSCALL];
+  uint64 before;
+  int i, n;
+
+  if(sysstats(0, all, NSYSCALL) != NSYSCALL){
+    printf("%s: sysstats failed\n", s);
+    exit(1);
+  }
+  before = all[SYS_getpid].count;
+  for(i = 0; i < 10; i++)
+    getpid();
+  n = sysstats(getpid(), mine, NSYSCALL);
+  if(n != NSYSCALL || sysstats(0, all, NSYSCALL) != NSYSCALL){
+    printf("%s: sysstats failed\n", s);
+    exit(1);
+  }
+  // the getpid() that was sysstats()'s argument counts too.
+  if(mine[SYS_getpid].count != 11){
+    printf("%s: %d getpid()s counted, not 11\n", s, (int)mine[SYS_getpid].count);
+    exit(1);
+  }
+  if(all[SYS_getpid].count < before + 11){
+    printf("%s: all processes' getpid() count too low\n", s);
+    exit(1);
+  }
+  n = 0;
+  for(i = 0; i < NSYSHIST; i++)
+    n += all[SYS_getpid].hist[i];
+  if(n < before + 11){
+    printf("%s: histogram has only %d calls\n", s, n);
+    exit(1);
+  }
+  if(sysstats(-1, mine, NSYSCALL) != -1){
+    printf("%s: sysstats(-1) succeeded\n", s);
+    exit(1);
+  }
+}
+
+// getrusage() counts this process's file bytes, system calls,
+// and page faults.
+void
+rusagetest(char *s)
+{
+  struct rusage a, b;
+  char data[100];
+  int fd;
+
+  if(getrusage(getpid(), &a, 1) != 1){
+    printf("%s: getrusage failed\n", s);
+    exit(1);
+  }
+  unlink("rusage.out");
+  if((fd = open("rusage.out", O_CREATE|O_RDWR)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  memset(data, 'x', sizeof(data));
+  if(write(fd, data, sizeof(data)) != sizeof(data) ||
+     pread(fd, data, sizeof(data), 0) != sizeof(data)){
+    printf("%s: write/read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("rusage.out");
+  // copy-on-write after the fork that started this test.
+  buf[BUFSZ-1] = 1;
+  if(getrusage(getpid(), &b, 1) != 1){
+    printf("%s: getrusage failed\n", s);
+    exit(1);
+  }
+  if(b.pid != getpid() || strcmp(b.name, "usertests") != 0){
+    printf("%s: wrong process %d %s\n", s, b.pid, b.name);
+    exit(1);
+  }
+  if(b.wbytes - a.wbytes < sizeof(data) || b.rbytes - a.rbytes < sizeof(data)){
+    printf("%s: %d bytes written, %d read\n", s,
+           (int)(b.wbytes - a.wbytes), (int)(b.rbytes - a.rbytes));
+    exit(1);
+  }
+  if(b.syscalls - a.syscalls < 6 || b.faults == a.faults || b.cputime < a.cputime){
+    printf("%s: syscalls, faults or cputime not counted\n", s);
+    exit(1);
+  }
+  if(getrusage(-1, &a, 1) != -1){
+    printf("%s: getrusage(-1) succeeded\n", s);
+    exit(1);
+  }
+}
+
+// test if child is killed (status = -1)
+void
+killstatus(char *s)
+{
+  int xst;
+  
+  for(int i = 0; i < 100; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid1 == 0){
+      while(1) {
+        getpid();
+      }
+      exit(0);
+    }
+    sleep(1);
+    kill(pid1);
+    wait(&xst);
+    if(xst != -1) {
+       printf("%s: status should be -1\n", s);
+       exit(1);
+    }
+  }
+  exit(0);
+}
+
+// meant to be run w/ at most two CPUs
+void
+preempt(char *s)
+{
+  int pid1, pid2, pid3;
+  int pfds[2];
+
+  pid1 = fork();
+  if(pid1 < 0) {
+    printf("%s: fork failed", s);
+    exit(1);
+  }
+  if(pid1 == 0)
+    for(;;)
+      ;
+
+  pid2 = fork();
+  if(pid2 < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid2 == 0)
+    for(;;)
+      ;
+
+  pipe(pfds);
+  pid3 = fork();
+  if(pid3 < 0) {
+     printf("%s: fork failed\n", s);
+     exit(1);
+  }
+  if(pid3 == 0){
+    close(pfds[0]);
+    if(write(pfds[1], "x", 1) != 1)
+      printf("%s: preempt write error", s);
+    close(pfds[1]);
+    for(;;)
+      ;
+  }
+
+  close(pfds[1]);
+  if(read(pfds[0], buf, sizeof(buf)) != 1){
+    printf("%s: preempt read error", s);
+    return;
+  }
+  close(pfds[0]);
+  printf("kill... ");
+  kill(pid1);
+  kill(pid2);
+  kill(pid3);
+  printf("wait... ");
+  wait(0);
+  wait(0);
+  wait(0);
+}
+
+// try to find any races between exit and wait
+void
+exitwait(char *s)
+{
+  int i, pid;
+
+  for(i = 0; i < 100; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid){
+      int xstate;
+      if(wait(&xstate) != pid){
+        printf("%s: wait wrong pid\n", s);
+        exit(1);
+      }
+      if(i != xstate) {
+        printf("%s: wait wrong exit status\n", s);
+        exit(1);
+      }
+    } else {
+      exit(i);
+    }
+  }
+}
+
+// try to find races in the reparenting
+// code that handles a parent exiting
+// when it still has live children.
+void
+reparent(char *s)
+{
+  int master_pid = getpid();
+  for(int i = 0; i < 200; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid){
+      if(wait(0) != pid){
+        printf("%s: wait wrong pid\n", s);
+        exit(1);
+      }
+    } else {
+      int pid2 = fork();
+      if(pid2 < 0){
+        kill(master_pid);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  exit(0);
+}
+
+// what if two children exit() at the same time?
+void
+twochildren(char *s)
+{
+  for(int i = 0; i < 1000; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid1 == 0){
+      exit(0);
+    } else {
       int pid2 = fork();
       if(pid2 < 0){
         printf("%s: fork failed\n", s);
         exit(1);
       }
-      if(pid2 == 0){
-        exit(0);
-      } else {
-        wait(0);
-        wait(0);
+      if(pid2 == 0){
+        exit(0);
+      } else {
+        wait(0);
+        wait(0);
+      }
+    }
+  }
+}
+
+// parent and child share memory copy-on-write after fork;
+// check that each one's stores, including those the kernel
+// makes for read(), stay private.
+void
+cowfork(char *s)
+{
+  enum { NPAGE = 256 };
+  char *p, *a;
+  int i, pid, fds[2], xstatus;
+
+  p = sbrk(NPAGE*PGSIZE);
+  if(p == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NPAGE; i++)
+    p[i*PGSIZE] = 'p' + i;
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    for(i = 0; i < NPAGE; i++){
+      if(p[i*PGSIZE] != (char)('p' + i)){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    for(i = 0; i < NPAGE; i += 2)
+      p[i*PGSIZE] = 'c';
+    if(read(fds[0], p + PGSIZE + 1, 1) != 1){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(i = 0; i < NPAGE; i++){
+      if(p[i*PGSIZE] != (i % 2 ? (char)('p' + i) : 'c')){
+        printf("%s: child lost its own store\n", s);
+        exit(1);
+      }
+    }
+    if(p[PGSIZE+1] != 'x'){
+      printf("%s: read into shared page failed\n", s);
+      exit(1);
+    }
+    exit(0);
+  }
+
+  close(fds[0]);
+  for(i = 1; i < NPAGE; i += 2)
+    p[i*PGSIZE] = 'q';
+  if(write(fds[1], "x", 1) != 1){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(i = 0; i < NPAGE; i++){
+    if(p[i*PGSIZE] != (i % 2 ? 'q' : (char)('p' + i))){
+      printf("%s: parent sees the child's store\n", s);
+      exit(1);
+    }
+  }
+  if(p[PGSIZE+1] == 'x'){
+    printf("%s: parent sees the child's read\n", s);
+    exit(1);
+  }
+
+  a = sbrk(-(NPAGE*PGSIZE));
+  if(a == (char*)-1){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// concurrent forks to try to expose locking bugs.
+void
+forkfork(char *s)
+{
+  enum { N=2 };
+  
+  for(int i = 0; i < N; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(int j = 0; j < 200; j++){
+        int pid1 = fork();
+        if(pid1 < 0){
+          exit(1);
+        }
+        if(pid1 == 0){
+          exit(0);
+        }
+        wait(0);
+      }
+      exit(0);
+    }
+  }
+
+  int xstatus;
+  for(int i = 0; i < N; i++){
+    wait(&xstatus);
+    if(xstatus != 0) {
+      printf("%s: fork in child failed", s);
+      exit(1);
+    }
+  }
+}
+
+void
+forkforkfork(char *s)
+{
+  unlink("stopforking");
+
+  int pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed", s);
+    exit(1);
+  }
+  if(pid == 0){
+    while(1){
+      int fd = open("stopforking", 0);
+      if(fd >= 0){
+        exit(0);
+      }
+      if(fork() < 0){
+        close(open("stopforking", O_CREATE|O_RDWR));
+      }
+    }
+
+    exit(0);
+  }
+
+  sleep(20); // two seconds
+  close(open("stopforking", O_CREATE|O_RDWR));
+  wait(0);
+  sleep(10); // one second
+}
+
+// regression test. does reparent() violate the parent-then-child
+// locking order when giving away a child to init, so that exit()
+// deadlocks against init's wait()? also used to trigger a "panic:
+// release" due to exit() releasing a different p->parent->lock than
+// it acquired.
+void
+reparent2(char *s)
+{
+  for(int i = 0; i < 800; i++){
+    int pid1 = fork();
+    if(pid1 < 0){
+      printf("fork failed\n");
+      exit(1);
+    }
+    if(pid1 == 0){
+      fork();
+      fork();
+      exit(0);
+    }
+    wait(0);
+  }
+
+  exit(0);
+}
+
+// spawn() starts a program with the descriptors it's given in
+// place of the caller's.
+void
+spawntest(char *s)
+{
+  int fd, pid, xstatus, n;
+  char *args[] = { "echo", "spawned", 0 };
+  char *nope[] = { "nosuchprogram", 0 };
+  int fds[3];
+
+  unlink("spawnout");
+  fd = open("spawnout", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  fds[0] = -1;
+  fds[1] = fd;
+  fds[2] = 2;
+  pid = spawn("echo", args, fds, 3);
+  close(fd);
+  if(pid < 0){
+    printf("%s: spawn failed\n", s);
+    exit(1);
+  }
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+  fd = open("spawnout", O_RDONLY);
+  n = read(fd, buf, sizeof(buf));
+  close(fd);
+  unlink("spawnout");
+  if(n != 8 || memcmp(buf, "spawned\n", 8) != 0){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+
+  if(spawn("nosuchprogram", nope, 0, -1) != -1){
+    printf("%s: spawned a missing program\n", s);
+    exit(1);
+  }
+  fds[1] = NOFILE-1;
+  if(spawn("echo", args, fds, 3) != -1){
+    printf("%s: spawn with a closed fd\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: a child was left over\n", s);
+    exit(1);
+  }
+}
+
+// clone()d threads share memory: each adds to a counter under a
+// lock built on a futex, and no increment is lost. A process
+// that exits takes its threads with it.
+static int tcount;
+static int tlock;
+
+static void
+threadadd(void *arg)
+{
+  int i;
+
+  for(i = 0; i < *(int*)arg; i++){
+    while(__sync_lock_test_and_set(&tlock, 1))
+      futex_wait(&tlock, 1);
+    tcount++;
+    __sync_lock_release(&tlock);
+    futex_wake(&tlock, 1);
+  }
+}
+
+static void
+threadspin(void *arg)
+{
+  for(;;)
+    ;
+}
+
+void
+threadtest(char *s)
+{
+  enum { NT=4, N=1000 };
+  int i, n, pid, xstatus;
+  char *args[] = { "echo", 0 };
+
+  n = N;
+  for(i = 0; i < NT; i++){
+    if(thread_create(threadadd, &n) < 0){
+      printf("%s: thread_create failed\n", s);
+      exit(1);
+    }
+  }
+  for(i = 0; i < NT; i++){
+    if(thread_join() < 0){
+      printf("%s: thread_join failed\n", s);
+      exit(1);
+    }
+  }
+  if(thread_join() != -1){
+    printf("%s: joined a thread that wasn't there\n", s);
+    exit(1);
+  }
+  if(tcount != NT*N){
+    printf("%s: count %d, not %d\n", s, tcount, NT*N);
+    exit(1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(thread_create(threadspin, 0) < 0)
+      exit(1);
+    // it would leave the thread without its memory.
+    if(exec("echo", args) != -1)
+      exit(2);
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child failed %d\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// blocks of every size class and a few large ones don't
+// overlap, and freed ones are handed out again.
+void
+mallocsizes(char *s)
+{
+  enum { N=40 };
+  char *p[N], *q;
+  int i, j, sz;
+
+  for(i = 0; i < N; i++){
+    sz = i < N-4 ? (1 << (i % 12)) + i : 5000 + i;
+    if((p[i] = malloc(sz)) == 0){
+      printf("%s: malloc(%d) failed\n", s, sz);
+      exit(1);
+    }
+    memset(p[i], i, sz);
+  }
+  for(i = 0; i < N; i++){
+    sz = i < N-4 ? (1 << (i % 12)) + i : 5000 + i;
+    for(j = 0; j < sz; j++){
+      if(p[i][j] != (char)i){
+        printf("%s: block %d overwritten\n", s, i);
+        exit(1);
+      }
+    }
+  }
+  q = p[3];
+  free(q);
+  if(malloc((1 << 3) + 3) != q){
+    printf("%s: freed block not reused\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    free(p[i]);
+}
+
+// processes making and closing pipes at once, as the object
+// caches hand struct file and struct pipe back and forth
+// between CPUs; each pipe still carries its own data.
+void
+pipecache(char *s)
+{
+  enum { NCHILD=4, N=200 };
+  int i, j, fds[NCHILD][2], xstatus;
+  char c;
+
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < N; j++){
+        int k = j % NCHILD;
+        if(pipe(fds[k]) < 0){
+          printf("%s: pipe failed\n", s);
+          exit(1);
+        }
+        c = 'a' + i;
+        if(write(fds[k][1], &c, 1) != 1 || read(fds[k][0], &c, 1) != 1 ||
+           c != 'a' + i){
+          printf("%s: pipe lost its data\n", s);
+          exit(1);
+        }
+        close(fds[k][0]);
+        close(fds[k][1]);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+}
+
+// buffered output is written once, by the process that wrote
+// it, even when it forks before flushing; fgets() reads lines
+// back through its own buffer.
+void
+stdiotest(char *s)
+{
+  int fds[2], fd, pid, n, xstatus;
+  char buf[64];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    fprintf(fds[1], "one ");
+    if(fork() == 0){
+      fprintf(fds[1], "two ");
+      exit(0);
+    }
+    wait(0);
+    fprintf(fds[1], "three");
+    exit(0);
+  }
+  close(fds[1]);
+  n = 0;
+  while(n < sizeof(buf) - 1 && (xstatus = read(fds[0], buf+n, sizeof(buf)-1-n)) > 0)
+    n += xstatus;
+  buf[n] = 0;
+  close(fds[0]);
+  wait(&xstatus);
+  if(xstatus != 0 || strcmp(buf, "one two three") != 0){
+    printf("%s: read back \"%s\"\n", s, buf);
+    exit(1);
+  }
+
+  if((fd = open("stdio", O_CREATE|O_WRONLY)) < 0){
+    printf("%s: create stdio failed\n", s);
+    exit(1);
+  }
+  for(n = 0; n < 100; n++)
+    fprintf(fd, "line %d\n", n);
+  close(fd);
+  if((fd = open("stdio", O_RDONLY)) < 0){
+    printf("%s: open stdio failed\n", s);
+    exit(1);
+  }
+  for(n = 0; n < 100; n++){
+    fgets(fd, buf, sizeof(buf));
+    if(strlen(buf) < 6 || memcmp(buf, "line ", 5) != 0 || atoi(buf+5) != n){
+      printf("%s: line %d is \"%s\"\n", s, n, buf);
+      exit(1);
+    }
+  }
+  if(*fgets(fd, buf, sizeof(buf)) != 0){
+    printf("%s: read past the end\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("stdio");
+}
+
+// getdents() lists a directory's entries in use with their
+// types, however small the buffer, and fstatat() finds a name
+// relative to the directory.
+void
+getdentstest(char *s)
+{
+  enum { N=20 };
+  struct dent de[3];
+  struct stat st;
+  char name[8];
+  int fd, i, n, k, nfile, ndir, seen[N];
+
+  if(mkdir("dents") < 0 || mkdir("dents/sub") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  memmove(name, "dents/", 6);
+  name[7] = 0;
+  for(i = 0; i < N; i++){
+    name[6] = 'a' + i;
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    write(fd, name, i % 8);
+    close(fd);
+  }
+  unlink("dents/b");   // leaves an entry not in use
+
+  if((fd = open("dents", O_RDONLY)) < 0){
+    printf("%s: open dents failed\n", s);
+    exit(1);
+  }
+  memset(seen, 0, sizeof(seen));
+  nfile = ndir = 0;
+  while((n = getdents(fd, de, sizeof(de))) > 0){
+    for(k = 0; k < n / sizeof(de[0]); k++){
+      if(de[k].type == T_DIR){
+        ndir++;
+        continue;
+      }
+      if(de[k].inum == 0 || de[k].type != T_FILE || de[k].name[1] != 0 ||
+         de[k].name[0] < 'a' || de[k].name[0] >= 'a' + N){
+        printf("%s: bad entry %s type %d\n", s, de[k].name, de[k].type);
+        exit(1);
+      }
+      seen[de[k].name[0] - 'a']++;
+      nfile++;
+    }
+  }
+  if(n < 0 || ndir != 3 || nfile != N-1 || seen[1] != 0){
+    printf("%s: listed %d dirs, %d files\n", s, ndir, nfile);
+    exit(1);
+  }
+  if(fstatat(fd, "h", &st) < 0 || st.type != T_FILE || st.size != 7 ||
+     fstatat(fd, "sub/..", &st) < 0 || st.type != T_DIR ||
+     fstatat(fd, "b", &st) == 0){
+    printf("%s: fstatat failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("dents/c", O_RDONLY)) < 0 || getdents(fd, de, sizeof(de)) >= 0){
+    printf("%s: getdents of a file succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for(i = 0; i < N; i++){
+    name[6] = 'a' + i;
+    unlink(name);
+  }
+  unlink("dents/sub");
+  unlink("dents");
+}
+
+// pread() and pwrite() use their own offset and leave the file's
+// alone; readv() and writev() fill and drain buffers in order.
+void
+preadtest(char *s)
+{
+  char a[100], b[300], c[50];
+  struct iovec iov[3];
+  int fd, i;
+
+  for(i = 0; i < sizeof(a); i++)
+    a[i] = 'a' + i % 26;
+  if((fd = open("pread", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  iov[0].base = a;
+  iov[0].len = sizeof(a);
+  iov[1].base = a;
+  iov[1].len = 0;
+  iov[2].base = a + 10;
+  iov[2].len = 20;
+  if(writev(fd, iov, 3) != sizeof(a) + 20){
+    printf("%s: writev failed\n", s);
+    exit(1);
+  }
+  if(pwrite(fd, "XY", 2, 5) != 2 || pread(fd, c, 10, 110) != 10 ||
+     memcmp(c, a + 20, 10) != 0){
+    printf("%s: pread/pwrite failed\n", s);
+    exit(1);
+  }
+  // the offset is still at the end.
+  if(write(fd, "!", 1) != 1 || pread(fd, c, 5, 118) != 3 ||
+     memcmp(c, "cd!", 3) != 0){
+    printf("%s: pwrite moved the offset\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  if((fd = open("pread", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  iov[0].base = c;
+  iov[0].len = 7;
+  iov[1].base = b;
+  iov[1].len = sizeof(b);
+  iov[2].base = c + 10;
+  iov[2].len = 10;
+  if(readv(fd, iov, 3) != 121 || memcmp(c, "abcdeXY", 7) != 0 ||
+     memcmp(b, a + 7, 93) != 0 || b[113] != '!'){
+    printf("%s: readv failed\n", s);
+    exit(1);
+  }
+  if(readv(fd, iov, IOV_MAX + 1) != -1){
+    printf("%s: readv took too many buffers\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("pread");
+}
+
+// writes to an O_ASYNC file read back at once, fsync() waits
+// for them, and files of both kinds can be fsync()ed.
+void
+asyncwrite(char *s)
+{
+  char buf[BSIZE];
+  int fd, fds[2], i;
+
+  if((fd = open("async", O_CREATE|O_RDWR|O_ASYNC)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 8; i++){
+    memset(buf, 'a' + i, sizeof(buf));
+    if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 8; i++){
+    if(pread(fd, buf, sizeof(buf), i * BSIZE) != sizeof(buf) ||
+       buf[0] != 'a' + i || buf[BSIZE-1] != 'a' + i){
+      printf("%s: block %d wrong\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  if(pipe(fds) < 0 || fsync(fds[0]) != 0 || fsync(-1) != -1){
+    printf("%s: fsync of a pipe\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink("async");
+  if(fsync(0) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+}
+
+// two files growing at the same time, a block each in turn,
+// each in its own allocation window, and so in a few long
+// extents rather than 40 one-block ones; then a third one in
+// the space the first leaves.
+void
+interleave(char *s)
+{
+  char buf[BSIZE];
+  char *names[3] = { "il0", "il1", "il2" };
+  struct stat st;
+  int fd[3], i, j;
+
+  for(j = 0; j < 2; j++){
+    if((fd[j] = open(names[j], O_CREATE|O_RDWR)) < 0){
+      printf("%s: create %s failed\n", s, names[j]);
+      exit(1);
+    }
+  }
+  for(i = 0; i < 40; i++){
+    for(j = 0; j < 2; j++){
+      memset(buf, 'a' + i % 26 + j, sizeof(buf));
+      if(write(fd[j], buf, sizeof(buf)) != sizeof(buf)){
+        printf("%s: write %s failed\n", s, names[j]);
+        exit(1);
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    if(fstat(fd[j], &st) < 0 || st.nextent == 0 || st.nextent > 4){
+      printf("%s: %s in %d extents\n", s, names[j], st.nextent);
+      exit(1);
+    }
+  }
+  close(fd[0]);
+  unlink(names[0]);
+  if((fd[2] = open(names[2], O_CREATE|O_RDWR)) < 0){
+    printf("%s: create %s failed\n", s, names[2]);
+    exit(1);
+  }
+  for(i = 0; i < 40; i++){
+    memset(buf, 'a' + i % 26 + 2, sizeof(buf));
+    if(write(fd[2], buf, sizeof(buf)) != sizeof(buf)){
+      printf("%s: write %s failed\n", s, names[2]);
+      exit(1);
+    }
+  }
+  if(fstat(fd[2], &st) < 0 || st.nextent == 0 || st.nextent > 4){
+    printf("%s: %s in %d extents\n", s, names[2], st.nextent);
+    exit(1);
+  }
+  for(j = 1; j < 3; j++){
+    for(i = 0; i < 40; i++){
+      if(pread(fd[j], buf, sizeof(buf), i * BSIZE) != sizeof(buf) ||
+         buf[0] != 'a' + i % 26 + j || buf[BSIZE-1] != 'a' + i % 26 + j){
+        printf("%s: %s block %d wrong\n", s, names[j], i);
+        exit(1);
       }
     }
+    close(fd[j]);
+    unlink(names[j]);
   }
 }
 
-// concurrent forks to try to expose locking bugs.
+// a small file kept in its inode, growing out of it and then
+// truncated back into it, and full ones read with a shared lock.
 void
-forkfork(char *s)
+inlinefile(char *s)
 {
-  enum { N=2 };
-  
-  for(int i = 0; i < N; i++){
-    int pid = fork();
-    if(pid < 0){
-      printf("%s: fork failed", s);
+  char buf[100], name[8];
+  struct dent de[4];
+  struct stat st;
+  int fd, i, n, k, nfile;
+
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  if((fd = open("inl", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  if(write(fd, buf, 10) != 10 || write(fd, buf + 10, 20) != 20){
+    printf("%s: small write failed\n", s);
+    exit(1);
+  }
+  memset(buf + 50, 0, 50);
+  if(pread(fd, buf + 50, 50, 0) != 30 || memcmp(buf, buf + 50, 30) != 0){
+    printf("%s: small read wrong\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf + 30, 70) != 70){
+    printf("%s: growing write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("inl", O_RDONLY);
+  memset(buf, 0, sizeof(buf));
+  if(read(fd, buf, sizeof(buf)) != 100){
+    printf("%s: read after growing failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++){
+    if(buf[i] != 'a' + i % 26){
+      printf("%s: byte %d wrong after growing\n", s, i);
       exit(1);
     }
-    if(pid == 0){
-      for(int j = 0; j < 200; j++){
-        int pid1 = fork();
-        if(pid1 < 0){
-          exit(1);
-        }
-        if(pid1 == 0){
-          exit(0);
-        }
-        wait(0);
-      }
-      exit(0);
-    }
   }
+  close(fd);
+  if((fd = open("inl", O_RDWR|O_TRUNC)) < 0 || write(fd, "xyz", 3) != 3){
+    printf("%s: truncate and rewrite failed\n", s);
+    exit(1);
+  }
+  if(pread(fd, buf, sizeof(buf), 0) != 3 || buf[0] != 'x' || buf[2] != 'z'){
+    printf("%s: read after truncate wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("inl");
 
-  int xstatus;
-  for(int i = 0; i < N; i++){
-    wait(&xstatus);
-    if(xstatus != 0) {
-      printf("%s: fork in child failed", s);
+  // files as big as an inline file gets, whose data fills the
+  // inode's extents, first looked at by read(), fstatat() and
+  // getdents() with the inode locked shared.
+  if(mkdir("inld") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  strcpy(name, "inld/a");
+  for(i = 0; i < 3; i++){
+    name[5] = 'a' + i;
+    if((fd = open(name, O_CREATE|O_WRONLY)) < 0 ||
+       write(fd, buf, INLINESIZE) != INLINESIZE){
+      printf("%s: create %s failed\n", s, name);
       exit(1);
     }
+    close(fd);
+  }
+  memset(buf + 50, 0, 50);
+  if((fd = open("inld/a", O_RDONLY)) < 0 ||
+     read(fd, buf + 50, 50) != INLINESIZE || memcmp(buf, buf + 50, INLINESIZE) != 0){
+    printf("%s: read of full inline file wrong\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("inld", O_RDONLY)) < 0){
+    printf("%s: open inld failed\n", s);
+    exit(1);
   }
+  if(fstatat(fd, "b", &st) < 0 || st.type != T_FILE || st.size != INLINESIZE){
+    printf("%s: fstatat of full inline file wrong\n", s);
+    exit(1);
+  }
+  nfile = 0;
+  while((n = getdents(fd, de, sizeof(de))) > 0)
+    for(k = 0; k < n / sizeof(de[0]); k++)
+      if(de[k].type == T_FILE)
+        nfile++;
+  if(n < 0 || nfile != 3){
+    printf("%s: getdents found %d inline files, not 3\n", s, nfile);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < 3; i++){
+    name[5] = 'a' + i;
+    unlink(name);
+  }
+  unlink("inld");
 }
 
+// a directory big enough for a hash index, with names
+// unlinked and linked again.
 void
-forkforkfork(char *s)
+dirindex(char *s)
 {
-  unlink("stopforking");
+  char name[16];
+  int fd, i, round;
 
-  int pid = fork();
-  if(pid < 0){
-    printf("%s: fork failed", s);
+  if(mkdir("dx") < 0 || (fd = open("dx/f", O_CREATE|O_RDWR)) < 0){
+    printf("%s: mkdir or create failed\n", s);
     exit(1);
   }
-  if(pid == 0){
-    while(1){
-      int fd = open("stopforking", 0);
-      if(fd >= 0){
-        exit(0);
+  close(fd);
+  strcpy(name, "dx/l");
+  for(i = 0; i < 200; i++){
+    name[4] = 'a' + i / 26 % 26;
+    name[5] = 'a' + i % 26;
+    name[6] = '\0';
+    if(link("dx/f", name) < 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(round = 0; round < 2; round++){
+    for(i = 0; i < 200; i += 2){
+      name[4] = 'a' + i / 26 % 26;
+      name[5] = 'a' + i % 26;
+      if(round == 0 && unlink(name) < 0){
+        printf("%s: unlink %s failed\n", s, name);
+        exit(1);
       }
-      if(fork() < 0){
-        close(open("stopforking", O_CREATE|O_RDWR));
+      if(round == 1 && link("dx/f", name) < 0){
+        printf("%s: relink %s failed\n", s, name);
+        exit(1);
+      }
+    }
+    for(i = 0; i < 200; i++){
+      name[4] = 'a' + i / 26 % 26;
+      name[5] = 'a' + i % 26;
+      fd = open(name, O_RDONLY);
+      if((fd >= 0) != (round == 1 || i % 2 == 1)){
+        printf("%s: %s %s\n", s, name, fd >= 0 ? "still there" : "missing");
+        exit(1);
       }
+      close(fd);
+    }
+  }
+  for(i = 0; i < 200; i++){
+    name[4] = 'a' + i / 26 % 26;
+    name[5] = 'a' + i % 26;
+    unlink(name);
+  }
+  unlink("dx/f");
+  if(unlink("dx") < 0){
+    printf("%s: unlink dx failed\n", s);
+    exit(1);
+  }
+}
+
+// files, directories and links on the tmpfs at /tmp, and
+// getting back out of it with "..".
+void
+tmpfs(char *s)
+{
+  static char buf[3*PGSIZE/2 + 10];
+  struct stat st, rst;
+  int fd, i;
+
+  if(stat("/tmp", &st) < 0 || st.type != T_DIR || stat("/", &rst) < 0){
+    printf("%s: no /tmp\n", s);
+    exit(1);
+  }
+  if(st.dev == rst.dev){
+    printf("%s: /tmp not mounted\n", s);
+    exit(1);
+  }
+  if(mkdir("/tmp/td") < 0 || (fd = open("/tmp/td/f", O_CREATE|O_RDWR)) < 0){
+    printf("%s: create in /tmp failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = i % 251;
+  if(write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  memset(buf, 0, sizeof(buf));
+  if((fd = open("/tmp/td/f", O_RDONLY)) < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: read back failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++){
+    if(buf[i] != (char)(i % 251)){
+      printf("%s: byte %d wrong\n", s, i);
+      exit(1);
     }
+  }
+  close(fd);
+  if(link("/tmp/td/f", "/tmp/td/g") < 0 || link("/tmp/td/f", "tmpfsx") == 0){
+    printf("%s: link within /tmp failed, or out of it worked\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp/td/f") < 0 || (fd = open("/tmp/td/g", O_RDWR|O_TRUNC)) < 0){
+    printf("%s: second link lost\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(chdir("/tmp/td") < 0 || chdir("../..") < 0 || stat(".", &st) < 0 ||
+     st.dev != rst.dev || st.ino != rst.ino){
+    printf("%s: .. out of /tmp went wrong\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp/td") == 0 || unlink("/tmp/td/g") < 0 || unlink("/tmp/td") < 0){
+    printf("%s: unlink in /tmp went wrong\n", s);
+    exit(1);
+  }
+  if(unlink("/tmp") == 0){
+    printf("%s: unlinked the mount point\n", s);
+    exit(1);
+  }
+}
 
+// a process can hold many more descriptors than NOFILE, and
+// more than NFILE files can be open; the lowest free descriptor
+// is handed out, and fork() copies them all.
+void
+manyfds(char *s)
+{
+  enum { N = 1000, NF = 2*NFILE };
+  int i, fd, first, pid, xstatus;
+  struct stat st;
+
+  first = dup(0);
+  for(i = 1; i < N; i++){
+    if((fd = dup(0)) != first + i){
+      printf("%s: dup gave %d, not %d\n", s, fd, first + i);
+      exit(1);
+    }
+  }
+  close(first + N/2);
+  if(dup(0) != first + N/2){
+    printf("%s: freed descriptor not reused\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NF; i++){
+    if((fd = open(".", O_RDONLY)) != first + N + i){
+      printf("%s: open %d gave %d\n", s, i, fd);
+      exit(1);
+    }
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    if(fstat(first + N + NF - 1, &st) < 0 || st.type != T_DIR)
+      exit(1);
     exit(0);
   }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child lost descriptors\n", s);
+    exit(1);
+  }
+  for(i = first; i < first + N + NF; i++)
+    close(i);
+  if((fd = dup(0)) != first){
+    printf("%s: dup after closing gave %d\n", s, fd);
+    exit(1);
+  }
+  close(fd);
+}
 
-  sleep(20); // two seconds
-  close(open("stopforking", O_CREATE|O_RDWR));
+// poll() watches several pipes at once: it times out when none
+// has data, reports the one a child writes to, and sees a closed
+// writer; O_NONBLOCK reads of an empty pipe fail at once.
+void
+pollpipes(char *s)
+{
+  enum { N = 3 };
+  int p[N][2], i, pid;
+  struct pollfd fds[N];
+  char c;
+
+  for(i = 0; i < N; i++){
+    if(pipe(p[i]) < 0){
+      printf("%s: pipe failed\n", s);
+      exit(1);
+    }
+    fds[i].fd = p[i][0];
+    fds[i].events = POLLIN;
+  }
+  if(poll(fds, N, 2) != 0){
+    printf("%s: poll of empty pipes didn't time out\n", s);
+    exit(1);
+  }
+  if(fcntl(p[0][0], F_SETFL, O_NONBLOCK) < 0 ||
+     fcntl(p[0][0], F_GETFL, 0) != O_NONBLOCK || read(p[0][0], &c, 1) != -1){
+    printf("%s: non-blocking read waited or worked\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    sleep(2);
+    write(p[1][1], "x", 1);
+    exit(0);
+  }
+  if(poll(fds, N, -1) != 1 || fds[1].revents != POLLIN ||
+     fds[0].revents != 0 || fds[2].revents != 0){
+    printf("%s: poll missed the write\n", s);
+    exit(1);
+  }
   wait(0);
-  sleep(10); // one second
+  if(read(p[1][0], &c, 1) != 1 || c != 'x'){
+    printf("%s: read after poll failed\n", s);
+    exit(1);
+  }
+  close(p[2][1]);
+  if(poll(fds, N, -1) != 1 || (fds[2].revents & POLLHUP) == 0){
+    printf("%s: poll missed the closed writer\n", s);
+    exit(1);
+  }
+  fds[0].fd = p[0][1];
+  fds[0].events = POLLOUT;
+  if(poll(fds, 1, 0) != 1 || fds[0].revents != POLLOUT){
+    printf("%s: empty pipe not writable\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    close(p[i][0]);
+    if(i != 2)
+      close(p[i][1]);
+  }
 }
 
-// regression test. does reparent() violate the parent-then-child
-// locking order when giving away a child to init, so that exit()
-// deadlocks against init's wait()? also used to trigger a "panic:
-// release" due to exit() releasing a different p->parent->lock than
-// it acquired.
+// exec with many more arguments than the old limit of 32, all
+// copied to the new program's stack.
 void
-reparent2(char *s)
+manyargs(char *s)
 {
-  for(int i = 0; i < 800; i++){
-    int pid1 = fork();
-    if(pid1 < 0){
-      printf("fork failed\n");
+  static char *args[MAXARG];
+  char buf[2*MAXARG];
+  int i, n, fd, pid, xstatus;
+
+  unlink("manyargs.out");
+  for(i = 1; i < MAXARG-1; i++)
+    args[i] = "x";
+  args[0] = "echo";
+  args[MAXARG-1] = 0;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    if(open("manyargs.out", O_CREATE|O_WRONLY) != 1){
+      printf("%s: create failed\n", s);
       exit(1);
     }
-    if(pid1 == 0){
-      fork();
-      fork();
-      exit(0);
+    exec("echo", args);
+    printf("%s: exec with %d args failed\n", s, MAXARG-1);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if((fd = open("manyargs.out", O_RDONLY)) < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  n = read(fd, buf, sizeof(buf));
+  close(fd);
+  unlink("manyargs.out");
+  if(n != 2*(MAXARG-2)){
+    printf("%s: echo wrote %d bytes, not %d\n", s, n, 2*(MAXARG-2));
+    exit(1);
+  }
+  for(i = 0; i < n; i += 2){
+    if(buf[i] != 'x' || buf[i+1] != (i+2 < n ? ' ' : '\n')){
+      printf("%s: wrong output at %d\n", s, i);
+      exit(1);
     }
-    wait(0);
   }
-
-  exit(0);
 }
 
 // allocate all mem, free it, and allocate again
@@ -1212,6 +2826,87 @@ fourfiles(char *s)
   }
 }
 
+// processes read the same file at once, some through their
+// own opens (which share the inode lock) and some through one
+// shared fd (which mustn't hand the same bytes out twice).
+void
+sharedreads(char *s)
+{
+  enum { N=8, NCHILD=4, SZ=512 };
+  int fd, sfd, fds[2], pid, i, j, k, n, total, xstatus;
+  struct stat st;
+
+  unlink("sr/f");
+  unlink("sr");
+  if(mkdir("sr") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  fd = open("sr/f", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, 'a'+i, SZ);
+    if(write(fd, buf, SZ) != SZ){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  if(pipe(fds) < 0 || (sfd = open("sr/f", O_RDONLY)) < 0){
+    printf("%s: pipe or open failed\n", s);
+    exit(1);
+  }
+  for(k = 0; k < NCHILD; k++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(fds[0]);
+      for(j = 0; j < 10; j++){
+        if((fd = open("sr/f", O_RDONLY)) < 0)
+          exit(1);
+        if(fstat(fd, &st) < 0 || st.size != N*SZ)
+          exit(2);
+        for(i = 0; i < N; i++){
+          if(read(fd, buf, SZ) != SZ || buf[0] != 'a'+i || buf[SZ-1] != 'a'+i)
+            exit(3);
+        }
+        close(fd);
+      }
+      total = 0;
+      while((n = read(sfd, buf, SZ)) > 0)
+        total += n;
+      write(fds[1], &total, sizeof(total));
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  close(sfd);
+  total = 0;
+  while(read(fds[0], &n, sizeof(n)) == sizeof(n))
+    total += n;
+  close(fds[0]);
+  for(k = 0; k < NCHILD; k++){
+    wait(&xstatus);
+    if(xstatus != 0){
+      printf("%s: reader failed, status %d\n", s, xstatus);
+      exit(1);
+    }
+  }
+  if(total != N*SZ){
+    printf("%s: shared fd read %d bytes, not %d\n", s, total, N*SZ);
+    exit(1);
+  }
+  unlink("sr/f");
+  unlink("sr");
+}
+
 // four processes create and delete different files in same directory
 void
 createdelete(char *s)
@@ -1519,6 +3214,71 @@ linkunlink(char *s)
 }
 
 
+// look names up again after the directories holding them change,
+// to check that the kernel's name cache doesn't return stale
+// answers, including for missing names and for "..".
+void
+dirnames(char *s)
+{
+  struct stat st1, st2;
+  int fd;
+
+  unlink("dnx");
+  if(open("dnx", O_RDONLY) >= 0){
+    printf("%s: open dnx succeeded before create\n", s);
+    exit(1);
+  }
+  fd = open("dnx", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create dnx failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("dnx", O_RDONLY)) < 0){
+    printf("%s: open dnx failed after create\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dnx") < 0){
+    printf("%s: unlink dnx failed\n", s);
+    exit(1);
+  }
+  if(open("dnx", O_RDONLY) >= 0){
+    printf("%s: open dnx succeeded after unlink\n", s);
+    exit(1);
+  }
+
+  // a freed directory's inode is likely to be reused by the next
+  // mkdir, whose ".." must name its own parent.
+  if(mkdir("dna") < 0 || mkdir("dna/sub") < 0 || mkdir("dnb") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  if(stat("dna/sub/..", &st1) < 0){
+    printf("%s: stat dna/sub/.. failed\n", s);
+    exit(1);
+  }
+  if(unlink("dna/sub") < 0 || mkdir("dnb/sub") < 0){
+    printf("%s: unlink or mkdir failed\n", s);
+    exit(1);
+  }
+  if(stat("dnb/sub/..", &st1) < 0 || stat("dnb", &st2) < 0){
+    printf("%s: stat dnb failed\n", s);
+    exit(1);
+  }
+  if(st1.ino != st2.ino){
+    printf("%s: dnb/sub/.. is not dnb\n", s);
+    exit(1);
+  }
+  if(open("dna/sub", O_RDONLY) >= 0){
+    printf("%s: open dna/sub succeeded after unlink\n", s);
+    exit(1);
+  }
+  unlink("dnb/sub");
+  unlink("dnb");
+  unlink("dna");
+}
+
 void
 subdir(char *s)
 {
@@ -1725,6 +3485,59 @@ bigwrite(char *s)
 }
 
 
+// write two files a block at a time, in turn, so that neither
+// gets contiguous blocks and both run out of extents.
+void
+fragfiles(char *s)
+{
+  enum { N = 200 };
+  int fd[2], i, j;
+  char *names[2] = { "frag0", "frag1" };
+
+  for(j = 0; j < 2; j++){
+    unlink(names[j]);
+    fd[j] = open(names[j], O_CREATE | O_RDWR);
+    if(fd[j] < 0){
+      printf("%s: cannot create %s\n", s, names[j]);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    for(j = 0; j < 2; j++){
+      ((int*)buf)[0] = i;
+      ((int*)buf)[1] = j;
+      if(write(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: write %s failed\n", s, names[j]);
+        exit(1);
+      }
+    }
+  }
+  for(j = 0; j < 2; j++){
+    close(fd[j]);
+    fd[j] = open(names[j], O_RDONLY);
+    if(fd[j] < 0){
+      printf("%s: cannot open %s\n", s, names[j]);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      if(read(fd[j], buf, BSIZE) != BSIZE){
+        printf("%s: read %s failed\n", s, names[j]);
+        exit(1);
+      }
+      if(((int*)buf)[0] != i || ((int*)buf)[1] != j){
+        printf("%s: %s block %d has wrong content\n", s, names[j], i);
+        exit(1);
+      }
+    }
+    if(read(fd[j], buf, BSIZE) != 0){
+      printf("%s: %s too long\n", s, names[j]);
+      exit(1);
+    }
+    close(fd[j]);
+    unlink(names[j]);
+  }
+}
+
 void
 bigfile(char *s)
 {
@@ -2544,6 +4357,265 @@ sbrklast(char *s)
 }
 
 
+// sbrk more memory than the machine has, and touch only a few
+// pages of it; pages should be allocated only when first used,
+// including by the kernel on behalf of read() and write().
+void
+sbrksparse(char *s)
+{
+  enum { SZ = 1024*1024*1024, STEP = 64*1024*1024 };
+  char *a, *p;
+  int fds[2];
+
+  a = sbrk(SZ);
+  if(a == (char*)-1){
+    printf("%s: sbrk(%d) failed\n", s, SZ);
+    exit(1);
+  }
+  for(p = a; p < a + SZ; p += STEP){
+    if(*p != 0){
+      printf("%s: untouched page is not zero\n", s);
+      exit(1);
+    }
+    *p = 'a' + (p - a) / STEP;
+  }
+  for(p = a; p < a + SZ; p += STEP){
+    if(*p != 'a' + (p - a) / STEP){
+      printf("%s: lost a store\n", s);
+      exit(1);
+    }
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  p = a + SZ - PGSIZE - 10;   // spans two untouched pages
+  if(write(fds[1], p, 20) != 20 || read(fds[0], p + 1, 20) != 20){
+    printf("%s: pipe i/o to untouched pages failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(sbrk(-SZ) == (char*)-1){
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// mmap() a file privately and shared, and check what reaches it.
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*PGSIZE + PGSIZE/2 };
+  char *a, *b;
+  int fd, i, pid, xstatus;
+  static char buf[SZ];
+
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 23;
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, SZ) != SZ){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, SZ, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(memcmp(a, buf, SZ) != 0 || a[SZ] != 0 || a[3*PGSIZE-1] != 0){
+    printf("%s: mapping doesn't match the file\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid == 0){
+    a[0] = 'x';   // read-only
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: store to a read-only mapping succeeded\n", s);
+    exit(1);
+  }
+  if(munmap(a, 3*PGSIZE) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  // stores to a private mapping stay there.
+  a = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  b = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)-1 || b == (char*)-1 || a == b){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  a[1] = 'P';
+  b[PGSIZE] = 'S';
+  b[SZ-1] = 'T';
+  if(munmap(a, SZ) != 0)
+    exit(1);
+
+  // unmap the first page of the shared mapping, then the rest.
+  if(munmap(b, PGSIZE) != 0){
+    printf("%s: munmap of the first page failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid == 0){
+    b[0] = 'x';   // unmapped
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: store to an unmapped page succeeded\n", s);
+    exit(1);
+  }
+  if(munmap(b + PGSIZE, SZ - PGSIZE) != 0){
+    printf("%s: munmap of the rest failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, SZ) != SZ){
+    printf("%s: reopen failed\n", s);
+    exit(1);
+  }
+  if(buf[1] != 'a' + 1 || buf[PGSIZE] != 'S' || buf[SZ-1] != 'T'){
+    printf("%s: wrong file contents after munmap\n", s);
+    exit(1);
+  }
+  if(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: writable shared mapping of a read-only fd\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+  exit(0);
+}
+
+// What read() stores into a shared mapping reaches the file,
+// through munmap() and through exit().
+void
+mmapread(char *s)
+{
+  char *b;
+  int fd, src, i, pid, xstatus;
+  static char buf[2*PGSIZE];
+
+  memset(buf, 'a', sizeof(buf));
+  unlink("mmapread");
+  fd = open("mmapread", O_CREATE|O_RDWR);
+  if(fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'r', sizeof(buf));
+  unlink("mmapsrc");
+  src = open("mmapsrc", O_CREATE|O_RDWR);
+  if(src < 0 || write(src, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+
+  b = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(b == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(pread(src, b, PGSIZE, 0) != PGSIZE || munmap(b, sizeof(buf)) != 0){
+    printf("%s: read into the mapping failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid == 0){
+    b = mmap(0, sizeof(buf), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(b == (char*)-1 || pread(src, b + PGSIZE, PGSIZE, PGSIZE) != PGSIZE)
+      exit(1);
+    exit(0);   // without munmap()
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: child's read into the mapping failed\n", s);
+    exit(1);
+  }
+  close(src);
+  close(fd);
+
+  memset(buf, 0, sizeof(buf));
+  fd = open("mmapread", O_RDONLY);
+  if(fd < 0 || read(fd, buf, sizeof(buf)) != sizeof(buf)){
+    printf("%s: reopen failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++){
+    if(buf[i] != 'r'){
+      printf("%s: read() into the mapping lost at byte %d\n", s, i);
+      exit(1);
+    }
+  }
+  close(fd);
+  unlink("mmapread");
+  unlink("mmapsrc");
+}
+
+// A segment from shmget() is shared with fork()'s children and
+// with anyone else who attaches it by key, and a futex word in
+// it wakes a sleeper in another process.
+void
+shmtest(char *s)
+{
+  enum { KEY=0x5e9, SZ=2*PGSIZE, W=PGSIZE/sizeof(int) };
+  int id, pid, xstatus;
+  volatile int *a;
+  int *b;
+
+  id = shmget(KEY, SZ);
+  if(id < 0 || (a = shmat(id)) == (int*)-1){
+    printf("%s: shmget or shmat failed\n", s);
+    exit(1);
+  }
+  a[0] = 0;
+  a[W] = 0;
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    while(a[0] == 0)
+      futex_wait((int*)a, 0);
+    a[W] = 2;
+    exit(0);
+  }
+
+  // attach it again by key, elsewhere.
+  b = shmat(shmget(KEY, SZ));
+  if(b == (int*)-1 || b == a){
+    printf("%s: second shmat failed\n", s);
+    exit(1);
+  }
+  b[0] = 1;
+  futex_wake(b, 1);
+  wait(&xstatus);
+  if(xstatus != 0 || a[W] != 2 || b[W] != 2){
+    printf("%s: the child's store wasn't seen\n", s);
+    exit(1);
+  }
+  if(shmdt(b) < 0 || shmdt(b) != -1 || shmdt((int*)a) < 0){
+    printf("%s: shmdt failed\n", s);
+    exit(1);
+  }
+  if(shmget(KEY, SZ+PGSIZE*NSHMPAGE) != -1){
+    printf("%s: shmget of an oversized segment\n", s);
+    exit(1);
+  }
+}
+
 // does sbrk handle signed int32 wrap-around with
 // negative arguments?
 void
@@ -2593,26 +4665,56 @@ struct test {
   {createtest, "createtest"},
   {dirtest, "dirtest"},
   {exectest, "exectest"},
+  {textshare, "textshare"},
   {pipe1, "pipe1"},
+  {pipesize, "pipesize"},
+  {splicetest, "splice"},
+  {ringtest, "ring"},
   {killstatus, "killstatus"},
+  {priority, "priority"},
+  {affinity, "affinity"},
+  {sleeptime, "sleeptime"},
+  {usyscall, "usyscall"},
+  {tracetest, "trace"},
+  {sysstatstest, "sysstats"},
+  {rusagetest, "rusage"},
   {preempt, "preempt"},
   {exitwait, "exitwait"},
   {reparent, "reparent" },
   {twochildren, "twochildren"},
+  {cowfork, "cowfork"},
   {forkfork, "forkfork"},
   {forkforkfork, "forkforkfork"},
   {reparent2, "reparent2"},
+  {threadtest, "threads"},
+  {spawntest, "spawn"},
   {mem, "mem"},
+  {mallocsizes, "mallocsizes"},
+  {pipecache, "pipecache"},
+  {stdiotest, "stdio"},
+  {getdentstest, "getdents"},
+  {preadtest, "pread"},
+  {asyncwrite, "asyncwrite"},
+  {interleave, "interleave"},
+  {inlinefile, "inlinefile"},
+  {dirindex, "dirindex"},
+  {tmpfs, "tmpfs"},
+  {manyfds, "manyfds"},
+  {pollpipes, "pollpipes"},
+  {manyargs, "manyargs"},
   {sharedfd, "sharedfd"},
   {fourfiles, "fourfiles"},
+  {sharedreads, "sharedreads"},
   {createdelete, "createdelete"},
   {unlinkread, "unlinkread"},
   {linktest, "linktest"},
   {concreate, "concreate"},
   {linkunlink, "linkunlink"},
   {subdir, "subdir"},
+  {dirnames, "dirnames"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {fragfiles, "fragfiles"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
@@ -2634,6 +4736,10 @@ struct test {
   {sbrkbugs, "sbrkbugs" },
   {sbrklast, "sbrklast"},
   {sbrk8000, "sbrk8000"},
+  {sbrksparse, "sbrksparse"},
+  {mmaptest, "mmaptest"},
+  {mmapread, "mmapread"},
+  {shmtest, "shm"},
   {badarg, "badarg" },
 
   { 0, 0},
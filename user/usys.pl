@@ -1,6 +1,7 @@
 #!/usr/bin/perl -w
 
-# Generate usys.S, the stubs for syscalls.
+# Generate usys.S, the stubs for syscalls. A stub with a second
+# name is called that instead, for ulib.c to wrap.
 
 print "# generated by usys.pl - do not edit\n";
 
@@ -8,22 +9,23 @@ print "#include \"kernel/syscall.h\"\n";
 
 sub entry {
     my $name = shift;
-    print ".global $name\n";
-    print "${name}:\n";
+    my $label = shift || $name;
+    print ".global $label\n";
+    print "${label}:\n";
     print " li a7, SYS_${name}\n";
     print " ecall\n";
     print " ret\n";
 }
 	
-entry("fork");
-entry("exit");
+entry("fork", "_fork");
+entry("exit", "_exit");
 entry("wait");
 entry("pipe");
 entry("read");
 entry("write");
-entry("close");
+entry("close", "_close");
 entry("kill");
-entry("exec");
+entry("exec", "_exec");
 entry("open");
 entry("mknod");
 entry("unlink");
@@ -36,3 +38,29 @@ entry("getpid");
 entry("sbrk");
 entry("sleep");
 entry("uptime");
+entry("mmap");
+entry("munmap");
+entry("setpriority");
+entry("setaffinity");
+entry("fcntl");
+entry("splice");
+entry("tee");
+entry("ring_enter");
+entry("sysstats");
+entry("clone");
+entry("join");
+entry("futex_wait");
+entry("futex_wake");
+entry("shmget");
+entry("shmat");
+entry("shmdt");
+entry("spawn", "_spawn");
+entry("getdents");
+entry("fstatat");
+entry("pread");
+entry("pwrite");
+entry("readv");
+entry("writev");
+entry("fsync");
+entry("poll");
+entry("getrusage");
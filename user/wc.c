@@ -2,26 +2,31 @@
 #include "kernel/stat.h"
 #include "user/user.h"
 
-char buf[512];
+char buf[4096];
 
 void
 wc(int fd, char *name)
 {
   int i, n;
   int l, w, c, inword;
+  char *p, *e;
 
   l = w = c = 0;
   inword = 0;
   while((n = read(fd, buf, sizeof(buf))) > 0){
+    c += n;
+    for(p = buf, e = buf + n; (p = memchr(p, '\n', e - p)) != 0; p++)
+      l++;
     for(i=0; i<n; i++){
-      c++;
-      if(buf[i] == '\n')
-        l++;
-      if(strchr(" \r\t\n\v", buf[i]))
+      switch(buf[i]){
+      case ' ': case '\r': case '\t': case '\n': case '\v': case '\0':
         inword = 0;
-      else if(!inword){
-        w++;
-        inword = 1;
+        break;
+      default:
+        if(!inword){
+          w++;
+          inword = 1;
+        }
       }
     }
   }
@@ -4,71 +4,142 @@
 #include "user/user.h"
 
 #define MAX_LINE_LENGTH 512
+#define ARENA 2048
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        fprintf(2, "Usage: xargs <command> [args...]\n");
+// xargs [-n N] [-P N] command [args...]
+//
+// 从标准输入读取参数，每凑够 N 个（默认为 exec 所能接受的最多个数）
+// 就执行一次命令，最多同时运行 P 个（默认 1 个）。参数存放在一块
+// arena 中，spawn() 在内核里复制完参数后这块内存即可重用。
+
+char* args[MAXARG];
+int nbase;          // 命令本身及其固定参数的个数
+int nargs;
+int maxargs;        // 每次执行最多附加的参数个数
+char arena[ARENA];
+int used;           // arena 中已用的字节数
+int nrun, maxrun;   // 正在运行 / 最多同时运行的子进程数
+int nexec;
+int failed;
+
+void reap(void) {
+    int status;
+
+    if (wait(&status) >= 0) {
+        nrun--;
+        if (status != 0)
+            failed = 1;
+    }
+}
+
+// 用已收集的参数执行一次命令，然后重用 arena
+void run(void) {
+    args[nargs] = 0;
+    while (nrun >= maxrun)
+        reap();
+    if (spawn(args[0], args, 0, -1) < 0) {
+        fprintf(2, "xargs: exec %s failed\n", args[0]);
         exit(1);
     }
+    nrun++;
+    nexec++;
+    nargs = nbase;
+    used = 0;
+}
 
-    char line[MAX_LINE_LENGTH];
-    char* args[MAXARG];
-    int arg_idx = 0;
+int main(int argc, char* argv[]) {
+    int i = 1;
 
-    // 复制原始参数（跳过 "xargs"）
-    for (int i = 1; i < argc; ++i) {
-        args[arg_idx++] = argv[i];
+    maxargs = MAXARG - 1;
+    maxrun = 1;
+    while (i + 1 < argc && argv[i][0] == '-') {
+        if (strcmp(argv[i], "-n") == 0)
+            maxargs = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-P") == 0)
+            maxrun = atoi(argv[i + 1]);
+        else
+            break;
+        i += 2;
+    }
+    if (i >= argc || maxargs < 1 || maxrun < 1) {
+        fprintf(2, "Usage: xargs [-n N] [-P N] <command> [args...]\n");
+        exit(1);
     }
 
-    // 读取标准输入并解析参数
-    int n;
-    while ((n = read(0, line, sizeof(line)))) {
+    // 复制原始参数（跳过 "xargs" 和选项）
+    for (; i < argc; ++i) {
+        if (nbase >= MAXARG - 1) {
+            fprintf(2, "xargs: too many arguments\n");
+            exit(1);
+        }
+        args[nbase++] = argv[i];
+    }
+    if (maxargs > MAXARG - 1 - nbase)
+        maxargs = MAXARG - 1 - nbase;
+    // 所有参数的字符串加上 argv[] 指针不能超过 exec 的 ARGMAX 字节：
+    // arena、固定参数的字符串，以及每个参数一个指针
+    int basebytes = 0;
+    for (int k = 0; k < nbase; k++)
+        basebytes += strlen(args[k]) + 1;
+    int room = (ARGMAX - ARENA - basebytes - 16) / (int)sizeof(char*) - nbase - 1;
+    if (maxargs > room)
+        maxargs = room;
+    if (maxargs < 1) {
+        fprintf(2, "xargs: too many arguments\n");
+        exit(1);
+    }
+    nargs = nbase;
+
+    // 流式读取标准输入；一个参数可能跨越两次 read()
+    char line[MAX_LINE_LENGTH];
+    int n, start = -1;   // 正在读取的参数在 arena 中的起点
+    while ((n = read(0, line, sizeof(line))) != 0) {
         if (n < 0) {
             fprintf(2, "xargs: read error\n");
             exit(1);
         }
-
-        line[n] = '\0'; // 确保字符串终止
-        char* p = line;
-
-        // 解析每行参数
-        while (*p != '\0') {
-            // 跳过空白字符
-            while (*p == ' ' || *p == '\n') p++;
-            if (*p == '\0') break;
-
-            // 定位参数结束位置
-            char* arg_start = p;
-            while (*p != ' ' && *p != '\n' && *p != '\0') p++;
-            
-            // 复制参数到新内存
-            char* arg = malloc(p - arg_start + 1);
-            if (!arg) {
-                fprintf(2, "xargs: memory allocation failed\n");
-                exit(1);
+        for (int k = 0; k < n; k++) {
+            char c = line[k];
+            if (c == ' ' || c == '\n' || c == '\t') {
+                if (start < 0)
+                    continue;
+                arena[used++] = '\0';
+                args[nargs++] = arena + start;
+                start = -1;
+                if (nargs - nbase == maxargs)
+                    run();
+                continue;
             }
-            memmove(arg, arg_start, p - arg_start);
-            arg[p - arg_start] = '\0';
-
-            // 检查参数数量是否超限
-            if (arg_idx >= MAXARG - 1) {
-                fprintf(2, "xargs: too many arguments\n");
-                exit(1);
+            if (used + 2 > ARENA) {
+                // arena 已满：先用已经完整的参数执行
+                if (nargs == nbase) {
+                    fprintf(2, "xargs: argument too long\n");
+                    exit(1);
+                }
+                int len = start < 0 ? 0 : used - start;
+                char* partial = arena + (start < 0 ? used : start);
+                int saved = start;
+                run();
+                if (saved >= 0) {
+                    memmove(arena, partial, len);
+                    used = len;
+                    start = 0;
+                }
             }
-            args[arg_idx++] = arg;
+            if (start < 0)
+                start = used;
+            arena[used++] = c;
         }
     }
-
-    // 设置exec的参数结尾NULL
-    args[arg_idx] = 0;
-
-    // 执行命令
-    if (fork() == 0) {
-        exec(args[0], args);
-        fprintf(2, "xargs: exec %s failed\n", args[0]);
-        exit(1);
-    } else {
-        wait(0);
-        exit(0);
+    if (start >= 0) {
+        arena[used++] = '\0';
+        args[nargs++] = arena + start;
     }
-}
\ No newline at end of file
+
+    // 没有输入时也执行一次命令
+    if (nargs > nbase || nexec == 0)
+        run();
+    while (nrun > 0)
+        reap();
+    exit(failed);
+}